@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "autocfg.h"
+#include "packet.h"
+#include "producer.h"
+#include "utils.h"
+
+// v1 reports "no limit" as a huge page-aligned number rather than "max"
+#define V1_NO_LIMIT (1UL << 62)
+
+enum { CTRL_CPU, CTRL_CPUSET, CTRL_MEMORY, NUM_CTRLS };
+
+static const char *const v1_names[NUM_CTRLS] = { "cpu", "cpuset", "memory" };
+
+// Reads a small file into `buf` without its trailing newline; -1 if it cannot be read
+static int read_line(const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+	if (!ok)
+		return -1;
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+// Whether `token` is one of the comma-separated words of `list`
+static int has_token(const char *list, const char *token)
+{
+	size_t n = strlen(token);
+
+	for (const char *p = list; p; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, token, n) && (p[n] == ',' || p[n] == '\0'))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Counts the CPUs of a list such as "0-3,6"
+static int count_cpus(const char *list)
+{
+	const char *p = list;
+	int count = 0;
+
+	while (*p) {
+		char *end;
+		long lo = strtol(p, &end, 10), hi = lo;
+
+		if (end == p)
+			break;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		count += hi - lo + 1;
+		if (*end != ',')
+			break;
+		p = end + 1;
+	}
+
+	return count;
+}
+
+static void lower_quota(so_limits_t *lim, double cpus)
+{
+	if (cpus > 0 && (lim->cpu_quota == 0 || cpus < lim->cpu_quota))
+		lim->cpu_quota = cpus;
+}
+
+static void lower_mem(so_limits_t *lim, const char *value)
+{
+	unsigned long bytes;
+
+	if (!strcmp(value, "max"))
+		return;
+	bytes = strtoul(value, NULL, 10);
+	if (bytes && bytes < V1_NO_LIMIT && (lim->mem_limit == 0 || bytes < lim->mem_limit))
+		lim->mem_limit = bytes;
+}
+
+// Reads the v2 limits of one cgroup directory
+static void read_v2(const char *dir, so_limits_t *lim, int leaf)
+{
+	char buf[256], period[32];
+	char quota[32];
+
+	if (read_line(dir, "cpu.max", buf, sizeof(buf)) == 0 &&
+	    sscanf(buf, "%31s %31s", quota, period) == 2 && strcmp(quota, "max"))
+		lower_quota(lim, strtod(quota, NULL) / strtod(period, NULL));
+	if (read_line(dir, "memory.max", buf, sizeof(buf)) == 0)
+		lower_mem(lim, buf);
+	if (read_line(dir, "memory.high", buf, sizeof(buf)) == 0)
+		lower_mem(lim, buf);
+	if (leaf && read_line(dir, "cpuset.cpus.effective", buf, sizeof(buf)) == 0)
+		lim->cpuset_cpus = count_cpus(buf);
+}
+
+// Reads the v1 limits of one cgroup directory of controller `ctrl`
+static void read_v1(const char *dir, int ctrl, so_limits_t *lim, int leaf)
+{
+	char buf[256], period[32];
+
+	switch (ctrl) {
+	case CTRL_CPU:
+		if (read_line(dir, "cpu.cfs_quota_us", buf, sizeof(buf)) == 0 &&
+		    read_line(dir, "cpu.cfs_period_us", period, sizeof(period)) == 0 &&
+		    strtol(buf, NULL, 10) > 0)
+			lower_quota(lim, strtod(buf, NULL) / strtod(period, NULL));
+		break;
+	case CTRL_CPUSET:
+		if (leaf && read_line(dir, "cpuset.effective_cpus", buf, sizeof(buf)) == 0)
+			lim->cpuset_cpus = count_cpus(buf);
+		break;
+	case CTRL_MEMORY:
+		if (read_line(dir, "memory.limit_in_bytes", buf, sizeof(buf)) == 0)
+			lower_mem(lim, buf);
+		break;
+	}
+}
+
+/*
+ * Finds where the hierarchy of cgroup version `version` (controller `ctrl`
+ * for v1) is mounted and the process's cgroup directory in it.
+ */
+static int find_cgroup(int version, int ctrl, char *mount, char *dir)
+{
+	char line[1024], path[PATH_MAX] = "", root[PATH_MAX], point[PATH_MAX];
+	char fstype[64], opts[512];
+	int found = 0;
+	FILE *f;
+
+	// /proc/self/cgroup: "0::<path>" for v2, "<id>:<controllers>:<path>" for v1
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		char *ctrls = strchr(line, ':'), *p;
+
+		if (!ctrls || !(p = strchr(++ctrls, ':')))
+			continue;
+		*p++ = '\0';
+		p[strcspn(p, "\n")] = '\0';
+		if (version == 2 ? !strncmp(line, "0:", 2) && !*ctrls : has_token(ctrls, v1_names[ctrl])) {
+			snprintf(path, sizeof(path), "%s", p);
+			break;
+		}
+	}
+	fclose(f);
+	if (!*path)
+		return -1;
+
+	// mountinfo: "<id> <parent> <dev> <root> <point> <options> [tags] - <fstype> <source> <super options>"
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return -1;
+	while (!found && fgets(line, sizeof(line), f)) {
+		char *sep = strstr(line, " - ");
+
+		if (!sep || sscanf(line, "%*s %*s %*s %4095s %4095s", root, point) != 2 ||
+		    sscanf(sep + 3, "%63s %*s %511s", fstype, opts) != 2)
+			continue;
+		if (version == 2)
+			found = !strcmp(fstype, "cgroup2");
+		else
+			found = !strcmp(fstype, "cgroup") && has_token(opts, v1_names[ctrl]);
+	}
+	fclose(f);
+	if (!found)
+		return -1;
+
+	// In a cgroup namespace the mount's root may be the path itself, or part of it
+	snprintf(mount, PATH_MAX, "%s", point);
+	if (strcmp(root, "/") && !strncmp(path, root, strlen(root)))
+		memmove(path, path + strlen(root), strlen(path) - strlen(root) + 1);
+	if (snprintf(dir, PATH_MAX, "%s%s", point, strcmp(path, "/") ? path : "") >= PATH_MAX)
+		return -1;
+
+	return 0;
+}
+
+// Reads the limits of `dir` and of each parent up to `mount`
+static void walk_up(int version, int ctrl, const char *mount, char *dir, so_limits_t *lim)
+{
+	for (int leaf = 1;; leaf = 0) {
+		char *slash;
+
+		if (version == 2)
+			read_v2(dir, lim, leaf);
+		else
+			read_v1(dir, ctrl, lim, leaf);
+
+		slash = strrchr(dir, '/');
+		if (!strcmp(dir, mount) || !slash || slash - dir < (long)strlen(mount))
+			break;
+		*slash = '\0';
+	}
+}
+
+void autocfg_read_limits(const char *dir, so_limits_t *lim)
+{
+	char mount[PATH_MAX], path[PATH_MAX], ctrls[256];
+	cpu_set_t allowed;
+
+	memset(lim, 0, sizeof(*lim));
+	if (dir) {
+		read_v2(dir, lim, 1);
+		lim->version = 2;
+		return;
+	}
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		lim->affinity_cpus = CPU_COUNT(&allowed);
+
+	// v2 only if it has the controllers: hybrid setups mount an empty one next to v1
+	if (find_cgroup(2, 0, mount, path) == 0 &&
+	    read_line(mount, "cgroup.controllers", ctrls, sizeof(ctrls)) == 0 &&
+	    (strstr(ctrls, "cpu") || strstr(ctrls, "memory"))) {
+		walk_up(2, 0, mount, path, lim);
+		lim->version = 2;
+		return;
+	}
+
+	for (int ctrl = 0; ctrl < NUM_CTRLS; ctrl++) {
+		if (find_cgroup(1, ctrl, mount, path) < 0)
+			continue;
+		walk_up(1, ctrl, mount, path, lim);
+		lim->version = 1;
+	}
+}
+
+static size_t pow2_floor(size_t n)
+{
+	size_t p = 1;
+
+	while (p * 2 <= n)
+		p *= 2;
+
+	return p;
+}
+
+void autocfg_pick(const so_limits_t *lim, so_autocfg_t *cfg)
+{
+	double cpus = AUTOCFG_MAX_CONSUMERS;
+	size_t ring_pkts;
+
+	if (lim->affinity_cpus && lim->affinity_cpus < cpus)
+		cpus = lim->affinity_cpus;
+	if (lim->cpuset_cpus && lim->cpuset_cpus < cpus)
+		cpus = lim->cpuset_cpus;
+	if (lim->cpu_quota && lim->cpu_quota < cpus)
+		cpus = lim->cpu_quota;
+
+	cfg->consumers = cpus < 1 ? 1 : (int)cpus;
+
+	ring_pkts = (size_t)cfg->consumers * AUTOCFG_RING_PKTS;
+	cfg->read_size = PRODUCER_BUF_SZ;
+	if (lim->mem_limit) {
+		if (ring_pkts > lim->mem_limit / AUTOCFG_RING_MEM_SHARE / PKT_SZ)
+			ring_pkts = lim->mem_limit / AUTOCFG_RING_MEM_SHARE / PKT_SZ;
+		if (cfg->read_size > lim->mem_limit / AUTOCFG_READ_MEM_SHARE)
+			cfg->read_size = pow2_floor(lim->mem_limit / AUTOCFG_READ_MEM_SHARE);
+	}
+	if (ring_pkts < AUTOCFG_RING_MIN_PKTS)
+		ring_pkts = AUTOCFG_RING_MIN_PKTS;
+	if (cfg->read_size < AUTOCFG_READ_MIN)
+		cfg->read_size = AUTOCFG_READ_MIN;
+	// Any record, up to PKT_MAX_SZ, must still fit in the ring, whole records at a time
+	cfg->ring_size = ring_pkts * PKT_SZ;
+	if (cfg->ring_size < PRODUCER_RING_MIN)
+		cfg->ring_size = PRODUCER_RING_MIN;
+	cfg->ring_size &= ~(size_t)(RING_REC_ALIGN - 1);
+
+	log_info("auto: cgroup v%d, quota %.2f CPUs, cpuset %d, affinity %d, memory limit %zu MiB",
+		 lim->version, lim->cpu_quota, lim->cpuset_cpus, lim->affinity_cpus,
+		 lim->mem_limit >> 20);
+	log_info("auto: %d consumers, %zu KiB ring, %zu KiB reads", cfg->consumers,
+		 cfg->ring_size >> 10, cfg->read_size >> 10);
+}
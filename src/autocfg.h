@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_AUTOCFG_H__
+#define __SO_AUTOCFG_H__
+
+#include <stddef.h>
+
+/* As many consumers as the command line takes. */
+#define AUTOCFG_MAX_CONSUMERS 32
+
+/* Byte ring packets per consumer; one consumer gets the default ring. */
+#define AUTOCFG_RING_PKTS 1000
+
+/* Smallest byte ring, in packets, and the largest share of the memory limit it may take. */
+#define AUTOCFG_RING_MIN_PKTS 64
+#define AUTOCFG_RING_MEM_SHARE 32
+
+/* Bounds on the producer's read size, and the largest share of the memory limit it may take. */
+#define AUTOCFG_READ_MIN (64 << 10)
+#define AUTOCFG_READ_MEM_SHARE 64
+
+/* Resources the process may use; 0 in a field means no limit (or unknown). */
+typedef struct so_limits_t {
+	int version;		/* cgroup version read, 0 when none was found */
+	double cpu_quota;	/* CPUs worth of run time per period, from cpu.max */
+	int cpuset_cpus;	/* CPUs in cpuset.cpus.effective */
+	int affinity_cpus;	/* CPUs in the scheduler affinity mask */
+	size_t mem_limit;	/* lowest memory.max or memory.high */
+} so_limits_t;
+
+/* Sizes picked from the limits. */
+typedef struct so_autocfg_t {
+	int consumers;
+	size_t ring_size;	/* bytes of the byte ring */
+	size_t read_size;	/* bytes the producer reads at a time */
+} so_autocfg_t;
+
+/**
+ * @brief Reads the CPU and memory limits that apply to the process.
+ *
+ * With `dir` NULL, the process's own cgroup is found through
+ * /proc/self/cgroup and /proc/self/mountinfo: cgroup v2 (`cpu.max`,
+ * `cpuset.cpus.effective`, `memory.max`, `memory.high`), else the v1 `cpu`,
+ * `cpuset` and `memory` controllers. Quotas and memory limits are the lowest
+ * found on the way up to the root of the hierarchy, as the kernel applies
+ * every ancestor's; the scheduler affinity mask is read as well.
+ *
+ * A `dir` holding v2 files is read alone, without the affinity mask, to try
+ * the sizing on simulated limits. Missing files leave their limit at 0, so
+ * this does not fail outside a container.
+ */
+void autocfg_read_limits(const char *dir, so_limits_t *lim);
+
+/**
+ * @brief Sizes the firewall for `lim` and logs the limits and the choice.
+ *
+ * One consumer per whole CPU the limits allow (1 to `AUTOCFG_MAX_CONSUMERS`), leaving the
+ * fraction of a quota to the producer; a byte ring of `AUTOCFG_RING_PKTS`
+ * packets per consumer and a 1 MiB read size, both cut down to their share of
+ * a memory limit.
+ */
+void autocfg_pick(const so_limits_t *lim, so_autocfg_t *cfg);
+
+#endif /* __SO_AUTOCFG_H__ */
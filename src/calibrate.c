@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "calibrate.h"
+#include "consumer.h"
+#include "producer.h"
+#include "ring_buffer.h"
+#include "utils.h"
+
+// Timing rounds: every candidate runs once per round, so noise is spread over all of them
+#define KERNEL_ROUNDS 4
+#define RING_ROUNDS 2
+
+// Share of the budget, in percent, of the hash kernels and the source kernels; the rest is the rings'
+#define HASH_SHARE 40
+#define SOURCE_SHARE 10
+
+// Calls between two clock reads
+#define HASH_STEP 16
+#define SOURCE_STEP 1024
+#define RING_STEP 64
+
+// Shortest time a ring size is fed for
+#define RING_MIN_SLICE 1000000UL
+
+// Packets whose hashes are checked, each at several lengths
+#define VERIFY_PKTS 32
+
+#define MODEL_SZ 128
+#define LINE_SZ 512
+
+static const size_t ring_pkts[] = CALIBRATE_RING_PKTS;
+#define NUM_RINGS (sizeof(ring_pkts) / sizeof(ring_pkts[0]))
+
+// Bytes of the r-th ring tried: never below what the largest records need
+static size_t ring_bytes(size_t r)
+{
+	size_t size = ring_pkts[r] * PKT_SZ;
+
+	if (size < PRODUCER_RING_MIN)
+		size = PRODUCER_RING_MIN;
+
+	return size & ~(size_t)(RING_REC_ALIGN - 1);
+}
+
+struct trial {
+	unsigned long calls;
+	unsigned long ns;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static double rate(const struct trial *t)
+{
+	return t->ns ? t->calls * 1e3 / t->ns : 0;
+}
+
+// Random headers and payloads: about half the sources are allowed, payload bytes cover the signed range
+static so_packet_t *make_sample(void)
+{
+	so_packet_t *sample = malloc(CALIBRATE_SAMPLE_PKTS * sizeof(*sample));
+	unsigned long x = 0x9e3779b97f4a7c15UL;
+
+	if (!sample)
+		return NULL;
+	for (unsigned char *p = (unsigned char *)sample;
+	     p < (unsigned char *)(sample + CALIBRATE_SAMPLE_PKTS); p++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		*p = x >> 32;
+	}
+
+	return sample;
+}
+
+// Whether `kernel` gives the reference hash on short, odd and full-size records
+static int hash_kernel_ok(so_hash_kernel_t kernel, const so_packet_t *sample)
+{
+	static const size_t lens[] = { sizeof(so_hdr_t), sizeof(so_hdr_t) + 1, 101, PKT_SZ };
+
+	for (int i = 0; i < VERIFY_PKTS; i++) {
+		for (size_t j = 0; j < sizeof(lens) / sizeof(lens[0]); j++) {
+			if (packet_hash_kernel(kernel, &sample[i], lens[j]) !=
+			    packet_hash_kernel(HASH_SCALAR, &sample[i], lens[j]))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void time_hash(so_hash_kernel_t kernel, const so_packet_t *sample, unsigned long ns,
+		      struct trial *t)
+{
+	unsigned long start = now_ns(), end = start + ns, now, calls = 0;
+	volatile unsigned long sink = 0;
+
+	do {
+		for (int i = 0; i < HASH_STEP; i++, calls++)
+			sink += packet_hash_kernel(kernel, &sample[calls % CALIBRATE_SAMPLE_PKTS], PKT_SZ);
+	} while ((now = now_ns()) < end);
+
+	t->calls += calls;
+	t->ns += now - start;
+}
+
+static void time_source(so_source_kernel_t kernel, const so_packet_t *sample, unsigned long ns,
+			struct trial *t)
+{
+	unsigned long start = now_ns(), end = start + ns, now, calls = 0;
+	volatile int sink = 0;
+
+	do {
+		for (int i = 0; i < SOURCE_STEP; i++, calls++)
+			sink += packet_source_kernel(kernel,
+						     sample[calls % CALIBRATE_SAMPLE_PKTS].hdr.source);
+	} while ((now = now_ns()) < end);
+
+	t->calls += calls;
+	t->ns += now - start;
+}
+
+// Feeds the sample to real consumers through a ring of `ring_size` bytes for about `ns`
+static int time_ring(int num_consumers, size_t ring_size, const so_packet_t *sample,
+		     unsigned long ns, struct trial *t)
+{
+	so_ring_buffer_t rb;
+	so_packet_t pkt;
+	pthread_t *tids = calloc(num_consumers, sizeof(*tids));
+	unsigned long start, end, calls = 0;
+	int threads;
+
+	if (!tids || ring_buffer_init(&rb, ring_size) < 0) {
+		free(tids);
+		return -1;
+	}
+
+	threads = create_consumers(tids, num_consumers, &rb, "/dev/null", NULL);
+	start = now_ns();
+	end = start + ns;
+	if (threads > 0) {
+		do {
+			for (int i = 0; i < RING_STEP; i++, calls++) {
+				// Copied like the producer's reads, numbered so that timestamps keep rising
+				pkt = sample[calls % CALIBRATE_SAMPLE_PKTS];
+				pkt.hdr.timestamp = calls;
+				DIE(ring_buffer_enqueue_rec(&rb, &pkt, PKT_SZ) < 0,
+				    "record larger than the ring");
+			}
+		} while (now_ns() < end);
+	}
+	ring_buffer_stop(&rb);
+
+	// Until the consumers are done with what is queued
+	for (int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	t->calls += calls;
+	t->ns += now_ns() - start;
+
+	ring_buffer_destroy(&rb);
+	free(tids);
+
+	return threads > 0 ? 0 : -1;
+}
+
+// Appends "<name> <rate>" to the summary `buf` of `size` bytes
+static void summary_add(char *buf, size_t size, const char *name, double mpps)
+{
+	size_t len = strlen(buf);
+
+	snprintf(buf + len, size - len, "%s%s %.2f", len ? ", " : "", name, mpps);
+}
+
+static void cpu_model(char *model, size_t size)
+{
+	char line[LINE_SZ];
+	FILE *f = fopen("/proc/cpuinfo", "r");
+
+	snprintf(model, size, "unknown");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		char *colon = strchr(line, ':');
+
+		if (!strncmp(line, "model name", 10) && colon) {
+			colon += strspn(colon + 1, " \t") + 1;
+			colon[strcspn(colon, "\t\n")] = '\0';
+			snprintf(model, size, "%s", colon);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static int find_name(const char *const *names, int num, const char *name)
+{
+	for (int i = 0; i < num; i++) {
+		if (!strcmp(names[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Cache lines are "<model>\t<consumers>\t<hash kernel>\t<source kernel>\t<ring bytes>".
+ * Returns 0 and fills `cal` from the line of (`model`, `num_consumers`), -1 if there is none.
+ */
+static int cache_lookup(const char *cache, const char *model, int num_consumers,
+			so_calibration_t *cal)
+{
+	char line[LINE_SZ], name[MODEL_SZ], hash[32], source[32];
+	int consumers, found = -1;
+	size_t ring_size;
+	FILE *f = fopen(cache, "r");
+
+	if (!f)
+		return -1;
+	while (found < 0 && fgets(line, sizeof(line), f)) {
+		int h, s;
+
+		if (sscanf(line, "%127[^\t]\t%d\t%31s\t%31s\t%zu", name, &consumers, hash, source,
+			   &ring_size) != 5 ||
+		    strcmp(name, model) || consumers != num_consumers)
+			continue;
+		h = find_name(hash_kernel_names, NUM_HASH_KERNELS, hash);
+		s = find_name(source_kernel_names, NUM_SOURCE_KERNELS, source);
+		if (h < 0 || s < 0 || ring_size < PRODUCER_RING_MIN || ring_size % RING_REC_ALIGN)
+			continue;
+		cal->hash = h;
+		cal->source = s;
+		cal->ring_size = ring_size;
+		found = 0;
+	}
+	fclose(f);
+
+	return found;
+}
+
+// Rewrites `cache` with the line of (`model`, `num_consumers`) replaced by `cal`
+static int cache_store(const char *cache, const char *model, int num_consumers,
+		       const so_calibration_t *cal)
+{
+	char line[LINE_SZ], name[MODEL_SZ];
+	char *tmp_path = malloc(strlen(cache) + sizeof(".tmp"));
+	FILE *in, *out;
+	int consumers;
+
+	if (!tmp_path)
+		return -1;
+
+	// Written next to the cache and renamed over it, so concurrent runs never read half of it
+	sprintf(tmp_path, "%s.tmp", cache);
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		free(tmp_path);
+		return -1;
+	}
+	in = fopen(cache, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (sscanf(line, "%127[^\t]\t%d", name, &consumers) == 2 &&
+		    !strcmp(name, model) && consumers == num_consumers)
+			continue;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+	fprintf(out, "%s\t%d\t%s\t%s\t%zu\n", model, num_consumers, hash_kernel_names[cal->hash],
+		source_kernel_names[cal->source], cal->ring_size);
+
+	if (fclose(out) || rename(tmp_path, cache) < 0) {
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+	free(tmp_path);
+
+	return 0;
+}
+
+static void pick_hash(const so_packet_t *sample, unsigned long ns, so_calibration_t *cal)
+{
+	struct trial trials[NUM_HASH_KERNELS] = { 0 };
+	int ok[NUM_HASH_KERNELS];
+	char summary[LINE_SZ] = "";
+
+	for (int k = 0; k < NUM_HASH_KERNELS; k++) {
+		ok[k] = hash_kernel_ok(k, sample);
+		if (!ok[k])
+			log_warn("calibration: hash kernel %s gives wrong hashes, left out",
+				 hash_kernel_names[k]);
+	}
+
+	for (int round = 0; round < KERNEL_ROUNDS; round++) {
+		for (int k = 0; k < NUM_HASH_KERNELS; k++) {
+			if (ok[k])
+				time_hash(k, sample, ns / KERNEL_ROUNDS / NUM_HASH_KERNELS, &trials[k]);
+		}
+	}
+
+	cal->hash = HASH_SCALAR;
+	for (int k = 0; k < NUM_HASH_KERNELS; k++) {
+		if (!ok[k])
+			continue;
+		summary_add(summary, sizeof(summary), hash_kernel_names[k], rate(&trials[k]));
+		if (rate(&trials[k]) > rate(&trials[cal->hash]))
+			cal->hash = k;
+	}
+	log_info("calibration: hash kernels (M packets/s): %s", summary);
+}
+
+static void pick_source(const so_packet_t *sample, unsigned long ns, so_calibration_t *cal)
+{
+	struct trial trials[NUM_SOURCE_KERNELS] = { 0 };
+	char summary[LINE_SZ] = "";
+
+	for (int round = 0; round < KERNEL_ROUNDS; round++) {
+		for (int k = 0; k < NUM_SOURCE_KERNELS; k++)
+			time_source(k, sample, ns / KERNEL_ROUNDS / NUM_SOURCE_KERNELS, &trials[k]);
+	}
+
+	cal->source = SOURCE_SCAN;
+	for (int k = 0; k < NUM_SOURCE_KERNELS; k++) {
+		summary_add(summary, sizeof(summary), source_kernel_names[k], rate(&trials[k]));
+		if (rate(&trials[k]) > rate(&trials[cal->source]))
+			cal->source = k;
+	}
+	log_info("calibration: source kernels (M lookups/s): %s", summary);
+}
+
+static void pick_ring(int num_consumers, const so_packet_t *sample, unsigned long ns,
+		      so_calibration_t *cal)
+{
+	struct trial trials[NUM_RINGS] = { 0 };
+	char summary[LINE_SZ] = "", name[32];
+	unsigned long deadline = now_ns() + ns, left = RING_ROUNDS * NUM_RINGS;
+	size_t best = 0;
+
+	for (int round = 0; round < RING_ROUNDS; round++) {
+		for (size_t r = 0; r < NUM_RINGS; r++, left--) {
+			// A run also drains its ring: share out what the earlier ones left
+			unsigned long now = now_ns();
+			unsigned long slice = now + left * RING_MIN_SLICE < deadline ?
+					      (deadline - now) / left : RING_MIN_SLICE;
+
+			if (time_ring(num_consumers, ring_bytes(r), sample, slice,
+				      &trials[r]) < 0) {
+				log_warn("calibration: could not run the consumers, keeping the ring size");
+				return;
+			}
+		}
+	}
+
+	for (size_t r = 0; r < NUM_RINGS; r++) {
+		snprintf(name, sizeof(name), "%zu KiB", ring_bytes(r) >> 10);
+		summary_add(summary, sizeof(summary), name, rate(&trials[r]));
+		if (rate(&trials[r]) > rate(&trials[best]))
+			best = r;
+	}
+	cal->ring_size = ring_bytes(best);
+	log_info("calibration: byte ring with %d consumers (M packets/s): %s", num_consumers,
+		 summary);
+}
+
+void calibrate(int num_consumers, unsigned int budget_ms, const char *cache,
+	       so_calibration_t *cal)
+{
+	unsigned long budget = budget_ms * 1000000UL, start = now_ns();
+	char model[MODEL_SZ];
+	so_packet_t *sample;
+
+	cpu_model(model, sizeof(model));
+	if (cache && cache_lookup(cache, model, num_consumers, cal) == 0) {
+		packet_set_hash_kernel(cal->hash);
+		packet_set_source_kernel(cal->source);
+		log_info("calibration: cached for %s with %d consumers: hash %s, sources %s, %zu KiB ring",
+			 model, num_consumers, hash_kernel_names[cal->hash],
+			 source_kernel_names[cal->source], cal->ring_size >> 10);
+		return;
+	}
+
+	sample = make_sample();
+	DIE(sample == NULL, "malloc");
+
+	// The rings are timed with the kernels the consumers will run
+	pick_hash(sample, budget * HASH_SHARE / 100, cal);
+	packet_set_hash_kernel(cal->hash);
+	pick_source(sample, budget * SOURCE_SHARE / 100, cal);
+	packet_set_source_kernel(cal->source);
+	pick_ring(num_consumers, sample, budget * (100 - HASH_SHARE - SOURCE_SHARE) / 100, cal);
+	free(sample);
+
+	log_info("calibration: picked hash %s, sources %s, %zu KiB ring in %lu ms on %s",
+		 hash_kernel_names[cal->hash], source_kernel_names[cal->source],
+		 cal->ring_size >> 10, (now_ns() - start) / 1000000, model);
+
+	if (cache && cache_store(cache, model, num_consumers, cal) < 0)
+		log_warn("calibration: could not write %s: %s", cache, strerror(errno));
+}
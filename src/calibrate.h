@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_CALIBRATE_H__
+#define __SO_CALIBRATE_H__
+
+#include <stddef.h>
+
+#include "packet.h"
+
+/* Default time the calibration may take, and its bounds. */
+#define CALIBRATE_BUDGET_MS 200
+#define CALIBRATE_MIN_MS 20
+#define CALIBRATE_MAX_MS 10000
+
+/* Synthetic packets the kernels and rings are timed on. */
+#define CALIBRATE_SAMPLE_PKTS 1024
+
+/* Byte ring sizes tried, in packets; none below PRODUCER_RING_MIN bytes. */
+#define CALIBRATE_RING_PKTS { 250, 1000, 4000, 16000 }
+
+/* What the calibration picked. */
+typedef struct so_calibration_t {
+	so_hash_kernel_t hash;
+	so_source_kernel_t source;
+	size_t ring_size;	/* bytes of the byte ring */
+} so_calibration_t;
+
+/**
+ * @brief Times the packet kernels and byte ring sizes on this CPU and picks the fastest.
+ *
+ * Each hash kernel is first checked against `HASH_SCALAR` on records of
+ * several lengths and left out if any hash differs. The kernels are then
+ * timed on `CALIBRATE_SAMPLE_PKTS` synthetic packets, in rounds so that a
+ * burst of noise does not decide alone, and each ring size of
+ * `CALIBRATE_RING_PKTS` is timed by running `num_consumers` real consumers,
+ * logging to /dev/null, behind a producer replaying the sample. All of it
+ * takes about `budget_ms`.
+ *
+ * With a `cache` file, a line for the same CPU model and consumer count is
+ * used instead of timing anything; otherwise the result is added to the file,
+ * which is replaced atomically. The kernels picked are installed with
+ * packet_set_hash_kernel() and packet_set_source_kernel() (the rings are
+ * timed with them); the ring size is left in `cal` for the caller.
+ *
+ * Call before any packet policy (payload rules, capture, ...) is installed,
+ * as the consumers run the packet path on the synthetic packets.
+ */
+void calibrate(int num_consumers, unsigned int budget_ms, const char *cache,
+	       so_calibration_t *cal);
+
+#endif /* __SO_CALIBRATE_H__ */
@@ -0,0 +1,687 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <endian.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cluster.h"
+#include "packet.h"
+#include "lockprof.h"
+#include "membudget.h"
+#include "utils.h"
+
+// Connections a worker lets wait for accept()
+#define LISTEN_BACKLOG 64
+
+// Precedes the records of a chunk, each a 32-bit length and its bytes; all fields big-endian
+struct chunk_hdr {
+	uint64_t id;
+	uint32_t records;
+	uint32_t len;
+};
+
+// Precedes the log lines of a chunk
+struct result_hdr {
+	uint64_t id;
+	uint32_t records;
+	uint32_t passed;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct chunk {
+	unsigned long id;
+	uint32_t records;
+	size_t len;
+	char *data;
+	char *out;		// log lines, once a worker has answered
+	size_t out_len;
+	uint32_t passed;
+	int done;
+	struct chunk *next;	// in the dispatch queue
+};
+
+struct conn;
+
+typedef struct so_cluster_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	// signaled on any change below
+
+	// Chunks waiting for a connection, re-dispatched ones first
+	struct chunk *head, *tail;
+	// Chunks read and not written yet, by id % CLUSTER_WINDOW
+	struct chunk *window[CLUSTER_WINDOW];
+	unsigned long next_id;
+	unsigned long next_write;
+	unsigned long pending;	// queued or in flight
+	int eof;
+	int alive;		// connections still up
+
+	unsigned long redispatched;
+	unsigned long packets;
+	unsigned long passed;
+
+	struct chunk *cur;	// being filled by the reader
+	so_output_t out;
+} so_cluster_t;
+
+struct conn {
+	so_cluster_t *cl;
+	const char *addr;
+	int fd;
+	int dead;
+	int closing;		// the sender is done and has shut down its side
+
+	// Sent and not answered yet: a worker answers in order
+	struct chunk *inflight[CLUSTER_INFLIGHT];
+	int first;
+	int count;
+
+	unsigned long chunks;
+	pthread_t sender;
+	pthread_t receiver;
+};
+
+// Sends all of `buf`; -1 on error, EPIPE rather than SIGPIPE when the peer is gone
+static int send_all(int fd, const void *buf, size_t len, int flags)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = send(fd, p, len, flags | MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Receives exactly `len` bytes: 1 once they are in, 0 if the stream ended before any, -1 otherwise
+static int recv_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t got = 0;
+
+	while (got < len) {
+		ssize_t n = recv(fd, p + got, len - got, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0 && got == 0)
+			return 0;
+		if (n <= 0) {
+			if (n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		got += n;
+	}
+
+	return 1;
+}
+
+// Both ends send the magic first and check the other's
+static int greet(int fd)
+{
+	char magic[CLUSTER_MAGIC_SZ];
+
+	if (send_all(fd, CLUSTER_MAGIC, CLUSTER_MAGIC_SZ, 0) < 0 ||
+	    recv_all(fd, magic, sizeof(magic)) != 1)
+		return -1;
+	if (memcmp(magic, CLUSTER_MAGIC, CLUSTER_MAGIC_SZ)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Fills `ss` from "unix:<path>", "<host>:<port>" or "[<ipv6>]:<port>"
+static int parse_addr(const char *addr, int passive, struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct addrinfo hints = { 0 }, *res;
+	const char *port;
+	char host[256];
+	int rc;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+
+		if (strlen(addr + 5) >= sizeof(sun->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(sun, 0, sizeof(*sun));
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, addr + 5);
+		*len = sizeof(*sun);
+		return 0;
+	}
+
+	port = strrchr(addr, ':');
+	if (!port || port - addr >= (long)sizeof(host)) {
+		errno = EINVAL;
+		return -1;
+	}
+	// The brackets of "[::1]:7000" only delimit the address
+	if (addr[0] == '[' && port > addr + 1 && port[-1] == ']')
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr - 2), addr + 1);
+	else
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	rc = getaddrinfo(*host ? host : NULL, port + 1, &hints, &res);
+	if (rc) {
+		log_error("cluster: %s: %s", addr, gai_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+// Headers and the tail of a chunk must not wait for an ACK
+static void set_nodelay(int fd, const struct sockaddr_storage *ss)
+{
+	int one = 1;
+
+	if (ss->ss_family != AF_UNIX)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * Classifies the `n` records framed in `in` and formats their lines into
+ * `out`, which holds `n` lines. Returns the length of the lines, or -1 if the
+ * framing does not add up.
+ */
+static ssize_t process_chunk(const char *in, size_t len, uint32_t n, char *out, uint32_t *passed)
+{
+	size_t off = 0, out_len = 0;
+	uint32_t rec_len;
+
+	*passed = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		const so_packet_t *pkt;
+		so_action_t action;
+		unsigned long hash;
+
+		if (len - off < sizeof(rec_len))
+			return -1;
+		memcpy(&rec_len, in + off, sizeof(rec_len));
+		rec_len = be32toh(rec_len);
+		off += sizeof(rec_len);
+		if (rec_len < sizeof(so_hdr_t) || rec_len > PKT_MAX_SZ || rec_len > len - off)
+			return -1;
+
+		pkt = (const so_packet_t *)(in + off);
+		action = process_packet_len(pkt, rec_len);
+		packet_prefetch_owner(pkt, NULL);	// Overlap the owner lookup with the hash
+		hash = packet_hash_len(pkt, rec_len);
+		out_len += packet_format(out + out_len, action, hash, pkt, packet_owner(pkt));
+		*passed += action == PASS;
+		off += rec_len;
+	}
+
+	return off == len ? (ssize_t)out_len : -1;
+}
+
+static void *serve_conn(void *arg)
+{
+	int fd = (long)arg;
+	char *in = NULL, *out = NULL;
+	size_t in_cap = 0, out_cap = 0;
+	struct chunk_hdr ch;
+	struct result_hdr rh = { 0 };
+	unsigned long chunks = 0;
+	int rc = -1;
+
+	if (greet(fd) < 0) {
+		log_warn("cluster: connection without the %s greeting: %s", CLUSTER_MAGIC,
+			 strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	while ((rc = recv_all(fd, &ch, sizeof(ch))) == 1) {
+		uint32_t n = be32toh(ch.records), len = be32toh(ch.len), passed;
+		ssize_t out_len;
+
+		// The sizes come from the peer: nothing larger than a chunk is allocated for
+		if (n > CLUSTER_CHUNK_PKTS || len > CLUSTER_CHUNK_SZ) {
+			log_warn("cluster: chunk %lu of %u records, %u bytes is over the chunk size, closing its connection",
+				 (unsigned long)be64toh(ch.id), n, len);
+			break;
+		}
+		if (len > in_cap) {
+			free(in);
+			in_cap = len;
+			in = malloc(in_cap);
+			DIE(in == NULL, "malloc");
+		}
+		if ((size_t)n * PKT_LINE_SZ > out_cap) {
+			free(out);
+			out_cap = (size_t)n * PKT_LINE_SZ;
+			out = malloc(out_cap);
+			DIE(out == NULL, "malloc");
+		}
+		if (recv_all(fd, in, len) != 1) {
+			rc = -1;
+			break;
+		}
+
+		out_len = process_chunk(in, len, n, out, &passed);
+		if (out_len < 0) {
+			log_warn("cluster: chunk %lu is malformed, closing its connection",
+				 (unsigned long)be64toh(ch.id));
+			break;
+		}
+
+		rh.id = ch.id;
+		rh.records = ch.records;
+		rh.passed = htobe32(passed);
+		rh.len = htobe32(out_len);
+		if (send_all(fd, &rh, sizeof(rh), MSG_MORE) < 0 || send_all(fd, out, out_len, 0) < 0) {
+			rc = -1;
+			break;
+		}
+		chunks++;
+	}
+	if (rc < 0)
+		log_warn("cluster: connection lost after %lu chunks: %s", chunks, strerror(errno));
+
+	close(fd);
+	free(in);
+	free(out);
+
+	return NULL;
+}
+
+int cluster_serve(const char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int fd, one = 1;
+
+	if (parse_addr(addr, 1, &ss, &len) < 0)
+		return -1;
+	fd = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (ss.ss_family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+	else
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&ss, len) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+		close(fd);
+		return -1;
+	}
+	log_info("cluster: serving on %s", addr);
+
+	for (;;) {
+		pthread_t tid;
+		int conn = accept(fd, NULL, NULL);
+
+		if (conn < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		DIE(conn < 0, "accept");
+		set_nodelay(conn, &ss);
+		if (pthread_create(&tid, NULL, serve_conn, (void *)(long)conn) != 0) {
+			log_warn("cluster: no thread for a new connection, closed");
+			close(conn);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+}
+
+static int conn_open(const char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int fd;
+
+	if (parse_addr(addr, 0, &ss, &len) < 0)
+		return -1;
+	fd = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&ss, len) < 0 || greet(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	set_nodelay(fd, &ss);
+
+	return fd;
+}
+
+// Marks `c` dead and wakes both of its threads; its chunks are re-dispatched by the receiver
+static void conn_fail(struct conn *c, int err)
+{
+	so_cluster_t *cl = c->cl;
+
+	so_mutex_lock(&cl->mutex);
+	if (!c->dead) {
+		c->dead = 1;
+		cl->alive--;
+		log_warn("cluster: lost %s (%s), %d chunks in flight go to the other workers",
+			 c->addr, strerror(err), c->count);
+	}
+	pthread_cond_broadcast(&cl->cond);
+	so_mutex_unlock(&cl->mutex);
+
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+// Puts the unanswered chunks of the dead `c` back at the front of the queue, oldest first
+static void redispatch(struct conn *c)
+{
+	so_cluster_t *cl = c->cl;
+
+	so_mutex_lock(&cl->mutex);
+	while (c->count) {
+		struct chunk *ch = c->inflight[(c->first + --c->count) % CLUSTER_INFLIGHT];
+
+		ch->next = cl->head;
+		cl->head = ch;
+		if (!cl->tail)
+			cl->tail = ch;
+		cl->redispatched++;
+	}
+	if (!cl->alive && cl->pending) {
+		log_error("cluster: no worker left with %lu chunks unprocessed", cl->pending);
+		exit(EXIT_FAILURE);
+	}
+	pthread_cond_broadcast(&cl->cond);
+	so_mutex_unlock(&cl->mutex);
+}
+
+static void *send_loop(void *arg)
+{
+	struct conn *c = arg;
+	so_cluster_t *cl = c->cl;
+
+	for (;;) {
+		struct chunk_hdr hdr;
+		struct chunk *ch;
+
+		// Stay until every chunk is answered: one may come back from a dead connection
+		so_mutex_lock(&cl->mutex);
+		while (!c->dead &&
+		       (c->count == CLUSTER_INFLIGHT || (!cl->head && !(cl->eof && !cl->pending))))
+			so_cond_wait(&cl->cond, &cl->mutex);
+		if (c->dead || !cl->head) {
+			c->closing = !c->dead;
+			so_mutex_unlock(&cl->mutex);
+			break;
+		}
+		ch = cl->head;
+		cl->head = ch->next;
+		if (!cl->head)
+			cl->tail = NULL;
+		c->inflight[(c->first + c->count++) % CLUSTER_INFLIGHT] = ch;
+		so_mutex_unlock(&cl->mutex);
+
+		hdr.id = htobe64(ch->id);
+		hdr.records = htobe32(ch->records);
+		hdr.len = htobe32(ch->len);
+		if (send_all(c->fd, &hdr, sizeof(hdr), MSG_MORE) < 0 ||
+		    send_all(c->fd, ch->data, ch->len, 0) < 0) {
+			conn_fail(c, errno);
+			break;
+		}
+	}
+
+	// The worker answers what it has, then sees the end of the stream and closes
+	if (c->closing)
+		shutdown(c->fd, SHUT_WR);
+
+	return NULL;
+}
+
+static void *recv_loop(void *arg)
+{
+	struct conn *c = arg;
+	so_cluster_t *cl = c->cl;
+	struct result_hdr rh;
+	int rc, err = 0;
+
+	while ((rc = recv_all(c->fd, &rh, sizeof(rh))) == 1) {
+		uint32_t len = be32toh(rh.len);
+		struct chunk *ch;
+		char *out;
+
+		// No chunk has more lines than this: a larger answer is not one of ours
+		if (len > CLUSTER_CHUNK_PKTS * PKT_LINE_SZ) {
+			errno = EPROTO;
+			rc = -1;
+			break;
+		}
+		out = malloc(len ? len : 1);
+		DIE(out == NULL, "malloc");
+		if (recv_all(c->fd, out, len) < 0) {
+			free(out);
+			rc = -1;
+			break;
+		}
+
+		so_mutex_lock(&cl->mutex);
+		ch = c->count ? c->inflight[c->first] : NULL;
+		if (!ch || ch->id != be64toh(rh.id) || ch->records != be32toh(rh.records)) {
+			so_mutex_unlock(&cl->mutex);
+			free(out);
+			errno = EPROTO;
+			rc = -1;
+			break;
+		}
+		c->first = (c->first + 1) % CLUSTER_INFLIGHT;
+		c->count--;
+		c->chunks++;
+		ch->out = out;
+		ch->out_len = len;
+		ch->passed = be32toh(rh.passed);
+		ch->done = 1;
+		cl->pending--;
+		pthread_cond_broadcast(&cl->cond);
+		so_mutex_unlock(&cl->mutex);
+	}
+	if (rc < 0)
+		err = errno;
+
+	// A clean end only comes after the sender shut down and every chunk was answered
+	so_mutex_lock(&cl->mutex);
+	if (!err && (c->count || !c->closing))
+		err = ECONNRESET;
+	so_mutex_unlock(&cl->mutex);
+	if (err)
+		conn_fail(c, err);
+
+	pthread_join(c->sender, NULL);
+	if (c->dead)
+		redispatch(c);
+
+	return NULL;
+}
+
+// Writes the chunks in id order as they are answered
+static void *write_loop(void *arg)
+{
+	so_cluster_t *cl = arg;
+	struct chunk *ch = NULL;
+
+	so_mutex_lock(&cl->mutex);
+	for (;;) {
+		while (!(cl->eof && cl->next_write == cl->next_id) &&
+		       !((ch = cl->window[cl->next_write % CLUSTER_WINDOW]) && ch->done))
+			so_cond_wait(&cl->cond, &cl->mutex);
+		if (cl->eof && cl->next_write == cl->next_id)
+			break;
+		so_mutex_unlock(&cl->mutex);
+
+		output_write(&cl->out, ch->out, ch->out_len);
+		cl->packets += ch->records;
+		cl->passed += ch->passed;
+		free(ch->out);
+		free(ch->data);
+		free(ch);
+		membudget_release(MEM_IO, CLUSTER_CHUNK_MEM);
+
+		so_mutex_lock(&cl->mutex);
+		cl->window[cl->next_write++ % CLUSTER_WINDOW] = NULL;
+		pthread_cond_broadcast(&cl->cond);
+	}
+	so_mutex_unlock(&cl->mutex);
+
+	return NULL;
+}
+
+// Queues the chunk being filled, once the window has room for it
+static void dispatch(so_cluster_t *cl)
+{
+	struct chunk *ch = cl->cur;
+
+	so_mutex_lock(&cl->mutex);
+	while (cl->next_id - cl->next_write >= CLUSTER_WINDOW)
+		so_cond_wait(&cl->cond, &cl->mutex);
+	ch->id = cl->next_id++;
+	cl->window[ch->id % CLUSTER_WINDOW] = ch;
+	if (cl->tail)
+		cl->tail->next = ch;
+	else
+		cl->head = ch;
+	cl->tail = ch;
+	cl->pending++;
+	pthread_cond_broadcast(&cl->cond);
+	so_mutex_unlock(&cl->mutex);
+
+	cl->cur = NULL;
+}
+
+static void add_record(void *arg, const void *rec, size_t len)
+{
+	so_cluster_t *cl = arg;
+	uint32_t be_len = htobe32(len);
+
+	if (cl->cur && (cl->cur->records == CLUSTER_CHUNK_PKTS ||
+			cl->cur->len + sizeof(be_len) + len > CLUSTER_CHUNK_SZ))
+		dispatch(cl);
+	if (!cl->cur) {
+		// Over the memory limit, wait for the writer to free a chunk rather than hold more
+		so_mutex_lock(&cl->mutex);
+		while (membudget_charge(MEM_IO, CLUSTER_CHUNK_MEM) < 0) {
+			DIE(cl->next_write == cl->next_id, "memory limit: cluster chunk");
+			so_cond_wait(&cl->cond, &cl->mutex);
+		}
+		so_mutex_unlock(&cl->mutex);
+
+		cl->cur = calloc(1, sizeof(*cl->cur));
+		DIE(cl->cur == NULL, "calloc");
+		cl->cur->data = malloc(CLUSTER_CHUNK_SZ);
+		DIE(cl->cur->data == NULL, "malloc");
+	}
+
+	memcpy(cl->cur->data + cl->cur->len, &be_len, sizeof(be_len));
+	memcpy(cl->cur->data + cl->cur->len + sizeof(be_len), rec, len);
+	cl->cur->len += sizeof(be_len) + len;
+	cl->cur->records++;
+}
+
+int cluster_run(const char *in_file, const char *out_file, const char *workers,
+		const so_producer_opts_t *producer_opts, const so_output_opts_t *output_opts)
+{
+	struct conn conns[CLUSTER_MAX_CONNS];
+	char *list = strdup(workers), *addr, *save;
+	int num_conns = 0, ret = -1, err;
+	so_cluster_t *cl;
+	pthread_t writer;
+
+	cl = calloc(1, sizeof(*cl));
+	DIE(cl == NULL || list == NULL, "calloc");
+	so_mutex_init(&cl->mutex, "cluster->mutex");
+	pthread_cond_init(&cl->cond, NULL);
+
+	for (addr = strtok_r(list, ",", &save); addr; addr = strtok_r(NULL, ",", &save)) {
+		struct conn *c = &conns[num_conns];
+
+		if (num_conns == CLUSTER_MAX_CONNS) {
+			log_error("cluster: more than %d workers", CLUSTER_MAX_CONNS);
+			errno = EINVAL;
+			goto out;
+		}
+		memset(c, 0, sizeof(*c));
+		c->cl = cl;
+		c->addr = addr;
+		c->fd = conn_open(addr);
+		if (c->fd < 0) {
+			log_error("cluster: %s: %s", addr, strerror(errno));
+			goto out;
+		}
+		num_conns++;
+	}
+	if (!num_conns) {
+		errno = EINVAL;
+		goto out;
+	}
+	if (output_open(&cl->out, out_file, output_opts) < 0)
+		goto out;
+
+	cl->alive = num_conns;
+	for (int i = 0; i < num_conns; i++) {
+		DIE(pthread_create(&conns[i].sender, NULL, send_loop, &conns[i]) != 0,
+		    "pthread_create");
+		DIE(pthread_create(&conns[i].receiver, NULL, recv_loop, &conns[i]) != 0,
+		    "pthread_create");
+	}
+	DIE(pthread_create(&writer, NULL, write_loop, cl) != 0, "pthread_create");
+
+	read_packets(in_file, producer_opts, add_record, cl);
+	if (cl->cur)
+		dispatch(cl);
+	so_mutex_lock(&cl->mutex);
+	cl->eof = 1;
+	pthread_cond_broadcast(&cl->cond);
+	so_mutex_unlock(&cl->mutex);
+
+	// Each receiver joins its sender
+	for (int i = 0; i < num_conns; i++)
+		pthread_join(conns[i].receiver, NULL);
+	pthread_join(writer, NULL);
+	output_close(&cl->out);
+
+	log_info("cluster: %lu packets in %lu chunks, %lu passed, %lu dropped, %lu chunks re-dispatched",
+		 cl->packets, cl->next_id, cl->passed, cl->packets - cl->passed, cl->redispatched);
+	for (int i = 0; i < num_conns; i++)
+		log_info("cluster: %s: %lu chunks%s", conns[i].addr, conns[i].chunks,
+			 conns[i].dead ? ", lost" : "");
+	ret = 0;
+out:
+	err = errno;
+	for (int i = 0; i < num_conns; i++)
+		close(conns[i].fd);
+	so_mutex_destroy(&cl->mutex);
+	pthread_cond_destroy(&cl->cond);
+	free(cl);
+	free(list);
+	errno = err;
+
+	return ret;
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_CLUSTER_H__
+#define __SO_CLUSTER_H__
+
+#include "producer.h"
+#include "output.h"
+
+/* Sent by both ends when a connection opens, so mismatched builds fail at once. */
+#define CLUSTER_MAGIC "SOCLUST1"
+#define CLUSTER_MAGIC_SZ 8
+
+/* A chunk ends after this many records or before this many bytes of them. */
+#define CLUSTER_CHUNK_PKTS 4096
+#define CLUSTER_CHUNK_SZ (1 << 20)
+
+/* Memory budget charged per chunk held: its records and room for their log lines. */
+#define CLUSTER_CHUNK_MEM (CLUSTER_CHUNK_SZ + CLUSTER_CHUNK_PKTS * PKT_LINE_SZ)
+
+/* Chunks sent to a connection ahead of its results, so the worker never waits for the next one. */
+#define CLUSTER_INFLIGHT 2
+
+/* Chunks read ahead of the oldest one not written yet. */
+#define CLUSTER_WINDOW 64
+
+/* Connections a coordinator may open. */
+#define CLUSTER_MAX_CONNS 64
+
+/**
+ * @brief Worker side: serves chunks on `addr` until the process is killed.
+ *
+ * `addr` is `unix:<path>` for a Unix socket (replacing a stale one) or
+ * `<host>:<port>` for TCP (`[<ipv6>]:<port>` also works, an empty host
+ * listens on every address). Each connection is served by its own thread,
+ * which classifies and hashes every record of a chunk with the policy the
+ * process has installed (payload rules, source sets, ...) and sends back its
+ * log lines, so a worker with several CPUs takes several connections.
+ *
+ * @return -1 with `errno` set if `addr` cannot be listened on; never returns otherwise.
+ */
+int cluster_serve(const char *addr);
+
+/**
+ * @brief Coordinator side: logs `in_file` to `out_file` through remote workers.
+ *
+ * `workers` is a comma-separated list of worker addresses, as given to
+ * cluster_serve(); an address listed twice gets two connections. The calling
+ * thread reads the input (any format `read_packets()` takes) and cuts it into
+ * chunks of whole records, which each connection pulls as it frees up, with
+ * `CLUSTER_INFLIGHT` in flight. Results come back in any order and are
+ * written in input order, so the log is the one a local run would write; at
+ * most `CLUSTER_WINDOW` chunks are held meanwhile, fewer if the memory limit
+ * is reached, and reading waits when the oldest is late.
+ *
+ * A connection that fails or closes mid-chunk is dropped and its unanswered
+ * chunks go to the other connections; the process exits with an error when
+ * none is left.
+ *
+ * @return 0 on success, -1 with `errno` set if the output or a connection could not be opened.
+ */
+int cluster_run(const char *in_file, const char *out_file, const char *workers,
+		const so_producer_opts_t *producer_opts, const so_output_opts_t *output_opts);
+
+#endif /* __SO_CLUSTER_H__ */
@@ -1,87 +1,242 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <pthread.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include "consumer.h"
 #include "ring_buffer.h"
 #include "packet.h"
+#include "lockprof.h"
+#include "slab.h"
+#include "tenants.h"
+#include "shmring.h"
+#include "realtime.h"
+#include "membudget.h"
 #include "utils.h"
 
-void consumer_thread(so_consumer_ctx_t *ctx)
-{
-	// Temporary storage for packet and output buffer
-	so_packet_t packet;
-	char out_buf[PKT_SZ];
+// A log line held in the reorder heap
+typedef struct so_out_rec_t {
+	unsigned long timestamp;
+	unsigned long seq;
 	int len;
+	int tenant;
+	so_action_t action;
+	unsigned long hash;
+	so_hdr_t hdr;
+	char line[PKT_LINE_SZ];
+} so_out_rec_t;
 
-	// Open the output file for appending processed packets
-	int fd = open(ctx->out_filename, O_WRONLY | O_CREAT | O_APPEND, 0777);
+static inline int rec_less(const so_out_rec_t *a, const so_out_rec_t *b)
+{
+	return a->timestamp < b->timestamp ||
+		   (a->timestamp == b->timestamp && a->seq < b->seq);
+}
 
-	if (fd < 0) {
-		perror("open");
-		return; // Error opening file, exit the consumer thread
-	}
+static void heap_push(so_consumer_ctx_t *ctx, so_out_rec_t *rec)
+{
+	size_t i = ctx->heap_len++;
 
-	while (1) {
-		// Acquire the mutex to ensure safe access to shared resources (buffer)
-		pthread_mutex_lock(&ctx->mutex);
+	// Sift the new record up to its place
+	while (i > 0 && rec_less(rec, ctx->heap[(i - 1) / 2])) {
+		ctx->heap[i] = ctx->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	ctx->heap[i] = rec;
+}
 
-		// Wait until there is data in the producer's ring buffer or the producer has stopped
-		while (ctx->producer_rb->len == 0 && !ctx->producer_rb->stop)
-			pthread_cond_wait(&ctx->producer_rb->not_empty, &ctx->mutex);
+static so_out_rec_t *heap_pop(so_consumer_ctx_t *ctx)
+{
+	so_out_rec_t *last = ctx->heap[--ctx->heap_len];
+	so_out_rec_t *min = ctx->heap[0];
+	size_t i = 0, child;
 
-		// If the producer has stopped and no data is left in the buffer, terminate the thread
-		if (ctx->producer_rb->stop && ctx->producer_rb->len == 0) {
-			pthread_mutex_unlock(&ctx->mutex);
+	// Sift the last record down from the root
+	while ((child = 2 * i + 1) < ctx->heap_len) {
+		if (child + 1 < ctx->heap_len && rec_less(ctx->heap[child + 1], ctx->heap[child]))
+			child++;
+		if (!rec_less(ctx->heap[child], last))
 			break;
-		}
+		ctx->heap[i] = ctx->heap[child];
+		i = child;
+	}
+	ctx->heap[i] = last;
 
-		// Dequeue a packet from the producer's ring buffer
-		ring_buffer_dequeue(ctx->producer_rb, &packet, sizeof(packet));
+	return min;
+}
 
-		// Protect the shared `times` array and update the timestamp for the current packet
-		pthread_mutex_lock(&ctx->file_mutex);
-		ctx->times[*ctx->idx] = packet.hdr.timestamp; // Store the timestamp in the array
-		(*ctx->idx)++;								  // Increment the index to track the position
-		pthread_mutex_unlock(&ctx->file_mutex);
+// Writes a line to the log, its tenant's sink and the shm ring; called with the file mutex held
+static void write_rec(so_consumer_ctx_t *ctx, const so_out_rec_t *rec)
+{
+	output_write(&ctx->out, rec->line, rec->len);
+	if (ctx->opts.tenants)
+		tenants_record(ctx->opts.tenants, rec->tenant, rec->action, rec->line, rec->len);
+	if (ctx->opts.output.shm_ring)
+		shmring_publish(ctx->opts.output.shm_ring, rec->action, rec->hash, &rec->hdr);
+}
+
+// Writes the smallest pending line and frees its record; called with the file mutex held
+static void heap_write_min(so_consumer_ctx_t *ctx)
+{
+	so_out_rec_t *rec = heap_pop(ctx);
+
+	if (rec->timestamp < ctx->last_written)
+		ctx->unsorted_lines++; // Arrived later than the window could absorb
+	ctx->last_written = rec->timestamp;
+	write_rec(ctx, rec);
+
+	// Often allocated by another consumer: goes back to its owner's slab
+	slab_free(ctx->rec_slab, rec);
+}
+
+static void report_timestamps(so_consumer_ctx_t *ctx)
+{
+	if (ctx->dup_timestamps || ctx->regressed_timestamps)
+		log_warn("input timestamps: %lu duplicate, %lu regressing",
+				 ctx->dup_timestamps, ctx->regressed_timestamps);
+	if (ctx->unsorted_lines)
+		log_warn("%lu log lines out of timestamp order after a reorder window of %zu",
+				 ctx->unsorted_lines, ctx->opts.reorder_window);
+}
+
+/*
+ * Takes the next packet record and its input sequence number. Returns the
+ * record length, or 0 once the producer has stopped and nothing is left.
+ * `*later` is pointed at `ahead`, filled with the header of the record queued
+ * after it, or set to NULL when there is none (or no byte ring, or no prefix
+ * database to prefetch for, in which case the header is not copied).
+ */
+static ssize_t next_packet(so_consumer_ctx_t *ctx, char *record, size_t cap, unsigned long *seq,
+			   so_packet_t *ahead, const so_packet_t **later)
+{
+	size_t ahead_len = sizeof(ahead->hdr);
+	ssize_t pkt_len;
+	long pos;
+
+	*later = NULL;
+
+	if (ctx->opts.pkt_ring) {
+		// The fixed-slot ring numbers packets itself, in push order
+		pos = so_pkt_ring_pop(ctx->opts.pkt_ring, (so_packet_t *)record);
+		if (pos < 0)
+			return 0;
+		*seq = pos;
+		return PKT_SZ;
+	}
 
-		// Unlock the mutex since the packet has been safely dequeued
-		pthread_mutex_unlock(&ctx->mutex);
+	// Acquire the mutex to ensure safe access to shared resources (buffer)
+	so_mutex_lock(&ctx->mutex);
 
+	// Wait until there is data in the producer's ring buffer or the producer has stopped
+	while (ctx->producer_rb->len == 0 && !ctx->producer_rb->stop)
+		so_cond_wait(&ctx->producer_rb->not_empty, &ctx->mutex);
+
+	// If the producer has stopped and no data is left in the buffer, terminate the thread
+	if (ctx->producer_rb->stop && ctx->producer_rb->len == 0) {
+		so_mutex_unlock(&ctx->mutex);
+		return 0;
+	}
+
+	// Dequeue a packet record, and the next one's header only when owners are looked up
+	if (packet_has_prefix_db()) {
+		pkt_len = ring_buffer_dequeue_rec_ahead(ctx->producer_rb, record, cap, &ahead->hdr,
+							&ahead_len);
+		if (ahead_len == sizeof(ahead->hdr))
+			*later = ahead;
+	} else {
+		pkt_len = ring_buffer_dequeue_rec(ctx->producer_rb, record, cap);
+	}
+
+	// Number the packet in input order
+	*seq = ctx->dequeue_seq++;
+
+	// Unlock the mutex since the packet has been safely dequeued
+	so_mutex_unlock(&ctx->mutex);
+
+	return pkt_len;
+}
+
+void consumer_thread(so_consumer_ctx_t *ctx)
+{
+	// Temporary storage for packet records (fixed or variable-length) and output buffer
+	union {
+		so_packet_t hdr;
+		char raw[PKT_MAX_SZ];
+	} record;
+	so_packet_t *packet = &record.hdr, ahead;
+	const so_packet_t *later;
+	so_out_rec_t line, *rec = &line;
+	unsigned long seq;
+	ssize_t pkt_len;
+
+	realtime_thread(RT_WORKER);
+
+	while ((pkt_len = next_packet(ctx, record.raw, sizeof(record), &seq, &ahead, &later)) > 0) {
 		// Process the packet and prepare formatted output for writing
-		so_action_t action = process_packet(&packet);	// Process the packet data
-		unsigned long hash = packet_hash(&packet);		// Generate a hash for the packet
-		unsigned long timestamp = packet.hdr.timestamp; // Extract the timestamp
+		int tenant;
+		so_action_t action = process_packet_tenant(packet, pkt_len, &tenant);	// Process the packet data
+		unsigned long hash;
+
+		packet_prefetch_owner(packet, later);		// Overlap the owner lookup with the hash
+		hash = packet_hash_len(packet, pkt_len);	// Generate a hash for the packet
 
-		// Format the packet data into the output buffer
-		len = snprintf(out_buf, PKT_SZ, "%s %016lx %lu\n",
-					   RES_TO_STR(action), hash, timestamp);
+		// Lines held back for reordering outlive this iteration: give them their own record
+		if (ctx->opts.reorder_window)
+			rec = slab_alloc(ctx->rec_slab);
+
+		// Format the packet data into the output record
+		rec->timestamp = packet->hdr.timestamp;
+		rec->seq = seq;
+		rec->tenant = tenant;
+		rec->action = action;
+		rec->hash = hash;
+		rec->hdr = packet->hdr;
+		rec->len = packet_format(rec->line, action, hash, packet, packet_owner(packet));
 
 		// Lock the file mutex to ensure safe access to the output file
-		pthread_mutex_lock(&ctx->file_mutex);
+		so_mutex_lock(&ctx->file_mutex);
 
-		// Wait until the current packet's timestamp matches the first timestamp in the array
-		while (timestamp != ctx->times[0])
-			pthread_cond_wait(&ctx->cond, &ctx->file_mutex);
+		// Wait until every packet dequeued before this one has been written
+		while (ctx->write_seq != seq)
+			so_cond_wait(&ctx->cond, &ctx->file_mutex);
 
-		// Shift the timestamps array to make space for the next packet
-		for (unsigned long i = 0; i < (*ctx->idx) - 1; i++)
-			ctx->times[i] = ctx->times[i + 1];
-		(*ctx->idx)--; // Decrease the index after removing the processed timestamp
+		// Packets get here in input order: check the timestamp against the previous one
+		if (seq > 0) {
+			if (rec->timestamp == ctx->last_timestamp)
+				ctx->dup_timestamps++;
+			else if (rec->timestamp < ctx->last_timestamp)
+				ctx->regressed_timestamps++;
+		}
+		ctx->last_timestamp = rec->timestamp;
 
-		// Broadcast any waiting threads that the data has been processed and written
-		pthread_cond_broadcast(&ctx->cond);
+		if (ctx->opts.reorder_window) {
+			// Hold the line back and emit the oldest once the window is full
+			heap_push(ctx, rec);
+			if (ctx->heap_len > ctx->opts.reorder_window)
+				heap_write_min(ctx);
+		} else {
+			// Write the formatted packet data to the file
+			write_rec(ctx, rec);
+		}
 
-		// Write the formatted packet data to the file
-		write(fd, out_buf, len);
+		// Let the consumer holding the next sequence number write
+		ctx->write_seq++;
+		pthread_cond_broadcast(&ctx->cond);
 
 		// Unlock the file mutex after writing
-		pthread_mutex_unlock(&ctx->file_mutex);
+		so_mutex_unlock(&ctx->file_mutex);
 	}
 
-	// Close the file once all packets are processed and written
-	close(fd);
+	// The last consumer to finish drains the reorder heap, reports anomalies and closes the file
+	so_mutex_lock(&ctx->file_mutex);
+	if (--ctx->active == 0) {
+		while (ctx->heap_len)
+			heap_write_min(ctx);
+		if (ctx->rec_slab) {
+			slab_report(ctx->rec_slab);
+			slab_destroy(ctx->rec_slab);
+		}
+		report_timestamps(ctx);
+		output_close(&ctx->out);
+	}
+	so_mutex_unlock(&ctx->file_mutex);
 }
 
 void *consumer_wrapper(void *arg)
@@ -93,10 +248,11 @@ void *consumer_wrapper(void *arg)
 int create_consumers(pthread_t *tids,
 					 int num_consumers,
 					 struct so_ring_buffer_t *rb,
-					 const char *out_filename)
+					 const char *out_filename,
+					 const so_consumer_opts_t *opts)
 {
 	// Allocate memory for the consumer context structure
-	so_consumer_ctx_t *ctx = malloc(sizeof(so_consumer_ctx_t));
+	so_consumer_ctx_t *ctx = calloc(1, sizeof(so_consumer_ctx_t));
 
 	if (!ctx)
 		return -1; // Check if memory allocation failed
@@ -104,15 +260,41 @@ int create_consumers(pthread_t *tids,
 	// Initialize the consumer context with provided parameters
 	ctx->producer_rb = rb;			  // Set the producer's ring buffer
 	ctx->out_filename = out_filename; // Save the output filename for each consumer
+	if (opts)
+		ctx->opts = *opts;
+	ctx->active = num_consumers;
 
-	// Initialize shared resources used for timestamp ordering
-	ctx->times = malloc(num_consumers * sizeof(unsigned long)); // Array to store timestamps
-	ctx->idx = calloc(1, sizeof(unsigned long));				// Index to track the current position
+	// Allocate the reorder heap, one slot more than the window for the incoming line,
+	// and the per-thread slab cache its records come from; under a memory limit the
+	// window shrinks so that the heap and its records fit the reorder share
+	if (ctx->opts.reorder_window) {
+		size_t entry = sizeof(*ctx->heap) + sizeof(so_out_rec_t);
+		size_t window = membudget_fit((ctx->opts.reorder_window + 1) * entry, 2 * entry,
+					      MEMBUDGET_REORDER_SHARE) / entry - 1;
+
+		if (window < ctx->opts.reorder_window) {
+			log_warn("memory limit: reorder window lowered from %zu to %zu packets",
+				 ctx->opts.reorder_window, window);
+			ctx->opts.reorder_window = window;
+		}
+		DIE(membudget_charge(MEM_REORDER, (window + 1) * entry) < 0,
+		    "memory limit: reorder window");
+		ctx->heap = malloc((ctx->opts.reorder_window + 1) * sizeof(*ctx->heap));
+		ctx->rec_slab = slab_create("out_rec", sizeof(so_out_rec_t));
+		if (!ctx->heap || !ctx->rec_slab)
+			return -1;
+	}
+
+	// Open the output file for appending processed packets
+	if (output_open(&ctx->out, out_filename, &ctx->opts.output) < 0) {
+		perror("open");
+		return -1;
+	}
 
-    // Initialize mutexes and condition variables for synchronization
+	// Initialize mutexes and condition variables for synchronization
 	pthread_cond_init(&ctx->cond, NULL);
-	pthread_mutex_init(&ctx->mutex, NULL);
-	pthread_mutex_init(&ctx->file_mutex, NULL);
+	so_mutex_init(&ctx->mutex, "ctx->mutex");
+	so_mutex_init(&ctx->file_mutex, "ctx->file_mutex");
 
 	// Create the consumer threads
 	for (int i = 0; i < num_consumers; i++) {
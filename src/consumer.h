@@ -5,6 +5,42 @@
 
 #include "ring_buffer.h"
 #include "packet.h"
+#include "output.h"
+#include "pkt_ring.h"
+
+/**
+ * @brief Tunables for the consumer threads; a zeroed structure gives the defaults.
+ */
+typedef struct so_consumer_opts_t
+{
+    /**
+     * @brief Number of log lines held back to restore timestamp order.
+     *
+     * Lines are always emitted in input order when this is `0`. Otherwise they
+     * pass through a min-heap of this size, which re-sorts jittered timestamps
+     * as long as no packet arrives more than `reorder_window` positions late.
+     */
+    size_t reorder_window;
+
+    /**
+     * @brief How the log file is written, see `so_output_opts_t`.
+     */
+    so_output_opts_t output;
+
+    /**
+     * @brief Fixed-slot ring to take packets from instead of the byte ring.
+     *
+     * Only for fixed-size packet input; the ring's push order numbers the packets.
+     */
+    so_pkt_ring_t *pkt_ring;
+
+    /**
+     * @brief Tenants whose counters and log sinks follow the log, or `NULL`.
+     *
+     * The same tenants must be installed with `packet_set_tenants()`.
+     */
+    struct so_tenants_t *tenants;
+} so_consumer_opts_t;
 
 /**
  * @brief Consumer context structure used to manage synchronization and
@@ -13,7 +49,7 @@
  * This structure contains all the necessary information for a consumer thread to
  * access the producer's buffer and write processed packets to a file. It also includes
  * mutexes and condition variables to ensure proper synchronization of access to shared
- * resources and to maintain the correct order of packets based on timestamps.
+ * resources and to maintain the correct order of packets based on their input sequence.
  */
 typedef struct so_consumer_ctx_t
 {
@@ -33,20 +69,66 @@ typedef struct so_consumer_ctx_t
     const char *out_filename;
 
     /**
-     * @brief Array for storing timestamps.
+     * @brief Log file sink shared by all consumers, protected by `file_mutex`.
+     */
+    so_output_t out;
+
+    /**
+     * @brief Consumer options, copied at creation.
+     */
+    so_consumer_opts_t opts;
+
+    /**
+     * @brief Input sequence number handed to the next dequeued packet.
+     *
+     * Packets are numbered in the order they leave the producer's ring buffer,
+     * under `mutex`. Output is ordered by this number rather than by timestamp,
+     * so duplicate or regressing timestamps cannot stall the writers.
+     */
+    unsigned long dequeue_seq;
+
+    /**
+     * @brief Sequence number of the next packet allowed to write its log line.
+     *
+     * Protected by `file_mutex`; consumers wait on `cond` until it reaches theirs.
+     */
+    unsigned long write_seq;
+
+    /**
+     * @brief Timestamp of the previous packet in input order, for O(1) anomaly checks.
      *
-     * This is an array of timestamps that are used to order the packets dequeued
-     * from the producer's buffer. Each timestamp corresponds to a data packet.
+     * Checked when a packet's turn to write comes, under `file_mutex`.
      */
-    unsigned long *times;
+    unsigned long last_timestamp;
 
     /**
-     * @brief Index for managing the timestamps array.
+     * @brief Packets whose timestamp equals / is lower than the previous one.
+     */
+    unsigned long dup_timestamps;
+    unsigned long regressed_timestamps;
+
+    /**
+     * @brief Min-heap of pending log lines keyed by (timestamp, sequence).
      *
-     * This is a pointer to an index that is updated as timestamps are processed, helping
-     * in managing the order of timestamps and facilitating proper synchronization of data.
+     * Only used when `opts.reorder_window` is not zero. Protected by `file_mutex`.
+     * The heap holds pointers to records allocated from `rec_slab` by the
+     * consumer that formatted the line, and freed by the one that writes it.
+     */
+    struct so_out_rec_t **heap;
+    size_t heap_len;
+    struct so_slab_t *rec_slab;
+
+    /**
+     * @brief Timestamp of the last line written and lines that were still out of
+     * order after leaving the reorder window.
+     */
+    unsigned long last_written;
+    unsigned long unsorted_lines;
+
+    /**
+     * @brief Number of consumer threads still running; the last one flushes the heap.
      */
-    unsigned long *idx;
+    int active;
 
     /**
      * @brief Mutex for protecting shared resources, especially the producer's ring buffer.
@@ -57,10 +139,10 @@ typedef struct so_consumer_ctx_t
     pthread_mutex_t mutex;
 
     /**
-     * @brief Condition variable for synchronizing threads based on timestamp ordering.
+     * @brief Condition variable for synchronizing threads based on input sequence ordering.
      *
      * This condition variable is used to synchronize threads so that packets are processed
-     * in the correct order according to their timestamps.
+     * in the correct order according to their input sequence.
      */
     pthread_cond_t cond;
 
@@ -75,7 +157,7 @@ typedef struct so_consumer_ctx_t
 
 /**
  * Represents a consumer thread function that processes packets from a producer's ring buffer,
- * formats them, and writes them to a file in timestamp order.
+ * formats them, and writes them to a file in input order.
  *
  * <p>This function operates in a multithreaded environment where multiple consumer threads
  * may access shared resources (e.g., ring buffer, output file). Synchronization is handled
@@ -86,13 +168,14 @@ typedef struct so_consumer_ctx_t
  *                <li>A reference to the producer's ring buffer.</li>
  *                <li>The name of the output file where processed packets are written.</li>
  *                <li>Synchronization primitives (mutexes and condition variables).</li>
- *                <li>Shared resources for timestamp ordering and output coordination.</li>
+ *                <li>Shared sequence counters for output ordering and coordination.</li>
  *            </ul>
  *
  * <p>The function:
  * <ol>
  *     <li>Waits for packets to become available in the producer's ring buffer.</li>
  *     <li>Dequeues packets from the buffer and processes them.</li>
+ *     <li>Numbers packets in dequeue order and counts duplicate or regressing timestamps.</li>
  *     <li>Synchronizes access to shared resources to maintain proper ordering of packets.</li>
  *     <li>Writes processed and formatted packet data to the output file.</li>
  * </ol>
@@ -108,7 +191,8 @@ typedef struct so_consumer_ctx_t
  * <p>If the producer signals termination and the ring buffer is empty, the thread will exit.</p>
  *
  * @note Proper initialization of the consumer context is required before invoking this function.
- *       The output file is opened in append mode and closed when processing is complete.
+ *       The output file is opened in append mode by `create_consumers` and closed by the last
+ *       consumer to finish.
  */
 void consumer_thread(so_consumer_ctx_t *ctx);
 
@@ -140,6 +224,7 @@ void *consumer_wrapper(void *arg);
  * @param rb A pointer to the shared ring buffer (`so_ring_buffer_t`) used by the producer
  *           and consumers for exchanging data.
  * @param out_filename The name of the file where the consumers will write the processed data.
+ * @param opts Consumer options, or `NULL` for the defaults.
  *
  * @return The number of consumer threads successfully created, or `-1` if an error occurs
  *         (e.g., memory allocation failure or thread creation failure).
@@ -147,7 +232,7 @@ void *consumer_wrapper(void *arg);
  * <h3>Details:</h3>
  * <ul>
  *   <li><b>Memory Management:</b> Allocates memory for the consumer context (`so_consumer_ctx_t`) 
- *       and shared resources (`ctx->times`, `ctx->idx`). These should be properly released after use.</li>
+ *       and, with a reorder window, the pending line heap (`ctx->heap`).</li>
  *   <li><b>Synchronization:</b> Initializes mutexes and condition variables for thread-safe
  *       coordination and shared resource access.</li>
  *   <li><b>Thread Creation:</b> Uses `pthread_create` to start each consumer thread. Each thread
@@ -163,6 +248,7 @@ void *consumer_wrapper(void *arg);
 int create_consumers(pthread_t *tids,
                      int num_consumers,
                      so_ring_buffer_t *rb,
-                     const char *out_filename);
+                     const char *out_filename,
+                     const so_consumer_opts_t *opts);
 
 #endif /* __SO_CONSUMER_H__ */
@@ -0,0 +1,884 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "prefilter.h"
+#include "lockprof.h"
+#include "membudget.h"
+#include "utils.h"
+
+/* Longest required literal kept per rule for the prefilter. */
+#define DFA_LITERAL_MAX 32
+
+// Bytes a state within the bound may cost: up to 4 table slots, its pointer and transitions
+#define STATE_COST (4 * sizeof(int) + sizeof(struct dfa_state *) + sizeof(struct dfa_state))
+
+enum nfa_type {
+	NFA_CLASS,	// consumes one byte from `cls`, then goes to `out`
+	NFA_SPLIT,	// epsilon to both `out` and `out1`
+	NFA_EPS,	// epsilon to `out`
+	NFA_MATCH,	// accepts `rule`
+};
+
+struct nfa_state {
+	enum nfa_type type;
+	int out;
+	int out1;
+	int rule;
+	unsigned char cls[32];
+};
+
+struct dfa_state {
+	int next[256];		// -1 until the transition has been built
+	int match;			// lowest accepting rule, -1 if none
+	size_t n;
+	int ids[];			// sorted NFA states (CLASS and MATCH only)
+};
+
+struct sparse_set {
+	int *dense;
+	int *sparse;
+	size_t n;
+};
+
+struct so_dfa_t {
+	struct nfa_state *nfa;
+	size_t nfa_len;
+	size_t nfa_cap;
+
+	int *starts;		// all rule entry states
+	size_t nstarts;
+	int *floating;		// entry states of unanchored rules
+	size_t nfloating;
+
+	struct dfa_state **states;
+	size_t nstates;
+	size_t max_states;
+
+	int *table;			// open addressing, state index + 1
+	size_t table_mask;
+
+	pthread_mutex_t mutex;	// serializes DFA construction
+	struct sparse_set scratch;
+	int *stack;
+	int *ids;
+
+	unsigned long fallbacks;
+	size_t mem;		// bytes charged to the memory budget
+
+	so_prefilter_t *prefilter;	// NULL if some rule has no required literal
+	int use_prefilter;
+};
+
+/* A fragment under construction: `start` is its entry, `end` a dangling EPS. */
+struct frag {
+	int start;
+	int end;
+};
+
+struct parser {
+	so_dfa_t *dfa;
+	const char *p;
+	int err;
+};
+
+static int nfa_new(so_dfa_t *dfa, enum nfa_type type)
+{
+	if (dfa->nfa_len == dfa->nfa_cap) {
+		size_t cap = dfa->nfa_cap ? dfa->nfa_cap * 2 : 64;
+		struct nfa_state *nfa = realloc(dfa->nfa, cap * sizeof(*nfa));
+
+		DIE(nfa == NULL, "realloc");
+		dfa->nfa = nfa;
+		dfa->nfa_cap = cap;
+	}
+
+	struct nfa_state *s = &dfa->nfa[dfa->nfa_len];
+
+	memset(s, 0, sizeof(*s));
+	s->type = type;
+	s->out = -1;
+	s->out1 = -1;
+	s->rule = -1;
+
+	return dfa->nfa_len++;
+}
+
+static inline void cls_set(unsigned char *cls, unsigned int c)
+{
+	cls[c >> 3] |= 1 << (c & 7);
+}
+
+static inline int cls_has(const unsigned char *cls, unsigned int c)
+{
+	return cls[c >> 3] & (1 << (c & 7));
+}
+
+static struct frag frag_class(so_dfa_t *dfa, const unsigned char *cls)
+{
+	struct frag f;
+
+	f.start = nfa_new(dfa, NFA_CLASS);
+	f.end = nfa_new(dfa, NFA_EPS);
+	memcpy(dfa->nfa[f.start].cls, cls, 32);
+	dfa->nfa[f.start].out = f.end;
+
+	return f;
+}
+
+static struct frag frag_empty(so_dfa_t *dfa)
+{
+	int e = nfa_new(dfa, NFA_EPS);
+
+	return (struct frag){ e, e };
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parses the escape after a `\` into `cls`; returns 1 if it is a single byte. */
+static int parse_escape(struct parser *ps, unsigned char *cls, unsigned int *byte)
+{
+	char c = *ps->p++;
+	int negate = 0, hi, lo;
+	unsigned char tmp[32] = { 0 };
+
+	switch (c) {
+	case 'D':
+	case 'W':
+	case 'S':
+		negate = 1;
+		c = c - 'A' + 'a';
+		/* fall through */
+	case 'd':
+	case 'w':
+	case 's':
+		for (unsigned int i = 0; i < 256; i++) {
+			int in = (c == 'd' && i >= '0' && i <= '9') ||
+				 (c == 'w' && ((i >= '0' && i <= '9') || (i >= 'a' && i <= 'z') ||
+					       (i >= 'A' && i <= 'Z') || i == '_')) ||
+				 (c == 's' && (i == ' ' || (i >= '\t' && i <= '\r')));
+			if (in != negate)
+				cls_set(tmp, i);
+		}
+		for (int i = 0; i < 32; i++)
+			cls[i] |= tmp[i];
+		return 0;
+	case 'x':
+		hi = hex_digit(ps->p[0]);
+		lo = hi < 0 ? -1 : hex_digit(ps->p[1]);
+		if (lo < 0) {
+			ps->err = 1;
+			return 0;
+		}
+		ps->p += 2;
+		*byte = hi << 4 | lo;
+		break;
+	case 'n':
+		*byte = '\n';
+		break;
+	case 'r':
+		*byte = '\r';
+		break;
+	case 't':
+		*byte = '\t';
+		break;
+	case '0':
+		*byte = 0;
+		break;
+	case '\0':
+		ps->err = 1;
+		ps->p--;
+		return 0;
+	default:
+		*byte = (unsigned char)c;
+		break;
+	}
+
+	cls_set(cls, *byte);
+	return 1;
+}
+
+static struct frag parse_bracket(struct parser *ps)
+{
+	unsigned char cls[32] = { 0 };
+	int negate = 0, first = 1;
+
+	if (*ps->p == '^') {
+		negate = 1;
+		ps->p++;
+	}
+
+	while (*ps->p && (*ps->p != ']' || first)) {
+		unsigned int lo, hi;
+		unsigned char item[32] = { 0 };
+
+		first = 0;
+		if (*ps->p == '\\') {
+			ps->p++;
+			if (!parse_escape(ps, item, &lo)) {
+				for (int i = 0; i < 32; i++)
+					cls[i] |= item[i];
+				continue;
+			}
+		} else {
+			lo = (unsigned char)*ps->p++;
+		}
+
+		hi = lo;
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			ps->p++;
+			if (*ps->p == '\\') {
+				ps->p++;
+				if (!parse_escape(ps, item, &hi))
+					ps->err = 1;
+			} else {
+				hi = (unsigned char)*ps->p++;
+			}
+		}
+		if (hi < lo)
+			ps->err = 1;
+		for (unsigned int c = lo; c <= hi && c < 256; c++)
+			cls_set(cls, c);
+	}
+
+	if (*ps->p != ']')
+		ps->err = 1;
+	else
+		ps->p++;
+
+	if (negate)
+		for (int i = 0; i < 32; i++)
+			cls[i] = ~cls[i];
+
+	return frag_class(ps->dfa, cls);
+}
+
+static struct frag parse_alt(struct parser *ps);
+
+static struct frag parse_atom(struct parser *ps)
+{
+	unsigned char cls[32] = { 0 };
+	unsigned int byte;
+	struct frag f;
+
+	switch (*ps->p) {
+	case '(':
+		ps->p++;
+		f = parse_alt(ps);
+		if (*ps->p != ')')
+			ps->err = 1;
+		else
+			ps->p++;
+		return f;
+	case '[':
+		ps->p++;
+		return parse_bracket(ps);
+	case '.':
+		ps->p++;
+		memset(cls, 0xff, sizeof(cls));
+		return frag_class(ps->dfa, cls);
+	case '\\':
+		ps->p++;
+		parse_escape(ps, cls, &byte);
+		return frag_class(ps->dfa, cls);
+	case '*':
+	case '+':
+	case '?':
+		ps->err = 1;
+		ps->p++;
+		return frag_empty(ps->dfa);
+	default:
+		cls_set(cls, (unsigned char)*ps->p++);
+		return frag_class(ps->dfa, cls);
+	}
+}
+
+static struct frag parse_repeat(struct parser *ps)
+{
+	so_dfa_t *dfa = ps->dfa;
+	struct frag f = parse_atom(ps);
+
+	while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+		char op = *ps->p++;
+		int s = nfa_new(dfa, NFA_SPLIT);
+		int e = nfa_new(dfa, NFA_EPS);
+
+		dfa->nfa[s].out = f.start;
+		dfa->nfa[s].out1 = e;
+		dfa->nfa[f.end].out = (op == '?') ? e : s;
+		f.start = (op == '+') ? f.start : s;
+		f.end = e;
+	}
+
+	return f;
+}
+
+static struct frag parse_concat(struct parser *ps)
+{
+	struct frag f = frag_empty(ps->dfa);
+
+	while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+		struct frag next = parse_repeat(ps);
+
+		ps->dfa->nfa[f.end].out = next.start;
+		f.end = next.end;
+	}
+
+	return f;
+}
+
+static struct frag parse_alt(struct parser *ps)
+{
+	so_dfa_t *dfa = ps->dfa;
+	struct frag f = parse_concat(ps);
+
+	while (*ps->p == '|' && !ps->err) {
+		ps->p++;
+
+		struct frag rhs = parse_concat(ps);
+		int s = nfa_new(dfa, NFA_SPLIT);
+		int e = nfa_new(dfa, NFA_EPS);
+
+		dfa->nfa[s].out = f.start;
+		dfa->nfa[s].out1 = rhs.start;
+		dfa->nfa[f.end].out = e;
+		dfa->nfa[rhs.end].out = e;
+		f.start = s;
+		f.end = e;
+	}
+
+	return f;
+}
+
+static int sparse_init(struct sparse_set *set, size_t cap)
+{
+	set->dense = calloc(cap, sizeof(int));
+	set->sparse = calloc(cap, sizeof(int));
+	set->n = 0;
+
+	return (set->dense && set->sparse) ? 0 : -1;
+}
+
+static void sparse_free(struct sparse_set *set)
+{
+	free(set->dense);
+	free(set->sparse);
+}
+
+static inline int sparse_has(const struct sparse_set *set, int id)
+{
+	size_t i = set->sparse[id];
+
+	return i < set->n && set->dense[i] == id;
+}
+
+static inline void sparse_add(struct sparse_set *set, int id)
+{
+	set->sparse[id] = set->n;
+	set->dense[set->n++] = id;
+}
+
+/* Adds `id` and everything reachable from it through epsilon edges. */
+static void closure_add(const so_dfa_t *dfa, struct sparse_set *set, int *stack, int id)
+{
+	size_t top = 0;
+
+	if (id < 0 || sparse_has(set, id))
+		return;
+	sparse_add(set, id);
+	stack[top++] = id;
+
+	while (top) {
+		const struct nfa_state *s = &dfa->nfa[stack[--top]];
+		int outs[2] = { -1, -1 };
+
+		if (s->type == NFA_SPLIT) {
+			outs[0] = s->out1;
+			outs[1] = s->out;
+		} else if (s->type == NFA_EPS) {
+			outs[0] = s->out;
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (outs[i] < 0 || sparse_has(set, outs[i]))
+				continue;
+			sparse_add(set, outs[i]);
+			stack[top++] = outs[i];
+		}
+	}
+}
+
+/* Moves every state of `ids` over `c` into `set`, then restarts floating rules. */
+static void nfa_step(const so_dfa_t *dfa, const int *ids, size_t n, unsigned char c,
+		     struct sparse_set *set, int *stack)
+{
+	set->n = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct nfa_state *s = &dfa->nfa[ids[i]];
+
+		if (s->type == NFA_CLASS && cls_has(s->cls, c))
+			closure_add(dfa, set, stack, s->out);
+	}
+	for (size_t i = 0; i < dfa->nfloating; i++)
+		closure_add(dfa, set, stack, dfa->floating[i]);
+}
+
+static int set_match(const so_dfa_t *dfa, const int *ids, size_t n)
+{
+	int match = -1;
+
+	for (size_t i = 0; i < n; i++) {
+		const struct nfa_state *s = &dfa->nfa[ids[i]];
+
+		if (s->type == NFA_MATCH && (match < 0 || s->rule < match))
+			match = s->rule;
+	}
+
+	return match;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Reduces a closure to its sorted CLASS/MATCH members into `dfa->ids`. */
+static size_t set_key(so_dfa_t *dfa, const struct sparse_set *set)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < set->n; i++) {
+		enum nfa_type type = dfa->nfa[set->dense[i]].type;
+
+		if (type == NFA_CLASS || type == NFA_MATCH)
+			dfa->ids[n++] = set->dense[i];
+	}
+	qsort(dfa->ids, n, sizeof(int), cmp_int);
+
+	return n;
+}
+
+static size_t key_hash(const int *ids, size_t n)
+{
+	size_t h = 14695981039346656037UL;
+
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (size_t)ids[i]) * 1099511628211UL;
+
+	return h;
+}
+
+/* Finds or creates the state for `dfa->ids[0..n)`; returns -1 if the cache is full. */
+static int state_intern(so_dfa_t *dfa, size_t n)
+{
+	size_t slot = key_hash(dfa->ids, n) & dfa->table_mask;
+	struct dfa_state *st;
+
+	while (dfa->table[slot]) {
+		st = dfa->states[dfa->table[slot] - 1];
+		if (st->n == n && !memcmp(st->ids, dfa->ids, n * sizeof(int)))
+			return dfa->table[slot] - 1;
+		slot = (slot + 1) & dfa->table_mask;
+	}
+
+	if (dfa->nstates == dfa->max_states)
+		return -1;
+
+	// Over the memory limit the cache stops growing, as when it is full
+	if (membudget_charge(MEM_REGEX, sizeof(*st) + n * sizeof(int)) < 0)
+		return -1;
+	st = malloc(sizeof(*st) + n * sizeof(int));
+	if (!st) {
+		membudget_release(MEM_REGEX, sizeof(*st) + n * sizeof(int));
+		return -1;
+	}
+	dfa->mem += sizeof(*st) + n * sizeof(int);
+	memset(st->next, 0xff, sizeof(st->next));
+	st->n = n;
+	memcpy(st->ids, dfa->ids, n * sizeof(int));
+	st->match = set_match(dfa, st->ids, n);
+
+	dfa->states[dfa->nstates] = st;
+	dfa->table[slot] = dfa->nstates + 1;
+	__atomic_store_n(&dfa->nstates, dfa->nstates + 1, __ATOMIC_RELEASE);
+
+	return dfa->nstates - 1;
+}
+
+static int dfa_transition(so_dfa_t *dfa, int from, unsigned char c)
+{
+	struct dfa_state *st = dfa->states[from];
+	int to;
+
+	so_mutex_lock(&dfa->mutex);
+
+	to = st->next[c];
+	if (to < 0) {
+		nfa_step(dfa, st->ids, st->n, c, &dfa->scratch, dfa->stack);
+		to = state_intern(dfa, set_key(dfa, &dfa->scratch));
+		if (to >= 0)
+			__atomic_store_n(&st->next[c], to, __ATOMIC_RELEASE);
+		else
+			__atomic_fetch_add(&dfa->fallbacks, 1, __ATOMIC_RELAXED);
+	}
+
+	so_mutex_unlock(&dfa->mutex);
+
+	return to;
+}
+
+/* Pike-style set simulation used once the DFA cache is exhausted. */
+static int nfa_simulate(const so_dfa_t *dfa, const struct dfa_state *from,
+			const unsigned char *buf, size_t len)
+{
+	struct sparse_set sets[2];
+	int *stack = malloc(dfa->nfa_len * sizeof(int));
+	int match = -1, cur = 0;
+
+	DIE(stack == NULL, "malloc");
+	DIE(sparse_init(&sets[0], dfa->nfa_len) < 0, "calloc");
+	DIE(sparse_init(&sets[1], dfa->nfa_len) < 0, "calloc");
+
+	nfa_step(dfa, from->ids, from->n, buf[0], &sets[cur], stack);
+	for (size_t i = 1; i <= len; i++) {
+		match = set_match(dfa, sets[cur].dense, sets[cur].n);
+		if (match >= 0 || i == len)
+			break;
+		nfa_step(dfa, sets[cur].dense, sets[cur].n, buf[i], &sets[cur ^ 1], stack);
+		cur ^= 1;
+	}
+
+	sparse_free(&sets[0]);
+	sparse_free(&sets[1]);
+	free(stack);
+
+	return match;
+}
+
+int dfa_match(so_dfa_t *dfa, const unsigned char *buf, size_t len)
+{
+	const struct dfa_state *st = dfa->states[0];
+	int cur = 0;
+
+	if (dfa->use_prefilter && !prefilter_scan(dfa->prefilter, buf, len))
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		int next;
+
+		if (st->match >= 0)
+			return st->match;
+
+		next = __atomic_load_n(&st->next[buf[i]], __ATOMIC_ACQUIRE);
+		if (next < 0) {
+			next = dfa_transition(dfa, cur, buf[i]);
+			if (next < 0)
+				return nfa_simulate(dfa, st, buf + i, len - i);
+		}
+
+		cur = next;
+		st = dfa->states[cur];
+	}
+
+	return st->match;
+}
+
+/* Skips a `(...)` group or `[...]` class starting at `p`; returns the char after it. */
+static const char *skip_nested(const char *p)
+{
+	int depth = 0, in_class = 0;
+
+	do {
+		if (*p == '\\' && p[1]) {
+			p += 2;
+			continue;
+		}
+		if (in_class) {
+			if (*p == ']')
+				in_class = 0;
+		} else if (*p == '[') {
+			in_class = 1;
+			if (p[1] == '^')
+				p++;
+			if (p[1] == ']')
+				p++;
+		} else if (*p == '(') {
+			depth++;
+		} else if (*p == ')') {
+			depth--;
+		}
+		p++;
+	} while (*p && (depth > 0 || in_class));
+
+	return p;
+}
+
+/*
+ * Extracts the longest literal that every match of `pattern` must contain.
+ * Only the top level concatenation is considered: groups, classes and
+ * optional characters break a run, a top level `|` yields no literal.
+ */
+static size_t required_literal(const char *pattern, unsigned char *out)
+{
+	unsigned char run[DFA_LITERAL_MAX];
+	size_t run_len = 0, best = 0;
+	const char *p = pattern + (*pattern == '^');
+
+	while (*p) {
+		int literal = 1, required = 1, ends = 0;
+		unsigned char byte = 0;
+
+		if (*p == '|')
+			return 0;
+
+		if (*p == '(' || *p == '[') {
+			p = skip_nested(p);
+			literal = 0;
+		} else if (*p == '.') {
+			p++;
+			literal = 0;
+		} else if (*p == '\\') {
+			p++;
+			if (strchr("dwsDWS", *p) || !*p) {
+				literal = 0;
+			} else if (*p == 'x' && hex_digit(p[1]) >= 0 && hex_digit(p[2]) >= 0) {
+				byte = hex_digit(p[1]) << 4 | hex_digit(p[2]);
+				p += 2;
+			} else {
+				byte = *p == 'n' ? '\n' : *p == 'r' ? '\r' : *p == 't' ? '\t' :
+				       *p == '0' ? 0 : (unsigned char)*p;
+			}
+			if (*p)
+				p++;
+		} else {
+			byte = (unsigned char)*p++;
+		}
+
+		for (; *p == '*' || *p == '+' || *p == '?'; p++) {
+			if (*p != '+')
+				required = 0;
+			ends = 1;
+		}
+
+		if (literal && required && run_len < DFA_LITERAL_MAX)
+			run[run_len++] = byte;
+		if (!literal || !required || ends) {
+			if (run_len > best) {
+				best = run_len;
+				memcpy(out, run, run_len);
+			}
+			run_len = 0;
+		}
+	}
+
+	if (run_len > best) {
+		best = run_len;
+		memcpy(out, run, run_len);
+	}
+
+	return best;
+}
+
+static void build_prefilter(so_dfa_t *dfa, const char *const *patterns, size_t count)
+{
+	unsigned char (*lits)[DFA_LITERAL_MAX] = calloc(count + 1, DFA_LITERAL_MAX);
+	const unsigned char **ptrs = calloc(count + 1, sizeof(*ptrs));
+	size_t *lens = calloc(count + 1, sizeof(*lens));
+
+	DIE(!lits || !ptrs || !lens, "calloc");
+
+	for (size_t i = 0; i < count; i++) {
+		lens[i] = required_literal(patterns[i], lits[i]);
+		ptrs[i] = lits[i];
+		if (lens[i] == 0) {
+			log_info("regex rule %zu has no required literal, prefilter disabled", i);
+			goto out;
+		}
+	}
+
+	dfa->prefilter = prefilter_build(ptrs, lens, count);
+	dfa->use_prefilter = dfa->prefilter != NULL;
+
+out:
+	free(lits);
+	free(ptrs);
+	free(lens);
+}
+
+void dfa_set_prefilter(so_dfa_t *dfa, int enable)
+{
+	dfa->use_prefilter = enable && dfa->prefilter;
+}
+
+int dfa_has_prefilter(so_dfa_t *dfa)
+{
+	return dfa->use_prefilter;
+}
+
+static so_dfa_t *dfa_alloc(size_t max_states)
+{
+	so_dfa_t *dfa = calloc(1, sizeof(*dfa));
+	size_t table_sz = 1;
+
+	if (!dfa)
+		return NULL;
+
+	dfa->max_states = max_states ? max_states : DFA_MAX_STATES;
+	// Under a memory limit, a smaller bound whose states fit the regex share
+	while (dfa->max_states > DFA_MIN_STATES &&
+	       membudget_fit(dfa->max_states * STATE_COST, 0, MEMBUDGET_REGEX_SHARE) <
+	       dfa->max_states * STATE_COST)
+		dfa->max_states /= 2;
+	if (dfa->max_states < (max_states ? max_states : DFA_MAX_STATES))
+		log_info("memory limit: %zu DFA states at most", dfa->max_states);
+	while (table_sz < 2 * dfa->max_states)
+		table_sz <<= 1;
+	dfa->table_mask = table_sz - 1;
+	so_mutex_init(&dfa->mutex, "dfa->mutex");
+	if (membudget_charge(MEM_REGEX, table_sz * sizeof(int) +
+			     dfa->max_states * sizeof(*dfa->states)) < 0) {
+		dfa_destroy(dfa);
+		return NULL;
+	}
+	dfa->mem = table_sz * sizeof(int) + dfa->max_states * sizeof(*dfa->states);
+	dfa->table = calloc(table_sz, sizeof(int));
+	dfa->states = calloc(dfa->max_states, sizeof(*dfa->states));
+
+	if (!dfa->table || !dfa->states) {
+		dfa_destroy(dfa);
+		return NULL;
+	}
+
+	return dfa;
+}
+
+so_dfa_t *dfa_compile(const char *const *patterns, size_t count, size_t max_states)
+{
+	so_dfa_t *dfa = dfa_alloc(max_states);
+	struct parser ps = { .dfa = dfa };
+
+	if (!dfa)
+		return NULL;
+
+	dfa->starts = calloc(count + 1, sizeof(int));
+	dfa->floating = calloc(count + 1, sizeof(int));
+	DIE(!dfa->starts || !dfa->floating, "calloc");
+
+	for (size_t i = 0; i < count; i++) {
+		int anchored = patterns[i][0] == '^';
+		struct frag f;
+		int m;
+
+		ps.p = patterns[i] + anchored;
+		f = parse_alt(&ps);
+		if (ps.err || *ps.p) {
+			log_error("regex rule %zu: syntax error at offset %ld in \"%s\"",
+				  i, (long)(ps.p - patterns[i]), patterns[i]);
+			dfa_destroy(dfa);
+			return NULL;
+		}
+
+		m = nfa_new(dfa, NFA_MATCH);
+		dfa->nfa[m].rule = i;
+		dfa->nfa[f.end].out = m;
+
+		dfa->starts[dfa->nstarts++] = f.start;
+		if (!anchored)
+			dfa->floating[dfa->nfloating++] = f.start;
+	}
+
+	dfa->stack = malloc((dfa->nfa_len + 1) * sizeof(int));
+	dfa->ids = malloc((dfa->nfa_len + 1) * sizeof(int));
+	DIE(!dfa->stack || !dfa->ids, "malloc");
+	DIE(sparse_init(&dfa->scratch, dfa->nfa_len + 1) < 0, "calloc");
+
+	/* The start state is the closure of every rule entry. */
+	for (size_t i = 0; i < dfa->nstarts; i++)
+		closure_add(dfa, &dfa->scratch, dfa->stack, dfa->starts[i]);
+	DIE(state_intern(dfa, set_key(dfa, &dfa->scratch)) != 0, "dfa start state");
+
+	build_prefilter(dfa, patterns, count);
+
+	return dfa;
+}
+
+so_dfa_t *dfa_load(const char *path, size_t max_states)
+{
+	FILE *f = fopen(path, "r");
+	char **patterns = NULL;
+	size_t count = 0, cap = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+	so_dfa_t *dfa;
+
+	if (!f) {
+		log_error("%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	while ((n = getline(&line, &line_cap, f)) >= 0) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+		if (n == 0 || line[0] == '#')
+			continue;
+
+		if (count == cap) {
+			cap = cap ? cap * 2 : 16;
+			patterns = realloc(patterns, cap * sizeof(*patterns));
+			DIE(patterns == NULL, "realloc");
+		}
+		patterns[count] = strdup(line);
+		DIE(patterns[count] == NULL, "strdup");
+		count++;
+	}
+	free(line);
+	fclose(f);
+
+	dfa = dfa_compile((const char *const *)patterns, count, max_states);
+
+	for (size_t i = 0; i < count; i++)
+		free(patterns[i]);
+	free(patterns);
+
+	return dfa;
+}
+
+void dfa_stats(so_dfa_t *dfa, size_t *states, unsigned long *fallbacks)
+{
+	*states = __atomic_load_n(&dfa->nstates, __ATOMIC_ACQUIRE);
+	*fallbacks = __atomic_load_n(&dfa->fallbacks, __ATOMIC_RELAXED);
+}
+
+void dfa_destroy(so_dfa_t *dfa)
+{
+	if (!dfa)
+		return;
+
+	for (size_t i = 0; i < dfa->nstates; i++)
+		free(dfa->states[i]);
+	free(dfa->states);
+	free(dfa->table);
+	free(dfa->nfa);
+	free(dfa->starts);
+	free(dfa->floating);
+	free(dfa->stack);
+	free(dfa->ids);
+	sparse_free(&dfa->scratch);
+	prefilter_destroy(dfa->prefilter);
+	so_mutex_destroy(&dfa->mutex);
+	membudget_release(MEM_REGEX, dfa->mem);
+	free(dfa);
+}
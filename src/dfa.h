@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_DFA_H__
+#define __SO_DFA_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Default bound on the number of cached DFA states (256 transitions each). */
+#define DFA_MAX_STATES 4096
+/* Lowest bound a memory limit may leave. */
+#define DFA_MIN_STATES 64
+
+/**
+ * @brief A set of payload regex rules compiled into one NFA, executed through
+ * a lazily built DFA.
+ *
+ * Patterns are unanchored substring matches unless they start with `^`.
+ * The supported syntax is: literals, `.`, `[...]` / `[^...]` classes with
+ * ranges, `\d \w \s \xHH` and escaped metacharacters, grouping with `( )`,
+ * alternation `|` and the `* + ?` quantifiers.
+ *
+ * DFA states are built on demand by the consumers and published with release
+ * stores, so lookups of already known transitions take no lock. Only a miss
+ * serializes on `mutex`. Once `max_states` states exist, or the memory limit
+ * is reached (see membudget.h), no new ones are created; the remainder of
+ * that payload is matched by simulating the NFA, which keeps the matcher
+ * linear in the payload length in every case.
+ */
+typedef struct so_dfa_t so_dfa_t;
+
+/**
+ * @brief Compiles the patterns from a rule file, one per line.
+ *
+ * Blank lines and lines starting with `#` are ignored.
+ *
+ * @param path Rule file path.
+ * @param max_states Bound on cached DFA states, `0` selects `DFA_MAX_STATES`.
+ * @return The compiled rule set, or `NULL` on I/O or syntax error.
+ */
+so_dfa_t *dfa_load(const char *path, size_t max_states);
+
+/**
+ * @brief Compiles an in-memory array of patterns.
+ *
+ * @return The compiled rule set, or `NULL` on syntax error.
+ */
+so_dfa_t *dfa_compile(const char *const *patterns, size_t count, size_t max_states);
+
+/**
+ * @brief Searches a buffer for the first rule that matches anywhere in it.
+ *
+ * Safe to call concurrently from any number of threads.
+ *
+ * @return The index of the matching rule (lowest index wins when several
+ *         rules match at the same position), or `-1` if none matches.
+ */
+int dfa_match(so_dfa_t *dfa, const unsigned char *buf, size_t len);
+
+/**
+ * @brief Enables or disables the literal prefilter.
+ *
+ * When every rule contains a required literal, `dfa_compile` builds a SIMD
+ * prefilter over those literals and `dfa_match` only runs the automaton on
+ * buffers in which one of them occurs. It is enabled by default.
+ */
+void dfa_set_prefilter(so_dfa_t *dfa, int enable);
+
+/* Returns whether `dfa_match` currently runs the literal prefilter. */
+int dfa_has_prefilter(so_dfa_t *dfa);
+
+/**
+ * @brief Number of DFA states built so far and number of payloads that had
+ * to fall back to NFA simulation because the cache was full.
+ */
+void dfa_stats(so_dfa_t *dfa, size_t *states, unsigned long *fallbacks);
+
+void dfa_destroy(so_dfa_t *dfa);
+
+#endif /* __SO_DFA_H__ */
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dio.h"
+#include "lockprof.h"
+#include "realtime.h"
+#include "membudget.h"
+#include "utils.h"
+
+int dio_pool_init(so_dio_pool_t *pool, size_t count, size_t buf_size)
+{
+	void *mem;
+
+	if (buf_size < DIO_BUF_SZ_MIN)
+		buf_size = DIO_BUF_SZ_MIN;
+	if (buf_size > DIO_BUF_SZ_MAX)
+		buf_size = DIO_BUF_SZ_MAX;
+	buf_size = membudget_fit(count * buf_size, count * DIO_BUF_SZ_MIN, MEMBUDGET_IO_SHARE) / count;
+	buf_size = (buf_size + DIO_ALIGN - 1) & ~(size_t)(DIO_ALIGN - 1);
+
+	if (membudget_charge(MEM_IO, count * buf_size) < 0)
+		return -1;
+	if (posix_memalign(&mem, DIO_ALIGN, count * buf_size)) {
+		membudget_release(MEM_IO, count * buf_size);
+		return -1;
+	}
+	realtime_prefault(mem, count * buf_size);
+
+	pool->free = malloc(count * sizeof(*pool->free));
+	if (!pool->free) {
+		free(mem);
+		membudget_release(MEM_IO, count * buf_size);
+		return -1;
+	}
+
+	pool->mem = mem;
+	pool->count = count;
+	pool->nfree = count;
+	pool->buf_size = buf_size;
+	for (size_t i = 0; i < count; i++)
+		pool->free[i] = pool->mem + i * buf_size;
+
+	so_mutex_init(&pool->mutex, "dio_pool->mutex");
+	pthread_cond_init(&pool->available, NULL);
+
+	return 0;
+}
+
+char *dio_pool_get(so_dio_pool_t *pool)
+{
+	char *buf;
+
+	so_mutex_lock(&pool->mutex);
+	while (pool->nfree == 0)
+		so_cond_wait(&pool->available, &pool->mutex);
+	buf = pool->free[--pool->nfree];
+	so_mutex_unlock(&pool->mutex);
+
+	return buf;
+}
+
+void dio_pool_put(so_dio_pool_t *pool, char *buf)
+{
+	so_mutex_lock(&pool->mutex);
+	pool->free[pool->nfree++] = buf;
+	so_mutex_unlock(&pool->mutex);
+	pthread_cond_signal(&pool->available);
+}
+
+void dio_pool_destroy(so_dio_pool_t *pool)
+{
+	free(pool->mem);
+	free(pool->free);
+	membudget_release(MEM_IO, pool->count * pool->buf_size);
+	so_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->available);
+}
+
+int dio_open(const char *path, int flags, int mode, int *direct)
+{
+	int fd;
+
+	if (*direct) {
+		fd = open(path, flags | O_DIRECT, mode);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+
+		log_warn("%s: file system does not support O_DIRECT, using buffered I/O", path);
+		*direct = 0;
+	}
+
+	return open(path, flags, mode);
+}
+
+void dio_disable(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags >= 0)
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
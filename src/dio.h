@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_DIO_H__
+#define __SO_DIO_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Buffer address, size and file offset alignment used for O_DIRECT. */
+#define DIO_ALIGN 4096
+
+#define DIO_BUF_SZ_MIN (1UL << 20)
+#define DIO_BUF_SZ_MAX (8UL << 20)
+#define DIO_BUF_SZ_DEFAULT (4UL << 20)
+
+/**
+ * @brief Pool of large `DIO_ALIGN`-aligned buffers for direct I/O.
+ *
+ * Buffers are allocated once; `dio_pool_get()` blocks until one is free.
+ */
+typedef struct so_dio_pool_t {
+	char **free;
+	size_t nfree;
+	size_t count;
+	size_t buf_size;
+	char *mem;
+	pthread_mutex_t mutex;
+	pthread_cond_t available;
+} so_dio_pool_t;
+
+/**
+ * @brief Allocates `count` buffers of `buf_size` bytes, clamped to
+ * [`DIO_BUF_SZ_MIN`, `DIO_BUF_SZ_MAX`] and rounded to `DIO_ALIGN`.
+ *
+ * Under a memory limit the buffers are made smaller, down to
+ * `DIO_BUF_SZ_MIN`, to fit the I/O share of it (see membudget.h).
+ *
+ * @return 0 on success, -1 if the allocation failed or is over the memory limit.
+ */
+int dio_pool_init(so_dio_pool_t *pool, size_t count, size_t buf_size);
+char *dio_pool_get(so_dio_pool_t *pool);
+void dio_pool_put(so_dio_pool_t *pool, char *buf);
+void dio_pool_destroy(so_dio_pool_t *pool);
+
+/**
+ * @brief Opens `path` with O_DIRECT when `*direct` is set.
+ *
+ * If the file system rejects O_DIRECT, the file is opened for buffered I/O
+ * instead, a warning is logged and `*direct` is cleared.
+ *
+ * @return The file descriptor, or -1 with `errno` set.
+ */
+int dio_open(const char *path, int flags, int mode, int *direct);
+
+/**
+ * @brief Switches a descriptor back to buffered I/O, e.g. for an unaligned tail
+ * or after the file system refused a direct transfer with EINVAL.
+ */
+void dio_disable(int fd);
+
+#endif /* __SO_DIO_H__ */
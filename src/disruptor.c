@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "disruptor.h"
+#include "realtime.h"
+#include "membudget.h"
+#include "utils.h"
+
+static void init_sizes(so_disruptor_t *d, size_t num_slots, size_t slot_size)
+{
+	size_t n = 1;
+
+	memset(d, 0, sizeof(*d));
+
+	while (n < num_slots)
+		n <<= 1;
+
+	// Keep every slot on its own cache lines
+	d->slot_size = (slot_size + DISRUPTOR_CACHE_LINE - 1) & ~(size_t)(DISRUPTOR_CACHE_LINE - 1);
+
+	// Halve the ring until it fits the memory budget
+	while (n > DISRUPTOR_MIN_SLOTS &&
+	       membudget_fit(n * d->slot_size, 0, MEMBUDGET_RING_SHARE) < n * d->slot_size)
+		n >>= 1;
+	if (n < num_slots)
+		log_info("memory limit: %zu ring slots", n);
+	d->num_slots = n;
+}
+
+int disruptor_init(so_disruptor_t *d, size_t num_slots, size_t slot_size)
+{
+	init_sizes(d, num_slots, slot_size);
+
+	if (membudget_charge(MEM_RING, d->num_slots * d->slot_size) < 0)
+		return -1;
+	if (posix_memalign((void **)&d->slots, DISRUPTOR_CACHE_LINE,
+			   d->num_slots * d->slot_size) != 0) {
+		membudget_release(MEM_RING, d->num_slots * d->slot_size);
+		return -1;
+	}
+	realtime_prefault(d->slots, d->num_slots * d->slot_size);
+
+	return 0;
+}
+
+int disruptor_init_shared(so_disruptor_t *d, size_t num_slots, size_t slot_size)
+{
+	init_sizes(d, num_slots, slot_size);
+
+	if (membudget_charge(MEM_RING, d->num_slots * d->slot_size) < 0)
+		return -1;
+	// Page-aligned, so cache-line aligned
+	d->slots = mmap(NULL, d->num_slots * d->slot_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (d->slots == MAP_FAILED) {
+		d->slots = NULL;
+		membudget_release(MEM_RING, d->num_slots * d->slot_size);
+		return -1;
+	}
+	d->shared = 1;
+	realtime_prefault(d->slots, d->num_slots * d->slot_size);
+
+	return 0;
+}
+
+void disruptor_add_gating(so_disruptor_t *d, so_seq_t *seq)
+{
+	d->gating = realloc(d->gating, (d->num_gating + 1) * sizeof(*d->gating));
+	DIE(d->gating == NULL, "realloc");
+	d->gating[d->num_gating++] = seq;
+}
+
+// Spins, then yields: on an oversubscribed machine the thread we wait for needs the CPU
+static inline void wait_pause(unsigned int *tries)
+{
+	if (++*tries >= DISRUPTOR_SPIN_TRIES)
+		sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+	else
+		__builtin_ia32_pause();
+#endif
+}
+
+static unsigned long min_seq(so_seq_t *const *seqs, size_t n, unsigned long limit)
+{
+	unsigned long v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = seq_get(seqs[i]);
+		if (v < limit)
+			limit = v;
+	}
+
+	return limit;
+}
+
+unsigned long disruptor_claim(so_disruptor_t *d)
+{
+	unsigned long seq = d->cursor.value;
+	unsigned int tries = 0;
+
+	// The slot is free once every gating consumer is less than a lap behind
+	while (seq >= d->cached_gate.value + d->num_slots) {
+		d->cached_gate.value = min_seq(d->gating, d->num_gating, seq);
+		if (seq < d->cached_gate.value + d->num_slots)
+			break;
+		wait_pause(&tries);
+	}
+
+	return seq;
+}
+
+void disruptor_publish(so_disruptor_t *d, unsigned long seq)
+{
+	seq_set(&d->cursor, seq + 1);
+}
+
+void disruptor_finish(so_disruptor_t *d)
+{
+	__atomic_store_n(&d->finished, 1, __ATOMIC_RELEASE);
+}
+
+void disruptor_destroy(so_disruptor_t *d)
+{
+	if (d->shared)
+		munmap(d->slots, d->num_slots * d->slot_size);
+	else
+		free(d->slots);
+	membudget_release(MEM_RING, d->num_slots * d->slot_size);
+	free(d->gating);
+}
+
+unsigned long barrier_wait(const so_barrier_t *b, unsigned long next)
+{
+	unsigned long avail;
+	unsigned int tries = 0;
+	int finished;
+
+	while (1) {
+		// Read the flag first: a cursor read afterwards is then final
+		finished = __atomic_load_n(&b->d->finished, __ATOMIC_ACQUIRE);
+		avail = seq_get(&b->d->cursor);
+		if (b->num_deps)
+			avail = min_seq(b->deps, b->num_deps, avail);
+
+		if (avail > next)
+			return avail;
+		if (finished && seq_get(&b->d->cursor) == next)
+			return next;
+
+		wait_pause(&tries);
+	}
+}
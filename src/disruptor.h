@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_DISRUPTOR_H__
+#define __SO_DISRUPTOR_H__
+
+#include <stddef.h>
+
+#define DISRUPTOR_CACHE_LINE 64
+
+/* Fewest slots the memory limit may leave a ring with. */
+#define DISRUPTOR_MIN_SLOTS 16
+
+/* Busy-wait rounds before a waiting thread starts yielding the CPU. */
+#define DISRUPTOR_SPIN_TRIES 256
+
+/**
+ * @brief Progress counter of one producer or consumer, alone on its cache line.
+ *
+ * `value` counts the sequences published (producer) or fully processed
+ * (consumer): sequence `s` is done once `value > s`. Only its owner writes it.
+ */
+typedef struct so_seq_t {
+	unsigned long value;
+	char pad[DISRUPTOR_CACHE_LINE - sizeof(unsigned long)];
+} __attribute__((aligned(DISRUPTOR_CACHE_LINE))) so_seq_t;
+
+/**
+ * @brief Single-producer multicast ring of preallocated slots.
+ *
+ * The producer fills each slot once; consumers read (and annotate) the slots
+ * in place instead of copying them into per-stage queues. Every consumer keeps
+ * its own `so_seq_t` and waits on a barrier: the minimum of the sequences it
+ * depends on (the producer's `cursor` when it has no dependencies). The
+ * producer only reuses a slot once every gating sequence (normally the last
+ * stages) has moved past it. No locks are taken: threads spin, then yield.
+ */
+typedef struct so_disruptor_t {
+	char *slots;
+	size_t num_slots;	/* power of two */
+	size_t slot_size;
+
+	so_seq_t cursor;	/* sequences published */
+	so_seq_t cached_gate;	/* producer's last view of the gating minimum */
+
+	so_seq_t **gating;
+	size_t num_gating;
+
+	int finished;		/* no sequence will be published after `cursor` */
+	int shared;		/* slots in a shared mapping, see disruptor_init_shared() */
+} so_disruptor_t;
+
+/**
+ * @brief Dependencies of one consumer: the sequences it must stay behind.
+ */
+typedef struct so_barrier_t {
+	so_disruptor_t *d;
+	so_seq_t **deps;
+	size_t num_deps;
+} so_barrier_t;
+
+/**
+ * @brief Allocates `num_slots` (rounded up to a power of two) slots of
+ * `slot_size` bytes each, cache-line aligned.
+ *
+ * Under a memory limit, fewer slots are taken if `num_slots` would not fit
+ * in the ring's share of it (see membudget.h), down to `DISRUPTOR_MIN_SLOTS`.
+ *
+ * @return 0 on success, -1 if the allocation failed or is over the memory limit.
+ */
+int disruptor_init(so_disruptor_t *d, size_t num_slots, size_t slot_size);
+
+/**
+ * @brief Same, with the slots in an anonymous shared mapping, so that
+ * processes forked afterwards work on them too.
+ *
+ * `d` and the consumer sequences must then be in shared memory as well; the
+ * gating list is only read by the producer and may stay private.
+ */
+int disruptor_init_shared(so_disruptor_t *d, size_t num_slots, size_t slot_size);
+
+/**
+ * @brief Makes the producer wait for `seq` before reusing slots.
+ *
+ * Must be called for the final consumers before anything is published.
+ */
+void disruptor_add_gating(so_disruptor_t *d, so_seq_t *seq);
+
+static inline void *disruptor_slot(so_disruptor_t *d, unsigned long seq)
+{
+	return d->slots + (seq & (d->num_slots - 1)) * d->slot_size;
+}
+
+/**
+ * @brief Returns the next sequence, waiting until its slot is free again.
+ */
+unsigned long disruptor_claim(so_disruptor_t *d);
+
+/**
+ * @brief Makes the slot of `seq`, the last claimed sequence, visible to consumers.
+ */
+void disruptor_publish(so_disruptor_t *d, unsigned long seq);
+
+/**
+ * @brief Signals that nothing more will be published.
+ */
+void disruptor_finish(so_disruptor_t *d);
+
+void disruptor_destroy(so_disruptor_t *d);
+
+/**
+ * @brief Waits until sequence `next` is available behind every dependency.
+ *
+ * @return The number of sequences available (greater than `next`; the caller
+ *         may process the whole batch), or `next` once the producer has
+ *         finished and everything up to its cursor has been consumed.
+ */
+unsigned long barrier_wait(const so_barrier_t *b, unsigned long next);
+
+/**
+ * @brief Publishes the progress of a consumer: sequences below `value` are done.
+ */
+static inline void seq_set(so_seq_t *seq, unsigned long value)
+{
+	__atomic_store_n(&seq->value, value, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long seq_get(const so_seq_t *seq)
+{
+	return __atomic_load_n(&seq->value, __ATOMIC_ACQUIRE);
+}
+
+#endif /* __SO_DISRUPTOR_H__ */
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "dropcap.h"
+#include "packet.h"
+#include "pcap.h"
+#include "membudget.h"
+#include "utils.h"
+
+#define CACHE_LINE 64
+
+// Slots looked at for a source in DROPCAP_FIRST mode before giving up on it
+#define SOURCE_PROBES 16
+
+_Static_assert((DROPCAP_QUEUE_SLOTS & (DROPCAP_QUEUE_SLOTS - 1)) == 0,
+	       "DROPCAP_QUEUE_SLOTS is not a power of two");
+
+struct cap_slot {
+	// Equal to the position it can be claimed at, one more once filled
+	unsigned long seq;
+	size_t len;			// of the record, before truncation
+	char data[DROPCAP_SNAPLEN];
+};
+
+struct so_dropcap_t {
+	so_dropcap_opts_t opts;
+	const char *path;
+	FILE *f;
+	pthread_t tid;
+	int stop;
+	int failed;
+
+	struct cap_slot *slots;
+	unsigned long head;		// next position to write out, writer only
+
+	// DROPCAP_FIRST: drops seen per source, keyed by source + 1 (0 for a free slot)
+	uint64_t *src_keys;
+	unsigned long *src_counts;
+
+	// Claimed by the consumers, apart from what the writer touches
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	unsigned long drops;
+	unsigned long sampled;
+	unsigned long lost;
+	unsigned long untracked;
+
+	unsigned long written __attribute__((aligned(CACHE_LINE)));
+};
+
+// Counter slot of `source`, claimed on its first drop; -1 when its probe run is full
+static long track(so_dropcap_t *cap, uint32_t source)
+{
+	uint64_t key = (uint64_t)source + 1;
+	size_t i = (source * 0x9e3779b1u) & (DROPCAP_SOURCES - 1);
+
+	for (int probe = 0; probe < SOURCE_PROBES; probe++, i = (i + 1) & (DROPCAP_SOURCES - 1)) {
+		uint64_t cur = __atomic_load_n(&cap->src_keys[i], __ATOMIC_RELAXED);
+
+		if (cur == 0 &&
+		    __atomic_compare_exchange_n(&cap->src_keys[i], &cur, key, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return i;
+		if (cur == key)
+			return i;
+	}
+
+	return -1;
+}
+
+static int sample(so_dropcap_t *cap, const so_packet_t *pkt)
+{
+	unsigned long nth = __atomic_fetch_add(&cap->drops, 1, __ATOMIC_RELAXED);
+	long i;
+
+	if (cap->opts.mode == DROPCAP_EVERY)
+		return nth % cap->opts.n == 0;
+
+	i = track(cap, pkt->hdr.source);
+	if (i < 0) {
+		__atomic_fetch_add(&cap->untracked, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return __atomic_fetch_add(&cap->src_counts[i], 1, __ATOMIC_RELAXED) < cap->opts.n;
+}
+
+void dropcap_offer(so_dropcap_t *cap, const void *rec, size_t len)
+{
+	unsigned long pos = __atomic_load_n(&cap->tail, __ATOMIC_RELAXED);
+	struct cap_slot *slot;
+
+	if (!sample(cap, rec))
+		return;
+	__atomic_fetch_add(&cap->sampled, 1, __ATOMIC_RELAXED);
+
+	// Claim the slot at the tail unless the writer has not freed it yet
+	for (;;) {
+		long diff;
+
+		slot = &cap->slots[pos & (DROPCAP_QUEUE_SLOTS - 1)];
+		diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&cap->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&cap->lost, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&cap->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->len = len;
+	memcpy(slot->data, rec, len < DROPCAP_SNAPLEN ? len : DROPCAP_SNAPLEN);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void write_slot(so_dropcap_t *cap, const struct cap_slot *slot)
+{
+	const so_packet_t *pkt = (const so_packet_t *)slot->data;
+	size_t kept = slot->len < DROPCAP_SNAPLEN ? slot->len : DROPCAP_SNAPLEN;
+	size_t skip = cap->opts.linktype == PCAP_LINKTYPE_RAW ? sizeof(so_hdr_t) : 0;
+
+	if (cap->failed)
+		return;
+	if (pcap_write_packet(cap->f, pkt->hdr.timestamp, slot->data + skip, kept - skip,
+			      slot->len - skip) < 0) {
+		log_error("%s: %s, no more drops captured", cap->path, strerror(errno));
+		cap->failed = 1;
+		return;
+	}
+	cap->written++;
+}
+
+static void *writer_thread(void *arg)
+{
+	so_dropcap_t *cap = arg;
+
+	for (;;) {
+		struct cap_slot *slot = &cap->slots[cap->head & (DROPCAP_QUEUE_SLOTS - 1)];
+		// Read first: once stopping, every offer has been published
+		int stopping = __atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == cap->head + 1) {
+			write_slot(cap, slot);
+			__atomic_store_n(&slot->seq, cap->head + DROPCAP_QUEUE_SLOTS, __ATOMIC_RELEASE);
+			cap->head++;
+			continue;
+		}
+		if (stopping)
+			break;
+
+		// Idle: let what was written reach the file, then wait for more
+		fflush(cap->f);
+		usleep(DROPCAP_POLL_US);
+	}
+
+	return NULL;
+}
+
+so_dropcap_t *dropcap_open(const char *path, const so_dropcap_opts_t *opts)
+{
+	so_dropcap_t *cap;
+	unsigned int snaplen;
+
+	if (opts->n == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+	cap->opts = *opts;
+	cap->path = path;
+
+	if (membudget_charge(MEM_TABLES, DROPCAP_QUEUE_SLOTS * sizeof(*cap->slots)) < 0) {
+		free(cap);
+		return NULL;
+	}
+	cap->slots = calloc(DROPCAP_QUEUE_SLOTS, sizeof(*cap->slots));
+	if (!cap->slots)
+		goto err;
+	for (size_t i = 0; i < DROPCAP_QUEUE_SLOTS; i++)
+		cap->slots[i].seq = i;
+
+	if (opts->mode == DROPCAP_FIRST) {
+		cap->src_keys = calloc(DROPCAP_SOURCES, sizeof(*cap->src_keys));
+		cap->src_counts = calloc(DROPCAP_SOURCES, sizeof(*cap->src_counts));
+		if (!cap->src_keys || !cap->src_counts)
+			goto err;
+	}
+
+	cap->f = fopen(path, "w");
+	if (!cap->f)
+		goto err;
+	setvbuf(cap->f, NULL, _IOFBF, 1 << 20);
+
+	snaplen = DROPCAP_SNAPLEN - (opts->linktype == PCAP_LINKTYPE_RAW ? sizeof(so_hdr_t) : 0);
+	if (pcap_write_header(cap->f, snaplen, opts->linktype) < 0)
+		goto err;
+
+	errno = pthread_create(&cap->tid, NULL, writer_thread, cap);
+	if (errno)
+		goto err;
+
+	return cap;
+err:
+	if (cap->f)
+		fclose(cap->f);
+	free(cap->src_keys);
+	free(cap->src_counts);
+	free(cap->slots);
+	membudget_release(MEM_TABLES, DROPCAP_QUEUE_SLOTS * sizeof(*cap->slots));
+	free(cap);
+	return NULL;
+}
+
+static void report(const so_dropcap_t *cap)
+{
+	log_info("drop capture %s: %lu drops, %lu sampled, %lu written, %lu lost to a full queue",
+		 cap->path, cap->drops, cap->sampled, cap->written, cap->lost);
+	if (cap->untracked)
+		log_info("drop capture %s: %lu drops of sources beyond the %d tracked", cap->path,
+			 cap->untracked, DROPCAP_SOURCES);
+}
+
+void dropcap_close(so_dropcap_t *cap)
+{
+	__atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(cap->tid, NULL);
+
+	if (fclose(cap->f) && !cap->failed)
+		log_error("%s: %s", cap->path, strerror(errno));
+	report(cap);
+	free(cap->src_keys);
+	free(cap->src_counts);
+	free(cap->slots);
+	membudget_release(MEM_TABLES, DROPCAP_QUEUE_SLOTS * sizeof(*cap->slots));
+	free(cap);
+}
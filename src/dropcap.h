@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_DROPCAP_H__
+#define __SO_DROPCAP_H__
+
+#include <stddef.h>
+
+/* Queue slots between the consumers and the writer thread (a power of two). */
+#define DROPCAP_QUEUE_SLOTS 1024
+
+/* Bytes kept of each sampled record; longer ones are truncated. */
+#define DROPCAP_SNAPLEN 2048
+
+/* Sources tracked in DROPCAP_FIRST mode; drops of further sources are not sampled. */
+#define DROPCAP_SOURCES 65536
+
+/* How long the writer sleeps when it finds the queue empty. */
+#define DROPCAP_POLL_US 1000
+
+typedef enum {
+	DROPCAP_EVERY = 0,	/* one in every `n` drops */
+	DROPCAP_FIRST,		/* the first `n` drops of each source */
+} so_dropcap_mode_t;
+
+typedef struct so_dropcap_opts_t {
+	so_dropcap_mode_t mode;
+	unsigned long n;
+	/*
+	 * PCAP_LINKTYPE_RAW writes the record payload, which starts at the IPv4
+	 * header for captured input; PCAP_LINKTYPE_USER0 writes whole records.
+	 */
+	unsigned int linktype;
+} so_dropcap_opts_t;
+
+/**
+ * @brief Sampled capture of dropped packets to a pcap file.
+ *
+ * Consumers offer their DROP records with dropcap_offer(), which decides on
+ * sampling with one atomic counter and copies a sampled record into a
+ * bounded lock-free queue: a slot is claimed with a compare-and-swap on the
+ * tail and published through its own sequence number, so offering never
+ * takes a lock or makes a system call. When the queue is full the sample is
+ * counted as lost rather than waited for. A background thread drains the
+ * queue into the file, sleeping `DROPCAP_POLL_US` whenever it is empty.
+ */
+typedef struct so_dropcap_t so_dropcap_t;
+
+/**
+ * @brief Creates (truncating) the pcap file and starts the writer thread.
+ *
+ * @return The capture, or NULL with `errno` set.
+ */
+so_dropcap_t *dropcap_open(const char *path, const so_dropcap_opts_t *opts);
+
+/* Samples a dropped record of `len` bytes (header included); thread-safe, never blocks. */
+void dropcap_offer(so_dropcap_t *cap, const void *rec, size_t len);
+
+/*
+ * Writes out what is queued, stops the writer and closes the file, then logs
+ * the drops seen and the samples written and lost at info level.
+ */
+void dropcap_close(so_dropcap_t *cap);
+
+#endif /* __SO_DROPCAP_H__ */
@@ -1,20 +1,49 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <getopt.h>
 
 #include "ring_buffer.h"
 #include "consumer.h"
 #include "producer.h"
 #include "log/log.h"
 #include "packet.h"
+#include "dfa.h"
+#include "dio.h"
+#include "rtc.h"
+#include "pipeline.h"
+#include "forkpool.h"
+#include "srcset.h"
+#include "pairtab.h"
+#include "timed_rules.h"
+#include "tenants.h"
+#include "prefixdb.h"
+#include "dropcap.h"
+#include "pcap.h"
+#include "shmring.h"
+#include "realtime.h"
+#include "autocfg.h"
+#include "calibrate.h"
+#include "cluster.h"
+#include "lockprof.h"
+#include "membudget.h"
 #include "utils.h"
 
 #define SO_RING_SZ (PKT_SZ * 1000)
 
+/* Upper bounds of the numeric options that have none of their own. */
+#define SO_MAX_REGEX_STATES (1UL << 20)
+#define SO_MAX_REORDER_WINDOW (1UL << 24)
+#define SO_MAX_SHM_SLOTS (1UL << 30)
+#define SO_MAX_MIB (1UL << 24)
+
 pthread_mutex_t MUTEX_LOG;
 
 void log_lock(bool lock, void *udata)
@@ -22,51 +51,221 @@ void log_lock(bool lock, void *udata)
 	pthread_mutex_t *LOCK = (pthread_mutex_t *)udata;
 
 	if (lock)
-		pthread_mutex_lock(LOCK);
+		so_mutex_lock(LOCK);
 	else
-		pthread_mutex_unlock(LOCK);
+		so_mutex_unlock(LOCK);
 }
 
 void __attribute__((constructor)) init()
 {
-	pthread_mutex_init(&MUTEX_LOG, NULL);
+	so_mutex_init(&MUTEX_LOG, "MUTEX_LOG");
 	log_set_lock(log_lock, &MUTEX_LOG);
 }
 
 void __attribute__((destructor)) dest()
 {
-	pthread_mutex_destroy(&MUTEX_LOG);
+	so_mutex_destroy(&MUTEX_LOG);
 }
 
-int main(int argc, char **argv)
+static void usage(const char *prog)
 {
-	so_ring_buffer_t ring_buffer;
-	int num_consumers, threads, rc;
-	pthread_t *thread_ids = NULL;
+	fprintf(stderr,
+		"Usage %s [options] <input-file> <output-file> <num-consumers:1-32|auto>\n"
+		"With `auto`, the consumers, ring and read sizes follow the cgroup CPU and memory limits\n"
+		"Options:\n"
+		"  --regex-rules <file>   drop packets whose payload matches any regex in <file>\n"
+		"  --regex-states <n>     bound on cached DFA states (default %d)\n"
+		"  --no-prefilter         run the DFA on every payload, without the literal prefilter\n"
+		"  --reorder-window <n>   re-sort log lines by timestamp within a window of n packets\n"
+		"  --direct-io[=<MiB>]    bypass the page cache with O_DIRECT, using 1-8 MiB buffers (default 4)\n"
+		"  --uring-writer[=<n>]   write the log asynchronously through io_uring, n buffers in flight (default %d)\n"
+		"  --uring-fsync <MiB>    with --uring-writer, fsync the log after every <MiB> written\n"
+		"  --engine <ring|rtc|disruptor|fork>\n"
+		"                         producer/consumer ring (default), run-to-completion workers,\n"
+		"                         stages on a multicast ring or worker processes sharing it\n"
+		"  --slot-ring            with the ring engine, pass fixed-size packets through a\n"
+		"                         typed ring of whole packets instead of the byte ring\n"
+		"  --allow-sources <file> pass only the sources listed in <file> (addresses, CIDR\n"
+		"                         blocks or ranges) instead of the built-in ranges\n"
+		"  --source-set <roaring|flat>\n"
+		"                         keep --allow-sources as compressed roaring containers\n"
+		"                         (default) or a 512 MB bitmap when that much memory is free\n"
+		"  --pinholes <file>      also pass the exact <source> <dest> pairs listed in <file>\n"
+		"  --timed-rules <file>   drop or pass sources only while packet timestamps are in\n"
+		"                         the windows given in <file>\n"
+		"  --tenants <file>       classify each packet with the policy of the tenant owning\n"
+		"                         its destination, with per-tenant counters and logs\n"
+		"  --prefix-db <file>     append the owner id of each source, from a database built\n"
+		"                         by mkprefixdb, to its log line\n"
+		"  --capture-drops <file> write a sample of the dropped packets to the pcap <file>\n"
+		"  --capture-every <n>    with --capture-drops, sample one in every n drops (default 1)\n"
+		"  --capture-first <n>    with --capture-drops, sample the first n drops of each source\n"
+		"  --shm-ring <name>      also publish every packet's record to the shared memory\n"
+		"                         ring <name> (e.g. /firewall), read by shmtail\n"
+		"  --shm-slots <n>        records in the ring, a power of two (default %d)\n"
+		"  --shm-policy <block|overwrite>\n"
+		"                         wait for the slowest reader (default) or let lagging\n"
+		"                         readers lose records\n"
+		"  --shm-readers <n>      wait for n readers to attach before reading the input\n"
+		"  --realtime[=<prio>]    lock and prefault memory and keep the producer and writer\n"
+		"                         on a CPU of their own, running SCHED_FIFO at <prio> if given\n"
+		"  --cgroup-dir <dir>     with `auto`, read the cgroup v2 limit files in <dir> instead\n"
+		"                         of those of the process's cgroup\n"
+		"  --calibrate[=<ms>]     time the hash and source kernels and the ring sizes for\n"
+		"                         about ms milliseconds (default %d) and use the fastest\n"
+		"  --calibrate-cache <file>  reuse the calibration of this CPU model from <file>,\n"
+		"                         or store it there\n"
+		"  --workers <addr>[,...] send the input in chunks to workers at these addresses\n"
+		"                         (<host>:<port> or unix:<path>) and write their log lines\n"
+		"  --serve <addr>         run as a worker on <addr>, without positional arguments\n"
+		"                         (nor --capture-drops or --shm-ring)\n"
+		"  --memory-limit[=<MiB>] fit rings, buffers and tables in <MiB> of memory, and\n"
+		"                         report the peak footprint of each (only report without <MiB>)\n",
+		prog, DFA_MAX_STATES, OUTPUT_URING_DEPTH, SHMRING_SLOTS, CALIBRATE_BUDGET_MS);
+	exit(EXIT_FAILURE);
+}
+
+/* The whole of `arg` as a decimal number in [min, max], or exits with an error about `name` */
+static unsigned long parse_num(const char *name, const char *arg, unsigned long min,
+			       unsigned long max)
+{
+	unsigned long val;
+	char *end;
 
-	if (argc < 4) {
-		fprintf(stderr, "Usage %s <input-file> <output-file> <num-consumers:1-32>\n", argv[0]);
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (errno || end == arg || *end || *arg == '-' || val < min || val > max) {
+		fprintf(stderr, "%s [%s] must be in the interval [%lu-%lu]\n", name, arg, min, max);
 		exit(EXIT_FAILURE);
 	}
 
-	rc = ring_buffer_init(&ring_buffer, SO_RING_SZ);
-	DIE(rc < 0, "ring_buffer_init");
+	return val;
+}
 
-	num_consumers = strtol(argv[3], NULL, 10);
+enum {
+	ENGINE_RING,
+	ENGINE_RTC,
+	ENGINE_DISRUPTOR,
+	ENGINE_FORK,
+	ENGINE_CLUSTER,		/* --workers: the coordinator has done the work */
+};
 
-	if (num_consumers <= 0 || num_consumers > 32) {
-		fprintf(stderr, "num-consumers [%d] must be in the interval [1-32]\n", num_consumers);
-		exit(EXIT_FAILURE);
+enum {
+	OPT_REGEX_RULES = 256,
+	OPT_REGEX_STATES,
+	OPT_NO_PREFILTER,
+	OPT_REORDER_WINDOW,
+	OPT_DIRECT_IO,
+	OPT_URING_WRITER,
+	OPT_URING_FSYNC,
+	OPT_ENGINE,
+	OPT_SLOT_RING,
+	OPT_ALLOW_SOURCES,
+	OPT_SOURCE_SET,
+	OPT_PINHOLES,
+	OPT_TIMED_RULES,
+	OPT_TENANTS,
+	OPT_PREFIX_DB,
+	OPT_CAPTURE_DROPS,
+	OPT_CAPTURE_EVERY,
+	OPT_CAPTURE_FIRST,
+	OPT_SHM_RING,
+	OPT_SHM_SLOTS,
+	OPT_SHM_POLICY,
+	OPT_SHM_READERS,
+	OPT_REALTIME,
+	OPT_CGROUP_DIR,
+	OPT_CALIBRATE,
+	OPT_CALIBRATE_CACHE,
+	OPT_WORKERS,
+	OPT_SERVE,
+	OPT_MEMORY_LIMIT,
+};
+
+static const struct option long_options[] = {
+	{ "regex-rules",	required_argument,	NULL,	OPT_REGEX_RULES },
+	{ "regex-states",	required_argument,	NULL,	OPT_REGEX_STATES },
+	{ "no-prefilter",	no_argument,		NULL,	OPT_NO_PREFILTER },
+	{ "reorder-window",	required_argument,	NULL,	OPT_REORDER_WINDOW },
+	{ "direct-io",		optional_argument,	NULL,	OPT_DIRECT_IO },
+	{ "uring-writer",	optional_argument,	NULL,	OPT_URING_WRITER },
+	{ "uring-fsync",	required_argument,	NULL,	OPT_URING_FSYNC },
+	{ "engine",		required_argument,	NULL,	OPT_ENGINE },
+	{ "slot-ring",		no_argument,		NULL,	OPT_SLOT_RING },
+	{ "allow-sources",	required_argument,	NULL,	OPT_ALLOW_SOURCES },
+	{ "source-set",		required_argument,	NULL,	OPT_SOURCE_SET },
+	{ "pinholes",		required_argument,	NULL,	OPT_PINHOLES },
+	{ "timed-rules",	required_argument,	NULL,	OPT_TIMED_RULES },
+	{ "tenants",		required_argument,	NULL,	OPT_TENANTS },
+	{ "prefix-db",		required_argument,	NULL,	OPT_PREFIX_DB },
+	{ "capture-drops",	required_argument,	NULL,	OPT_CAPTURE_DROPS },
+	{ "capture-every",	required_argument,	NULL,	OPT_CAPTURE_EVERY },
+	{ "capture-first",	required_argument,	NULL,	OPT_CAPTURE_FIRST },
+	{ "shm-ring",		required_argument,	NULL,	OPT_SHM_RING },
+	{ "shm-slots",		required_argument,	NULL,	OPT_SHM_SLOTS },
+	{ "shm-policy",		required_argument,	NULL,	OPT_SHM_POLICY },
+	{ "shm-readers",	required_argument,	NULL,	OPT_SHM_READERS },
+	{ "realtime",		optional_argument,	NULL,	OPT_REALTIME },
+	{ "cgroup-dir",		required_argument,	NULL,	OPT_CGROUP_DIR },
+	{ "calibrate",		optional_argument,	NULL,	OPT_CALIBRATE },
+	{ "calibrate-cache",	required_argument,	NULL,	OPT_CALIBRATE_CACHE },
+	{ "workers",		required_argument,	NULL,	OPT_WORKERS },
+	{ "serve",		required_argument,	NULL,	OPT_SERVE },
+	{ "memory-limit",	optional_argument,	NULL,	OPT_MEMORY_LIMIT },
+	{ NULL,			0,			NULL,	0 },
+};
+
+static void push_packet(void *arg, const void *rec, size_t len)
+{
+	(void)len;
+	so_pkt_ring_push(arg, rec);
+}
+
+static void run_ring(const char *in_file, const char *out_file, int num_consumers,
+		     size_t ring_size, so_consumer_opts_t *consumer_opts,
+		     const so_producer_opts_t *producer_opts, int slot_ring)
+{
+	so_ring_buffer_t ring_buffer;
+	pthread_t *thread_ids = NULL;
+	size_t fitted;
+	int threads, rc;
+
+	if (slot_ring && input_is_fixed(in_file) != 1) {
+		log_warn("--slot-ring needs fixed-size packets, using the byte ring");
+		slot_ring = 0;
+	}
+	if (slot_ring) {
+		DIE(membudget_charge(MEM_RING, sizeof(so_pkt_ring_t)) < 0, "memory limit: slot ring");
+		consumer_opts->pkt_ring = malloc(sizeof(so_pkt_ring_t));
+		DIE(consumer_opts->pkt_ring == NULL, "malloc");
+		so_pkt_ring_init(consumer_opts->pkt_ring);
+		realtime_prefault(consumer_opts->pkt_ring, sizeof(so_pkt_ring_t));
 	}
 
+	/* Half of the memory left at most: the consumers' buffers come next */
+	fitted = membudget_fit(ring_size, PRODUCER_RING_MIN, MEMBUDGET_RING_SHARE);
+	if (fitted < ring_size) {
+		ring_size = fitted & ~(size_t)(RING_REC_ALIGN - 1);
+		log_info("memory limit: %zu KiB ring", ring_size >> 10);
+	}
+	rc = ring_buffer_init(&ring_buffer, ring_size);
+	DIE(rc < 0, "ring_buffer_init");
+
 	thread_ids = calloc(num_consumers, sizeof(pthread_t));
 	DIE(thread_ids == NULL, "calloc pthread_t");
 
 	/* create consumer threads */
-	threads = create_consumers(thread_ids, num_consumers, &ring_buffer, argv[2]);
+	threads = create_consumers(thread_ids, num_consumers, &ring_buffer, out_file, consumer_opts);
+	DIE(threads < 0, "create_consumers");
 
 	/* start publishing data */
-	publish_data(&ring_buffer, argv[1]);
+	realtime_thread(RT_PRODUCER);
+	if (slot_ring) {
+		read_packets(in_file, producer_opts, push_packet, consumer_opts->pkt_ring);
+		so_pkt_ring_stop(consumer_opts->pkt_ring);
+	} else {
+		publish_data(&ring_buffer, in_file, producer_opts);
+	}
 
 	/* wait for child threads to finish execution */
 	for (int i = 0; i < threads; i++)
@@ -75,5 +274,385 @@ int main(int argc, char **argv)
 	ring_buffer_destroy(&ring_buffer);
 	free(thread_ids);
 
+	if (slot_ring) {
+		so_pkt_ring_destroy(consumer_opts->pkt_ring);
+		free(consumer_opts->pkt_ring);
+		membudget_release(MEM_RING, sizeof(so_pkt_ring_t));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int num_consumers, rc, opt;
+	const char *in_file, *out_file;
+	const char *regex_rules = NULL;
+	size_t regex_states = 0;
+	int prefilter = 1;
+	int engine = ENGINE_RING;
+	int slot_ring = 0;
+	so_consumer_opts_t consumer_opts = { 0 };
+	so_producer_opts_t producer_opts = { 0 };
+	size_t dio_buf_size = DIO_BUF_SZ_DEFAULT;
+	so_dio_pool_t dio_pool;
+	so_dfa_t *dfa = NULL;
+	const char *allow_sources = NULL;
+	so_srcset_mode_t srcset_mode = SRCSET_ROARING;
+	so_srcset_t *srcset = NULL;
+	const char *pinholes_file = NULL;
+	so_pairtab_t *pinholes = NULL;
+	const char *timed_rules_file = NULL;
+	so_timed_rules_t *timed_rules = NULL;
+	const char *tenants_file = NULL;
+	so_tenants_t *tenants = NULL;
+	const char *prefix_db_file = NULL;
+	so_prefixdb_t *prefix_db = NULL;
+	const char *capture_file = NULL;
+	so_dropcap_opts_t capture_opts = { .mode = DROPCAP_EVERY, .n = 1 };
+	so_dropcap_t *capture = NULL;
+	const char *shm_name = NULL;
+	size_t shm_slots = SHMRING_SLOTS;
+	so_shmring_policy_t shm_policy = SHMRING_BLOCK;
+	so_shmring_t *shm_ring = NULL;
+	int shm_readers = 0;
+	int realtime = 0, fifo_prio = 0;
+	const char *cgroup_dir = NULL;
+	size_t ring_size = SO_RING_SZ;
+	unsigned int calibrate_ms = 0;
+	const char *calibrate_cache = NULL;
+	const char *workers = NULL, *serve_addr = NULL;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_REGEX_RULES:
+			regex_rules = optarg;
+			break;
+		case OPT_REGEX_STATES:
+			regex_states = parse_num("regex-states", optarg, 1, SO_MAX_REGEX_STATES);
+			break;
+		case OPT_NO_PREFILTER:
+			prefilter = 0;
+			break;
+		case OPT_REORDER_WINDOW:
+			consumer_opts.reorder_window = parse_num("reorder-window", optarg, 0,
+								 SO_MAX_REORDER_WINDOW);
+			break;
+		case OPT_DIRECT_IO:
+			producer_opts.direct_io = 1;
+			consumer_opts.output.mode = OUTPUT_DIRECT;
+			if (optarg)
+				dio_buf_size = parse_num("direct-io", optarg, DIO_BUF_SZ_MIN >> 20,
+							 DIO_BUF_SZ_MAX >> 20) << 20;
+			break;
+		case OPT_URING_WRITER:
+			consumer_opts.output.mode = OUTPUT_URING;
+			if (optarg)
+				consumer_opts.output.uring_depth = parse_num("uring-writer", optarg, 1,
+									     OUTPUT_URING_MAX_DEPTH);
+			break;
+		case OPT_URING_FSYNC:
+			consumer_opts.output.uring_fsync = parse_num("uring-fsync", optarg, 1, SO_MAX_MIB) << 20;
+			break;
+		case OPT_ENGINE:
+			if (!strcmp(optarg, "rtc"))
+				engine = ENGINE_RTC;
+			else if (!strcmp(optarg, "disruptor"))
+				engine = ENGINE_DISRUPTOR;
+			else if (!strcmp(optarg, "fork"))
+				engine = ENGINE_FORK;
+			else if (strcmp(optarg, "ring"))
+				usage(argv[0]);
+			break;
+		case OPT_SLOT_RING:
+			slot_ring = 1;
+			break;
+		case OPT_ALLOW_SOURCES:
+			allow_sources = optarg;
+			break;
+		case OPT_SOURCE_SET:
+			if (!strcmp(optarg, "flat"))
+				srcset_mode = SRCSET_FLAT;
+			else if (strcmp(optarg, "roaring"))
+				usage(argv[0]);
+			break;
+		case OPT_PINHOLES:
+			pinholes_file = optarg;
+			break;
+		case OPT_TIMED_RULES:
+			timed_rules_file = optarg;
+			break;
+		case OPT_TENANTS:
+			tenants_file = optarg;
+			break;
+		case OPT_PREFIX_DB:
+			prefix_db_file = optarg;
+			break;
+		case OPT_CAPTURE_DROPS:
+			capture_file = optarg;
+			break;
+		case OPT_CAPTURE_EVERY:
+			capture_opts.mode = DROPCAP_EVERY;
+			capture_opts.n = parse_num("capture-every", optarg, 1, UINT_MAX);
+			break;
+		case OPT_CAPTURE_FIRST:
+			capture_opts.mode = DROPCAP_FIRST;
+			capture_opts.n = parse_num("capture-first", optarg, 1, UINT_MAX);
+			break;
+		case OPT_SHM_RING:
+			shm_name = optarg;
+			break;
+		case OPT_SHM_SLOTS:
+			shm_slots = parse_num("shm-slots", optarg, 1, SO_MAX_SHM_SLOTS);
+			break;
+		case OPT_SHM_POLICY:
+			if (!strcmp(optarg, "overwrite"))
+				shm_policy = SHMRING_OVERWRITE;
+			else if (strcmp(optarg, "block"))
+				usage(argv[0]);
+			break;
+		case OPT_SHM_READERS:
+			shm_readers = parse_num("shm-readers", optarg, 0, SHMRING_MAX_READERS);
+			break;
+		case OPT_REALTIME:
+			realtime = 1;
+			if (optarg)
+				fifo_prio = parse_num("realtime", optarg, 0, 99);
+			break;
+		case OPT_CGROUP_DIR:
+			cgroup_dir = optarg;
+			break;
+		case OPT_CALIBRATE:
+			calibrate_ms = optarg ? parse_num("calibrate", optarg, CALIBRATE_MIN_MS,
+							  CALIBRATE_MAX_MS) : CALIBRATE_BUDGET_MS;
+			break;
+		case OPT_CALIBRATE_CACHE:
+			calibrate_cache = optarg;
+			break;
+		case OPT_WORKERS:
+			workers = optarg;
+			break;
+		case OPT_SERVE:
+			serve_addr = optarg;
+			break;
+		case OPT_MEMORY_LIMIT:
+			membudget_set_limit(optarg ? parse_num("memory-limit", optarg, 1, SO_MAX_MIB) << 20 : 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* A worker takes its packets from the coordinator's connections */
+	if (serve_addr) {
+		/* No input file to tell the capture's link type from, nor a log writer to feed */
+		if (argc != optind || workers || capture_file || shm_name)
+			usage(argv[0]);
+		if (tenants_file)
+			log_warn("--serve: packets are classified by tenant, but --tenants logs and counters do not apply");
+		in_file = out_file = NULL;
+		num_consumers = 1;
+	} else if (argc - optind < 3) {
+		usage(argv[0]);
+	} else if (!strcmp(argv[optind + 2], "auto")) {
+		so_limits_t limits;
+		so_autocfg_t cfg;
+
+		autocfg_read_limits(cgroup_dir, &limits);
+		autocfg_pick(&limits, &cfg);
+		num_consumers = cfg.consumers;
+		ring_size = cfg.ring_size;
+		producer_opts.read_size = cfg.read_size;
+	} else {
+		num_consumers = parse_num("num-consumers", argv[optind + 2], 1, 32);
+	}
+	if (!serve_addr) {
+		in_file = argv[optind];
+		out_file = argv[optind + 1];
+	}
+
+	if (num_consumers <= 0 || num_consumers > 32) {
+		fprintf(stderr, "num-consumers [%d] must be in the interval [1-32]\n", num_consumers);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Before anything large is allocated, so that all of it ends up locked */
+	if (realtime)
+		realtime_init(fifo_prio);
+
+	/* The consumers it runs classify synthetic packets: before any policy is installed */
+	if (calibrate_ms || calibrate_cache) {
+		so_calibration_t cal = { .ring_size = ring_size };
+
+		calibrate(num_consumers, calibrate_ms ? calibrate_ms : CALIBRATE_BUDGET_MS,
+			  calibrate_cache, &cal);
+		ring_size = cal.ring_size;
+	}
+
+	if (regex_rules) {
+		dfa = dfa_load(regex_rules, regex_states);
+		DIE(dfa == NULL, "dfa_load");
+		dfa_set_prefilter(dfa, prefilter);
+		packet_set_payload_rules(dfa);
+	}
+
+	if (allow_sources) {
+		srcset = srcset_load(allow_sources, srcset_mode);
+		DIE(srcset == NULL, "srcset_load");
+		srcset_report(srcset);
+		packet_set_source_set(srcset);
+	}
+
+	if (pinholes_file) {
+		pinholes = pairtab_load(pinholes_file);
+		DIE(pinholes == NULL, "pairtab_load");
+		pairtab_report(pinholes);
+		packet_set_pinholes(pinholes);
+	}
+
+	if (timed_rules_file) {
+		timed_rules = timed_rules_load(timed_rules_file);
+		DIE(timed_rules == NULL, "timed_rules_load");
+		packet_set_timed_rules(timed_rules);
+	}
+
+	if (tenants_file) {
+		tenants = tenants_load(tenants_file);
+		DIE(tenants == NULL, "tenants_load");
+		packet_set_tenants(tenants);
+		consumer_opts.tenants = tenants;
+	}
+
+	if (prefix_db_file) {
+		prefix_db = prefixdb_open(prefix_db_file);
+		DIE(prefix_db == NULL, "prefixdb_open");
+		prefixdb_report(prefix_db);
+		packet_set_prefix_db(prefix_db);
+	}
+
+	/* Captured input is written back as raw IP, anything else as whole records */
+	if (capture_file) {
+		rc = input_is_capture(in_file);
+		DIE(rc < 0, "input_is_capture");
+		capture_opts.linktype = rc ? PCAP_LINKTYPE_RAW : PCAP_LINKTYPE_USER0;
+		capture = dropcap_open(capture_file, &capture_opts);
+		DIE(capture == NULL, "dropcap_open");
+		packet_set_drop_capture(capture);
+	}
+
+	if (shm_name) {
+		shm_ring = shmring_create(shm_name, shm_slots, shm_policy);
+		DIE(shm_ring == NULL, "shmring_create");
+		consumer_opts.output.shm_ring = shm_ring;
+		if (shm_readers > 0) {
+			log_info("shm ring %s: waiting for %d readers", shm_name, shm_readers);
+			shmring_wait_readers(shm_ring, shm_readers);
+		}
+	}
+
+	/* One aligned buffer for the producer's reads and one for the log writes */
+	if (producer_opts.direct_io) {
+		DIE(dio_pool_init(&dio_pool, 2, dio_buf_size) < 0, "dio_pool_init");
+		producer_opts.pool = &dio_pool;
+		consumer_opts.output.pool = &dio_pool;
+	}
+
+	if (serve_addr) {
+		rc = cluster_serve(serve_addr);
+		DIE(rc < 0, "cluster_serve");
+	}
+
+	/* The workers classify with their own options: here only the input and output ones count */
+	if (workers) {
+		if (engine != ENGINE_RING || slot_ring || consumer_opts.reorder_window || dfa || srcset ||
+		    pinholes || timed_rules || tenants || prefix_db || capture || shm_ring)
+			log_warn("--workers: packets are classified by the workers, give them the policy options; engines, --reorder-window, --tenants logs and --shm-ring do not apply");
+		rc = cluster_run(in_file, out_file, workers, &producer_opts, &consumer_opts.output);
+		DIE(rc < 0, "cluster_run");
+		engine = ENGINE_CLUSTER;
+	}
+
+	if (engine == ENGINE_RTC &&
+	    (consumer_opts.reorder_window || consumer_opts.output.mode != OUTPUT_WRITE || tenants ||
+	     shm_ring)) {
+		log_warn("--engine=rtc does not combine with --reorder-window, --direct-io, --uring-writer, --tenants or --shm-ring, using the ring");
+		engine = ENGINE_RING;
+	}
+	if (engine == ENGINE_DISRUPTOR && consumer_opts.reorder_window) {
+		log_warn("--engine=disruptor does not combine with --reorder-window, using the ring");
+		engine = ENGINE_RING;
+	}
+	if (engine == ENGINE_FORK && consumer_opts.reorder_window) {
+		log_warn("--engine=fork does not combine with --reorder-window, using the ring");
+		engine = ENGINE_RING;
+	}
+	/* The drop capture queue and its writer thread would stay in each worker */
+	if (engine == ENGINE_FORK && capture) {
+		log_warn("--engine=fork does not combine with --capture-drops, using --engine=disruptor");
+		engine = ENGINE_DISRUPTOR;
+	}
+
+	/* run-to-completion workers, one per consumer, with no producer thread */
+	if (engine == ENGINE_RTC) {
+		rc = rtc_run(in_file, out_file, num_consumers);
+		if (rc < 0 && errno == ENOTSUP) {
+			log_warn("--engine=rtc needs fixed-size packets, using the ring");
+			engine = ENGINE_RING;
+		} else {
+			DIE(rc < 0, "rtc_run");
+		}
+	}
+
+	/* classifier and hasher stages with one worker each per consumer */
+	if (engine == ENGINE_DISRUPTOR) {
+		rc = pipeline_run(in_file, out_file, num_consumers, &producer_opts,
+				  &consumer_opts.output, tenants);
+		DIE(rc < 0, "pipeline_run");
+	}
+
+	/* classifying and hashing in worker processes, restarted when they crash */
+	if (engine == ENGINE_FORK) {
+		rc = forkpool_run(in_file, out_file, num_consumers, &producer_opts,
+				  &consumer_opts.output, tenants);
+		DIE(rc < 0, "forkpool_run");
+	}
+
+	if (engine == ENGINE_RING)
+		run_ring(in_file, out_file, num_consumers, ring_size, &consumer_opts, &producer_opts,
+			 slot_ring);
+
+	if (producer_opts.direct_io)
+		dio_pool_destroy(&dio_pool);
+
+	if (dfa) {
+		size_t states;
+		unsigned long fallbacks;
+
+		dfa_stats(dfa, &states, &fallbacks);
+		log_info("regex: %zu DFA states built, %lu NFA fallbacks", states, fallbacks);
+		dfa_destroy(dfa);
+	}
+
+	if (srcset)
+		srcset_destroy(srcset);
+	if (pinholes)
+		pairtab_destroy(pinholes);
+	if (tenants) {
+		tenants_report(tenants);
+		tenants_destroy(tenants);
+	}
+	if (timed_rules) {
+		timed_rules_report(timed_rules);
+		timed_rules_destroy(timed_rules);
+	}
+	if (prefix_db)
+		prefixdb_close(prefix_db);
+	if (capture)
+		dropcap_close(capture);
+	if (shm_ring)
+		shmring_destroy(shm_ring);
+
+	realtime_report();
+	lockprof_report();
+	membudget_report();
+
 	return 0;
 }
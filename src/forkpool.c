@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "forkpool.h"
+#include "disruptor.h"
+#include "packet.h"
+#include "tenants.h"
+#include "shmring.h"
+#include "realtime.h"
+#include "utils.h"
+
+// A slot of the ring: the record as read from the input and what the worker made of it
+struct fp_slot {
+	unsigned int len;
+	unsigned int owner;
+	unsigned long hash;
+	so_action_t action;
+	int tenant;
+	int poisoned;		// set by the supervisor: logged as dropped, left alone by the workers
+	int reserved;
+	char rec[];
+};
+
+// What the supervisor and a worker process share about the worker
+struct fp_worker {
+	so_seq_t seq;		// sequences done, as for a pipeline stage
+	so_seq_t current;	// sequence being processed, ULONG_MAX before the first one
+};
+
+// The anonymous shared mapping, set up before the supervisor is forked
+struct fp_shared {
+	so_disruptor_t d;
+	so_seq_t writer;
+	struct fp_worker workers[FORKPOOL_MAX_WORKERS];
+	unsigned long restarts;		// counted by the supervisor, read once it has exited
+	unsigned long poisoned;
+};
+
+typedef struct so_forkpool_t {
+	struct fp_shared *sh;
+	int num_workers;
+
+	pid_t supervisor;
+
+	// supervisor process, private
+	pid_t pids[FORKPOOL_MAX_WORKERS];
+	unsigned long last_crash[FORKPOOL_MAX_WORKERS];
+	int crashes[FORKPOOL_MAX_WORKERS];
+	int early_deaths[FORKPOOL_MAX_WORKERS];	// in a row, before the first packet
+
+	// writer
+	so_barrier_t barrier;
+	so_seq_t *deps[FORKPOOL_MAX_WORKERS];
+	so_output_t out;
+	so_tenants_t *tenants;
+	so_shmring_t *shm_ring;
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long passed;
+	unsigned long last_timestamp;
+	unsigned long dup_timestamps;
+	unsigned long regressed_timestamps;
+} so_forkpool_t;
+
+static void process(struct fp_slot *slot)
+{
+	const so_packet_t *pkt = (const so_packet_t *)slot->rec;
+
+	packet_prefetch_owner(pkt, NULL);
+	slot->action = process_packet_tenant(pkt, slot->len, &slot->tenant);
+	slot->hash = packet_hash_len(pkt, slot->len);
+	slot->owner = packet_owner(pkt);
+}
+
+// Body of a worker process: its stripes of every batch, from where its last run stopped
+static void __attribute__((noreturn)) worker_main(so_forkpool_t *fp, int index)
+{
+	struct fp_worker *w = &fp->sh->workers[index];
+	so_barrier_t barrier = { .d = &fp->sh->d };
+	unsigned long next = seq_get(&w->seq), avail, seq;
+
+	// Nothing to write to if the supervisor is gone
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		_exit(EXIT_FAILURE);
+	realtime_thread(RT_WORKER);
+
+	while ((avail = barrier_wait(&barrier, next)) > next) {
+		for (seq = next; seq < avail; seq++) {
+			struct fp_slot *slot = disruptor_slot(&fp->sh->d, seq);
+
+			if ((seq / FORKPOOL_STRIPE) % fp->num_workers != (unsigned long)index ||
+			    slot->poisoned)
+				continue;
+			__atomic_store_n(&w->current.value, seq, __ATOMIC_RELAXED);
+			process(slot);
+		}
+		seq_set(&w->seq, avail);
+		next = avail;
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+static void spawn(so_forkpool_t *fp, int index)
+{
+	pid_t pid;
+
+	fp->sh->workers[index].current.value = ULONG_MAX;
+	pid = fork();
+	DIE(pid < 0, "fork");
+	if (pid == 0)
+		worker_main(fp, index);
+	fp->pids[index] = pid;
+}
+
+// Logs the packet a worker keeps crashing on as dropped, so that the next one skips it
+static void poison(so_forkpool_t *fp, unsigned long seq)
+{
+	struct fp_slot *slot = disruptor_slot(&fp->sh->d, seq);
+	const so_packet_t *pkt = (const so_packet_t *)slot->rec;
+
+	slot->action = DROP;
+	slot->tenant = -1;
+	slot->hash = packet_hash_len(pkt, slot->len);
+	slot->owner = packet_owner(pkt);
+	__atomic_store_n(&slot->poisoned, 1, __ATOMIC_RELEASE);
+	fp->sh->poisoned++;
+	log_warn("fork: packet %lu (timestamp %lu) crashed its worker %d times, logged as dropped",
+		 seq, (unsigned long)pkt->hdr.timestamp, FORKPOOL_CRASH_RETRIES);
+}
+
+/*
+ * Body of the supervisor process: forks the workers and reaps them, forking
+ * again those that died, until all have finished. It is forked before this
+ * process starts any thread, so that every worker is the copy of a
+ * single-threaded process and no lock (malloc's, the log's) is held in it.
+ */
+static void __attribute__((noreturn)) supervisor_main(so_forkpool_t *fp)
+{
+	int running = fp->num_workers;
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		_exit(EXIT_FAILURE);
+
+	for (int i = 0; i < fp->num_workers; i++)
+		spawn(fp, i);
+
+	while (running) {
+		struct fp_worker *w;
+		unsigned long seq;
+		int status, index;
+		char at[64];
+		pid_t pid;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		DIE(pid < 0, "waitpid");
+
+		for (index = 0; index < fp->num_workers && fp->pids[index] != pid; index++)
+			;
+		if (index == fp->num_workers)
+			continue;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+			running--;
+			continue;
+		}
+
+		w = &fp->sh->workers[index];
+		seq = seq_get(&w->current);
+		if (seq == ULONG_MAX)
+			snprintf(at, sizeof(at), "before its first packet");
+		else
+			snprintf(at, sizeof(at), "at packet %lu", seq);
+		if (WIFSIGNALED(status))
+			log_warn("fork: worker %d (pid %d) killed by signal %d (%s) %s, restarting",
+				 index, pid, WTERMSIG(status), strsignal(WTERMSIG(status)), at);
+		else
+			log_warn("fork: worker %d (pid %d) exited with status %d %s, restarting",
+				 index, pid, WEXITSTATUS(status), at);
+
+		// Dying before any packet is not the fault of one: restarting will not help
+		if (seq == ULONG_MAX) {
+			if (++fp->early_deaths[index] >= FORKPOOL_START_RETRIES) {
+				log_error("fork: worker %d died %d times in a row before its first packet, giving up",
+					  index, FORKPOOL_START_RETRIES);
+				_exit(EXIT_FAILURE);
+			}
+		} else {
+			fp->early_deaths[index] = 0;
+		}
+
+		// Only a packet still in flight is blamed: its slot cannot have been reused
+		if (seq != ULONG_MAX && seq >= seq_get(&w->seq)) {
+			fp->crashes[index] = fp->last_crash[index] == seq ? fp->crashes[index] + 1 : 1;
+			fp->last_crash[index] = seq;
+			if (fp->crashes[index] >= FORKPOOL_CRASH_RETRIES)
+				poison(fp, seq);
+		}
+		fp->sh->restarts++;
+		spawn(fp, index);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+// The workers cannot finish without their supervisor: stop if it does not exit cleanly
+static void *watch_supervisor(void *arg)
+{
+	so_forkpool_t *fp = arg;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(fp->supervisor, &status, 0)) < 0 && errno == EINTR)
+		;
+	DIE(pid < 0, "waitpid");
+	DIE(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS, "fork: supervisor died");
+
+	return NULL;
+}
+
+static void write_line(so_forkpool_t *fp, unsigned long seq, const struct fp_slot *slot)
+{
+	const so_packet_t *pkt = (const so_packet_t *)slot->rec;
+	char line[PKT_LINE_SZ];
+	int len;
+
+	fp->packets++;
+	fp->bytes += slot->len;
+	if (slot->action == PASS)
+		fp->passed++;
+
+	if (seq > 0) {
+		if (pkt->hdr.timestamp == fp->last_timestamp)
+			fp->dup_timestamps++;
+		else if (pkt->hdr.timestamp < fp->last_timestamp)
+			fp->regressed_timestamps++;
+	}
+	fp->last_timestamp = pkt->hdr.timestamp;
+
+	len = packet_format(line, slot->action, slot->hash, pkt, slot->owner);
+	output_write(&fp->out, line, len);
+	if (fp->tenants)
+		tenants_record(fp->tenants, slot->tenant, slot->action, line, len);
+	if (fp->shm_ring)
+		shmring_publish(fp->shm_ring, slot->action, slot->hash, &pkt->hdr);
+}
+
+static void *writer_loop(void *arg)
+{
+	so_forkpool_t *fp = arg;
+	unsigned long next = 0, avail, seq;
+
+	realtime_thread(RT_WRITER);
+
+	while ((avail = barrier_wait(&fp->barrier, next)) > next) {
+		for (seq = next; seq < avail; seq++)
+			write_line(fp, seq, disruptor_slot(&fp->sh->d, seq));
+		seq_set(&fp->sh->writer, avail);
+		next = avail;
+	}
+
+	return NULL;
+}
+
+static void publish_slot(void *arg, const void *rec, size_t len)
+{
+	so_forkpool_t *fp = arg;
+	unsigned long seq = disruptor_claim(&fp->sh->d);
+	struct fp_slot *slot = disruptor_slot(&fp->sh->d, seq);
+
+	DIE(len > fp->sh->d.slot_size - sizeof(*slot), "record larger than a slot");
+	slot->len = len;
+	slot->poisoned = 0;
+	memcpy(slot->rec, rec, len);
+	disruptor_publish(&fp->sh->d, seq);
+}
+
+int forkpool_run(const char *in_file, const char *out_file, int num_workers,
+		 const so_producer_opts_t *producer_opts,
+		 const so_output_opts_t *output_opts, so_tenants_t *tenants)
+{
+	so_forkpool_t *fp;
+	pthread_t writer, supervisor;
+	size_t slots, slot_size;
+
+	fp = calloc(1, sizeof(*fp));
+	DIE(fp == NULL, "calloc");
+	fp->num_workers = num_workers < FORKPOOL_MAX_WORKERS ? num_workers : FORKPOOL_MAX_WORKERS;
+
+	if (output_open(&fp->out, out_file, output_opts) < 0) {
+		free(fp);
+		return -1;
+	}
+	fp->tenants = tenants;
+	fp->shm_ring = output_opts->shm_ring;
+
+	fp->sh = mmap(NULL, sizeof(*fp->sh), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	DIE(fp->sh == MAP_FAILED, "mmap");
+
+	// Slots hold whole records: small ones for 256-byte packets, 64 KiB otherwise
+	if (input_is_fixed(in_file) == 1) {
+		slots = FORKPOOL_SLOTS;
+		slot_size = sizeof(struct fp_slot) + PKT_SZ;
+	} else {
+		slots = FORKPOOL_SLOTS_LARGE;
+		slot_size = sizeof(struct fp_slot) + PKT_MAX_SZ;
+	}
+	DIE(disruptor_init_shared(&fp->sh->d, slots, slot_size) < 0, "disruptor_init_shared");
+	disruptor_add_gating(&fp->sh->d, &fp->sh->writer);
+
+	// Fork before starting any thread: the workers are forked from a single-threaded copy
+	fp->supervisor = fork();
+	DIE(fp->supervisor < 0, "fork");
+	if (fp->supervisor == 0)
+		supervisor_main(fp);
+
+	for (int i = 0; i < fp->num_workers; i++)
+		fp->deps[i] = &fp->sh->workers[i].seq;
+	fp->barrier.d = &fp->sh->d;
+	fp->barrier.deps = fp->deps;
+	fp->barrier.num_deps = fp->num_workers;
+	DIE(pthread_create(&writer, NULL, writer_loop, fp) != 0, "pthread_create");
+	DIE(pthread_create(&supervisor, NULL, watch_supervisor, fp) != 0, "pthread_create");
+
+	realtime_thread(RT_PRODUCER);
+	read_packets(in_file, producer_opts, publish_slot, fp);
+	disruptor_finish(&fp->sh->d);
+
+	pthread_join(writer, NULL);
+	pthread_join(supervisor, NULL);
+
+	if (fp->dup_timestamps || fp->regressed_timestamps)
+		log_warn("input timestamps: %lu duplicate, %lu regressing",
+			 fp->dup_timestamps, fp->regressed_timestamps);
+	log_info("fork: %lu packets (%lu bytes), %lu passed, %lu dropped, %lu worker restarts, %lu packets given up",
+		 fp->packets, fp->bytes, fp->passed, fp->packets - fp->passed, fp->sh->restarts,
+		 fp->sh->poisoned);
+
+	output_close(&fp->out);
+	disruptor_destroy(&fp->sh->d);
+	munmap(fp->sh, sizeof(*fp->sh));
+	free(fp);
+
+	return 0;
+}
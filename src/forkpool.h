@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_FORKPOOL_H__
+#define __SO_FORKPOOL_H__
+
+#include "producer.h"
+#include "output.h"
+
+struct so_tenants_t;
+
+/* Slots of the shared ring for fixed-size packets / for larger records. */
+#define FORKPOOL_SLOTS 4096
+#define FORKPOOL_SLOTS_LARGE 64
+
+/* Consecutive sequences handled by the same worker process. */
+#define FORKPOOL_STRIPE 8
+
+/* Worker processes at most, as many as consumers. */
+#define FORKPOOL_MAX_WORKERS 32
+
+/* Crashes a packet may cause before it is logged as dropped without being classified. */
+#define FORKPOOL_CRASH_RETRIES 2
+
+/* Deaths in a row of a worker before its first packet after which the run fails. */
+#define FORKPOOL_START_RETRIES 3
+
+/**
+ * @brief Engine whose classifiers and hashers are forked processes.
+ *
+ * Like pipeline_run(), the calling thread publishes every record once into
+ * a Disruptor-style ring and a writer thread formats the lines in sequence
+ * order; but the ring, the per-slot results and the sequences live in an
+ * anonymous shared mapping, and `num_workers` worker processes forked from
+ * this one each classify and hash every `num_workers`-th stripe of
+ * `FORKPOOL_STRIPE` sequences in place. A crash in the packet path (a rule
+ * engine bug, a bad record) then only takes one worker down.
+ *
+ * A supervisor process, forked before any thread is started, forks the
+ * workers and reaps them, so that no worker is the copy of a process holding
+ * another thread's locks. One that dies on a signal or with an error is
+ * forked again under the same index and restarts at the first sequence of
+ * the batch it had not reported, so its packets are done again and the log
+ * is unchanged. A packet that was in flight in
+ * `FORKPOOL_CRASH_RETRIES` consecutive crashes of its worker is logged as
+ * dropped, with its hash, and skipped by the next worker. A worker that
+ * dies `FORKPOOL_START_RETRIES` times in a row before taking its first packet
+ * cannot be the fault of one, and fails the run instead.
+ *
+ * State the packet path keeps per process (DFA states built, timed rules
+ * epochs) is built in each worker and not reported by this one.
+ *
+ * @return 0 on success, -1 with `errno` set if the output could not be opened.
+ */
+int forkpool_run(const char *in_file, const char *out_file, int num_workers,
+		 const so_producer_opts_t *producer_opts,
+		 const so_output_opts_t *output_opts, struct so_tenants_t *tenants);
+
+#endif /* __SO_FORKPOOL_H__ */
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dio.h"
+#include "output.h"
+#include "packet.h"
+#include "prefixdb.h"
+#include "producer.h"
+#include "utils.h"
+
+enum {
+	OPT_DIO_BUF = 256,
+};
+
+static const struct option long_options[] = {
+	{ "dio-buf",	required_argument,	NULL,	OPT_DIO_BUF },
+	{ NULL,		0,			NULL,	0 },
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options] <input-file> <output-file>\n"
+		"Reads the input as the producer does and writes a log line per packet as the\n"
+		"consumers do, first through the page cache and then with --direct-io, starting\n"
+		"each run with the input evicted; reports the time and what each run left of\n"
+		"the input and the log in the page cache. Packets are not hashed.\n"
+		"Options:\n"
+		"  --dio-buf <MiB>        direct I/O buffer size (default %lu)\n",
+		prog, DIO_BUF_SZ_DEFAULT >> 20);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bytes of `path` in the page cache, as fincore reports them
+static size_t resident(const char *path)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *vec;
+	size_t pages, res = 0;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	DIE(fd < 0, "open");
+	DIE(fstat(fd, &st) < 0, "fstat");
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	DIE(map == MAP_FAILED, "mmap");
+	pages = (st.st_size + page - 1) / page;
+	vec = malloc(pages);
+	DIE(vec == NULL, "malloc");
+	DIE(mincore(map, st.st_size, vec) < 0, "mincore");
+	for (size_t i = 0; i < pages; i++)
+		res += vec[i] & 1;
+
+	free(vec);
+	munmap(map, st.st_size);
+	close(fd);
+
+	return res * page;
+}
+
+static void evict(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	DIE(fd < 0, "open");
+	DIE(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0, "posix_fadvise");
+	close(fd);
+}
+
+// The log line of each record, with its timestamp standing in for the hash
+static void publish_line(void *arg, const void *rec, size_t len)
+{
+	const so_packet_t *pkt = rec;
+	char line[PKT_LINE_SZ];
+
+	(void)len;
+	output_write(arg, line, packet_format(line, PASS, pkt->hdr.timestamp, pkt, PREFIXDB_NONE));
+}
+
+static void run(const char *name, const char *in_file, const char *out_file,
+		const so_producer_opts_t *producer_opts, const so_output_opts_t *output_opts)
+{
+	so_output_t out;
+	double start, secs;
+
+	DIE(unlink(out_file) < 0 && errno != ENOENT, "unlink");
+	evict(in_file);
+
+	start = now();
+	DIE(output_open(&out, out_file, output_opts) < 0, "output_open");
+	read_packets(in_file, producer_opts, publish_line, &out);
+	output_close(&out);
+	secs = now() - start;
+
+	printf("%-9s %6.3f s, input %6zu KiB resident, log %6zu KiB resident\n", name, secs,
+	       resident(in_file) >> 10, resident(out_file) >> 10);
+}
+
+int main(int argc, char **argv)
+{
+	so_producer_opts_t producer_opts = { 0 };
+	so_output_opts_t output_opts = { 0 };
+	size_t dio_buf_size = DIO_BUF_SZ_DEFAULT;
+	so_dio_pool_t pool;
+	unsigned long mib;
+	char *end;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_DIO_BUF:
+			errno = 0;
+			mib = strtoul(optarg, &end, 10);
+			if (errno || end == optarg || *end || mib < DIO_BUF_SZ_MIN >> 20 ||
+			    mib > DIO_BUF_SZ_MAX >> 20)
+				usage(argv[0]);
+			dio_buf_size = mib << 20;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind + 2)
+		usage(argv[0]);
+
+	run("buffered", argv[optind], argv[optind + 1], &producer_opts, &output_opts);
+
+	// As the firewall sets up --direct-io: one buffer for the reads, one for the log
+	DIE(dio_pool_init(&pool, 2, dio_buf_size) < 0, "dio_pool_init");
+	producer_opts.direct_io = 1;
+	producer_opts.pool = &pool;
+	output_opts.mode = OUTPUT_DIRECT;
+	output_opts.pool = &pool;
+	run("direct", argv[optind], argv[optind + 1], &producer_opts, &output_opts);
+	dio_pool_destroy(&pool);
+
+	return 0;
+}
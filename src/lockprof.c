@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "lockprof.h"
+
+#ifdef SO_LOCKPROF
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct lock_stats {
+	pthread_mutex_t *m;	// NULL once destroyed, the statistics are kept
+	const char *name;
+
+	// Updated by the holder of the lock only, so without atomics
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long wait_ns;
+	unsigned long hold_ns;
+	unsigned long max_wait_ns;
+	unsigned long max_hold_ns;
+	unsigned long wait_hist[LOCKPROF_BUCKETS];
+	unsigned long hold_hist[LOCKPROF_BUCKETS];
+	unsigned long acquired_at;
+};
+
+static struct lock_stats locks[LOCKPROF_MAX_LOCKS];
+static int num_locks;
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void record(unsigned long *hist, unsigned long *max, unsigned long ns)
+{
+	int bucket = ns ? 64 - __builtin_clzl(ns) : 0;
+
+	hist[bucket < LOCKPROF_BUCKETS ? bucket : LOCKPROF_BUCKETS - 1]++;
+	if (ns > *max)
+		*max = ns;
+}
+
+static struct lock_stats *find(pthread_mutex_t *m)
+{
+	int n = __atomic_load_n(&num_locks, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < n; i++) {
+		if (locks[i].m == m)
+			return &locks[i];
+	}
+
+	return NULL;
+}
+
+void lockprof_register(pthread_mutex_t *m, const char *name)
+{
+	pthread_mutex_lock(&registry);
+	if (num_locks < LOCKPROF_MAX_LOCKS) {
+		locks[num_locks].m = m;
+		locks[num_locks].name = name;
+		__atomic_store_n(&num_locks, num_locks + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&registry);
+}
+
+void lockprof_forget(pthread_mutex_t *m)
+{
+	struct lock_stats *s;
+
+	pthread_mutex_lock(&registry);
+	s = find(m);
+	if (s)
+		s->m = NULL;
+	pthread_mutex_unlock(&registry);
+}
+
+// Accounts for an acquisition that took `wait` ns, now that the lock is held
+static inline void acquired(struct lock_stats *s, unsigned long wait, unsigned long at)
+{
+	s->acquisitions++;
+	s->wait_ns += wait;
+	record(s->wait_hist, &s->max_wait_ns, wait);
+	s->acquired_at = at;
+}
+
+static inline void releasing(struct lock_stats *s)
+{
+	unsigned long hold = now_ns() - s->acquired_at;
+
+	s->hold_ns += hold;
+	record(s->hold_hist, &s->max_hold_ns, hold);
+}
+
+int lockprof_lock(pthread_mutex_t *m)
+{
+	struct lock_stats *s = find(m);
+	unsigned long start, end;
+	int rc;
+
+	if (!s)
+		return pthread_mutex_lock(m);
+
+	if (pthread_mutex_trylock(m) == 0) {
+		acquired(s, 0, now_ns());
+		return 0;
+	}
+
+	start = now_ns();
+	rc = pthread_mutex_lock(m);
+	if (rc)
+		return rc;
+	end = now_ns();
+
+	s->contended++;
+	acquired(s, end - start, end);
+
+	return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *m)
+{
+	struct lock_stats *s = find(m);
+
+	if (s)
+		releasing(s);
+
+	return pthread_mutex_unlock(m);
+}
+
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+	struct lock_stats *s = find(m);
+	int rc;
+
+	if (s)
+		releasing(s);
+
+	rc = pthread_cond_wait(c, m);
+
+	// Time asleep on the condition is not contention: only count the re-acquisition
+	if (s) {
+		s->acquisitions++;
+		s->acquired_at = now_ns();
+	}
+
+	return rc;
+}
+
+// Upper bound of the bucket holding the p-th percentile, at most the maximum seen
+static unsigned long percentile(const unsigned long *hist, unsigned long max, double p)
+{
+	unsigned long seen = 0, total = 0;
+
+	for (int i = 0; i < LOCKPROF_BUCKETS; i++)
+		total += hist[i];
+
+	for (int i = 0; i < LOCKPROF_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen && seen >= p * total) {
+			if (i == 0)
+				return 0;
+			return (1UL << i) < max ? 1UL << i : max;
+		}
+	}
+
+	return 0;
+}
+
+static const char *fmt_ns(char *buf, size_t sz, unsigned long ns)
+{
+	if (ns < 1000)
+		snprintf(buf, sz, "%luns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, sz, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, sz, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, sz, "%.2fs", ns / 1e9);
+
+	return buf;
+}
+
+static int by_wait(const void *a, const void *b)
+{
+	const struct lock_stats *x = a, *y = b;
+
+	return x->wait_ns < y->wait_ns ? 1 : x->wait_ns > y->wait_ns ? -1 : 0;
+}
+
+void lockprof_report(void)
+{
+	struct lock_stats snap[LOCKPROF_MAX_LOCKS];
+	char b[6][16];
+	int n;
+
+	// Work on a copy: printing may take a profiled lock (the log mutex)
+	pthread_mutex_lock(&registry);
+	n = num_locks;
+	memcpy(snap, locks, n * sizeof(*snap));
+	pthread_mutex_unlock(&registry);
+
+	qsort(snap, n, sizeof(*snap), by_wait);
+
+	fprintf(stderr, "lock contention, worst total wait first:\n");
+	fprintf(stderr, "  %-20s %10s %10s %10s %23s %10s %23s\n", "lock", "acquired", "contended",
+		"wait", "wait p50/p99/max", "hold", "hold p50/p99/max");
+
+	for (int i = 0; i < n; i++) {
+		struct lock_stats *s = &snap[i];
+		char wait_pct[32], hold_pct[32];
+
+		if (!s->acquisitions)
+			continue;
+
+		snprintf(wait_pct, sizeof(wait_pct), "%s/%s/%s",
+			 fmt_ns(b[0], 16, percentile(s->wait_hist, s->max_wait_ns, 0.5)),
+			 fmt_ns(b[1], 16, percentile(s->wait_hist, s->max_wait_ns, 0.99)),
+			 fmt_ns(b[2], 16, s->max_wait_ns));
+		snprintf(hold_pct, sizeof(hold_pct), "%s/%s/%s",
+			 fmt_ns(b[3], 16, percentile(s->hold_hist, s->max_hold_ns, 0.5)),
+			 fmt_ns(b[4], 16, percentile(s->hold_hist, s->max_hold_ns, 0.99)),
+			 fmt_ns(b[5], 16, s->max_hold_ns));
+
+		fprintf(stderr, "  %-20s %10lu %9.1f%% %10s %23s", s->name, s->acquisitions,
+			100.0 * s->contended / s->acquisitions,
+			fmt_ns(b[0], 16, s->wait_ns), wait_pct);
+		fprintf(stderr, " %10s %23s\n", fmt_ns(b[1], 16, s->hold_ns), hold_pct);
+	}
+}
+
+#endif /* SO_LOCKPROF */
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_LOCKPROF_H__
+#define __SO_LOCKPROF_H__
+
+#include <pthread.h>
+
+/*
+ * Lock contention profiler.
+ *
+ * The firewall's mutexes go through the so_mutex_* / so_cond_* wrappers below.
+ * Built with `make LOCKPROF=1` (which defines SO_LOCKPROF), each named mutex
+ * records its acquisitions, how many of them found it taken, and log2
+ * histograms of the time spent waiting for it and holding it; the firewall
+ * prints them at exit, worst total wait first. Otherwise the wrappers are the
+ * plain pthread calls and none of the profiler is compiled in.
+ */
+
+#ifdef SO_LOCKPROF
+
+/* Named mutexes tracked at once; later ones are not profiled. */
+#define LOCKPROF_MAX_LOCKS 64
+/* Histogram buckets: bucket i counts durations in [2^(i-1), 2^i) ns. */
+#define LOCKPROF_BUCKETS 40
+
+void lockprof_register(pthread_mutex_t *m, const char *name);
+void lockprof_forget(pthread_mutex_t *m);
+int lockprof_lock(pthread_mutex_t *m);
+int lockprof_unlock(pthread_mutex_t *m);
+int lockprof_cond_wait(pthread_cond_t *c, pthread_mutex_t *m);
+
+/**
+ * @brief Prints the statistics of every lock to stderr, highest total wait first.
+ *
+ * Call once the threads using the locks have been joined.
+ */
+void lockprof_report(void);
+
+#define so_mutex_init(m, name)					\
+	do {							\
+		pthread_mutex_init(m, NULL);			\
+		lockprof_register(m, name);			\
+	} while (0)
+
+#define so_mutex_destroy(m)					\
+	do {							\
+		lockprof_forget(m);				\
+		pthread_mutex_destroy(m);			\
+	} while (0)
+
+#define so_mutex_lock(m) lockprof_lock(m)
+#define so_mutex_unlock(m) lockprof_unlock(m)
+#define so_cond_wait(c, m) lockprof_cond_wait(c, m)
+
+#else /* SO_LOCKPROF */
+
+#define so_mutex_init(m, name) pthread_mutex_init(m, NULL)
+#define so_mutex_destroy(m) pthread_mutex_destroy(m)
+#define so_mutex_lock(m) pthread_mutex_lock(m)
+#define so_mutex_unlock(m) pthread_mutex_unlock(m)
+#define so_cond_wait(c, m) pthread_cond_wait(c, m)
+#define lockprof_report() do { } while (0)
+
+#endif /* SO_LOCKPROF */
+
+#endif /* __SO_LOCKPROF_H__ */
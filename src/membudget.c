@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+
+#include "membudget.h"
+#include "utils.h"
+
+const char *const mem_part_names[NUM_MEM_PARTS] = {
+	[MEM_RING] = "ring",
+	[MEM_IO] = "io buffers",
+	[MEM_REORDER] = "reorder",
+	[MEM_REGEX] = "regex",
+	[MEM_TABLES] = "tables",
+};
+
+static struct {
+	int enabled;
+	size_t limit;		// 0: none
+	size_t used;
+	size_t peak;
+	size_t part_used[NUM_MEM_PARTS];
+	size_t part_peak[NUM_MEM_PARTS];
+} mb;
+
+void membudget_set_limit(size_t bytes)
+{
+	mb.enabled = 1;
+	mb.limit = bytes;
+}
+
+static void raise_peak(size_t *peak, size_t value)
+{
+	size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+	while (value > old &&
+	       !__atomic_compare_exchange_n(peak, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+int membudget_charge(so_mem_part_t part, size_t bytes)
+{
+	size_t used = __atomic_load_n(&mb.used, __ATOMIC_RELAXED);
+
+	// Reserve against the limit first, so that racing charges cannot both fit
+	do {
+		if (mb.limit && used + bytes > mb.limit) {
+			errno = ENOMEM;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&mb.used, &used, used + bytes, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	raise_peak(&mb.peak, used + bytes);
+	raise_peak(&mb.part_peak[part],
+		   __atomic_add_fetch(&mb.part_used[part], bytes, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+void membudget_release(so_mem_part_t part, size_t bytes)
+{
+	__atomic_sub_fetch(&mb.part_used[part], bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&mb.used, bytes, __ATOMIC_RELAXED);
+}
+
+size_t membudget_fit(size_t want, size_t min, unsigned int share)
+{
+	size_t used = __atomic_load_n(&mb.used, __ATOMIC_RELAXED), avail;
+
+	if (!mb.limit)
+		return want;
+
+	avail = used < mb.limit ? (mb.limit - used) / share : 0;
+	if (want <= avail)
+		return want;
+
+	return avail > min ? avail : min;
+}
+
+void membudget_report(void)
+{
+	if (!mb.enabled)
+		return;
+
+	for (int i = 0; i < NUM_MEM_PARTS; i++)
+		log_info("memory: %-10s %8zu KiB peak", mem_part_names[i], mb.part_peak[i] >> 10);
+	if (mb.limit)
+		log_info("memory: total      %8zu KiB peak of a %zu KiB limit",
+			 mb.peak >> 10, mb.limit >> 10);
+	else
+		log_info("memory: total      %8zu KiB peak", mb.peak >> 10);
+}
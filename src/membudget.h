@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_MEMBUDGET_H__
+#define __SO_MEMBUDGET_H__
+
+#include <stddef.h>
+
+/* Components whose large allocations are accounted. */
+typedef enum {
+	MEM_RING,	/* byte ring, slot ring, disruptor slots and their results */
+	MEM_IO,		/* read buffers, direct I/O pool, io_uring log buffers, rtc and cluster chunks */
+	MEM_REORDER,	/* reorder heap and the slab pages of its records */
+	MEM_REGEX,	/* DFA transition table and cached states */
+	MEM_TABLES,	/* source sets, pinholes, tenant index, drop capture queue */
+	NUM_MEM_PARTS,
+} so_mem_part_t;
+
+extern const char *const mem_part_names[NUM_MEM_PARTS];
+
+/* Shares of the memory left that the sized structures may take. */
+#define MEMBUDGET_RING_SHARE 2
+#define MEMBUDGET_IO_SHARE 4
+#define MEMBUDGET_REORDER_SHARE 2
+#define MEMBUDGET_REGEX_SHARE 4
+
+/**
+ * @brief Memory budget: a central count of the large allocations.
+ *
+ * Every large buffer, ring and table is charged to its component when it is
+ * allocated and released when it is freed, so the current and peak footprint
+ * of each component is known. With a limit set, structures that may be
+ * smaller (rings, buffer counts, the reorder window, the DFA state bound)
+ * are sized with membudget_fit() to what is left, those that may not fail
+ * to be charged, and what grows while running (DFA states, cluster chunks)
+ * stops growing and falls back or waits instead.
+ *
+ * Small allocations (contexts, strings, per-entry load-time arrays) and
+ * file mappings are not counted. Counts are per process: the workers of the
+ * fork engine keep their own.
+ */
+
+/**
+ * @brief Sets the limit, in bytes, and turns the report on; 0 only reports.
+ *
+ * Call before anything is charged.
+ */
+void membudget_set_limit(size_t bytes);
+
+/**
+ * @brief Charges `bytes` to `part`.
+ *
+ * @return 0, or -1 with `errno` set to `ENOMEM` (nothing charged) if the
+ *         limit would be exceeded.
+ */
+int membudget_charge(so_mem_part_t part, size_t bytes);
+
+void membudget_release(so_mem_part_t part, size_t bytes);
+
+/**
+ * @brief Bytes a structure wanting `want` bytes should take: `want` if it
+ * fits in 1/`share` of the memory left, else that share, but at least `min`.
+ *
+ * Without a limit, `want`. The caller still charges what it allocates.
+ */
+size_t membudget_fit(size_t want, size_t min, unsigned int share);
+
+/**
+ * @brief Logs the peak footprint of every component and of the total.
+ *
+ * Only once a limit (or 0) has been set.
+ */
+void membudget_report(void);
+
+#endif /* __SO_MEMBUDGET_H__ */
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "prefixdb.h"
+#include "utils.h"
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage %s <prefixes.csv> <output-db>\n"
+			"Compiles <prefix>,<id> lines into a database for --prefix-db\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	DIE(prefixdb_compile(argv[1], argv[2]) < 0, "prefixdb_compile");
+
+	return 0;
+}
@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "output.h"
+#include "realtime.h"
+#include "membudget.h"
+#include "utils.h"
+
+// user_data of the fsync linked after a checkpoint write; buffer writes use their index
+#define URING_FSYNC_TAG (~0UL)
+
+static int output_open_uring(so_output_t *out, const so_output_opts_t *opts)
+{
+	unsigned int i;
+
+	out->depth = opts->uring_depth ? opts->uring_depth : OUTPUT_URING_DEPTH;
+	if (out->depth > OUTPUT_URING_MAX_DEPTH)
+		out->depth = OUTPUT_URING_MAX_DEPTH;
+	// Under a memory limit, fewer writes in flight rather than a failure
+	out->depth = membudget_fit(out->depth * OUTPUT_URING_BUF_SZ, 2 * OUTPUT_URING_BUF_SZ,
+				   MEMBUDGET_IO_SHARE) / OUTPUT_URING_BUF_SZ;
+
+	// Each buffer may be followed by a linked fsync
+	if (uring_init(&out->ring, 2 * out->depth) < 0)
+		return -1;
+
+	DIE(membudget_charge(MEM_IO, out->depth * OUTPUT_URING_BUF_SZ) < 0,
+	    "memory limit: io_uring buffers");
+	for (i = 0; i < out->depth; i++) {
+		DIE(posix_memalign((void **)&out->ubufs[i], DIO_ALIGN, OUTPUT_URING_BUF_SZ) != 0,
+		    "posix_memalign");
+		realtime_prefault(out->ubufs[i], OUTPUT_URING_BUF_SZ);
+		out->ufree[out->nfree++] = i;
+	}
+
+	out->fsync_every = opts->uring_fsync;
+	out->cap = OUTPUT_URING_BUF_SZ;
+	out->cur = out->ufree[--out->nfree];
+	out->buf = out->ubufs[out->cur];
+
+	return 0;
+}
+
+int output_open(so_output_t *out, const char *path, const so_output_opts_t *opts)
+{
+	struct stat st;
+
+	memset(out, 0, sizeof(*out));
+	out->mode = opts ? opts->mode : OUTPUT_WRITE;
+
+	if (out->mode == OUTPUT_URING) {
+		// Writes land at precomputed offsets, several at a time: no O_APPEND
+		out->fd = open(path, O_WRONLY | O_CREAT, 0777);
+		if (out->fd < 0)
+			return -1;
+
+		DIE(fstat(out->fd, &st) < 0, "fstat");
+		out->off = st.st_size;
+
+		if (output_open_uring(out, opts) < 0) {
+			log_warn("io_uring unavailable (%s), using write()", strerror(errno));
+			close(out->fd);
+			out->mode = OUTPUT_WRITE;
+		} else {
+			return 0;
+		}
+	}
+
+	if (out->mode == OUTPUT_WRITE) {
+		out->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0777);
+		return out->fd < 0 ? -1 : 0;
+	}
+
+	out->direct = 1;
+	out->fd = dio_open(path, O_WRONLY | O_CREAT, 0777, &out->direct);
+	if (out->fd < 0)
+		return -1;
+
+	// Keep appending: direct writes must start at an aligned offset
+	DIE(fstat(out->fd, &st) < 0, "fstat");
+	out->off = st.st_size;
+	if (out->direct && (out->off % DIO_ALIGN)) {
+		log_warn("%s: size is not a multiple of %d, using buffered I/O", path, DIO_ALIGN);
+		dio_disable(out->fd);
+		out->direct = 0;
+	}
+
+	out->pool = opts->pool;
+	out->buf = dio_pool_get(out->pool);
+	out->cap = out->pool->buf_size;
+
+	return 0;
+}
+
+// Writes `len` bytes of the batch buffer at the current offset
+static void output_flush(so_output_t *out, size_t len)
+{
+	size_t done = 0;
+	ssize_t rc;
+
+	while (done < len) {
+		rc = pwrite(out->fd, out->buf + done, len - done, out->off + done);
+		if (rc < 0 && errno == EINVAL && out->direct) {
+			log_warn("O_DIRECT write rejected, using buffered I/O");
+			dio_disable(out->fd);
+			out->direct = 0;
+			continue;
+		}
+		DIE(rc <= 0, "pwrite");
+		done += rc;
+	}
+
+	out->off += len;
+	memmove(out->buf, out->buf + len, out->len - len);
+	out->len -= len;
+}
+
+// Handles the completions available, waiting for at least one if `wait` is set
+static void uring_reap(so_output_t *out, int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned long idx;
+	size_t done;
+	ssize_t rc;
+
+	if (wait && out->inflight)
+		DIE(uring_submit(&out->ring, 1) < 0, "io_uring_enter");
+
+	while ((cqe = uring_peek_cqe(&out->ring)) != NULL) {
+		idx = cqe->user_data;
+		rc = cqe->res;
+		uring_cqe_seen(&out->ring);
+		out->inflight--;
+
+		if (rc < 0)
+			errno = -rc;
+
+		if (idx == URING_FSYNC_TAG) {
+			// A short write breaks the link and cancels the fsync: do it here
+			if (rc == -ECANCELED)
+				rc = fsync(out->fd);
+			DIE(rc < 0, "fsync");
+			continue;
+		}
+
+		DIE(rc < 0, "io_uring write");
+
+		// Finish a short write synchronously; the offset is already reserved
+		for (done = rc; done < out->ulen[idx]; done += rc) {
+			rc = pwrite(out->fd, out->ubufs[idx] + done, out->ulen[idx] - done,
+				    out->uoff[idx] + done);
+			DIE(rc <= 0, "pwrite");
+		}
+
+		out->ufree[out->nfree++] = idx;
+	}
+}
+
+// Queues the current buffer for writing at the next offset and switches to a free one
+static void uring_flush(so_output_t *out)
+{
+	struct io_uring_sqe *sqe;
+	int fsync = 0;
+
+	out->ulen[out->cur] = out->len;
+	out->uoff[out->cur] = out->off;
+	out->off += out->len;
+
+	if (out->fsync_every) {
+		out->since_fsync += out->len;
+		if (out->since_fsync >= out->fsync_every) {
+			out->since_fsync = 0;
+			fsync = 1;
+		}
+	}
+
+	// The ring has two entries per buffer, so there is always room
+	sqe = uring_get_sqe(&out->ring);
+	uring_prep_rw(sqe, IORING_OP_WRITE, out->fd, out->buf, out->len, out->uoff[out->cur], out->cur);
+	out->inflight++;
+
+	if (fsync) {
+		// Drain the writes before this one, then sync once it has completed
+		sqe->flags |= IOSQE_IO_DRAIN | IOSQE_IO_LINK;
+		sqe = uring_get_sqe(&out->ring);
+		uring_prep_rw(sqe, IORING_OP_FSYNC, out->fd, NULL, 0, 0, URING_FSYNC_TAG);
+		out->inflight++;
+	}
+
+	DIE(uring_submit(&out->ring, 0) < 0, "io_uring_enter");
+
+	uring_reap(out, 0);
+	while (out->nfree == 0)
+		uring_reap(out, 1);
+
+	out->cur = out->ufree[--out->nfree];
+	out->buf = out->ubufs[out->cur];
+	out->len = 0;
+}
+
+void output_write(so_output_t *out, const char *data, size_t len)
+{
+	size_t chunk;
+
+	if (out->mode == OUTPUT_WRITE) {
+		write(out->fd, data, len);
+		return;
+	}
+
+	while (len) {
+		chunk = out->cap - out->len < len ? out->cap - out->len : len;
+		memcpy(out->buf + out->len, data, chunk);
+		out->len += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (out->len == out->cap) {
+			if (out->mode == OUTPUT_URING)
+				uring_flush(out);
+			else
+				output_flush(out, out->cap);
+		}
+	}
+}
+
+void output_close(so_output_t *out)
+{
+	size_t aligned;
+	unsigned int i;
+
+	if (out->mode == OUTPUT_URING) {
+		if (out->len)
+			uring_flush(out);
+		while (out->inflight)
+			uring_reap(out, 1);
+
+		uring_exit(&out->ring);
+		for (i = 0; i < out->depth; i++)
+			free(out->ubufs[i]);
+		membudget_release(MEM_IO, out->depth * OUTPUT_URING_BUF_SZ);
+	} else if (out->mode == OUTPUT_DIRECT) {
+		// Whole blocks go out directly, the unaligned tail through the page cache
+		aligned = out->len & ~(size_t)(DIO_ALIGN - 1);
+		if (aligned)
+			output_flush(out, aligned);
+		if (out->len) {
+			if (out->direct) {
+				dio_disable(out->fd);
+				out->direct = 0;
+			}
+			output_flush(out, out->len);
+		}
+		dio_pool_put(out->pool, out->buf);
+	}
+
+	close(out->fd);
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_OUTPUT_H__
+#define __SO_OUTPUT_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dio.h"
+#include "uring.h"
+
+struct so_shmring_t;
+
+#define OUTPUT_URING_MAX_DEPTH 64
+#define OUTPUT_URING_DEPTH 4
+#define OUTPUT_URING_BUF_SZ (256 << 10)
+
+typedef enum {
+	OUTPUT_WRITE = 0,	/* one write() per log line */
+	OUTPUT_DIRECT,		/* aligned O_DIRECT writes of whole pool buffers */
+	OUTPUT_URING,		/* asynchronous io_uring writes of whole buffers */
+} so_output_mode_t;
+
+/* Output settings; a zeroed structure gives one write() per line. */
+typedef struct so_output_opts_t {
+	so_output_mode_t mode;
+
+	/* OUTPUT_DIRECT: aligned buffer pool */
+	so_dio_pool_t *pool;
+
+	/* OUTPUT_URING: buffers in flight (default OUTPUT_URING_DEPTH) */
+	unsigned int uring_depth;
+	/* OUTPUT_URING: fsync linked after the write that crosses every `uring_fsync` bytes, 0 for none */
+	size_t uring_fsync;
+
+	/*
+	 * Shared-memory ring the writers of the log also publish every packet's
+	 * record to, in log order, or NULL; the file sink itself ignores it.
+	 */
+	struct so_shmring_t *shm_ring;
+} so_output_opts_t;
+
+/**
+ * @brief Log file sink shared by the consumer threads.
+ *
+ * Calls are serialized by the caller (the consumers' file mutex), in log order.
+ */
+typedef struct so_output_t {
+	so_output_mode_t mode;
+	int fd;
+	int direct;		/* fd currently has O_DIRECT set */
+
+	so_dio_pool_t *pool;
+	char *buf;		/* pending bytes for batched modes */
+	size_t len;
+	size_t cap;
+	off_t off;		/* file offset of buf[0] */
+
+	/* OUTPUT_URING: buffers cycle between `buf`, the free list and the kernel */
+	so_uring_t ring;
+	char *ubufs[OUTPUT_URING_MAX_DEPTH];
+	size_t ulen[OUTPUT_URING_MAX_DEPTH];
+	off_t uoff[OUTPUT_URING_MAX_DEPTH];
+	int ufree[OUTPUT_URING_MAX_DEPTH];
+	int nfree;
+	int cur;
+	unsigned int depth;
+	unsigned int inflight;
+	size_t fsync_every;
+	size_t since_fsync;
+} so_output_t;
+
+/**
+ * @brief Opens (creating if needed) the log file and appends to it.
+ *
+ * `OUTPUT_DIRECT` needs a buffer pool. When the file system rejects O_DIRECT,
+ * or the existing file size is not a multiple of `DIO_ALIGN`, the output is
+ * still batched through the pool buffer but written through the page cache.
+ *
+ * `OUTPUT_URING` fills `uring_depth` buffers in turn and submits each full one
+ * as a write at its precomputed file offset, so the caller never waits for the
+ * disk unless every buffer is in flight. Buffers are recycled as their writes
+ * complete. It falls back to `OUTPUT_WRITE` if io_uring is not available.
+ *
+ * @return 0 on success, -1 with `errno` set on failure.
+ */
+int output_open(so_output_t *out, const char *path, const so_output_opts_t *opts);
+
+void output_write(so_output_t *out, const char *data, size_t len);
+
+/**
+ * @brief Writes any pending bytes (the unaligned tail without O_DIRECT), waits
+ * for writes still in flight and closes the file.
+ */
+void output_close(so_output_t *out);
+
+#endif /* __SO_OUTPUT_H__ */
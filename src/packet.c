@@ -1,17 +1,30 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <stdio.h>
+
 #include "packet.h"
+#include "dfa.h"
+#include "srcset.h"
+#include "pairtab.h"
+#include "timed_rules.h"
+#include "tenants.h"
+#include "prefixdb.h"
+#include "dropcap.h"
 
 #define HASH_ITER 50
+#define HASH_SEED 5381
 
-unsigned long packet_hash(const struct so_packet_t *pkt)
+const char *const hash_kernel_names[NUM_HASH_KERNELS] = { "scalar", "fold", "lanes" };
+const char *const source_kernel_names[NUM_SOURCE_KERNELS] = { "scan", "branchless" };
+
+static unsigned long hash_scalar(const struct so_packet_t *pkt, size_t len)
 {
-	unsigned long hash = 5381;
+	unsigned long hash = HASH_SEED;
 	char *pkt_it;
 
 	for (int iter = 0; iter < HASH_ITER; iter++) {
 		pkt_it = (char *)pkt;
-		for (int i = 0; i < PKT_SZ; i++) {
+		for (size_t i = 0; i < len; i++) {
 			hash = ((hash << 5) + hash) + *pkt_it;
 			pkt_it++;
 		}
@@ -20,6 +33,98 @@ unsigned long packet_hash(const struct so_packet_t *pkt)
 	return hash;
 }
 
+// 33^n modulo 2^64
+static unsigned long pow33(size_t n)
+{
+	unsigned long result = 1, base = 33;
+
+	for (; n; n >>= 1) {
+		if (n & 1)
+			result *= base;
+		base *= base;
+	}
+
+	return result;
+}
+
+/*
+ * A round over the record maps the hash h to h * 33^len + s, s being the
+ * hash of the record started from 0: the rounds after the first only cost a
+ * multiply and an add.
+ */
+static unsigned long fold_rounds(unsigned long s, size_t len)
+{
+	unsigned long mult = pow33(len), hash = HASH_SEED;
+
+	for (int iter = 0; iter < HASH_ITER; iter++)
+		hash = hash * mult + s;
+
+	return hash;
+}
+
+static unsigned long hash_fold(const struct so_packet_t *pkt, size_t len)
+{
+	const char *p = (const char *)pkt;
+	unsigned long s = 0;
+
+	for (size_t i = 0; i < len; i++)
+		s = ((s << 5) + s) + p[i];
+
+	return fold_rounds(s, len);
+}
+
+// As hash_fold(), with the record cut in four quarters hashed side by side and joined
+static unsigned long hash_lanes(const struct so_packet_t *pkt, size_t len)
+{
+	const char *p = (const char *)pkt;
+	size_t q = len / 4, i;
+	unsigned long s0 = 0, s1 = 0, s2 = 0, s3 = 0, mult;
+
+	for (i = 0; i < q; i++) {
+		s0 = ((s0 << 5) + s0) + p[i];
+		s1 = ((s1 << 5) + s1) + p[q + i];
+		s2 = ((s2 << 5) + s2) + p[2 * q + i];
+		s3 = ((s3 << 5) + s3) + p[3 * q + i];
+	}
+	// The last quarter also takes the remainder
+	for (i = 4 * q; i < len; i++)
+		s3 = ((s3 << 5) + s3) + p[i];
+
+	mult = pow33(q);
+	s0 = (s0 * mult + s1) * mult + s2;
+	s0 = s0 * pow33(len - 3 * q) + s3;
+
+	return fold_rounds(s0, len);
+}
+
+static unsigned long (*const hash_kernels[NUM_HASH_KERNELS])(const struct so_packet_t *, size_t) = {
+	[HASH_SCALAR] = hash_scalar,
+	[HASH_FOLD] = hash_fold,
+	[HASH_LANES] = hash_lanes,
+};
+
+static unsigned long (*hash_fn)(const struct so_packet_t *, size_t) = hash_scalar;
+
+void packet_set_hash_kernel(so_hash_kernel_t kernel)
+{
+	hash_fn = hash_kernels[kernel];
+}
+
+unsigned long packet_hash_kernel(so_hash_kernel_t kernel, const struct so_packet_t *pkt, size_t len)
+{
+	return hash_kernels[kernel](pkt, len);
+}
+
+unsigned long packet_hash_len(const struct so_packet_t *pkt, size_t len)
+{
+	return hash_fn(pkt, len);
+}
+
+unsigned long packet_hash(const struct so_packet_t *pkt)
+{
+	return packet_hash_len(pkt, PKT_SZ);
+}
+
 static struct range {
 	unsigned int start;
 	unsigned int end;
@@ -36,15 +141,215 @@ static struct range {
 	}
 };
 
-so_action_t process_packet(const struct so_packet_t *pkt)
+static so_dfa_t *payload_rules;
+
+void packet_set_payload_rules(so_dfa_t *rules)
+{
+	payload_rules = rules;
+}
+
+static so_srcset_t *source_set;
+
+void packet_set_source_set(so_srcset_t *set)
+{
+	source_set = set;
+}
+
+static so_pairtab_t *pinholes;
+
+void packet_set_pinholes(so_pairtab_t *pairs)
+{
+	pinholes = pairs;
+}
+
+static so_timed_rules_t *timed_rules;
+
+void packet_set_timed_rules(so_timed_rules_t *rules)
+{
+	timed_rules = rules;
+}
+
+static so_tenants_t *tenants;
+
+void packet_set_tenants(so_tenants_t *t)
+{
+	tenants = t;
+}
+
+static so_prefixdb_t *prefix_db;
+
+void packet_set_prefix_db(so_prefixdb_t *db)
+{
+	prefix_db = db;
+}
+
+int packet_has_prefix_db(void)
+{
+	return prefix_db != NULL;
+}
+
+static so_dropcap_t *drop_capture;
+
+void packet_set_drop_capture(so_dropcap_t *cap)
+{
+	drop_capture = cap;
+}
+
+void packet_prefetch_owner(const so_packet_t *pkt, const so_packet_t *later)
+{
+	if (!prefix_db)
+		return;
+	prefixdb_prefetch(prefix_db, pkt->hdr.source);
+	if (later)
+		prefixdb_prefetch_index(prefix_db, later->hdr.source);
+}
+
+unsigned int packet_owner(const so_packet_t *pkt)
+{
+	return prefix_db ? prefixdb_lookup(prefix_db, pkt->hdr.source) : PREFIXDB_NONE;
+}
+
+// Replaces the newline ending a line of `len` bytes with " <owner>\n"; returns the new length
+static int append_owner(char *line, int len, unsigned int owner)
+{
+	char digits[10];
+	int n = 0;
+
+	// By hand: another snprintf() field would cost more than the lookup
+	line[len - 1] = ' ';
+	if (owner == PREFIXDB_NONE) {
+		line[len++] = '-';
+	} else {
+		do {
+			digits[n++] = '0' + owner % 10;
+			owner /= 10;
+		} while (owner);
+		while (n)
+			line[len++] = digits[--n];
+	}
+	line[len++] = '\n';
+
+	return len;
+}
+
+int packet_format(char *line, so_action_t action, unsigned long hash, const so_packet_t *pkt,
+		  unsigned int owner)
+{
+	int len = snprintf(line, PKT_LINE_SZ, "%s %016lx %lu\n",
+			   RES_TO_STR(action), hash, pkt->hdr.timestamp);
+
+	return prefix_db ? append_owner(line, len, owner) : len;
+}
+
+#define NUM_RANGES (sizeof(allowed_sources_range) / sizeof(allowed_sources_range[0]))
+
+static int in_ranges_scan(unsigned int source)
+{
+	for (size_t i = 0; i < NUM_RANGES; i++) {
+		if (allowed_sources_range[i].start <= source &&
+				source <= allowed_sources_range[i].end)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Every range is tested, with one unsigned comparison each: no branch to mispredict
+static int in_ranges_branchless(unsigned int source)
+{
+	int hit = 0;
+
+	for (size_t i = 0; i < NUM_RANGES; i++)
+		hit |= source - allowed_sources_range[i].start <=
+		       allowed_sources_range[i].end - allowed_sources_range[i].start;
+
+	return hit;
+}
+
+static int (*const source_kernels[NUM_SOURCE_KERNELS])(unsigned int) = {
+	[SOURCE_SCAN] = in_ranges_scan,
+	[SOURCE_BRANCHLESS] = in_ranges_branchless,
+};
+
+static int (*in_ranges)(unsigned int) = in_ranges_scan;
+
+void packet_set_source_kernel(so_source_kernel_t kernel)
 {
-	const int sz = sizeof(allowed_sources_range) / sizeof(allowed_sources_range[0]);
+	in_ranges = source_kernels[kernel];
+}
 
-	for (int i = 0; i < sz; i++) {
-		if (allowed_sources_range[i].start <= pkt->hdr.source &&
-				pkt->hdr.source <= allowed_sources_range[i].end)
-			return PASS;
+int packet_source_kernel(so_source_kernel_t kernel, unsigned int source)
+{
+	return source_kernels[kernel](source);
+}
+
+static int source_allowed(unsigned int source)
+{
+	if (source_set)
+		return srcset_contains(source_set, source);
+
+	return in_ranges(source);
+}
+
+static so_action_t classify(const struct so_packet_t *pkt, size_t len, int *tenant)
+{
+	const so_tenant_policy_t *policy = NULL;
+	so_dfa_t *rules = payload_rules;
+	int id = tenants ? tenants_lookup(tenants, pkt->hdr.dest) : -1;
+	int timed, allowed;
+
+	/* The destination's tenant classifies with its own policy where it has one. */
+	if (tenant)
+		*tenant = id;
+	if (id >= 0) {
+		policy = tenants_policy(tenants, id);
+		if (policy->rules)
+			rules = policy->rules;
 	}
 
-	return DROP;
+	timed = timed_rules ?
+		timed_rules_check(timed_rules, pkt->hdr.source, pkt->hdr.timestamp) : TIMED_NONE;
+
+	/* Timed rules active at the packet's timestamp override the static policy. */
+	if (timed == DROP)
+		return DROP;
+
+	if (policy && policy->num_allow)
+		allowed = srcset_ranges_cover(policy->allow, policy->num_allow, pkt->hdr.source);
+	else
+		allowed = source_allowed(pkt->hdr.source);
+
+	/* A pinhole lets its exact (source, dest) pair through a source that is not allowed. */
+	if (timed != PASS && !allowed &&
+	    !(pinholes && pairtab_contains(pinholes, pairtab_key(pkt->hdr.source, pkt->hdr.dest))))
+		return DROP;
+
+	/* Allowed sources are still dropped when the payload matches a deny rule. */
+	if (rules &&
+	    dfa_match(rules, (const unsigned char *)pkt + sizeof(so_hdr_t),
+		      len - sizeof(so_hdr_t)) >= 0)
+		return DROP;
+
+	return PASS;
+}
+
+so_action_t process_packet_tenant(const struct so_packet_t *pkt, size_t len, int *tenant)
+{
+	so_action_t action = classify(pkt, len, tenant);
+
+	/* With capture off this is the only cost: one predictable branch per drop. */
+	if (action == DROP && drop_capture)
+		dropcap_offer(drop_capture, pkt, len);
+
+	return action;
+}
+
+so_action_t process_packet_len(const struct so_packet_t *pkt, size_t len)
+{
+	return process_packet_tenant(pkt, len, NULL);
+}
+
+so_action_t process_packet(const struct so_packet_t *pkt)
+{
+	return process_packet_len(pkt, PKT_SZ);
 }
@@ -8,8 +8,21 @@
 #define __packed __attribute((__packed__))
 #endif /* __packed */
 
+#include <stddef.h>
+
 #define PKT_SZ 256
 
+/* Largest variable-length record, header included. */
+#define PKT_MAX_SZ 65536
+
+/*
+ * Input files starting with this 8-byte magic hold variable-length records:
+ * a 32-bit little-endian length followed by that many bytes, which start with
+ * an `so_hdr_t` and carry the payload in the rest.
+ */
+#define PKT_VAR_MAGIC "SOVARPKT"
+#define PKT_VAR_MAGIC_SZ 8
+
 typedef enum {
 	DROP = 0,
 	PASS = 1,
@@ -17,6 +30,9 @@ typedef enum {
 
 #define RES_TO_STR(decision) ((decision == PASS) ? "PASS" : "DROP")
 
+/* Longest log line: "DROP " + 16 hex digits + " " + 20 digits + " " + 10 digits + "\n". */
+#define PKT_LINE_SZ 64
+
 typedef struct __packed so_hdr_t {
 	unsigned int source;
 	unsigned int dest;
@@ -28,7 +44,91 @@ typedef struct __packed so_packet_t {
 	char payload[PKT_SZ - sizeof(so_hdr_t)];
 } so_packet_t;
 
+/* Implementations of packet_hash_len(), which all give the same hash. */
+typedef enum {
+	HASH_SCALAR,	/* every round reads the record again (the default) */
+	HASH_FOLD,	/* one pass, then each round is a multiply and an add */
+	HASH_LANES,	/* as HASH_FOLD, with the pass split into four independent chains */
+	NUM_HASH_KERNELS,
+} so_hash_kernel_t;
+
+/* Implementations of the built-in allowed source ranges check. */
+typedef enum {
+	SOURCE_SCAN,		/* stops at the first range holding the source (the default) */
+	SOURCE_BRANCHLESS,	/* tests every range without branching */
+	NUM_SOURCE_KERNELS,
+} so_source_kernel_t;
+
+extern const char *const hash_kernel_names[NUM_HASH_KERNELS];
+extern const char *const source_kernel_names[NUM_SOURCE_KERNELS];
+
+struct so_dfa_t;
+struct so_srcset_t;
+struct so_pairtab_t;
+struct so_timed_rules_t;
+struct so_tenants_t;
+struct so_prefixdb_t;
+struct so_dropcap_t;
+
 unsigned long packet_hash(const so_packet_t *pkt);
 so_action_t process_packet(const so_packet_t *pkt);
 
+/* Same as above for a record of `len` bytes (header included), `len >= sizeof(so_hdr_t)`. */
+unsigned long packet_hash_len(const so_packet_t *pkt, size_t len);
+so_action_t process_packet_len(const so_packet_t *pkt, size_t len);
+
+/* Same, also giving the index of the packet's tenant (-1 for none) when `tenant` is not NULL. */
+so_action_t process_packet_tenant(const so_packet_t *pkt, size_t len, int *tenant);
+
+/*
+ * Owner id of the packet's source in the prefix database, or UINT32_MAX when
+ * none is set or no prefix covers it. Calling packet_prefetch_owner() first
+ * and hashing meanwhile hides the database's cache misses; passing the packet
+ * to be processed after this one as `later` (or NULL) also starts on the
+ * index entry it will need, so that its own prefetch does not wait for it.
+ */
+void packet_prefetch_owner(const so_packet_t *pkt, const so_packet_t *later);
+unsigned int packet_owner(const so_packet_t *pkt);
+
+/*
+ * Formats the log line of a packet into `line` (PKT_LINE_SZ bytes), with
+ * `owner` appended (`-` for none) when a prefix database is set; returns its length.
+ */
+int packet_format(char *line, so_action_t action, unsigned long hash, const so_packet_t *pkt,
+		  unsigned int owner);
+
+/* Installs payload deny rules (NULL disables them); not thread-safe, call before processing. */
+void packet_set_payload_rules(struct so_dfa_t *rules);
+
+/* Replaces the built-in allowed source ranges with `set` (NULL restores them); same caveat. */
+void packet_set_source_set(struct so_srcset_t *set);
+
+/* Passes the exact (source, dest) pairs of `pairs` whatever their source (NULL disables); same caveat. */
+void packet_set_pinholes(struct so_pairtab_t *pairs);
+
+/* Applies source rules active only at some timestamps (NULL disables them); same caveat. */
+void packet_set_timed_rules(struct so_timed_rules_t *rules);
+
+/* Classifies packets by the policy of their destination's tenant (NULL disables); same caveat. */
+void packet_set_tenants(struct so_tenants_t *tenants);
+
+/* Appends the owner id of each source from `db` to the log lines (NULL disables); same caveat. */
+void packet_set_prefix_db(struct so_prefixdb_t *db);
+
+/* Whether a prefix database is set, i.e. whether owner prefetches do anything. */
+int packet_has_prefix_db(void);
+
+/* Selects the kernel behind packet_hash() and packet_hash_len(); same caveat. */
+void packet_set_hash_kernel(so_hash_kernel_t kernel);
+
+/* Selects the kernel checking the built-in allowed source ranges; same caveat. */
+void packet_set_source_kernel(so_source_kernel_t kernel);
+
+/* Runs one kernel directly, whichever is selected, e.g. to time or check it. */
+unsigned long packet_hash_kernel(so_hash_kernel_t kernel, const so_packet_t *pkt, size_t len);
+int packet_source_kernel(so_source_kernel_t kernel, unsigned int source);
+
+/* Offers every dropped record to the sampled capture `cap` (NULL disables it); same caveat. */
+void packet_set_drop_capture(struct so_dropcap_t *cap);
+
 #endif /* __SO_PACKET_H__ */
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "pairtab.h"
+#include "utils.h"
+
+#define DEFAULT_PROBES 20000000UL
+
+// Keys inserted while the concurrent check looks up others
+#define CONCURRENT_KEYS 1000000UL
+
+enum {
+	OPT_PROBES = 256,
+};
+
+static const struct option long_options[] = {
+	{ "probes",	required_argument,	NULL,	OPT_PROBES },
+	{ NULL,		0,			NULL,	0 },
+};
+
+static const size_t table_sizes[] = { 1000000, 10000000 };
+
+static const size_t batch_sizes[] = { 1, 8, PAIRTAB_BATCH };
+
+// What the inserting thread of the concurrent check adds
+struct inserter {
+	so_pairtab_t *tab;
+	const uint64_t *keys;
+	unsigned long num;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options]\n"
+		"Fills pinhole tables of 1M and 10M random keys, timing the inserts, then times\n"
+		"lookups of probes half of which are present, one at a time and in batches of 8\n"
+		"and %d; last, checks that lookups of present keys never miss while another\n"
+		"thread inserts\n"
+		"Options:\n"
+		"  --probes <n>           lookups per table and batch size (default %lu)\n",
+		prog, PAIRTAB_BATCH, DEFAULT_PROBES);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t seed = 1;
+
+static uint64_t next_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static void fill_keys(uint64_t *keys, unsigned long num)
+{
+	for (unsigned long i = 0; i < num; i++)
+		keys[i] = next_rand();
+}
+
+static void insert_keys(so_pairtab_t *tab, const uint64_t *keys, unsigned long num)
+{
+	for (unsigned long i = 0; i < num; i++)
+		DIE(pairtab_insert(tab, keys[i]) < 0, "pairtab_insert");
+}
+
+static void run(size_t entries, uint64_t *probes, unsigned char *found, unsigned long num)
+{
+	unsigned long hits;
+	double start, secs;
+	so_pairtab_t *tab;
+	uint64_t *keys;
+
+	keys = malloc(entries * sizeof(*keys));
+	DIE(keys == NULL, "malloc");
+	fill_keys(keys, entries);
+	tab = pairtab_create(entries);
+	DIE(tab == NULL, "pairtab_create");
+
+	start = now();
+	insert_keys(tab, keys, entries);
+	secs = now() - start;
+	printf("%zu keys: %.1f ns/insert\n", entries, secs * 1e9 / entries);
+	fflush(stdout);
+	pairtab_report(tab);
+
+	// Even probes are present, odd ones random
+	for (unsigned long i = 0; i < num; i++)
+		probes[i] = i & 1 ? next_rand() : keys[next_rand() % entries];
+
+	for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+		size_t batch = batch_sizes[b];
+
+		hits = 0;
+		start = now();
+		if (batch == 1) {
+			for (unsigned long i = 0; i < num; i++)
+				hits += pairtab_contains(tab, probes[i]);
+		} else {
+			for (unsigned long i = 0; i < num; i += batch)
+				pairtab_lookup_batch(tab, probes + i, num - i < batch ? num - i : batch, found + i);
+			for (unsigned long i = 0; i < num; i++)
+				hits += found[i];
+		}
+		secs = now() - start;
+		printf("  batch %2zu: %5.1f M lookups/s (%lu%% hits)\n", batch, num / secs / 1e6,
+		       hits * 100 / num);
+	}
+	fflush(stdout);
+
+	pairtab_destroy(tab);
+	free(keys);
+}
+
+static void *inserter(void *arg)
+{
+	struct inserter *in = arg;
+
+	insert_keys(in->tab, in->keys, in->num);
+
+	return NULL;
+}
+
+// Keys present from the start are looked up while the cuckoo paths of new inserts move them
+static void run_concurrent(void)
+{
+	struct inserter in = { .num = CONCURRENT_KEYS };
+	unsigned long lookups = 0, misses = 0;
+	pthread_t thread;
+	uint64_t *keys;
+
+	keys = malloc(2 * CONCURRENT_KEYS * sizeof(*keys));
+	DIE(keys == NULL, "malloc");
+	fill_keys(keys, 2 * CONCURRENT_KEYS);
+	in.tab = pairtab_create(2 * CONCURRENT_KEYS);
+	DIE(in.tab == NULL, "pairtab_create");
+	insert_keys(in.tab, keys, CONCURRENT_KEYS);
+	in.keys = keys + CONCURRENT_KEYS;
+
+	DIE(pthread_create(&thread, NULL, inserter, &in) != 0, "pthread_create");
+	while (pairtab_count(in.tab) < 2 * CONCURRENT_KEYS || lookups < CONCURRENT_KEYS) {
+		misses += !pairtab_contains(in.tab, keys[lookups % CONCURRENT_KEYS]);
+		lookups++;
+	}
+	pthread_join(thread, NULL);
+
+	printf("concurrent: %lu lookups of present keys during %lu inserts, %lu missed\n",
+	       lookups, CONCURRENT_KEYS, misses);
+	pairtab_destroy(in.tab);
+	free(keys);
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long probes_num = DEFAULT_PROBES;
+	unsigned char *found;
+	uint64_t *probes;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_PROBES:
+			probes_num = parse_count(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || probes_num == 0)
+		usage(argv[0]);
+
+	probes = malloc(probes_num * sizeof(*probes));
+	found = malloc(probes_num);
+	DIE(probes == NULL || found == NULL, "malloc");
+
+	for (size_t t = 0; t < sizeof(table_sizes) / sizeof(table_sizes[0]); t++)
+		run(table_sizes[t], probes, found, probes_num);
+	run_concurrent();
+
+	free(found);
+	free(probes);
+
+	return 0;
+}
@@ -0,0 +1,440 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "pairtab.h"
+#include "srcset.h"
+#include "membudget.h"
+#include "lockprof.h"
+#include "utils.h"
+
+// Version counters, each shared by every bucket with the same low index bits
+#define PAIRTAB_STRIPES 4096
+
+// Longest cuckoo path an insert follows, and walks it tries before giving up
+#define PAIRTAB_MAX_PATH 128
+#define PAIRTAB_INSERT_TRIES 16
+
+struct pt_bucket {
+	uint8_t tags[8];			// 0 marks an empty slot
+	uint64_t keys[PAIRTAB_SLOTS];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct pt_bucket) == 64, "pairtab bucket is not one cache line");
+
+struct so_pairtab_t {
+	struct pt_bucket *buckets;
+	size_t mask;
+	size_t count;
+	unsigned long moves;			// keys displaced by inserts
+	uint64_t rnd;
+
+	pthread_mutex_t mutex;			// serializes writers
+	unsigned int versions[PAIRTAB_STRIPES];	// odd while a bucket of the stripe is written
+};
+
+// Where a key may live and the tag that stands for it there
+struct pt_probe {
+	size_t b1;
+	size_t b2;
+	uint8_t tag;
+};
+
+// One step of a cuckoo path: the key in `slot` of `bucket` moves to the next step
+struct pt_step {
+	size_t bucket;
+	int slot;
+	uint64_t key;
+};
+
+static inline uint64_t mix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+static inline void locate(const so_pairtab_t *tab, uint64_t key, struct pt_probe *p)
+{
+	uint64_t h = mix64(key);
+
+	p->b1 = h & tab->mask;
+	p->b2 = (h >> 32) & tab->mask;
+	p->tag = h >> 56 ? h >> 56 : 1;
+}
+
+// The other bucket of a key found in `bucket`
+static inline size_t alt_bucket(const so_pairtab_t *tab, uint64_t key, size_t bucket)
+{
+	struct pt_probe p;
+
+	locate(tab, key, &p);
+	return bucket == p.b1 ? p.b2 : p.b1;
+}
+
+// Bit i set when slot i of the bucket carries `tag`
+static inline unsigned int tag_match(const struct pt_bucket *b, uint8_t tag)
+{
+#ifdef __x86_64__
+	__m128i tags = _mm_loadl_epi64((const __m128i *)b->tags);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag))) &
+	       ((1U << PAIRTAB_SLOTS) - 1);
+#else
+	unsigned int match = 0;
+
+	for (int i = 0; i < PAIRTAB_SLOTS; i++)
+		match |= (unsigned int)(b->tags[i] == tag) << i;
+	return match;
+#endif
+}
+
+static inline int probe_bucket(const struct pt_bucket *b, uint8_t tag, uint64_t key)
+{
+	unsigned int match = tag_match(b, tag);
+
+	while (match) {
+		int i = __builtin_ctz(match);
+
+		if (b->keys[i] == key)
+			return 1;
+		match &= match - 1;
+	}
+
+	return 0;
+}
+
+static inline unsigned int *stripe(so_pairtab_t *tab, size_t bucket)
+{
+	return &tab->versions[bucket % PAIRTAB_STRIPES];
+}
+
+static int lookup(const so_pairtab_t *tab, uint64_t key, const struct pt_probe *p)
+{
+	const unsigned int *v1 = &tab->versions[p->b1 % PAIRTAB_STRIPES];
+	const unsigned int *v2 = &tab->versions[p->b2 % PAIRTAB_STRIPES];
+	unsigned int s1, s2;
+	int found;
+
+	// Retry while a writer is in, or was in during the probe, either bucket
+	for (;;) {
+		s1 = __atomic_load_n(v1, __ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(v2, __ATOMIC_ACQUIRE);
+		if ((s1 | s2) & 1)
+			continue;
+
+		found = probe_bucket(&tab->buckets[p->b1], p->tag, key) ||
+			probe_bucket(&tab->buckets[p->b2], p->tag, key);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(v1, __ATOMIC_RELAXED) == s1 &&
+		    __atomic_load_n(v2, __ATOMIC_RELAXED) == s2)
+			return found;
+	}
+}
+
+int pairtab_contains(const so_pairtab_t *tab, uint64_t key)
+{
+	struct pt_probe p;
+
+	locate(tab, key, &p);
+	return lookup(tab, key, &p);
+}
+
+void pairtab_lookup_batch(const so_pairtab_t *tab, const uint64_t *keys, size_t n,
+			  unsigned char *found)
+{
+	struct pt_probe p[PAIRTAB_BATCH];
+
+	for (size_t i = 0; i < n; i += PAIRTAB_BATCH) {
+		size_t m = n - i < PAIRTAB_BATCH ? n - i : PAIRTAB_BATCH;
+
+		// Issue every cache miss of the group before waiting on the first one
+		for (size_t j = 0; j < m; j++) {
+			locate(tab, keys[i + j], &p[j]);
+			__builtin_prefetch(&tab->buckets[p[j].b1]);
+			__builtin_prefetch(&tab->buckets[p[j].b2]);
+		}
+		for (size_t j = 0; j < m; j++)
+			found[i + j] = lookup(tab, keys[i + j], &p[j]);
+	}
+}
+
+// Brackets writes to buckets `a` and `b` (possibly the same stripe) for readers
+static void write_begin(so_pairtab_t *tab, size_t a, size_t b)
+{
+	unsigned int *va = stripe(tab, a), *vb = stripe(tab, b);
+
+	__atomic_store_n(va, *va + 1, __ATOMIC_RELAXED);
+	if (vb != va)
+		__atomic_store_n(vb, *vb + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(so_pairtab_t *tab, size_t a, size_t b)
+{
+	unsigned int *va = stripe(tab, a), *vb = stripe(tab, b);
+
+	__atomic_store_n(va, *va + 1, __ATOMIC_RELEASE);
+	if (vb != va)
+		__atomic_store_n(vb, *vb + 1, __ATOMIC_RELEASE);
+}
+
+static int free_slot(const struct pt_bucket *b)
+{
+	for (int i = 0; i < PAIRTAB_SLOTS; i++)
+		if (!b->tags[i])
+			return i;
+
+	return -1;
+}
+
+static void place(so_pairtab_t *tab, size_t bucket, int slot, uint64_t key, uint8_t tag)
+{
+	struct pt_bucket *b = &tab->buckets[bucket];
+
+	write_begin(tab, bucket, bucket);
+	b->keys[slot] = key;
+	b->tags[slot] = tag;
+	write_end(tab, bucket, bucket);
+}
+
+/*
+ * Random walk from `start` through full buckets, each step evicting a random
+ * slot to its key's other bucket, until a bucket with a free slot. Nothing is
+ * moved yet. Returns the index of the free end in `path`, or -1.
+ */
+static int find_path(so_pairtab_t *tab, size_t start, struct pt_step *path)
+{
+	size_t bucket = start;
+
+	for (int d = 0; d < PAIRTAB_MAX_PATH; d++) {
+		struct pt_bucket *b = &tab->buckets[bucket];
+
+		path[d].bucket = bucket;
+		path[d].slot = free_slot(b);
+		if (path[d].slot >= 0)
+			return d;
+
+		tab->rnd ^= tab->rnd << 13;
+		tab->rnd ^= tab->rnd >> 7;
+		tab->rnd ^= tab->rnd << 17;
+		path[d].slot = tab->rnd % PAIRTAB_SLOTS;
+		path[d].key = b->keys[path[d].slot];
+		bucket = alt_bucket(tab, path[d].key, bucket);
+	}
+
+	return -1;
+}
+
+/*
+ * Moves the keys of a path one step each, starting at the free end: every key
+ * is copied to its other bucket before leaving the first one. Fails if the
+ * walk looped back over a slot it had already emptied.
+ */
+static int move_path(so_pairtab_t *tab, struct pt_step *path, int depth)
+{
+	for (int i = depth - 1; i >= 0; i--) {
+		struct pt_bucket *src = &tab->buckets[path[i].bucket];
+		struct pt_bucket *dst = &tab->buckets[path[i + 1].bucket];
+		int s = path[i].slot, d = path[i + 1].slot;
+
+		if (!src->tags[s] || src->keys[s] != path[i].key || dst->tags[d])
+			return -1;
+
+		write_begin(tab, path[i].bucket, path[i + 1].bucket);
+		dst->keys[d] = src->keys[s];
+		dst->tags[d] = src->tags[s];
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		src->tags[s] = 0;
+		write_end(tab, path[i].bucket, path[i + 1].bucket);
+		tab->moves++;
+	}
+
+	return 0;
+}
+
+int pairtab_insert(so_pairtab_t *tab, uint64_t key)
+{
+	struct pt_step path[PAIRTAB_MAX_PATH];
+	struct pt_probe p;
+	int ret = -1, slot, depth;
+
+	locate(tab, key, &p);
+
+	so_mutex_lock(&tab->mutex);
+	if (probe_bucket(&tab->buckets[p.b1], p.tag, key) ||
+	    probe_bucket(&tab->buckets[p.b2], p.tag, key)) {
+		ret = 0;
+		goto out;
+	}
+
+	for (int try = 0; try < PAIRTAB_INSERT_TRIES; try++) {
+		slot = free_slot(&tab->buckets[p.b1]);
+		if (slot >= 0) {
+			place(tab, p.b1, slot, key, p.tag);
+			ret = 1;
+			break;
+		}
+		slot = free_slot(&tab->buckets[p.b2]);
+		if (slot >= 0) {
+			place(tab, p.b2, slot, key, p.tag);
+			ret = 1;
+			break;
+		}
+
+		// Both full: make room in one of them, alternating between tries
+		depth = find_path(tab, try & 1 ? p.b2 : p.b1, path);
+		if (depth > 0)
+			move_path(tab, path, depth);
+	}
+
+	if (ret == 1)
+		tab->count++;
+	else
+		errno = ENOSPC;
+out:
+	so_mutex_unlock(&tab->mutex);
+	return ret;
+}
+
+so_pairtab_t *pairtab_create(size_t capacity)
+{
+	so_pairtab_t *tab = calloc(1, sizeof(*tab));
+	size_t want, num_buckets = 1;
+
+	if (!tab)
+		return NULL;
+
+	want = (capacity * 100 / PAIRTAB_LOAD_PCT + PAIRTAB_SLOTS - 1) / PAIRTAB_SLOTS;
+	while (num_buckets < want)
+		num_buckets <<= 1;
+
+	if (membudget_charge(MEM_TABLES, num_buckets * sizeof(struct pt_bucket)) < 0) {
+		free(tab);
+		return NULL;
+	}
+	if (posix_memalign((void **)&tab->buckets, sizeof(struct pt_bucket),
+			   num_buckets * sizeof(struct pt_bucket)) != 0) {
+		membudget_release(MEM_TABLES, num_buckets * sizeof(struct pt_bucket));
+		free(tab);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(tab->buckets, 0, num_buckets * sizeof(struct pt_bucket));
+	tab->mask = num_buckets - 1;
+	tab->rnd = 0x9e3779b97f4a7c15ULL;
+	so_mutex_init(&tab->mutex, "pairtab->mutex");
+
+	return tab;
+}
+
+// Parses `<source> <dest>`; returns 1 for a pair, 0 for an empty line, -1 on error
+static int parse_line(char *line, uint64_t *key)
+{
+	uint32_t source, dest;
+	char *p = line, *end;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '\0')
+		return 0;
+
+	if (srcset_parse_addr(p, &end, &source) < 0 || !isspace((unsigned char)*end))
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+	if (srcset_parse_addr(p, &end, &dest) < 0)
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+	*key = pairtab_key(source, dest);
+
+	return *p == '\0' ? 1 : -1;
+}
+
+so_pairtab_t *pairtab_load(const char *path)
+{
+	size_t n = 0, cap = 0, line_cap = 0, i;
+	uint64_t *keys = NULL, *tmp;
+	so_pairtab_t *tab = NULL;
+	char *line = NULL;
+	int lineno = 0, ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	while (getline(&line, &line_cap, f) != -1) {
+		lineno++;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 256;
+			tmp = realloc(keys, cap * sizeof(*keys));
+			if (!tmp)
+				goto out;
+			keys = tmp;
+		}
+
+		ret = parse_line(line, &keys[n]);
+		if (ret < 0) {
+			log_error("%s:%d: expected <source> <dest>", path, lineno);
+			errno = EINVAL;
+			goto out;
+		}
+		n += ret;
+	}
+
+	// An unlucky fill can leave a key without a path: retry with twice the buckets
+	for (cap = n; !tab; cap *= 2) {
+		tab = pairtab_create(cap);
+		if (!tab)
+			goto out;
+		for (i = 0; i < n && pairtab_insert(tab, keys[i]) >= 0; i++)
+			;
+		if (i < n) {
+			pairtab_destroy(tab);
+			tab = NULL;
+		}
+	}
+out:
+	free(line);
+	free(keys);
+	fclose(f);
+	return tab;
+}
+
+size_t pairtab_count(const so_pairtab_t *tab)
+{
+	return tab->count;
+}
+
+void pairtab_report(const so_pairtab_t *tab)
+{
+	size_t num_buckets = tab->mask + 1;
+
+	log_info("pinholes: %zu pairs in %zu buckets (%.0f%% full), %zu KiB, %lu keys moved",
+		 tab->count, num_buckets, 100.0 * tab->count / (num_buckets * PAIRTAB_SLOTS),
+		 num_buckets * sizeof(struct pt_bucket) >> 10, tab->moves);
+}
+
+void pairtab_destroy(so_pairtab_t *tab)
+{
+	so_mutex_destroy(&tab->mutex);
+	free(tab->buckets);
+	membudget_release(MEM_TABLES, (tab->mask + 1) * sizeof(struct pt_bucket));
+	free(tab);
+}
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PAIRTAB_H__
+#define __SO_PAIRTAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Keys per 64-byte bucket: 8 one-byte tags (the last unused) and 7 keys. */
+#define PAIRTAB_SLOTS 7
+
+/* Lookups per group in pairtab_lookup_batch(): all their buckets are prefetched first. */
+#define PAIRTAB_BATCH 32
+
+/* Buckets are sized for this fill; cuckoo inserts rarely fail below ~95%. */
+#define PAIRTAB_LOAD_PCT 85
+
+/**
+ * @brief Exact-match set of (source, dest) pairs, a bucketized cuckoo hash.
+ *
+ * Every pair can live in one of two 64-byte buckets, each holding 7 full keys
+ * and their one-byte tags; a lookup reads at most those two cache lines and
+ * compares a bucket's tags with one SIMD instruction before touching keys.
+ *
+ * Readers take no lock. Inserts are serialized by a mutex and move keys along
+ * a precomputed cuckoo path from its free end, so a key is always present in
+ * at least one of its buckets; every bucket write is bracketed by a striped
+ * version counter that readers check, retrying a lookup that overlapped a
+ * write. The table does not grow once created.
+ */
+typedef struct so_pairtab_t so_pairtab_t;
+
+static inline uint64_t pairtab_key(uint32_t source, uint32_t dest)
+{
+	return (uint64_t)source << 32 | dest;
+}
+
+/* Creates a table sized for `capacity` pairs at `PAIRTAB_LOAD_PCT`, NULL when out of memory. */
+so_pairtab_t *pairtab_create(size_t capacity);
+
+/**
+ * @brief Adds a pair; may run concurrently with lookups.
+ *
+ * @return 1 if added, 0 if already present, -1 with `errno` ENOSPC when no
+ *         cuckoo path to a free slot was found.
+ */
+int pairtab_insert(so_pairtab_t *tab, uint64_t key);
+
+int pairtab_contains(const so_pairtab_t *tab, uint64_t key);
+
+/**
+ * @brief Looks up `n` keys, setting `found[i]` to whether `keys[i]` is present.
+ *
+ * Hashes and prefetches the buckets of up to `PAIRTAB_BATCH` keys before
+ * probing any of them, so their cache misses overlap.
+ */
+void pairtab_lookup_batch(const so_pairtab_t *tab, const uint64_t *keys, size_t n,
+			  unsigned char *found);
+
+/**
+ * @brief Loads pairs from a text file, one `<source> <dest>` per line, both
+ * written as for `srcset_parse_addr()`. Blank lines and `#` comments are
+ * skipped.
+ *
+ * @return The table, or NULL with `errno` set (EINVAL for a malformed line,
+ *         which is logged).
+ */
+so_pairtab_t *pairtab_load(const char *path);
+
+size_t pairtab_count(const so_pairtab_t *tab);
+
+/* Logs pairs, buckets, fill and memory at info level. */
+void pairtab_report(const so_pairtab_t *tab);
+
+void pairtab_destroy(so_pairtab_t *tab);
+
+#endif /* __SO_PAIRTAB_H__ */
@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcap.h"
+#include "packet.h"
+#include "utils.h"
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4u
+#define PCAP_MAGIC_NSEC		0xa1b23c4du
+#define PCAPNG_SHB		0x0a0d0d0au
+#define PCAPNG_BOM		0x1a2b3c4du
+#define PCAPNG_IDB		1
+#define PCAPNG_SPB		3
+#define PCAPNG_EPB		6
+#define PCAPNG_OPT_TSRESOL	9
+
+#define PCAP_FILE_HDR_SZ	24
+#define PCAP_REC_HDR_SZ		16
+
+#define LINKTYPE_NULL		0
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		PCAP_LINKTYPE_RAW
+#define LINKTYPE_LINUX_SLL	113
+#define LINKTYPE_IPV4		228
+#define LINKTYPE_LINUX_SLL2	276
+
+#define ETH_P_IP		0x0800
+#define ETH_P_8021Q		0x8100
+#define ETH_P_8021AD		0x88a8
+
+static inline unsigned int rd32(const so_pcap_t *pc, const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return pc->swap ? __builtin_bswap32(v) : v;
+}
+
+static inline unsigned int rd16(const so_pcap_t *pc, const unsigned char *p)
+{
+	unsigned short v;
+
+	memcpy(&v, p, sizeof(v));
+	return pc->swap ? __builtin_bswap16(v) : v;
+}
+
+/* Network byte order, independent of the file byte order. */
+static inline unsigned int be16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline unsigned int be32(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int pcap_is_capture(const void *buf, size_t len)
+{
+	unsigned int magic;
+
+	if (len < sizeof(magic))
+		return 0;
+	memcpy(&magic, buf, sizeof(magic));
+
+	return magic == PCAP_MAGIC_USEC || magic == __builtin_bswap32(PCAP_MAGIC_USEC) ||
+	       magic == PCAP_MAGIC_NSEC || magic == __builtin_bswap32(PCAP_MAGIC_NSEC) ||
+	       magic == PCAPNG_SHB;
+}
+
+/* Returns the offset of the IPv4 header in a frame, or -1 if it carries none. */
+static long ipv4_offset(const so_pcap_t *pc, unsigned int linktype,
+			const unsigned char *frame, size_t len)
+{
+	size_t off;
+	unsigned int proto, family;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		off = 12;
+		if (len < off + 2)
+			return -1;
+		proto = be16(frame + off);
+		while ((proto == ETH_P_8021Q || proto == ETH_P_8021AD) && len >= off + 6) {
+			off += 4;
+			proto = be16(frame + off);
+		}
+		off += 2;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		proto = be16(frame + 14);
+		off = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		proto = be16(frame);
+		off = 20;
+		break;
+	case LINKTYPE_NULL:
+		/* The address family is in the byte order of the capturing host. */
+		if (len < 4)
+			return -1;
+		family = rd32(pc, frame);
+		proto = family == 2 ? ETH_P_IP : 0;
+		off = 4;
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+		proto = ETH_P_IP;
+		off = 0;
+		break;
+	default:
+		return -1;
+	}
+
+	if (proto != ETH_P_IP || len < off + 20)
+		return -1;
+	if ((frame[off] >> 4) != 4 || (frame[off] & 0xf) < 5)
+		return -1;
+
+	return off;
+}
+
+/* Converts a pcapng timestamp in `if_tsresol` units to microseconds. */
+static unsigned long ts_to_usec(unsigned long ts, unsigned char tsresol)
+{
+	unsigned long scale = 1;
+
+	if (tsresol & 0x80)
+		return (unsigned __int128)ts * 1000000 >> (tsresol & 0x7f);
+
+	if (tsresol <= 6) {
+		for (int i = tsresol; i < 6; i++)
+			scale *= 10;
+		return ts * scale;
+	}
+
+	for (int i = 6; i < tsresol && i < 26; i++)
+		scale *= 10;
+	return ts / scale;
+}
+
+static ssize_t build_record(so_pcap_t *pc, unsigned int linktype, unsigned long usec,
+			    const unsigned char *frame, size_t caplen, void *rec, size_t cap)
+{
+	long ip = ipv4_offset(pc, linktype, frame, caplen);
+	so_hdr_t hdr;
+	size_t len;
+
+	if (ip < 0) {
+		pc->skipped++;
+		return 0;
+	}
+
+	hdr.source = be32(frame + ip + 12);
+	hdr.dest = be32(frame + ip + 16);
+	hdr.timestamp = usec;
+
+	len = sizeof(hdr) + caplen - ip;
+	if (len > cap)
+		len = cap;
+	memcpy(rec, &hdr, sizeof(hdr));
+	memcpy((char *)rec + sizeof(hdr), frame + ip, len - sizeof(hdr));
+	pc->packets++;
+
+	return len;
+}
+
+static ssize_t next_classic(so_pcap_t *pc, void *rec, size_t cap)
+{
+	while (pc->off + PCAP_REC_HDR_SZ <= pc->size) {
+		const unsigned char *p = pc->map + pc->off;
+		unsigned long sec = rd32(pc, p), frac = rd32(pc, p + 4);
+		size_t caplen = rd32(pc, p + 8);
+		ssize_t len;
+
+		if (pc->off + PCAP_REC_HDR_SZ + caplen > pc->size)
+			return -1;
+		pc->off += PCAP_REC_HDR_SZ + caplen;
+
+		len = build_record(pc, pc->linktype, sec * 1000000 + (pc->nsec ? frac / 1000 : frac),
+				   p + PCAP_REC_HDR_SZ, caplen, rec, cap);
+		if (len)
+			return len;
+	}
+
+	return pc->off == pc->size ? 0 : -1;
+}
+
+/* Reads the options of an interface description block, looking for `if_tsresol`. */
+static void parse_idb(so_pcap_t *pc, const unsigned char *body, size_t len)
+{
+	size_t off = 8;
+
+	if (pc->nifs == PCAP_MAX_IFS || len < 8)
+		return;
+
+	pc->ifs[pc->nifs].linktype = rd16(pc, body);
+	pc->ifs[pc->nifs].tsresol = 6;
+
+	while (off + 4 <= len) {
+		unsigned int code = rd16(pc, body + off), olen = rd16(pc, body + off + 2);
+
+		if (code == 0 || off + 4 + olen > len)
+			break;
+		if (code == PCAPNG_OPT_TSRESOL && olen >= 1)
+			pc->ifs[pc->nifs].tsresol = body[off + 4];
+		off += 4 + ((olen + 3) & ~3u);
+	}
+
+	pc->nifs++;
+}
+
+static ssize_t next_ng(so_pcap_t *pc, void *rec, size_t cap)
+{
+	while (pc->off + 12 <= pc->size) {
+		const unsigned char *p = pc->map + pc->off;
+		unsigned int type, blen;
+		const unsigned char *body;
+		ssize_t len = 0;
+
+		memcpy(&type, p, sizeof(type));
+		if (type == PCAPNG_SHB) {
+			/* A new section may switch byte order and resets the interfaces. */
+			unsigned int bom;
+
+			memcpy(&bom, p + 8, sizeof(bom));
+			if (bom != PCAPNG_BOM && bom != __builtin_bswap32(PCAPNG_BOM))
+				return -1;
+			pc->swap = bom != PCAPNG_BOM;
+			pc->nifs = 0;
+		}
+
+		type = rd32(pc, p);
+		blen = rd32(pc, p + 4);
+		if (blen < 12 || (blen & 3) || pc->off + blen > pc->size)
+			return -1;
+		body = p + 8;
+		pc->off += blen;
+		blen -= 12;
+
+		if (type == PCAPNG_IDB) {
+			parse_idb(pc, body, blen);
+		} else if (type == PCAPNG_EPB && blen >= 20) {
+			unsigned int ifc = rd32(pc, body);
+			unsigned long ts = (unsigned long)rd32(pc, body + 4) << 32 | rd32(pc, body + 8);
+			size_t caplen = rd32(pc, body + 12);
+
+			if (ifc >= pc->nifs || 20 + caplen > blen)
+				return -1;
+			len = build_record(pc, pc->ifs[ifc].linktype,
+					   ts_to_usec(ts, pc->ifs[ifc].tsresol),
+					   body + 20, caplen, rec, cap);
+		} else if (type == PCAPNG_SPB && blen >= 4 && pc->nifs) {
+			/* Simple packets carry no timestamp and belong to interface 0. */
+			size_t caplen = rd32(pc, body);
+
+			if (caplen > blen - 4)
+				caplen = blen - 4;
+			len = build_record(pc, pc->ifs[0].linktype, 0, body + 4, caplen, rec, cap);
+		}
+
+		if (len)
+			return len;
+	}
+
+	return pc->off == pc->size ? 0 : -1;
+}
+
+int pcap_open(so_pcap_t *pc, int fd)
+{
+	struct stat st;
+	unsigned int magic;
+
+	memset(pc, 0, sizeof(*pc));
+
+	if (fstat(fd, &st) < 0 || st.st_size < PCAP_FILE_HDR_SZ)
+		return -1;
+
+	pc->size = st.st_size;
+	pc->map = mmap(NULL, pc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (pc->map == MAP_FAILED) {
+		pc->map = NULL;
+		return -1;
+	}
+	madvise((void *)pc->map, pc->size, MADV_SEQUENTIAL);
+
+	memcpy(&magic, pc->map, sizeof(magic));
+	if (magic == PCAPNG_SHB) {
+		pc->ng = 1;
+		return 0;
+	}
+
+	pc->swap = magic == __builtin_bswap32(PCAP_MAGIC_USEC) ||
+		   magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+	magic = rd32(pc, pc->map);
+	if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+		pcap_close(pc);
+		return -1;
+	}
+	pc->nsec = magic == PCAP_MAGIC_NSEC;
+	pc->linktype = rd32(pc, pc->map + 20) & 0xffff;
+	pc->off = PCAP_FILE_HDR_SZ;
+
+	return 0;
+}
+
+ssize_t pcap_next(so_pcap_t *pc, void *rec, size_t cap)
+{
+	return pc->ng ? next_ng(pc, rec, cap) : next_classic(pc, rec, cap);
+}
+
+void pcap_close(so_pcap_t *pc)
+{
+	if (pc->map)
+		munmap((void *)pc->map, pc->size);
+	pc->map = NULL;
+}
+
+int pcap_write_header(FILE *f, unsigned int snaplen, unsigned int linktype)
+{
+	struct {
+		unsigned int magic;
+		unsigned short major;
+		unsigned short minor;
+		int thiszone;
+		unsigned int sigfigs;
+		unsigned int snaplen;
+		unsigned int linktype;
+	} hdr = { PCAP_MAGIC_USEC, 2, 4, 0, 0, snaplen, linktype };
+
+	_Static_assert(sizeof(hdr) == PCAP_FILE_HDR_SZ, "pcap file header");
+
+	return fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+}
+
+int pcap_write_packet(FILE *f, unsigned long usec, const void *data, size_t len, size_t orig_len)
+{
+	unsigned int hdr[PCAP_REC_HDR_SZ / 4] = {
+		usec / 1000000,
+		usec % 1000000,
+		len,
+		orig_len,
+	};
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1 || fwrite(data, 1, len, f) != len)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PCAP_H__
+#define __SO_PCAP_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Link types written by pcap_write_header(). */
+#define PCAP_LINKTYPE_RAW	101	/* bare IPv4 packets */
+#define PCAP_LINKTYPE_USER0	147	/* private use: whole firewall records */
+
+/* Interfaces remembered per pcapng section. */
+#define PCAP_MAX_IFS 64
+
+/**
+ * @brief Reader for pcap and pcapng capture files.
+ *
+ * The file is mapped in memory and walked in place. Every IPv4 packet becomes
+ * a variable-length record: an `so_hdr_t` with the IPv4 source and destination
+ * (host byte order) and the capture timestamp in microseconds, followed by the
+ * captured bytes starting at the IPv4 header. Other packets are skipped.
+ *
+ * Supported link types are Ethernet (with VLAN tags), raw IP, BSD loopback and
+ * Linux cooked captures (SLL and SLL2), in either byte order and with micro- or
+ * nanosecond (pcap) or any `if_tsresol` (pcapng) timestamp resolution.
+ */
+typedef struct so_pcap_t {
+	const unsigned char *map;
+	size_t size;
+	size_t off;
+
+	int ng;				/* pcapng rather than classic pcap */
+	int swap;			/* file byte order differs from the host's */
+	int nsec;			/* classic pcap with nanosecond timestamps */
+	unsigned int linktype;		/* classic pcap link type */
+
+	struct {
+		unsigned int linktype;
+		unsigned char tsresol;
+	} ifs[PCAP_MAX_IFS];		/* pcapng interfaces of the current section */
+	size_t nifs;
+
+	unsigned long packets;		/* records produced */
+	unsigned long skipped;		/* non-IPv4 or malformed packets */
+} so_pcap_t;
+
+/**
+ * @brief Tells whether `buf` starts with a pcap or pcapng file header.
+ */
+int pcap_is_capture(const void *buf, size_t len);
+
+/**
+ * @brief Maps the capture file open on `fd` and parses its header.
+ *
+ * @return 0 on success, -1 if it cannot be mapped or is not a capture.
+ */
+int pcap_open(so_pcap_t *pc, int fd);
+
+/**
+ * @brief Builds the record for the next IPv4 packet into `rec`.
+ *
+ * Packets longer than `cap` are truncated to it.
+ *
+ * @return The record length, 0 at the end of the file, or -1 if the file is
+ *         corrupt.
+ */
+ssize_t pcap_next(so_pcap_t *pc, void *rec, size_t cap);
+
+void pcap_close(so_pcap_t *pc);
+
+/**
+ * @brief Writes a classic pcap file header: host byte order, microsecond
+ * timestamps, packets of up to `snaplen` bytes of type `linktype`.
+ *
+ * @return 0, or -1 with `errno` set on a write error.
+ */
+int pcap_write_header(FILE *f, unsigned int snaplen, unsigned int linktype);
+
+/**
+ * @brief Appends a packet record: the `len` bytes at `data`, captured from a
+ * packet of `orig_len` bytes at `usec` microseconds since the epoch.
+ *
+ * @return 0, or -1 with `errno` set on a write error.
+ */
+int pcap_write_packet(FILE *f, unsigned long usec, const void *data, size_t len, size_t orig_len);
+
+#endif /* __SO_PCAP_H__ */
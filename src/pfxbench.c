@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "packet.h"
+#include "prefixdb.h"
+#include "utils.h"
+
+#define DEFAULT_PACKETS 65536UL
+#define DEFAULT_ROUNDS 30UL
+
+enum {
+	OPT_PACKETS = 256,
+	OPT_ROUNDS,
+	OPT_HASH_KERNEL,
+};
+
+static const struct option long_options[] = {
+	{ "packets",		required_argument,	NULL,	OPT_PACKETS },
+	{ "rounds",		required_argument,	NULL,	OPT_ROUNDS },
+	{ "hash-kernel",	required_argument,	NULL,	OPT_HASH_KERNEL },
+	{ NULL,			0,			NULL,	0 },
+};
+
+// What each pass over the packets does with the database, in the order reported
+enum {
+	MODE_NONE,	// no database set: the baseline
+	MODE_DB,	// prefetch and lookup of the packet itself, as the ring engine did
+	MODE_AHEAD,	// also the index entry of the next packet, as rtc and the ring do
+	NUM_MODES,
+};
+
+static const char *const mode_names[NUM_MODES] = {
+	"no database", "database", "database, lookahead",
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options] <prefix db>\n"
+		"Times the log line of packets with random sources, with no prefix database,\n"
+		"with one and with the next packet's index entry prefetched as well, and\n"
+		"reports what the owner lookup adds per packet (best round of each)\n"
+		"Options:\n"
+		"  --packets <n>          packets per round (default %lu)\n"
+		"  --rounds <n>           rounds of each kind, interleaved (default %lu)\n"
+		"  --hash-kernel <name>   scalar, fold or lanes (default scalar)\n",
+		prog, DEFAULT_PACKETS, DEFAULT_ROUNDS);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One pass as a consumer does it: prefetch, hash meanwhile, then format with the owner
+static double run(const so_packet_t *pkts, unsigned long num, int mode)
+{
+	char line[PKT_LINE_SZ];
+	double start = now();
+
+	for (unsigned long i = 0; i < num; i++) {
+		const so_packet_t *later = mode == MODE_AHEAD && i + 1 < num ? &pkts[i + 1] : NULL;
+		unsigned long hash;
+
+		packet_prefetch_owner(&pkts[i], later);
+		hash = packet_hash_len(&pkts[i], PKT_SZ);
+		packet_format(line, PASS, hash, &pkts[i], packet_owner(&pkts[i]));
+	}
+
+	return (now() - start) * 1e9 / num;
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long packets = DEFAULT_PACKETS, rounds = DEFAULT_ROUNDS;
+	so_hash_kernel_t kernel = HASH_SCALAR;
+	double best[NUM_MODES];
+	so_prefixdb_t *db;
+	so_packet_t *pkts;
+	uint32_t seed = 1;
+	int opt, k;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_PACKETS:
+			packets = parse_count(optarg);
+			break;
+		case OPT_ROUNDS:
+			rounds = parse_count(optarg);
+			break;
+		case OPT_HASH_KERNEL:
+			for (k = 0; k < NUM_HASH_KERNELS; k++)
+				if (!strcmp(optarg, hash_kernel_names[k]))
+					break;
+			if (k == NUM_HASH_KERNELS)
+				usage(argv[0]);
+			kernel = k;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind + 1 || packets == 0 || rounds == 0)
+		usage(argv[0]);
+
+	db = prefixdb_open(argv[optind]);
+	DIE(db == NULL, "prefixdb_open");
+	prefixdb_report(db);
+	packet_set_hash_kernel(kernel);
+
+	pkts = calloc(packets, sizeof(*pkts));
+	DIE(pkts == NULL, "calloc");
+	for (unsigned long i = 0; i < packets; i++) {
+		seed = seed * 1664525 + 1013904223;
+		pkts[i].hdr.source = seed;
+		pkts[i].hdr.dest = ~seed;
+		pkts[i].hdr.timestamp = i;
+	}
+
+	for (int m = 0; m < NUM_MODES; m++)
+		best[m] = 1e18;
+	for (unsigned long r = 0; r < rounds; r++) {
+		for (int m = 0; m < NUM_MODES; m++) {
+			double ns;
+
+			packet_set_prefix_db(m == MODE_NONE ? NULL : db);
+			ns = run(pkts, packets, m);
+			if (ns < best[m])
+				best[m] = ns;
+		}
+	}
+	packet_set_prefix_db(NULL);
+
+	printf("%lu packets, %s hash, %lu rounds\n", packets, hash_kernel_names[kernel], rounds);
+	for (int m = 0; m < NUM_MODES; m++)
+		printf("%-20s %8.1f ns/pkt (%+.1f ns)\n", mode_names[m], best[m], best[m] - best[MODE_NONE]);
+
+	free(pkts);
+	prefixdb_close(db);
+
+	return 0;
+}
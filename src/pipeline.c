@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pipeline.h"
+#include "disruptor.h"
+#include "packet.h"
+#include "tenants.h"
+#include "shmring.h"
+#include "realtime.h"
+#include "membudget.h"
+#include "utils.h"
+
+// A slot of the ring: the record as read from the input
+struct pl_slot {
+	unsigned int len;
+	unsigned int reserved;
+	char rec[];
+};
+
+typedef struct so_pipeline_t so_pipeline_t;
+
+// One thread of a stage: its progress, what it waits for and what it does per sequence
+struct pl_worker {
+	so_seq_t seq;
+	so_barrier_t barrier;
+	so_pipeline_t *pl;
+	void (*fn)(so_pipeline_t *pl, unsigned long seq, struct pl_slot *slot);
+	int index;
+	int stride;
+	pthread_t tid;
+};
+
+struct so_pipeline_t {
+	so_disruptor_t d;
+
+	// Per-slot results, written by one stage and read by the later ones
+	so_action_t *actions;
+	unsigned long *hashes;
+	unsigned int *owners;
+	int *tenant_ids;
+	so_tenants_t *tenants;
+	so_shmring_t *shm_ring;
+
+	// stats stage
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long passed;
+
+	// writer stage
+	so_output_t out;
+	unsigned long last_timestamp;
+	unsigned long dup_timestamps;
+	unsigned long regressed_timestamps;
+};
+
+static inline size_t slot_idx(so_pipeline_t *pl, unsigned long seq)
+{
+	return seq & (pl->d.num_slots - 1);
+}
+
+static void classify(so_pipeline_t *pl, unsigned long seq, struct pl_slot *slot)
+{
+	pl->actions[slot_idx(pl, seq)] = process_packet_tenant((so_packet_t *)slot->rec, slot->len,
+							       &pl->tenant_ids[slot_idx(pl, seq)]);
+}
+
+static void hash(so_pipeline_t *pl, unsigned long seq, struct pl_slot *slot)
+{
+	const so_packet_t *pkt = (const so_packet_t *)slot->rec;
+
+	// The owner lookup rides along with the hash, off the writer
+	packet_prefetch_owner(pkt, NULL);
+	pl->hashes[slot_idx(pl, seq)] = packet_hash_len(pkt, slot->len);
+	pl->owners[slot_idx(pl, seq)] = packet_owner(pkt);
+}
+
+static void count(so_pipeline_t *pl, unsigned long seq, struct pl_slot *slot)
+{
+	pl->packets++;
+	pl->bytes += slot->len;
+	if (pl->actions[slot_idx(pl, seq)] == PASS)
+		pl->passed++;
+}
+
+static void write_line(so_pipeline_t *pl, unsigned long seq, struct pl_slot *slot)
+{
+	const so_packet_t *pkt = (const so_packet_t *)slot->rec;
+	char line[PKT_LINE_SZ];
+	int len;
+
+	if (seq > 0) {
+		if (pkt->hdr.timestamp == pl->last_timestamp)
+			pl->dup_timestamps++;
+		else if (pkt->hdr.timestamp < pl->last_timestamp)
+			pl->regressed_timestamps++;
+	}
+	pl->last_timestamp = pkt->hdr.timestamp;
+
+	len = packet_format(line, pl->actions[slot_idx(pl, seq)], pl->hashes[slot_idx(pl, seq)],
+			    pkt, pl->owners[slot_idx(pl, seq)]);
+	output_write(&pl->out, line, len);
+	if (pl->tenants)
+		tenants_record(pl->tenants, pl->tenant_ids[slot_idx(pl, seq)],
+			       pl->actions[slot_idx(pl, seq)], line, len);
+	if (pl->shm_ring)
+		shmring_publish(pl->shm_ring, pl->actions[slot_idx(pl, seq)],
+				pl->hashes[slot_idx(pl, seq)], &pkt->hdr);
+}
+
+static void *worker_loop(void *arg)
+{
+	struct pl_worker *w = arg;
+	unsigned long next = 0, avail, seq;
+
+	realtime_thread(w->fn == write_line ? RT_WRITER : RT_WORKER);
+
+	// Process every available sequence of our stripes, then report the whole batch done
+	while ((avail = barrier_wait(&w->barrier, next)) > next) {
+		for (seq = next; seq < avail; seq++) {
+			if ((seq / PIPELINE_STRIPE) % w->stride == (unsigned long)w->index)
+				w->fn(w->pl, seq, disruptor_slot(&w->pl->d, seq));
+		}
+		seq_set(&w->seq, avail);
+		next = avail;
+	}
+
+	return NULL;
+}
+
+static void publish_slot(void *arg, const void *rec, size_t len)
+{
+	so_pipeline_t *pl = arg;
+	unsigned long seq = disruptor_claim(&pl->d);
+	struct pl_slot *slot = disruptor_slot(&pl->d, seq);
+
+	DIE(len > pl->d.slot_size - sizeof(*slot), "record larger than a slot");
+	slot->len = len;
+	memcpy(slot->rec, rec, len);
+	disruptor_publish(&pl->d, seq);
+}
+
+int pipeline_run(const char *in_file, const char *out_file, int num_workers,
+		 const so_producer_opts_t *producer_opts,
+		 const so_output_opts_t *output_opts, so_tenants_t *tenants)
+{
+	so_pipeline_t *pl;
+	struct pl_worker *workers, *classifiers, *hashers, *stats, *writer;
+	so_seq_t **deps;
+	int num_threads = 2 * num_workers + 2;
+	size_t slots, slot_size, results_size;
+
+	pl = calloc(1, sizeof(*pl));
+	DIE(pl == NULL, "calloc");
+
+	if (output_open(&pl->out, out_file, output_opts) < 0) {
+		free(pl);
+		return -1;
+	}
+
+	// Slots hold whole records: small ones for 256-byte packets, 64 KiB otherwise
+	if (input_is_fixed(in_file) == 1) {
+		slots = PIPELINE_SLOTS;
+		slot_size = sizeof(struct pl_slot) + PKT_SZ;
+	} else {
+		slots = PIPELINE_SLOTS_LARGE;
+		slot_size = sizeof(struct pl_slot) + PKT_MAX_SZ;
+	}
+	DIE(disruptor_init(&pl->d, slots, slot_size) < 0, "disruptor_init");
+
+	results_size = pl->d.num_slots * (sizeof(*pl->actions) + sizeof(*pl->hashes) +
+					  sizeof(*pl->owners) + sizeof(*pl->tenant_ids));
+	DIE(membudget_charge(MEM_RING, results_size) < 0, "memory limit: pipeline results");
+	pl->actions = calloc(pl->d.num_slots, sizeof(*pl->actions));
+	pl->hashes = calloc(pl->d.num_slots, sizeof(*pl->hashes));
+	pl->owners = calloc(pl->d.num_slots, sizeof(*pl->owners));
+	pl->tenant_ids = calloc(pl->d.num_slots, sizeof(*pl->tenant_ids));
+	DIE(pl->actions == NULL || pl->hashes == NULL || pl->owners == NULL || pl->tenant_ids == NULL,
+	    "calloc");
+	realtime_prefault(pl->actions, pl->d.num_slots * sizeof(*pl->actions));
+	realtime_prefault(pl->hashes, pl->d.num_slots * sizeof(*pl->hashes));
+	realtime_prefault(pl->owners, pl->d.num_slots * sizeof(*pl->owners));
+	realtime_prefault(pl->tenant_ids, pl->d.num_slots * sizeof(*pl->tenant_ids));
+	pl->tenants = tenants;
+	pl->shm_ring = output_opts->shm_ring;
+
+	DIE(posix_memalign((void **)&workers, DISRUPTOR_CACHE_LINE,
+			   num_threads * sizeof(*workers)) != 0, "posix_memalign");
+	memset(workers, 0, num_threads * sizeof(*workers));
+	classifiers = workers;
+	hashers = workers + num_workers;
+	stats = workers + 2 * num_workers;
+	writer = stats + 1;
+
+	// classifiers and hashers follow the producer; stats the classifiers; the writer both
+	deps = calloc(2 * num_workers, sizeof(*deps));
+	DIE(deps == NULL, "calloc");
+	for (int i = 0; i < num_workers; i++) {
+		classifiers[i].fn = classify;
+		hashers[i].fn = hash;
+		classifiers[i].index = hashers[i].index = i;
+		classifiers[i].stride = hashers[i].stride = num_workers;
+		deps[i] = &classifiers[i].seq;
+		deps[num_workers + i] = &hashers[i].seq;
+	}
+
+	stats->fn = count;
+	stats->stride = 1;
+	stats->barrier.deps = deps;
+	stats->barrier.num_deps = num_workers;
+	writer->fn = write_line;
+	writer->stride = 1;
+	writer->barrier.deps = deps;
+	writer->barrier.num_deps = 2 * num_workers;
+
+	disruptor_add_gating(&pl->d, &stats->seq);
+	disruptor_add_gating(&pl->d, &writer->seq);
+
+	for (int i = 0; i < num_threads; i++) {
+		workers[i].pl = pl;
+		workers[i].barrier.d = &pl->d;
+		DIE(pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]) != 0,
+		    "pthread_create");
+	}
+
+	realtime_thread(RT_PRODUCER);
+	read_packets(in_file, producer_opts, publish_slot, pl);
+	disruptor_finish(&pl->d);
+
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(workers[i].tid, NULL);
+
+	if (pl->dup_timestamps || pl->regressed_timestamps)
+		log_warn("input timestamps: %lu duplicate, %lu regressing",
+			 pl->dup_timestamps, pl->regressed_timestamps);
+	log_info("pipeline: %lu packets (%lu bytes), %lu passed, %lu dropped",
+		 pl->packets, pl->bytes, pl->passed, pl->packets - pl->passed);
+
+	output_close(&pl->out);
+	disruptor_destroy(&pl->d);
+	free(deps);
+	free(workers);
+	free(pl->actions);
+	free(pl->hashes);
+	free(pl->owners);
+	free(pl->tenant_ids);
+	membudget_release(MEM_RING, results_size);
+	free(pl);
+
+	return 0;
+}
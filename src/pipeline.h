@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PIPELINE_H__
+#define __SO_PIPELINE_H__
+
+#include "producer.h"
+#include "output.h"
+
+struct so_tenants_t;
+
+/* Slots of the multicast ring for fixed-size packets / for larger records. */
+#define PIPELINE_SLOTS 4096
+#define PIPELINE_SLOTS_LARGE 64
+
+/* Consecutive sequences handled by the same worker of a parallel stage. */
+#define PIPELINE_STRIPE 8
+
+/**
+ * @brief Staged engine on a Disruptor-style multicast ring (see disruptor.h).
+ *
+ * The calling thread reads the input and publishes every packet once into a
+ * preallocated slot. The stages then work on the slots in place, each behind
+ * a sequence barrier:
+ *
+ *   producer -+-> classifier (x num_workers) -+-> stats
+ *             |                               |
+ *             +-> hasher     (x num_workers) -+-> writer
+ *
+ * Classifiers and hashers run in parallel, each worker taking every
+ * `num_workers`-th stripe of `PIPELINE_STRIPE` sequences. The stats stage
+ * follows the classifiers; the writer follows both and formats the lines in
+ * sequence order, so the log matches the ring engine's, and feeds `tenants`
+ * (if not NULL) their counters and sinks and the shm ring of `output_opts`
+ * its records. The producer reuses a slot once the stats and writer stages
+ * are past it.
+ *
+ * @return 0 on success, -1 with `errno` set if the output could not be opened.
+ */
+int pipeline_run(const char *in_file, const char *out_file, int num_workers,
+		 const so_producer_opts_t *producer_opts,
+		 const so_output_opts_t *output_opts, struct so_tenants_t *tenants);
+
+#endif /* __SO_PIPELINE_H__ */
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PKT_RING_H__
+#define __SO_PKT_RING_H__
+
+#include "slot_ring.h"
+#include "packet.h"
+
+/* 1024 packets, the same 256 KB as the byte ring. */
+#define PKT_RING_LOG2 10
+
+/* so_pkt_ring_t: fixed-slot ring of whole so_packet_t records. */
+SO_SLOT_RING_DEFINE(so_pkt_ring, so_packet_t, PKT_RING_LOG2)
+
+#endif /* __SO_PKT_RING_H__ */
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "prefilter.h"
+#include "utils.h"
+
+struct literal {
+	const unsigned char *data;
+	size_t len;
+};
+
+struct so_prefilter_t {
+	/* Bucket masks for the low / high nibble of the 1st and 2nd literal byte. */
+	unsigned char lo0[16] __attribute__((aligned(16)));
+	unsigned char hi0[16] __attribute__((aligned(16)));
+	unsigned char lo1[16] __attribute__((aligned(16)));
+	unsigned char hi1[16] __attribute__((aligned(16)));
+
+	struct literal *bucket[PREFILTER_BUCKETS];
+	size_t bucket_len[PREFILTER_BUCKETS];
+
+	unsigned char *storage;
+	int simd;
+};
+
+so_prefilter_t *prefilter_build(const unsigned char *const *lits, const size_t *lens, size_t n)
+{
+	so_prefilter_t *pf;
+	size_t total = 0, off = 0;
+
+	if (n == 0)
+		return NULL;
+	for (size_t i = 0; i < n; i++) {
+		if (lens[i] == 0)
+			return NULL;
+		total += lens[i];
+	}
+
+	pf = calloc(1, sizeof(*pf));
+	DIE(pf == NULL, "calloc");
+	pf->storage = malloc(total);
+	DIE(pf->storage == NULL, "malloc");
+
+	for (int b = 0; b < PREFILTER_BUCKETS; b++) {
+		pf->bucket[b] = calloc(n / PREFILTER_BUCKETS + 1, sizeof(struct literal));
+		DIE(pf->bucket[b] == NULL, "calloc");
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		int b = i % PREFILTER_BUCKETS;
+		unsigned char bit = 1 << b;
+		unsigned char c0 = lits[i][0];
+
+		memcpy(pf->storage + off, lits[i], lens[i]);
+		pf->bucket[b][pf->bucket_len[b]++] = (struct literal){ pf->storage + off, lens[i] };
+		off += lens[i];
+
+		pf->lo0[c0 & 0xf] |= bit;
+		pf->hi0[c0 >> 4] |= bit;
+		if (lens[i] > 1) {
+			unsigned char c1 = lits[i][1];
+
+			pf->lo1[c1 & 0xf] |= bit;
+			pf->hi1[c1 >> 4] |= bit;
+		} else {
+			/* One byte literals accept anything in the second position. */
+			for (int j = 0; j < 16; j++) {
+				pf->lo1[j] |= bit;
+				pf->hi1[j] |= bit;
+			}
+		}
+	}
+
+#ifdef __x86_64__
+	pf->simd = __builtin_cpu_supports("ssse3");
+#endif
+
+	return pf;
+}
+
+/* Checks the literals of every bucket in `buckets` against position `pos`. */
+static int verify(const so_prefilter_t *pf, unsigned int buckets,
+		  const unsigned char *buf, size_t len, size_t pos)
+{
+	while (buckets) {
+		int b = __builtin_ctz(buckets);
+
+		buckets &= buckets - 1;
+		for (size_t i = 0; i < pf->bucket_len[b]; i++) {
+			const struct literal *lit = &pf->bucket[b][i];
+
+			if (pos + lit->len <= len && !memcmp(buf + pos, lit->data, lit->len))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int scan_scalar(const so_prefilter_t *pf, const unsigned char *buf, size_t len, size_t from)
+{
+	for (size_t i = from; i < len; i++) {
+		unsigned char c0 = buf[i];
+		unsigned char c1 = (i + 1 < len) ? buf[i + 1] : 0;
+		unsigned int buckets = pf->lo0[c0 & 0xf] & pf->hi0[c0 >> 4] &
+				       pf->lo1[c1 & 0xf] & pf->hi1[c1 >> 4];
+
+		if (buckets && verify(pf, buckets, buf, len, i))
+			return 1;
+	}
+
+	return 0;
+}
+
+#ifdef __x86_64__
+__attribute__((target("ssse3")))
+static inline __m128i nibble_lookup(__m128i v, __m128i lo, __m128i hi)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, mask));
+	__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+
+	return _mm_and_si128(l, h);
+}
+
+__attribute__((target("ssse3")))
+static int scan_ssse3(const so_prefilter_t *pf, const unsigned char *buf, size_t len)
+{
+	const __m128i lo0 = _mm_load_si128((const __m128i *)pf->lo0);
+	const __m128i hi0 = _mm_load_si128((const __m128i *)pf->hi0);
+	const __m128i lo1 = _mm_load_si128((const __m128i *)pf->lo1);
+	const __m128i hi1 = _mm_load_si128((const __m128i *)pf->hi1);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	/* Each step needs 17 readable bytes: 16 first bytes and their successors. */
+	for (; i + 17 <= len; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+		__m128i cand = _mm_and_si128(nibble_lookup(v0, lo0, hi0),
+					     nibble_lookup(v1, lo1, hi1));
+		unsigned int pos = ~_mm_movemask_epi8(_mm_cmpeq_epi8(cand, zero)) & 0xffff;
+		unsigned char lanes[16] __attribute__((aligned(16)));
+
+		if (!pos)
+			continue;
+
+		_mm_store_si128((__m128i *)lanes, cand);
+		while (pos) {
+			int j = __builtin_ctz(pos);
+
+			pos &= pos - 1;
+			if (verify(pf, lanes[j], buf, len, i + j))
+				return 1;
+		}
+	}
+
+	return scan_scalar(pf, buf, len, i);
+}
+#endif
+
+int prefilter_scan(const so_prefilter_t *pf, const unsigned char *buf, size_t len)
+{
+#ifdef __x86_64__
+	if (pf->simd)
+		return scan_ssse3(pf, buf, len);
+#endif
+	return scan_scalar(pf, buf, len, 0);
+}
+
+void prefilter_destroy(so_prefilter_t *pf)
+{
+	if (!pf)
+		return;
+
+	for (int b = 0; b < PREFILTER_BUCKETS; b++)
+		free(pf->bucket[b]);
+	free(pf->storage);
+	free(pf);
+}
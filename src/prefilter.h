@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PREFILTER_H__
+#define __SO_PREFILTER_H__
+
+#include <stddef.h>
+
+/* Number of Teddy buckets, one bit each in the shuffle masks. */
+#define PREFILTER_BUCKETS 8
+
+/**
+ * @brief Multi-literal prefilter in the style of Hyperscan's Teddy.
+ *
+ * Literals are spread over `PREFILTER_BUCKETS` buckets. The first two bytes of
+ * each literal are folded into per-nibble shuffle masks, so one `pshufb` pair
+ * per input byte position yields the set of buckets that may start there.
+ * Candidates are then verified with `memcmp` against the literals of those
+ * buckets. A scalar implementation is used when SSSE3 is not available.
+ */
+typedef struct so_prefilter_t so_prefilter_t;
+
+/**
+ * @brief Builds a prefilter over `n` literals.
+ *
+ * @return The prefilter, or `NULL` if `n` is zero or a literal is empty.
+ */
+so_prefilter_t *prefilter_build(const unsigned char *const *lits, const size_t *lens, size_t n);
+
+/**
+ * @brief Reports whether any literal occurs in `buf`.
+ *
+ * @return 1 if at least one literal occurs, 0 otherwise.
+ */
+int prefilter_scan(const so_prefilter_t *pf, const unsigned char *buf, size_t len);
+
+void prefilter_destroy(so_prefilter_t *pf);
+
+#endif /* __SO_PREFILTER_H__ */
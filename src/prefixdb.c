@@ -0,0 +1,425 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "prefixdb.h"
+#include "srcset.h"
+#include "utils.h"
+
+#define LINE_SZ 64
+#define LINE_ALIGN(x) (((x) + LINE_SZ - 1) & ~(size_t)(LINE_SZ - 1))
+
+struct header {
+	char magic[PREFIXDB_MAGIC_SZ];
+	uint32_t num;
+	uint32_t bits;
+};
+
+// One range of the partition, with its id next to its start
+struct prange {
+	uint32_t start;
+	uint32_t id;
+};
+
+struct so_prefixdb_t {
+	const char *path;
+	void *map;
+	size_t map_sz;
+	uint32_t num;
+	int shift;			// 32 - bits: address to index entry
+	const uint32_t *index;
+	const struct prange *ranges;
+};
+
+// The ranges start on a cache line, so a prefetched line holds 8 whole ones
+static size_t ranges_off(int bits)
+{
+	return LINE_ALIGN(sizeof(struct header) + ((1UL << bits) + 1) * sizeof(uint32_t));
+}
+
+static size_t db_size(uint32_t num, int bits)
+{
+	return ranges_off(bits) + (size_t)num * sizeof(struct prange);
+}
+
+uint32_t prefixdb_lookup(const so_prefixdb_t *db, uint32_t addr)
+{
+	uint32_t lo = db->index[addr >> db->shift];
+	uint32_t n = db->index[(addr >> db->shift) + 1] - lo + 1;
+	const struct prange *base = &db->ranges[lo];
+
+	// Last range starting at or before addr; base[0] is one, so halve with conditional moves
+	while (n > 1) {
+		uint32_t half = n / 2;
+
+		base = base[half].start <= addr ? base + half : base;
+		n -= half;
+	}
+
+	return base->id;
+}
+
+void prefixdb_prefetch_index(const so_prefixdb_t *db, uint32_t addr)
+{
+	__builtin_prefetch(&db->index[addr >> db->shift]);
+}
+
+void prefixdb_prefetch(const so_prefixdb_t *db, uint32_t addr)
+{
+	const char *lo = (const char *)&db->ranges[db->index[addr >> db->shift]];
+	const char *hi = (const char *)&db->ranges[db->index[(addr >> db->shift) + 1]];
+
+	lo = (const char *)((uintptr_t)lo & ~(uintptr_t)(LINE_SZ - 1));
+	if (hi - lo >= PREFIXDB_PREFETCH_LINES * LINE_SZ)
+		return;
+	for (; lo <= hi; lo += LINE_SZ)
+		__builtin_prefetch(lo);
+}
+
+// Checks what lookups rely on, so a corrupt file cannot send them out of the map
+static int valid(const so_prefixdb_t *db)
+{
+	size_t last = 1UL << (32 - db->shift);
+
+	if (db->num == 0 || db->ranges[0].start != 0 || db->index[0] != 0 ||
+	    db->index[last] != db->num - 1)
+		return 0;
+	for (size_t b = 1; b <= last; b++)
+		if (db->index[b] < db->index[b - 1] || db->index[b] >= db->num)
+			return 0;
+
+	return 1;
+}
+
+so_prefixdb_t *prefixdb_open(const char *path)
+{
+	so_prefixdb_t *db = calloc(1, sizeof(*db));
+	const struct header *hdr;
+	struct stat st;
+	int fd;
+
+	if (!db)
+		return NULL;
+	db->path = path;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto err;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		goto err;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		goto bad;
+	}
+
+	db->map_sz = st.st_size;
+	db->map = mmap(NULL, db->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		goto err;
+	}
+
+	hdr = db->map;
+	if (memcmp(hdr->magic, PREFIXDB_MAGIC, PREFIXDB_MAGIC_SZ) ||
+	    hdr->bits < PREFIXDB_MIN_INDEX_BITS || hdr->bits > PREFIXDB_MAX_INDEX_BITS ||
+	    db->map_sz != db_size(hdr->num, hdr->bits))
+		goto bad;
+	db->num = hdr->num;
+	db->shift = 32 - hdr->bits;
+	db->index = (const uint32_t *)(hdr + 1);
+	db->ranges = (const struct prange *)((char *)db->map + ranges_off(hdr->bits));
+	if (!valid(db))
+		goto bad;
+
+	// Lookups land anywhere in it: read it all in now rather than on the first packets
+	madvise(db->map, db->map_sz, MADV_WILLNEED);
+
+	return db;
+bad:
+	log_error("%s: not a prefix database", path);
+	errno = EINVAL;
+err:
+	prefixdb_close(db);
+	return NULL;
+}
+
+void prefixdb_report(const so_prefixdb_t *db)
+{
+	log_info("prefix db %s: %u ranges, %d-bit index, %zu KB mapped", db->path, db->num,
+		 32 - db->shift, db->map_sz >> 10);
+}
+
+void prefixdb_close(so_prefixdb_t *db)
+{
+	if (db->map)
+		munmap(db->map, db->map_sz);
+	free(db);
+}
+
+struct entry {
+	so_src_range_t range;
+	uint32_t id;
+	int lineno;
+};
+
+// By start, and the wider of two ranges with the same start first, so nested ones follow
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	if (ea->range.start != eb->range.start)
+		return (ea->range.start > eb->range.start) - (ea->range.start < eb->range.start);
+	return (ea->range.end < eb->range.end) - (ea->range.end > eb->range.end);
+}
+
+// Parses `<prefix>,<id>[,...]`; returns 1 for an entry, 0 for an empty line, -1 on error
+static int parse_line(char *line, struct entry *e)
+{
+	char *p = line, *end;
+	unsigned long id;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '\0')
+		return 0;
+
+	if (srcset_parse_range(p, &end, &e->range) < 0)
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+	if (*p++ != ',')
+		return -1;
+	while (isspace((unsigned char)*p))
+		p++;
+
+	if (!strncasecmp(p, "AS", 2))
+		p += 2;
+	if (!isdigit((unsigned char)*p))
+		return -1;
+	errno = 0;
+	id = strtoul(p, &end, 10);
+	if (errno || id >= PREFIXDB_NONE)
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+	if (*p != '\0' && *p != ',')
+		return -1;
+
+	e->id = id;
+	return 1;
+}
+
+static int read_csv(const char *path, struct entry **entries, size_t *num)
+{
+	size_t cap = 0, line_cap = 0;
+	struct entry *tmp;
+	char *line = NULL;
+	int lineno = 0, seen = 0, ret = -1, n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (getline(&line, &line_cap, f) != -1) {
+		lineno++;
+		if (*num == cap) {
+			cap = cap ? 2 * cap : 1024;
+			tmp = realloc(*entries, cap * sizeof(**entries));
+			if (!tmp)
+				goto out;
+			*entries = tmp;
+		}
+
+		n = parse_line(line, &(*entries)[*num]);
+		if (n < 0 && !seen && !isdigit((unsigned char)line[strspn(line, " \t")])) {
+			// A column header
+			seen = 1;
+			continue;
+		}
+		if (n < 0) {
+			log_error("%s:%d: expected <prefix>,<id>", path, lineno);
+			errno = EINVAL;
+			goto out;
+		}
+		seen |= n;
+		(*entries)[*num].lineno = lineno;
+		*num += n;
+	}
+	ret = 0;
+out:
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+struct flat {
+	struct prange *ranges;
+	size_t num;
+};
+
+// Starts a range at `start` unless it would only continue the previous one
+static void emit(struct flat *fl, uint32_t start, uint32_t id)
+{
+	if (fl->num && fl->ranges[fl->num - 1].id == id)
+		return;
+	fl->ranges[fl->num++] = (struct prange){ start, id };
+}
+
+// Flattens sorted, nested entries into ranges partitioning the address space
+static int flatten(const char *path, const struct entry *e, size_t n, struct flat *fl)
+{
+	const struct entry **stack = malloc((n + 1) * sizeof(*stack));
+	uint64_t cursor = 0;	// first address not emitted yet
+	size_t sp = 0;
+
+	// Every entry starts at most two ranges (itself and the rest of its parent), plus a gap
+	fl->ranges = malloc((2 * n + 1) * sizeof(*fl->ranges));
+	fl->num = 0;
+	if (!stack || !fl->ranges) {
+		free(stack);
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		// Close the entries ending before this one, handing what is left to their parents
+		while (sp && stack[sp - 1]->range.end < e[i].range.start) {
+			const struct entry *top = stack[--sp];
+
+			if (cursor <= top->range.end) {
+				emit(fl, cursor, top->id);
+				cursor = (uint64_t)top->range.end + 1;
+			}
+		}
+
+		if (sp && (stack[sp - 1]->range.end < e[i].range.end ||
+			   (stack[sp - 1]->range.start == e[i].range.start &&
+			    stack[sp - 1]->range.end == e[i].range.end))) {
+			log_error("%s:%d: range overlaps the one on line %d", path, e[i].lineno,
+				  stack[sp - 1]->lineno);
+			free(stack);
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (cursor < e[i].range.start)
+			emit(fl, cursor, sp ? stack[sp - 1]->id : PREFIXDB_NONE);
+		cursor = e[i].range.start;
+		stack[sp++] = &e[i];
+	}
+
+	while (sp) {
+		const struct entry *top = stack[--sp];
+
+		if (cursor <= top->range.end) {
+			emit(fl, cursor, top->id);
+			cursor = (uint64_t)top->range.end + 1;
+		}
+	}
+	if (cursor <= UINT32_MAX)
+		emit(fl, cursor, PREFIXDB_NONE);
+
+	free(stack);
+	return 0;
+}
+
+// Zero-fills the file up to `off`, less than a cache line away
+static int pad_to(FILE *f, size_t off)
+{
+	static const char zeroes[LINE_SZ];
+	size_t n = off - ftell(f);
+
+	return fwrite(zeroes, 1, n, f) == n ? 0 : -1;
+}
+
+// About one range per index entry, within bounds
+static int pick_bits(size_t num)
+{
+	int bits = PREFIXDB_MIN_INDEX_BITS;
+
+	while (bits < PREFIXDB_MAX_INDEX_BITS && (1UL << bits) < num)
+		bits++;
+
+	return bits;
+}
+
+static int write_db(const char *path, const struct flat *fl)
+{
+	struct header hdr = { .num = fl->num, .bits = pick_bits(fl->num) };
+	size_t num_index = (1UL << hdr.bits) + 1;
+	uint32_t *index = malloc(num_index * sizeof(*index));
+	char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+	int ret = -1;
+	FILE *f;
+
+	if (!index || !tmp_path)
+		goto out;
+	memcpy(hdr.magic, PREFIXDB_MAGIC, PREFIXDB_MAGIC_SZ);
+
+	// index[b]: the range holding the first address of block b
+	for (size_t b = 0, j = 0; b < num_index - 1; b++) {
+		while (j + 1 < fl->num && fl->ranges[j + 1].start <= (uint32_t)(b << (32 - hdr.bits)))
+			j++;
+		index[b] = j;
+	}
+	index[num_index - 1] = fl->num - 1;
+
+	// Written next to the target and renamed over it, so a running firewall keeps its map
+	sprintf(tmp_path, "%s.tmp", path);
+	f = fopen(tmp_path, "w");
+	if (!f)
+		goto out;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(index, sizeof(*index), num_index, f) != num_index ||
+	    pad_to(f, ranges_off(hdr.bits)) < 0 ||
+	    fwrite(fl->ranges, sizeof(*fl->ranges), fl->num, f) != fl->num ||
+	    fflush(f) || fsync(fileno(f)) < 0) {
+		fclose(f);
+		unlink(tmp_path);
+		goto out;
+	}
+	if (fclose(f) || rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(index);
+	free(tmp_path);
+	return ret;
+}
+
+int prefixdb_compile(const char *csv_path, const char *db_path)
+{
+	struct entry *entries = NULL;
+	struct flat fl = { 0 };
+	size_t num = 0;
+	int ret = -1;
+
+	if (read_csv(csv_path, &entries, &num) < 0)
+		goto out;
+
+	qsort(entries, num, sizeof(*entries), entry_cmp);
+	if (flatten(csv_path, entries, num, &fl) < 0 || write_db(db_path, &fl) < 0)
+		goto out;
+
+	log_info("%s: %zu prefixes flattened to %zu ranges, %d-bit index, %zu KB", db_path, num,
+		 fl.num, pick_bits(fl.num), db_size(fl.num, pick_bits(fl.num)) >> 10);
+	ret = 0;
+out:
+	free(entries);
+	free(fl.ranges);
+	return ret;
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_PREFIXDB_H__
+#define __SO_PREFIXDB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* First 8 bytes of a database file. */
+#define PREFIXDB_MAGIC "SOPFXDB1"
+#define PREFIXDB_MAGIC_SZ 8
+
+/* Id of the addresses no prefix covers; not allowed in the CSV. */
+#define PREFIXDB_NONE UINT32_MAX
+
+/* Bounds on the bits of an address the top-level index is keyed on, picked by size. */
+#define PREFIXDB_MIN_INDEX_BITS 8
+#define PREFIXDB_MAX_INDEX_BITS 20
+
+/* Most cache lines of ranges prefetched for one lookup. */
+#define PREFIXDB_PREFETCH_LINES 4
+
+/**
+ * @brief Read-only map from IPv4 addresses to owner (e.g. ASN) ids.
+ *
+ * The file is compiled from CSV by `mkprefixdb` and mapped as is, in host
+ * byte order:
+ *
+ *   magic[8] | uint32 num | uint32 bits
+ *   uint32 index[(1 << bits) + 1]
+ *   { uint32 start; uint32 id; } ranges[num]	(from a 64-byte boundary)
+ *
+ * Nested prefixes are flattened at compile time, the most specific one
+ * winning, into `num` ranges that partition the whole address space: range i
+ * covers [start, next start) and maps to its id, `PREFIXDB_NONE` for gaps.
+ * index[b] is the range holding the first address whose top `bits` bits are
+ * b, and `bits` is picked so that there are about as many index entries as
+ * ranges. A lookup thus reads one index entry, then searches the one or few
+ * ranges of its block without branches, ending on the cache line that also
+ * holds the id: two cache misses when the database does not fit in cache.
+ */
+typedef struct so_prefixdb_t so_prefixdb_t;
+
+/**
+ * @brief Maps a database file built by prefixdb_compile().
+ *
+ * @return The database, or NULL with `errno` set (EINVAL for a file that is
+ *         not a well-formed database, which is logged).
+ */
+so_prefixdb_t *prefixdb_open(const char *path);
+
+/* Owner id of `addr`, or PREFIXDB_NONE; thread-safe. */
+uint32_t prefixdb_lookup(const so_prefixdb_t *db, uint32_t addr);
+
+/**
+ * @brief Starts loading what a lookup of `addr` will read, so that other work
+ * done meanwhile hides the memory latency: prefixdb_prefetch_index() its
+ * index entry without waiting for it, prefixdb_prefetch() its ranges, which
+ * waits for the index entry unless it was prefetched earlier. Blocks spanning
+ * more than `PREFIXDB_PREFETCH_LINES` cache lines are left to the lookup.
+ */
+void prefixdb_prefetch_index(const so_prefixdb_t *db, uint32_t addr);
+void prefixdb_prefetch(const so_prefixdb_t *db, uint32_t addr);
+
+/**
+ * @brief Compiles a CSV file of `<prefix>,<id>[,...]` lines into a database
+ * at `db_path`, replacing it atomically.
+ *
+ * <prefix> is an address, CIDR block or range as for `--allow-sources`; <id>
+ * a decimal number, optionally prefixed with `AS`. Further columns, blank
+ * lines, `#` comments and a header line are skipped. Ranges may nest but not
+ * partly overlap, and the same range may not be listed twice.
+ *
+ * @return 0, or -1 with `errno` set (EINVAL for a malformed or conflicting
+ *         line, which is logged).
+ */
+int prefixdb_compile(const char *csv_path, const char *db_path);
+
+/* Logs the file, the number of ranges and the bytes mapped at info level. */
+void prefixdb_report(const so_prefixdb_t *db);
+
+void prefixdb_close(so_prefixdb_t *db);
+
+#endif /* __SO_PREFIXDB_H__ */
@@ -6,24 +6,220 @@
 
 #include "ring_buffer.h"
 #include "packet.h"
+#include "pcap.h"
+#include "membudget.h"
 #include "utils.h"
 #include "producer.h"
 
-void publish_data(so_ring_buffer_t *rb, const char *filename)
+/* Input read in large chunks, handed out as contiguous byte ranges. */
+struct reader {
+	int fd;
+	int direct;
+	int drop_cache;		/* O_DIRECT was asked for but is not available */
+	char *buf;
+	size_t cap;
+	size_t off;
+	size_t len;
+	char bounce[PKT_MAX_SZ];	/* ranges that straddle two chunks */
+};
+
+static void reader_refill(struct reader *r)
 {
-	char buffer[PKT_SZ];
 	ssize_t sz;
-	int fd;
 
-	fd = open(filename, O_RDONLY);
-	DIE(fd < 0, "open");
+	do {
+		sz = read(r->fd, r->buf, r->cap);
+		if (sz < 0 && errno == EINVAL && r->direct) {
+			/* E.g. an unaligned short read at the end of the file */
+			dio_disable(r->fd);
+			r->direct = 0;
+			r->drop_cache = 1;
+			continue;
+		}
+		DIE(sz < 0, "read");
+	} while (sz < 0);
+
+	/* Emulate O_DIRECT by dropping what was read from the page cache: it is never read again. */
+	if (r->drop_cache && sz > 0)
+		posix_fadvise(r->fd, 0, lseek(r->fd, 0, SEEK_CUR), POSIX_FADV_DONTNEED);
+
+	r->off = 0;
+	r->len = sz;
+}
+
+/* Returns the first bytes of the input without consuming them. */
+static const char *reader_peek(struct reader *r, size_t *len)
+{
+	if (r->off == r->len)
+		reader_refill(r);
+	*len = r->len - r->off;
+
+	return r->buf + r->off;
+}
+
+/*
+ * Consumes `n` contiguous bytes. Returns NULL at a clean end of file, dies if
+ * the file ends in the middle of the range.
+ */
+static const char *reader_get(struct reader *r, size_t n)
+{
+	size_t got = 0, chunk;
+	const char *p;
+
+	if (r->len - r->off >= n) {
+		p = r->buf + r->off;
+		r->off += n;
+		return p;
+	}
+
+	while (got < n) {
+		if (r->off == r->len) {
+			reader_refill(r);
+			if (r->len == 0) {
+				DIE(got != 0, "packet truncated");
+				return NULL;
+			}
+		}
+		chunk = n - got < r->len - r->off ? n - got : r->len - r->off;
+		memcpy(r->bounce + got, r->buf + r->off, chunk);
+		r->off += chunk;
+		got += chunk;
+	}
+
+	return r->bounce;
+}
+
+/* Publishes length-prefixed records following the magic. */
+static void publish_records(so_publish_fn publish, void *arg, struct reader *r)
+{
+	const char *p;
+	unsigned int rec_len;
+
+	reader_get(r, PKT_VAR_MAGIC_SZ);
+
+	while ((p = reader_get(r, sizeof(rec_len))) != NULL) {
+		memcpy(&rec_len, p, sizeof(rec_len));
+		DIE(rec_len < sizeof(so_hdr_t) || rec_len > PKT_MAX_SZ, "bad record length");
+
+		p = reader_get(r, rec_len);
+		DIE(p == NULL, "packet truncated");
+
+		publish(arg, p, rec_len);
+	}
+}
+
+/* Publishes the IPv4 packets of a pcap / pcapng capture, parsed in place from a mapping. */
+static void publish_pcap(so_publish_fn publish, void *arg, int fd, char *buf)
+{
+	so_pcap_t pc;
+	ssize_t len;
+
+	DIE(pcap_open(&pc, fd) < 0, "pcap_open");
+
+	while ((len = pcap_next(&pc, buf, PKT_MAX_SZ)) > 0)
+		publish(arg, buf, len);
+	DIE(len < 0, "capture file corrupt");
+
+	if (pc.skipped)
+		log_info("pcap: %lu packets, %lu non-IPv4 skipped", pc.packets, pc.skipped);
+	pcap_close(&pc);
+}
+
+void read_packets(const char *filename, const so_producer_opts_t *opts,
+		  so_publish_fn publish, void *arg)
+{
+	struct reader *r;
+	const char *p;
+	size_t len;
+
+	r = calloc(1, sizeof(*r));
+	DIE(r == NULL, "calloc");
+
+	r->direct = opts && opts->direct_io;
+	r->fd = dio_open(filename, O_RDONLY, 0, &r->direct);
+	DIE(r->fd < 0, "open");
+
+	if (opts && opts->direct_io) {
+		r->drop_cache = !r->direct;
+		r->buf = dio_pool_get(opts->pool);
+		r->cap = opts->pool->buf_size;
+	} else {
+		r->cap = opts && opts->read_size ? opts->read_size : PRODUCER_BUF_SZ;
+		r->cap = membudget_fit(r->cap, PKT_MAX_SZ, MEMBUDGET_IO_SHARE);
+		DIE(membudget_charge(MEM_IO, r->cap) < 0, "memory limit: read buffer");
+		r->buf = malloc(r->cap);
+		DIE(r->buf == NULL, "malloc");
+		posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	/* The first bytes tell fixed 256-byte packets, variable records and captures apart. */
+	p = reader_peek(r, &len);
 
-	while ((sz = read(fd, buffer, PKT_SZ)) != 0) {
-		DIE(sz != PKT_SZ, "packet truncated");
+	if (pcap_is_capture(p, len)) {
+		publish_pcap(publish, arg, r->fd, r->bounce);
+	} else if (len >= PKT_VAR_MAGIC_SZ && !memcmp(p, PKT_VAR_MAGIC, PKT_VAR_MAGIC_SZ)) {
+		publish_records(publish, arg, r);
+	} else {
+		while ((p = reader_get(r, PKT_SZ)) != NULL)
+			publish(arg, p, PKT_SZ);
+	}
 
-		/* enequeue packet into ring buffer */
-		ring_buffer_enqueue(rb, buffer, sz);
+	if (opts && opts->direct_io) {
+		dio_pool_put(opts->pool, r->buf);
+	} else {
+		free(r->buf);
+		membudget_release(MEM_IO, r->cap);
 	}
+	close(r->fd);
+	free(r);
+}
+
+static void enqueue_packet(void *arg, const void *rec, size_t len)
+{
+	/* enqueue record into ring buffer */
+	DIE(ring_buffer_enqueue_rec(arg, rec, len) < 0, "record larger than the ring");
+}
 
+void publish_data(so_ring_buffer_t *rb, const char *filename, const so_producer_opts_t *opts)
+{
+	read_packets(filename, opts, enqueue_packet, rb);
 	ring_buffer_stop(rb);
 }
+
+/* Reads the first bytes of `filename` into `magic`; returns how many, or -1 on error. */
+static ssize_t read_magic(const char *filename, char magic[PKT_VAR_MAGIC_SZ])
+{
+	ssize_t sz;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	sz = pread(fd, magic, PKT_VAR_MAGIC_SZ, 0);
+	close(fd);
+
+	return sz;
+}
+
+int input_is_fixed(const char *filename)
+{
+	char magic[PKT_VAR_MAGIC_SZ];
+	ssize_t sz = read_magic(filename, magic);
+
+	if (sz < 0)
+		return -1;
+
+	return !pcap_is_capture(magic, sz) &&
+	       !(sz == PKT_VAR_MAGIC_SZ && !memcmp(magic, PKT_VAR_MAGIC, PKT_VAR_MAGIC_SZ));
+}
+
+int input_is_capture(const char *filename)
+{
+	char magic[PKT_VAR_MAGIC_SZ];
+	ssize_t sz = read_magic(filename, magic);
+
+	if (sz < 0)
+		return -1;
+
+	return pcap_is_capture(magic, sz);
+}
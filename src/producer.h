@@ -5,7 +5,45 @@
 
 #include "ring_buffer.h"
 #include "packet.h"
+#include "dio.h"
 
-void publish_data(struct so_ring_buffer_t *rb, const char *filename);
+/* Bytes read from the input at a time, without direct I/O. */
+#define PRODUCER_BUF_SZ (1 << 20)
+
+/*
+ * Smallest byte ring the producer may enqueue into: two of the largest
+ * records, so that one always fits past the padding before a wrap.
+ */
+#define PRODUCER_RING_MIN (2 * RING_REC_SPAN(PKT_MAX_SZ))
+
+/* Tunables for the producer; a zeroed structure gives the defaults. */
+typedef struct so_producer_opts_t {
+	/* Read the input with O_DIRECT into a buffer taken from `pool`. */
+	int direct_io;
+	so_dio_pool_t *pool;
+	/* Otherwise, bytes read at a time (PRODUCER_BUF_SZ if 0). */
+	size_t read_size;
+} so_producer_opts_t;
+
+/* Receives each packet record read from the input, in input order. */
+typedef void (*so_publish_fn)(void *arg, const void *rec, size_t len);
+
+/*
+ * Reads fixed-size packets, variable-length records or a capture from
+ * `filename` and hands every record to `publish`. `opts` may be NULL for the
+ * defaults.
+ */
+void read_packets(const char *filename, const so_producer_opts_t *opts,
+		  so_publish_fn publish, void *arg);
+
+/* Enqueues the input into `rb`, then stops it. */
+void publish_data(struct so_ring_buffer_t *rb, const char *filename,
+		  const so_producer_opts_t *opts);
+
+/* Returns 1 for fixed 256-byte packets, 0 for other formats, -1 on error. */
+int input_is_fixed(const char *filename);
+
+/* Returns 1 for a pcap or pcapng capture, 0 for other formats, -1 on error. */
+int input_is_capture(const char *filename);
 
 #endif /*__SO_PRODUCER_H__*/
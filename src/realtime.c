@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "realtime.h"
+#include "utils.h"
+
+static struct {
+	int enabled;
+	int fifo_prio;
+	int isolated;		// io_cpu and workers split the CPUs
+	int io_cpu;
+	cpu_set_t workers;
+	size_t page_size;
+
+	int fifo_warned;
+	long minflt;		// page faults when processing started
+	long majflt;
+} rt;
+
+static void mark_faults(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	rt.minflt = ru.ru_minflt;
+	rt.majflt = ru.ru_majflt;
+}
+
+void realtime_init(int fifo_prio)
+{
+	pthread_attr_t attr;
+	cpu_set_t allowed;
+
+	rt.enabled = 1;
+	rt.fifo_prio = fifo_prio;
+	rt.page_size = sysconf(_SC_PAGESIZE);
+	mark_faults();
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		log_warn("realtime: mlockall: %s (needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK), only prefaulting",
+			 strerror(errno));
+	else
+		log_info("realtime: memory locked");
+
+	// Rather than the 8 MiB default, all of which mlockall() would fault in per thread
+	if (pthread_attr_init(&attr) == 0) {
+		pthread_attr_setstacksize(&attr, REALTIME_STACK_SZ);
+		pthread_setattr_default_np(&attr);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) < 2) {
+		if (fifo_prio)
+			log_warn("realtime: a single CPU, the producer shares it with the workers and SCHED_FIFO is off");
+		else
+			log_warn("realtime: a single CPU, the producer shares it with the workers");
+		rt.fifo_prio = 0;
+		return;
+	}
+
+	// The last allowed CPU for the producer and writer, the others for the workers
+	rt.workers = allowed;
+	for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			rt.io_cpu = cpu;
+			CPU_CLR(cpu, &rt.workers);
+			break;
+		}
+	}
+	rt.isolated = 1;
+	log_info("realtime: producer and writer on CPU %d, workers on the other %d", rt.io_cpu,
+		 CPU_COUNT(&rt.workers));
+}
+
+void realtime_prefault(void *buf, size_t len)
+{
+	volatile char *p = buf;
+
+	if (!rt.enabled || !len)
+		return;
+
+	// Write back what is there: some buffers are already in use, e.g. zeroed
+	for (size_t off = 0; off < len; off += rt.page_size)
+		p[off] = p[off];
+	p[len - 1] = p[len - 1];
+}
+
+static void prefault_stack(void)
+{
+	volatile char *stack = alloca(REALTIME_STACK_PREFAULT);
+
+	for (size_t off = 0; off < REALTIME_STACK_PREFAULT; off += rt.page_size)
+		stack[off] = 0;
+}
+
+void realtime_thread(so_rt_role_t role)
+{
+	struct sched_param param = { .sched_priority = rt.fifo_prio };
+	cpu_set_t io;
+
+	if (!rt.enabled)
+		return;
+
+	prefault_stack();
+
+	// Setup is over once the producer starts: count the faults from here
+	if (role == RT_PRODUCER)
+		mark_faults();
+
+	if (!rt.isolated)
+		return;
+
+	if (role == RT_WORKER) {
+		pthread_setaffinity_np(pthread_self(), sizeof(rt.workers), &rt.workers);
+		return;
+	}
+
+	CPU_ZERO(&io);
+	CPU_SET(rt.io_cpu, &io);
+	pthread_setaffinity_np(pthread_self(), sizeof(io), &io);
+
+	if (rt.fifo_prio) {
+		errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (errno && !__atomic_exchange_n(&rt.fifo_warned, 1, __ATOMIC_RELAXED))
+			log_warn("realtime: SCHED_FIFO: %s (needs CAP_SYS_NICE or RLIMIT_RTPRIO), staying SCHED_OTHER",
+				 strerror(errno));
+	}
+}
+
+void realtime_report(void)
+{
+	struct rusage ru;
+
+	if (!rt.enabled)
+		return;
+
+	getrusage(RUSAGE_SELF, &ru);
+	log_info("realtime: %ld minor and %ld major page faults while processing",
+		 ru.ru_minflt - rt.minflt, ru.ru_majflt - rt.majflt);
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_REALTIME_H__
+#define __SO_REALTIME_H__
+
+#include <stddef.h>
+
+/* Stack each thread touches when it starts, so that it does not fault later. */
+#define REALTIME_STACK_PREFAULT (256 << 10)
+
+/* Stack size of the threads created afterwards: locked memory is resident in full. */
+#define REALTIME_STACK_SZ (2 << 20)
+
+typedef enum {
+	RT_PRODUCER,	/* reads the input: the calling thread of the engines */
+	RT_WRITER,	/* a thread that only writes the log */
+	RT_WORKER,	/* classifies and hashes */
+} so_rt_role_t;
+
+/**
+ * @brief Low-latency mode: keeps page faults and preemption off the packet path.
+ *
+ * realtime_init() locks the process memory with mlockall(), present and
+ * future, so that nothing is paged out and later allocations are faulted in
+ * when they are mapped. Large buffers (rings, output buffers) are also
+ * touched page by page with realtime_prefault() as they are set up, which
+ * still saves the first-touch faults when memory cannot be locked.
+ *
+ * With two or more CPUs, the last one the process may use is kept for the
+ * producer and writer threads and the others for the workers, so that neither
+ * side preempts the other. Those two roles then run SCHED_FIFO at `fifo_prio`
+ * when it is not 0. SCHED_FIFO is never used on a single CPU: the producer
+ * would starve the workers it waits for.
+ *
+ * Each step falls back with a warning when it is not permitted (no
+ * CAP_IPC_LOCK or too low an RLIMIT_MEMLOCK, no CAP_SYS_NICE). Until
+ * realtime_init() is called every other function does nothing.
+ */
+void realtime_init(int fifo_prio);
+
+/* Touches every page of `buf` so that the packet path does not fault on it. */
+void realtime_prefault(void *buf, size_t len);
+
+/* Applies the placement and policy of `role` to the calling thread and prefaults its stack. */
+void realtime_thread(so_rt_role_t role);
+
+/* Logs the page faults taken since processing started, at info level. */
+void realtime_report(void);
+
+#endif /* __SO_REALTIME_H__ */
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "dfa.h"
+#include "utils.h"
+
+#define DEFAULT_PATTERN "(a|aa)*c"
+#define DEFAULT_PAYLOADS 100000UL
+#define DEFAULT_SIZE 240UL
+
+enum {
+	OPT_PAYLOADS = 256,
+	OPT_SIZE,
+	OPT_FILL,
+	OPT_STATES,
+	OPT_NO_PREFILTER,
+};
+
+static const struct option long_options[] = {
+	{ "payloads",	required_argument,	NULL,	OPT_PAYLOADS },
+	{ "size",	required_argument,	NULL,	OPT_SIZE },
+	{ "fill",	required_argument,	NULL,	OPT_FILL },
+	{ "states",	required_argument,	NULL,	OPT_STATES },
+	{ "no-prefilter", no_argument,		NULL,	OPT_NO_PREFILTER },
+	{ NULL,		0,			NULL,	0 },
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options] [<regex>...]\n"
+		"Times dfa_match() over payloads of one repeated byte, or random bytes, against\n"
+		"the rules given (default %s, whose backtracking cost explodes on 'a's)\n"
+		"Options:\n"
+		"  --payloads <n>         payloads matched (default %lu)\n"
+		"  --size <n>             bytes per payload (default %lu)\n"
+		"  --fill <char|random>   payload contents (default a)\n"
+		"  --states <n>           bound on the cached DFA states (default %d)\n"
+		"  --no-prefilter         run the automaton on every payload\n",
+		prog, DEFAULT_PATTERN, DEFAULT_PAYLOADS, DEFAULT_SIZE, DFA_MAX_STATES);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long payloads = DEFAULT_PAYLOADS, size = DEFAULT_SIZE, states = DFA_MAX_STATES;
+	static const char *const default_patterns[] = { DEFAULT_PATTERN };
+	const char *const *patterns = default_patterns;
+	unsigned long matches = 0, fallbacks;
+	const char *fill = "a";
+	int prefilter = 1;
+	size_t num_patterns = 1, built;
+	unsigned char *buf;
+	double start, secs;
+	so_dfa_t *dfa;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_PAYLOADS:
+			payloads = parse_count(optarg);
+			break;
+		case OPT_SIZE:
+			size = parse_count(optarg);
+			break;
+		case OPT_FILL:
+			fill = optarg;
+			break;
+		case OPT_STATES:
+			states = parse_count(optarg);
+			break;
+		case OPT_NO_PREFILTER:
+			prefilter = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (payloads == 0 || size == 0 || states == 0 || (strlen(fill) != 1 && strcmp(fill, "random")))
+		usage(argv[0]);
+	if (optind < argc) {
+		patterns = (const char *const *)&argv[optind];
+		num_patterns = argc - optind;
+	}
+
+	dfa = dfa_compile(patterns, num_patterns, states);
+	DIE(dfa == NULL, "dfa_compile");
+	dfa_set_prefilter(dfa, prefilter);
+
+	// Back to back, as payloads follow each other in the ring
+	buf = malloc(payloads * size);
+	DIE(buf == NULL, "malloc");
+	if (strlen(fill) == 1) {
+		memset(buf, fill[0], payloads * size);
+	} else {
+		srand(1);
+		for (unsigned long i = 0; i < payloads * size; i++)
+			buf[i] = rand();
+	}
+
+	start = now();
+	for (unsigned long i = 0; i < payloads; i++)
+		matches += dfa_match(dfa, buf + i * size, size) >= 0;
+	secs = now() - start;
+
+	dfa_stats(dfa, &built, &fallbacks);
+	printf("%zu rule%s, %lu payloads of %lu bytes (%s), prefilter %s\n", num_patterns,
+	       num_patterns == 1 ? "" : "s", payloads, size, fill, dfa_has_prefilter(dfa) ? "on" : "off");
+	printf("%.3f s, %.1f ns/payload, %.0f MB/s, %lu matched, %zu DFA states, %lu NFA fallbacks\n",
+	       secs, secs * 1e9 / payloads, payloads * size / secs / 1e6, matches, built, fallbacks);
+
+	free(buf);
+	dfa_destroy(dfa);
+
+	return 0;
+}
@@ -1,14 +1,29 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <errno.h>
 #include <stdlib.h>
 #include "ring_buffer.h"
+#include "lockprof.h"
+#include "realtime.h"
+#include "membudget.h"
 
 int ring_buffer_init(so_ring_buffer_t *ring, size_t cap)
 {
-	// Allocate memory for the buffer data array.
+	// Records and the padding marker are written at RING_REC_ALIGN offsets.
+	if (cap == 0 || cap % RING_REC_ALIGN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Account for the buffer, then allocate its data array.
+	if (membudget_charge(MEM_RING, cap) < 0)
+		return -1; // Over the memory limit.
 	ring->data = (char *)malloc(cap);
-	if (!ring->data)
+	if (!ring->data) {
+		membudget_release(MEM_RING, cap);
 		return -1; // Memory allocation failed.
+	}
+	realtime_prefault(ring->data, cap); // Fault it in now rather than on the first lap.
 
 	// Initialize ring buffer properties.
 	ring->stop = 0;		 // The buffer is not stopped at the beginning.
@@ -18,7 +33,7 @@ int ring_buffer_init(so_ring_buffer_t *ring, size_t cap)
 	ring->cap = cap;	 // Set the buffer capacity.
 
 	// Initialize synchronization primitives for thread-safe operations.
-	pthread_mutex_init(&ring->mutex, NULL);	   // Mutex for protecting the buffer's integrity.
+	so_mutex_init(&ring->mutex, "ring->mutex");	   // Mutex for protecting the buffer's integrity.
 	pthread_cond_init(&ring->not_empty, NULL); // Condition variable to signal when buffer has data.
 	pthread_cond_init(&ring->not_full, NULL);  // Condition variable to signal when buffer has space.
 
@@ -27,11 +42,11 @@ int ring_buffer_init(so_ring_buffer_t *ring, size_t cap)
 
 ssize_t ring_buffer_enqueue(so_ring_buffer_t *ring, void *data, size_t size)
 {
-	pthread_mutex_lock(&ring->mutex); // Lock the mutex to ensure thread safety.
+	so_mutex_lock(&ring->mutex); // Lock the mutex to ensure thread safety.
 
 	// Wait until there is enough space in the buffer.
 	while (ring->len + size > ring->cap)
-		pthread_cond_wait(&ring->not_full, &ring->mutex);
+		so_cond_wait(&ring->not_full, &ring->mutex);
 
 	// Copy the data into the buffer at the current write position.
 	memcpy(ring->data + ring->write_pos, data, size);
@@ -41,7 +56,7 @@ ssize_t ring_buffer_enqueue(so_ring_buffer_t *ring, void *data, size_t size)
 	// Increase the length of the buffer by the size of the data.
 	ring->len += size;
 
-	pthread_mutex_unlock(&ring->mutex);	   // Unlock the mutex after the operation.
+	so_mutex_unlock(&ring->mutex);	   // Unlock the mutex after the operation.
 	pthread_cond_signal(&ring->not_empty); // Signal that the buffer is no longer empty.
 
 	return size; // Return the size of data enqueued.
@@ -49,7 +64,7 @@ ssize_t ring_buffer_enqueue(so_ring_buffer_t *ring, void *data, size_t size)
 
 ssize_t ring_buffer_dequeue(so_ring_buffer_t *ring, void *data, size_t size)
 {
-	pthread_mutex_lock(&ring->mutex); // Lock the mutex for thread safety.
+	so_mutex_lock(&ring->mutex); // Lock the mutex for thread safety.
 
 	// Copy the data from the buffer at the current read position.
 	memcpy(data, ring->data + ring->read_pos, size);
@@ -59,17 +74,120 @@ ssize_t ring_buffer_dequeue(so_ring_buffer_t *ring, void *data, size_t size)
 	// Decrease the length of the buffer by the size of the data.
 	ring->len -= size;
 
-	pthread_mutex_unlock(&ring->mutex);	  // Unlock the mutex after the operation.
+	so_mutex_unlock(&ring->mutex);	  // Unlock the mutex after the operation.
 	pthread_cond_signal(&ring->not_full); // Signal that the buffer is no longer full.
 
 	return size; // Return the size of data dequeued.
 }
 
+#define REC_PAD 0xffffffffu
+
+ssize_t ring_buffer_enqueue_rec(so_ring_buffer_t *ring, const void *data, size_t size)
+{
+	size_t span = RING_REC_SPAN(size);
+	size_t pad = 0;
+	struct ring_rec_hdr hdr = { .size = size };
+
+	if (span > ring->cap || size >= REC_PAD) {
+		errno = EMSGSIZE;
+		return -1; // The record could never fit.
+	}
+
+	so_mutex_lock(&ring->mutex); // Lock the mutex to ensure thread safety.
+
+	// Wait until there is enough space in the buffer for the padding and the record.
+	for (;;) {
+		// An empty buffer starts over at offset 0, so the padding cannot block forever.
+		if (ring->len == 0)
+			ring->read_pos = ring->write_pos = 0;
+
+		// Records never wrap: pad to the end of the buffer if the tail is too short.
+		pad = ring->write_pos + span > ring->cap ? ring->cap - ring->write_pos : 0;
+		if (ring->len + pad + span <= ring->cap)
+			break;
+		so_cond_wait(&ring->not_full, &ring->mutex);
+	}
+
+	if (pad) {
+		struct ring_rec_hdr marker = { .size = REC_PAD };
+
+		memcpy(ring->data + ring->write_pos, &marker, sizeof(marker));
+		ring->write_pos = 0;
+		ring->len += pad;
+	}
+
+	// Copy the header and the record, then advance by the aligned span.
+	memcpy(ring->data + ring->write_pos, &hdr, sizeof(hdr));
+	memcpy(ring->data + ring->write_pos + sizeof(hdr), data, size);
+	ring->write_pos = (ring->write_pos + span) % ring->cap;
+	ring->len += span;
+
+	so_mutex_unlock(&ring->mutex);	   // Unlock the mutex after the operation.
+	pthread_cond_signal(&ring->not_empty); // Signal that the buffer is no longer empty.
+
+	return size;
+}
+
+ssize_t ring_buffer_dequeue_rec(so_ring_buffer_t *ring, void *data, size_t cap)
+{
+	return ring_buffer_dequeue_rec_ahead(ring, data, cap, NULL, NULL);
+}
+
+ssize_t ring_buffer_dequeue_rec_ahead(so_ring_buffer_t *ring, void *data, size_t cap,
+				      void *ahead, size_t *ahead_len)
+{
+	struct ring_rec_hdr hdr;
+	size_t pos;
+	ssize_t ret;
+
+	so_mutex_lock(&ring->mutex); // Lock the mutex for thread safety.
+
+	memcpy(&hdr, ring->data + ring->read_pos, sizeof(hdr));
+
+	// Skip the padding the producer left before wrapping around.
+	if (hdr.size == REC_PAD) {
+		ring->len -= ring->cap - ring->read_pos;
+		ring->read_pos = 0;
+		memcpy(&hdr, ring->data, sizeof(hdr));
+	}
+
+	ret = hdr.size;
+	if (hdr.size <= cap)
+		memcpy(data, ring->data + ring->read_pos + sizeof(hdr), hdr.size);
+	else
+		ret = -1;
+
+	ring->read_pos = (ring->read_pos + RING_REC_SPAN(hdr.size)) % ring->cap;
+	ring->len -= RING_REC_SPAN(hdr.size);
+
+	// Copy the start of the next record, if any, leaving it in the buffer.
+	if (ahead) {
+		pos = ring->read_pos;
+		hdr.size = 0;
+		if (ring->len) {
+			memcpy(&hdr, ring->data + pos, sizeof(hdr));
+			if (hdr.size == REC_PAD) {
+				pos = 0;
+				memcpy(&hdr, ring->data, sizeof(hdr));
+			}
+		}
+		if (hdr.size < *ahead_len)
+			*ahead_len = hdr.size;
+		memcpy(ahead, ring->data + pos + sizeof(hdr), *ahead_len);
+	}
+
+	so_mutex_unlock(&ring->mutex);	  // Unlock the mutex after the operation.
+	pthread_cond_signal(&ring->not_full); // Signal that the buffer is no longer full.
+
+	return ret;
+}
+
 void ring_buffer_destroy(so_ring_buffer_t *ring)
 {
 	free(ring->data); // Free the memory allocated for the buffer data.
+	membudget_release(MEM_RING, ring->cap);
 	// Destroy synchronization primitives.
-	pthread_mutex_destroy(&ring->mutex);
+	so_mutex_destroy(&ring->mutex);
 	pthread_cond_destroy(&ring->not_empty);
 	pthread_cond_destroy(&ring->not_full);
 }
@@ -92,8 +92,9 @@ typedef struct so_ring_buffer_t
  * primitives.
  *
  * @param rb Pointer to the circular buffer structure.
- * @param cap The maximum capacity of the buffer (in bytes).
- * @return 0 if the initialization was successful, -1 if memory allocation failed.
+ * @param cap The maximum capacity of the buffer (in bytes), a multiple of RING_REC_ALIGN.
+ * @return 0 if the initialization was successful, -1 if memory allocation failed
+ *         or `cap` is not a multiple of RING_REC_ALIGN (with `errno` set to `EINVAL`).
  */
 int ring_buffer_init(so_ring_buffer_t *rb, size_t cap);
 
@@ -125,6 +126,74 @@ ssize_t ring_buffer_enqueue(so_ring_buffer_t *rb, void *data, size_t size);
  */
 ssize_t ring_buffer_dequeue(so_ring_buffer_t *rb, void *data, size_t size);
 
+/**
+ * @brief Alignment of records stored with `ring_buffer_enqueue_rec()`.
+ */
+#define RING_REC_ALIGN 8
+
+/**
+ * @brief Header in front of every record stored with `ring_buffer_enqueue_rec()`.
+ */
+struct ring_rec_hdr {
+	unsigned int size; /* Record size, or a padding marker up to the end of the buffer */
+	unsigned int reserved;
+};
+
+/**
+ * @brief Bytes a record of `size` bytes takes in the buffer, header and alignment included.
+ */
+#define RING_REC_SPAN(size) \
+	(((size) + sizeof(struct ring_rec_hdr) + RING_REC_ALIGN - 1) & ~(size_t)(RING_REC_ALIGN - 1))
+
+/**
+ * @brief Enqueues one variable-size record into the circular buffer.
+ *
+ * Each record is stored contiguously behind an 8-byte header holding its size,
+ * so consumers can copy it out (or parse it in place) without handling a wrap
+ * in the middle. When the record does not fit before the end of the buffer, a
+ * padding marker is written and the record starts again at offset 0. The
+ * buffer capacity must be a multiple of `RING_REC_ALIGN`.
+ *
+ * This function blocks until the record, its header and any padding fit. Once
+ * the buffer is empty, writing restarts at offset 0, so any record that fits
+ * in the capacity is eventually enqueued.
+ *
+ * @param rb Pointer to the circular buffer.
+ * @param data Pointer to the record.
+ * @param size The size (in bytes) of the record.
+ * @return `size`, or -1 with `errno` set to `EMSGSIZE` if the record can never
+ *         fit in the buffer.
+ */
+ssize_t ring_buffer_enqueue_rec(so_ring_buffer_t *rb, const void *data, size_t size);
+
+/**
+ * @brief Dequeues one variable-size record from the circular buffer.
+ *
+ * Like `ring_buffer_dequeue()`, the caller must have checked that the buffer is
+ * not empty. Padding markers left by the producer are skipped.
+ *
+ * @param rb Pointer to the circular buffer.
+ * @param data Pointer to the buffer where the record will be stored.
+ * @param cap The size (in bytes) of `data`.
+ * @return The size of the record, or -1 if it is larger than `cap` (the
+ *         record is dropped from the buffer in that case).
+ */
+ssize_t ring_buffer_dequeue_rec(so_ring_buffer_t *rb, void *data, size_t cap);
+
+/**
+ * @brief Dequeues one record like `ring_buffer_dequeue_rec()` and copies the
+ * start of the record after it, which stays in the buffer.
+ *
+ * Lets a consumer start on what the next record will need (e.g. prefetch a
+ * table entry for it) without taking the lock again.
+ *
+ * @param ahead Where the first bytes of the next record are copied.
+ * @param ahead_len On entry, the size (in bytes) of `ahead`; on return, the
+ *        bytes copied, 0 if the buffer is now empty.
+ */
+ssize_t ring_buffer_dequeue_rec_ahead(so_ring_buffer_t *rb, void *data, size_t cap,
+				      void *ahead, size_t *ahead_len);
+
 /**
  * @brief Destroys a circular buffer and releases resources.
  *
@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "ring_buffer.h"
+#include "disruptor.h"
+#include "pipeline.h"
+#include "pkt_ring.h"
+#include "packet.h"
+#include "realtime.h"
+#include "utils.h"
+
+#define DEFAULT_RECORDS 1000000UL
+
+// The firewall's ring: 1000 fixed-size packets
+#define RING_SZ (PKT_SZ * 1000)
+
+// A large ring, whose first lap faults page by page unless it was prefaulted
+#define LATENCY_RING_SZ (64 << 20)
+
+enum {
+	OPT_RECORDS = 256,
+	OPT_SIZE,
+	OPT_IMIX,
+	OPT_REALTIME,
+};
+
+static const struct option long_options[] = {
+	{ "records",	required_argument,	NULL,	OPT_RECORDS },
+	{ "size",	required_argument,	NULL,	OPT_SIZE },
+	{ "imix",	no_argument,		NULL,	OPT_IMIX },
+	{ "realtime",	no_argument,		NULL,	OPT_REALTIME },
+	{ NULL,		0,			NULL,	0 },
+};
+
+// Record sizes of gen_packets.py --varlen, header included, and their weights
+static const struct {
+	size_t size;
+	int weight;
+} imix[] = {
+	{ 64, 7 },
+	{ 576, 4 },
+	{ 1500, 1 },
+};
+
+#define IMIX_WEIGHTS 12
+
+// A run through one of the rings, and what its consumer saw
+struct handoff {
+	so_ring_buffer_t ring;
+	pthread_mutex_t mutex;	// what the consumers of the ring engine wait under
+	so_disruptor_t d;
+	so_seq_t seq;		// the disruptor consumer's progress
+	unsigned long records;
+	double latency;		// sum over the records, in seconds
+	unsigned long bytes;	// ring bytes the records took
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options]\n"
+		"Times the hand-off of records from a producer thread to a consumer thread through\n"
+		"the byte ring of the ring engine and the Disruptor ring of --engine=disruptor, and\n"
+		"reports the mean enqueue-to-dequeue latency and the ring bytes each record takes\n"
+		"(the byte ring holds %d bytes, the Disruptor %d slots, %d for records over %d bytes);\n"
+		"for fixed-size packets, also times an enqueue and a dequeue in one thread through\n"
+		"the byte ring and the slot ring of --slot-ring; last, reports the percentiles of\n"
+		"the enqueue time into a %d MiB byte ring and the page faults taken meanwhile\n"
+		"Options:\n"
+		"  --records <n>          records handed over (default %lu)\n"
+		"  --size <n>             bytes per record, header included (default %d)\n"
+		"  --imix                 64, 576 and 1500-byte records in the IMIX mix of\n"
+		"                         gen_packets.py --varlen instead\n"
+		"  --realtime             lock and prefault memory as the firewall's --realtime does\n",
+		prog, RING_SZ, PIPELINE_SLOTS, PIPELINE_SLOTS_LARGE, PKT_SZ, LATENCY_RING_SZ >> 20,
+		DEFAULT_RECORDS, PKT_SZ);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Every record starts with the time it was enqueued at
+static void *ring_consumer(void *arg)
+{
+	struct handoff *h = arg;
+	char rec[PKT_MAX_SZ];
+	double sent;
+	ssize_t len;
+
+	for (unsigned long i = 0; i < h->records; i++) {
+		// As next_packet() does: the ring only dequeues what it holds
+		pthread_mutex_lock(&h->mutex);
+		while (h->ring.len == 0)
+			pthread_cond_wait(&h->ring.not_empty, &h->mutex);
+		len = ring_buffer_dequeue_rec(&h->ring, rec, sizeof(rec));
+		pthread_mutex_unlock(&h->mutex);
+		DIE(len < (ssize_t)sizeof(sent), "ring_buffer_dequeue_rec");
+		memcpy(&sent, rec, sizeof(sent));
+		h->latency += now() - sent;
+		h->bytes += RING_REC_SPAN(len);
+	}
+
+	return NULL;
+}
+
+static void run_ring(const char *name, const size_t *sizes, unsigned long records)
+{
+	struct handoff h = { .records = records, .mutex = PTHREAD_MUTEX_INITIALIZER };
+	char rec[PKT_MAX_SZ] = { 0 };
+	pthread_t consumer;
+	double start, secs;
+
+	DIE(ring_buffer_init(&h.ring, RING_SZ) < 0, "ring_buffer_init");
+	DIE(pthread_create(&consumer, NULL, ring_consumer, &h) != 0, "pthread_create");
+
+	start = now();
+	for (unsigned long i = 0; i < records; i++) {
+		double sent = now();
+
+		memcpy(rec, &sent, sizeof(sent));
+		DIE(ring_buffer_enqueue_rec(&h.ring, rec, sizes[i]) < 0, "ring_buffer_enqueue_rec");
+	}
+	pthread_join(consumer, NULL);
+	secs = now() - start;
+
+	printf("%-10s %6.1f M rec/s, mean enqueue-to-dequeue %7.1f us, %5.1f ring bytes/rec\n",
+	       name, records / secs / 1e6, h.latency / records * 1e6, (double)h.bytes / records);
+	ring_buffer_destroy(&h.ring);
+}
+
+// Slots hold the record length, then the record, which starts with its publication time
+static void *disruptor_consumer(void *arg)
+{
+	struct handoff *h = arg;
+	so_barrier_t barrier = { .d = &h->d };
+	unsigned long next = 0, avail;
+	double sent;
+
+	while ((avail = barrier_wait(&barrier, next)) > next) {
+		for (unsigned long seq = next; seq < avail; seq++) {
+			const char *slot = disruptor_slot(&h->d, seq);
+
+			memcpy(&sent, slot + sizeof(size_t), sizeof(sent));
+			h->latency += now() - sent;
+		}
+		seq_set(&h->seq, avail);
+		next = avail;
+	}
+
+	return NULL;
+}
+
+static void run_disruptor(const char *name, const size_t *sizes, unsigned long records,
+			  size_t max_size)
+{
+	struct handoff h = { .records = records };
+	char rec[PKT_MAX_SZ] = { 0 };
+	pthread_t consumer;
+	double start, secs;
+
+	// Sized as the pipeline sizes its ring for the input
+	DIE(disruptor_init(&h.d, max_size <= PKT_SZ ? PIPELINE_SLOTS : PIPELINE_SLOTS_LARGE,
+			   sizeof(size_t) + max_size) < 0, "disruptor_init");
+	disruptor_add_gating(&h.d, &h.seq);
+	DIE(pthread_create(&consumer, NULL, disruptor_consumer, &h) != 0, "pthread_create");
+
+	start = now();
+	for (unsigned long i = 0; i < records; i++) {
+		unsigned long seq = disruptor_claim(&h.d);
+		char *slot = disruptor_slot(&h.d, seq);
+		double sent = now();
+
+		memcpy(rec, &sent, sizeof(sent));
+		memcpy(slot, &sizes[i], sizeof(size_t));
+		memcpy(slot + sizeof(size_t), rec, sizes[i]);
+		disruptor_publish(&h.d, seq);
+	}
+	disruptor_finish(&h.d);
+	pthread_join(consumer, NULL);
+	secs = now() - start;
+
+	printf("%-10s %6.1f M rec/s, mean enqueue-to-dequeue %7.1f us, %5.1f ring bytes/rec\n",
+	       name, records / secs / 1e6, h.latency / records * 1e6, (double)h.d.slot_size);
+	disruptor_destroy(&h.d);
+}
+
+// Enqueue then dequeue of one packet in the same thread: the cost of the ring itself
+static void run_one_thread(unsigned long records)
+{
+	static so_pkt_ring_t slot_ring;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	so_ring_buffer_t ring;
+	so_packet_t pkt = { 0 };
+	double start, byte_secs, slot_secs;
+
+	DIE(ring_buffer_init(&ring, RING_SZ) < 0, "ring_buffer_init");
+	start = now();
+	for (unsigned long i = 0; i < records; i++) {
+		pkt.hdr.timestamp = i;
+		DIE(ring_buffer_enqueue_rec(&ring, &pkt, PKT_SZ) < 0, "ring_buffer_enqueue_rec");
+		pthread_mutex_lock(&mutex);
+		DIE(ring_buffer_dequeue_rec(&ring, &pkt, PKT_SZ) != PKT_SZ, "ring_buffer_dequeue_rec");
+		pthread_mutex_unlock(&mutex);
+	}
+	byte_secs = now() - start;
+	ring_buffer_destroy(&ring);
+
+	so_pkt_ring_init(&slot_ring);
+	start = now();
+	for (unsigned long i = 0; i < records; i++) {
+		pkt.hdr.timestamp = i;
+		so_pkt_ring_push(&slot_ring, &pkt);
+		DIE(so_pkt_ring_pop(&slot_ring, &pkt) < 0, "so_pkt_ring_pop");
+	}
+	slot_secs = now() - start;
+	so_pkt_ring_destroy(&slot_ring);
+
+	printf("one thread: byte ring %.1f ns, slot ring %.1f ns per enqueue and dequeue\n",
+	       byte_secs * 1e9 / records, slot_secs * 1e9 / records);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Each enqueue timed on its own, with the consumer draining the ring meanwhile
+static void run_latency(const size_t *sizes, unsigned long records)
+{
+	static const double percentiles[] = { 50, 99, 99.9, 99.99 };
+	struct handoff h = { .records = records, .mutex = PTHREAD_MUTEX_INITIALIZER };
+	char rec[PKT_MAX_SZ] = { 0 };
+	struct rusage before, after;
+	pthread_t consumer;
+	double *lat;
+
+	lat = malloc(records * sizeof(*lat));
+	DIE(lat == NULL, "malloc");
+	realtime_prefault(lat, records * sizeof(*lat));
+	DIE(ring_buffer_init(&h.ring, LATENCY_RING_SZ) < 0, "ring_buffer_init");
+	DIE(pthread_create(&consumer, NULL, ring_consumer, &h) != 0, "pthread_create");
+
+	getrusage(RUSAGE_SELF, &before);
+	for (unsigned long i = 0; i < records; i++) {
+		double sent = now();
+
+		memcpy(rec, &sent, sizeof(sent));
+		DIE(ring_buffer_enqueue_rec(&h.ring, rec, sizes[i]) < 0, "ring_buffer_enqueue_rec");
+		lat[i] = now() - sent;
+	}
+	pthread_join(consumer, NULL);
+	getrusage(RUSAGE_SELF, &after);
+
+	qsort(lat, records, sizeof(*lat), cmp_double);
+	printf("enqueue into %d MiB: %ld page faults", LATENCY_RING_SZ >> 20,
+	       after.ru_minflt - before.ru_minflt);
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		printf(", p%g %.0f ns", percentiles[i],
+		       lat[(unsigned long)(percentiles[i] / 100 * (records - 1))] * 1e9);
+	printf("\n");
+
+	ring_buffer_destroy(&h.ring);
+	free(lat);
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long records = DEFAULT_RECORDS, bytes = 0;
+	size_t *sizes, size = PKT_SZ, max_size = 0;
+	int opt, mix = 0;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_RECORDS:
+			records = parse_count(optarg);
+			break;
+		case OPT_SIZE:
+			size = parse_count(optarg);
+			break;
+		case OPT_IMIX:
+			mix = 1;
+			break;
+		case OPT_REALTIME:
+			realtime_init(0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || records == 0 || size < sizeof(double) || size > PKT_MAX_SZ)
+		usage(argv[0]);
+
+	// Drawn up front, so that the producer loop only enqueues
+	sizes = malloc(records * sizeof(*sizes));
+	DIE(sizes == NULL, "malloc");
+	srand(1);
+	for (unsigned long i = 0; i < records; i++) {
+		int w = rand() % IMIX_WEIGHTS;
+		size_t k = 0;
+
+		while (mix && w >= imix[k].weight)
+			w -= imix[k++].weight;
+		sizes[i] = mix ? imix[k].size : size;
+		bytes += sizes[i];
+		if (sizes[i] > max_size)
+			max_size = sizes[i];
+	}
+
+	printf("%lu records, %.1f bytes each on average\n", records, (double)bytes / records);
+	fflush(stdout);
+	run_ring("byte ring", sizes, records);
+	fflush(stdout);
+	run_disruptor("disruptor", sizes, records, max_size);
+	if (max_size == PKT_SZ && !mix)
+		run_one_thread(records);
+	fflush(stdout);
+	run_latency(sizes, records);
+
+	free(sizes);
+
+	return 0;
+}
@@ -0,0 +1,406 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rtc.h"
+#include "producer.h"
+#include "uring.h"
+#include "dio.h"
+#include "lockprof.h"
+#include "realtime.h"
+#include "membudget.h"
+#include "utils.h"
+
+#define RTC_OUT_SZ (RTC_CHUNK_PKTS * PKT_LINE_SZ)
+
+// A worker's buffers: two chunks in and their lines out, for the memory budget
+#define WORKER_MEM (2 * (RTC_CHUNK_SZ + RTC_OUT_SZ))
+
+// user_data of the completions: the kind of request and the buffer it used
+#define RTC_READ 0
+#define RTC_WRITE 2
+
+// State shared by the workers: where the next chunk in input order goes
+struct rtc_shared {
+	int in_fd;
+	int out_fd;
+	int num_workers;
+	size_t in_size;
+	size_t num_chunks;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t placed;
+	size_t next_chunk;
+	off_t next_off;
+
+	// Timestamp checks across chunk boundaries, see report_timestamps() in consumer.c
+	unsigned long last_timestamp;
+	unsigned long dup_timestamps;
+	unsigned long regressed_timestamps;
+};
+
+struct rtc_worker {
+	struct rtc_shared *sh;
+	int id;
+	pthread_t tid;
+
+	so_uring_t ring;
+	int use_uring;
+	unsigned int inflight;
+
+	// Double buffered: the next chunk is read while the current one is processed
+	char *in[2];
+	size_t in_len[2];
+	off_t in_off[2];
+	int in_ready[2];
+
+	char *out[2];
+	size_t out_len[2];
+	off_t out_off[2];
+	int out_busy[2];
+
+	unsigned long dup_timestamps;
+	unsigned long regressed_timestamps;
+};
+
+static size_t chunk_len(struct rtc_shared *sh, size_t chunk)
+{
+	size_t off = chunk * RTC_CHUNK_SZ;
+
+	return sh->in_size - off < RTC_CHUNK_SZ ? sh->in_size - off : RTC_CHUNK_SZ;
+}
+
+static void full_pread(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	for (size_t done = 0; done < len; done += rc) {
+		rc = pread(fd, buf + done, len - done, off + done);
+		DIE(rc < 0, "pread");
+		DIE(rc == 0, "packet truncated");
+	}
+}
+
+static void full_pwrite(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	for (size_t done = 0; done < len; done += rc) {
+		rc = pwrite(fd, buf + done, len - done, off + done);
+		DIE(rc <= 0, "pwrite");
+	}
+}
+
+// Handles the completions available, waiting for at least one if `wait` is set
+static void worker_reap(struct rtc_worker *w, int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned long kind, slot;
+	ssize_t rc;
+
+	if (wait && w->inflight)
+		DIE(uring_submit(&w->ring, 1) < 0, "io_uring_enter");
+
+	while ((cqe = uring_peek_cqe(&w->ring)) != NULL) {
+		kind = cqe->user_data & ~1UL;
+		slot = cqe->user_data & 1;
+		rc = cqe->res;
+		uring_cqe_seen(&w->ring);
+		w->inflight--;
+
+		if (rc < 0)
+			errno = -rc;
+
+		// Short transfers are finished synchronously
+		if (kind == RTC_READ) {
+			DIE(rc < 0, "io_uring read");
+			if ((size_t)rc < w->in_len[slot])
+				full_pread(w->sh->in_fd, w->in[slot] + rc, w->in_len[slot] - rc,
+					   w->in_off[slot] + rc);
+			w->in_ready[slot] = 1;
+		} else {
+			DIE(rc < 0, "io_uring write");
+			if ((size_t)rc < w->out_len[slot])
+				full_pwrite(w->sh->out_fd, w->out[slot] + rc, w->out_len[slot] - rc,
+					    w->out_off[slot] + rc);
+			w->out_busy[slot] = 0;
+		}
+	}
+}
+
+static void worker_submit(struct rtc_worker *w, int op, int fd, void *buf, size_t len,
+			  off_t off, unsigned long user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	// At most two reads and two writes are in flight, the ring has room for them
+	sqe = uring_get_sqe(&w->ring);
+	uring_prep_rw(sqe, op, fd, buf, len, off, user_data);
+	w->inflight++;
+	DIE(uring_submit(&w->ring, 0) < 0, "io_uring_enter");
+}
+
+static void start_read(struct rtc_worker *w, size_t chunk, int slot)
+{
+	w->in_len[slot] = chunk_len(w->sh, chunk);
+	w->in_off[slot] = chunk * RTC_CHUNK_SZ;
+	w->in_ready[slot] = 0;
+
+	if (w->use_uring)
+		worker_submit(w, IORING_OP_READ, w->sh->in_fd, w->in[slot], w->in_len[slot],
+			      w->in_off[slot], RTC_READ | slot);
+}
+
+static void wait_read(struct rtc_worker *w, int slot)
+{
+	if (!w->use_uring) {
+		full_pread(w->sh->in_fd, w->in[slot], w->in_len[slot], w->in_off[slot]);
+		return;
+	}
+
+	while (!w->in_ready[slot])
+		worker_reap(w, 1);
+}
+
+static void start_write(struct rtc_worker *w, int slot)
+{
+	if (!w->use_uring) {
+		full_pwrite(w->sh->out_fd, w->out[slot], w->out_len[slot], w->out_off[slot]);
+		return;
+	}
+
+	w->out_busy[slot] = 1;
+	worker_submit(w, IORING_OP_WRITE, w->sh->out_fd, w->out[slot], w->out_len[slot],
+		      w->out_off[slot], RTC_WRITE | slot);
+}
+
+static void wait_write(struct rtc_worker *w, int slot)
+{
+	while (w->out_busy[slot])
+		worker_reap(w, 1);
+}
+
+// Classifies, hashes and formats a chunk into an output buffer, entirely in this worker's cache
+static void process_chunk(struct rtc_worker *w, int in_slot, int out_slot,
+			  unsigned long *first_ts, unsigned long *last_ts)
+{
+	size_t n = w->in_len[in_slot] / PKT_SZ;
+	char *out = w->out[out_slot];
+	size_t len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const so_packet_t *pkt = (const so_packet_t *)(w->in[in_slot] + i * PKT_SZ);
+		so_action_t action = process_packet(pkt);
+		unsigned long hash;
+
+		packet_prefetch_owner(pkt, i + 1 < n ? pkt + 1 : NULL);
+		hash = packet_hash(pkt);
+
+		if (i == 0) {
+			*first_ts = pkt->hdr.timestamp;
+		} else if (pkt->hdr.timestamp == *last_ts) {
+			w->dup_timestamps++;
+		} else if (pkt->hdr.timestamp < *last_ts) {
+			w->regressed_timestamps++;
+		}
+		*last_ts = pkt->hdr.timestamp;
+
+		len += packet_format(out + len, action, hash, pkt, packet_owner(pkt));
+	}
+
+	w->out_len[out_slot] = len;
+}
+
+// Waits for the chunks before `chunk` to be placed and reserves its range of the log
+static void place_chunk(struct rtc_worker *w, size_t chunk, int slot,
+			unsigned long first_ts, unsigned long last_ts)
+{
+	struct rtc_shared *sh = w->sh;
+
+	so_mutex_lock(&sh->mutex);
+	while (sh->next_chunk != chunk)
+		so_cond_wait(&sh->placed, &sh->mutex);
+
+	w->out_off[slot] = sh->next_off;
+	sh->next_off += w->out_len[slot];
+
+	if (chunk > 0) {
+		if (first_ts == sh->last_timestamp)
+			sh->dup_timestamps++;
+		else if (first_ts < sh->last_timestamp)
+			sh->regressed_timestamps++;
+	}
+	sh->last_timestamp = last_ts;
+
+	sh->next_chunk++;
+	pthread_cond_broadcast(&sh->placed);
+	so_mutex_unlock(&sh->mutex);
+}
+
+static void *worker_loop(void *arg)
+{
+	struct rtc_worker *w = arg;
+	struct rtc_shared *sh = w->sh;
+	unsigned long first_ts = 0, last_ts = 0;
+	size_t chunk = w->id, next;
+	int slot = 0;
+
+	if (chunk < sh->num_chunks)
+		start_read(w, chunk, slot);
+
+	for (; chunk < sh->num_chunks; chunk = next, slot ^= 1) {
+		next = chunk + sh->num_workers;
+		if (next < sh->num_chunks)
+			start_read(w, next, slot ^ 1);
+
+		wait_read(w, slot);
+		wait_write(w, slot);
+		process_chunk(w, slot, slot, &first_ts, &last_ts);
+		place_chunk(w, chunk, slot, first_ts, last_ts);
+		start_write(w, slot);
+	}
+
+	wait_write(w, 0);
+	wait_write(w, 1);
+
+	so_mutex_lock(&sh->mutex);
+	sh->dup_timestamps += w->dup_timestamps;
+	sh->regressed_timestamps += w->regressed_timestamps;
+	so_mutex_unlock(&sh->mutex);
+
+	return NULL;
+}
+
+static void worker_init(struct rtc_worker *w, struct rtc_shared *sh, int id)
+{
+	memset(w, 0, sizeof(*w));
+	w->sh = sh;
+	w->id = id;
+
+	DIE(membudget_charge(MEM_IO, WORKER_MEM) < 0,
+	    "memory limit: rtc worker buffers");
+	for (int i = 0; i < 2; i++) {
+		DIE(posix_memalign((void **)&w->in[i], DIO_ALIGN, RTC_CHUNK_SZ) != 0, "posix_memalign");
+		DIE(posix_memalign((void **)&w->out[i], DIO_ALIGN, RTC_OUT_SZ) != 0, "posix_memalign");
+		realtime_prefault(w->in[i], RTC_CHUNK_SZ);
+		realtime_prefault(w->out[i], RTC_OUT_SZ);
+	}
+
+	w->use_uring = uring_init(&w->ring, 4) == 0;
+	if (!w->use_uring && id == 0)
+		log_warn("io_uring unavailable (%s), using pread()/pwrite()", strerror(errno));
+}
+
+static void worker_destroy(struct rtc_worker *w)
+{
+	if (w->use_uring)
+		uring_exit(&w->ring);
+	for (int i = 0; i < 2; i++) {
+		free(w->in[i]);
+		free(w->out[i]);
+	}
+	membudget_release(MEM_IO, WORKER_MEM);
+}
+
+// Pins worker `id` to the id-th CPU the process may run on
+static void worker_pin(struct rtc_worker *w)
+{
+	cpu_set_t allowed, one;
+	int ncpus, cpu, seen = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+	ncpus = CPU_COUNT(&allowed);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && seen++ == w->id % ncpus)
+			break;
+	}
+
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	pthread_setaffinity_np(w->tid, sizeof(one), &one);
+}
+
+int rtc_run(const char *in_file, const char *out_file, int num_workers)
+{
+	struct rtc_shared sh;
+	struct rtc_worker *workers;
+	int wanted = num_workers;
+	struct stat st;
+
+	memset(&sh, 0, sizeof(sh));
+
+	// Only fixed-size packets can be cut into chunks without parsing
+	switch (input_is_fixed(in_file)) {
+	case -1:
+		return -1;
+	case 0:
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	sh.in_fd = open(in_file, O_RDONLY);
+	if (sh.in_fd < 0)
+		return -1;
+
+	DIE(fstat(sh.in_fd, &st) < 0, "fstat");
+	DIE(st.st_size % PKT_SZ, "packet truncated");
+	sh.in_size = st.st_size;
+	sh.num_chunks = (sh.in_size + RTC_CHUNK_SZ - 1) / RTC_CHUNK_SZ;
+
+	// Fewer workers under a memory limit: their chunk buffers cannot shrink
+	while (num_workers > 1 &&
+	       membudget_fit((size_t)num_workers * WORKER_MEM, 0, 1) < (size_t)num_workers * WORKER_MEM)
+		num_workers--;
+	if (num_workers < wanted)
+		log_info("memory limit: %d rtc workers", num_workers);
+	sh.num_workers = num_workers;
+	posix_fadvise(sh.in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// Chunks are placed at explicit offsets after the current end of the log
+	sh.out_fd = open(out_file, O_WRONLY | O_CREAT, 0777);
+	if (sh.out_fd < 0) {
+		close(sh.in_fd);
+		return -1;
+	}
+	DIE(fstat(sh.out_fd, &st) < 0, "fstat");
+	sh.next_off = st.st_size;
+
+	so_mutex_init(&sh.mutex, "rtc->mutex");
+	pthread_cond_init(&sh.placed, NULL);
+
+	workers = calloc(num_workers, sizeof(*workers));
+	DIE(workers == NULL, "calloc");
+
+	for (int i = 0; i < num_workers; i++) {
+		worker_init(&workers[i], &sh, i);
+		DIE(pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]) != 0,
+		    "pthread_create");
+		worker_pin(&workers[i]);
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].tid, NULL);
+		worker_destroy(&workers[i]);
+	}
+
+	if (sh.dup_timestamps || sh.regressed_timestamps)
+		log_warn("input timestamps: %lu duplicate, %lu regressing",
+			 sh.dup_timestamps, sh.regressed_timestamps);
+
+	free(workers);
+	so_mutex_destroy(&sh.mutex);
+	pthread_cond_destroy(&sh.placed);
+	close(sh.in_fd);
+	close(sh.out_fd);
+
+	return 0;
+}
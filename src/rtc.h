@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_RTC_H__
+#define __SO_RTC_H__
+
+#include "packet.h"
+
+/* Packets per chunk, the unit of work and of output placement. */
+#define RTC_CHUNK_PKTS 4096
+#define RTC_CHUNK_SZ (RTC_CHUNK_PKTS * PKT_SZ)
+
+/**
+ * @brief Run-to-completion engine: filters `in_file` into `out_file` without
+ * the producer and the ring buffer.
+ *
+ * The input is cut into chunks of `RTC_CHUNK_PKTS` packets and worker `i`
+ * owns chunks `i`, `i + num_workers`, ... Each worker is pinned to a CPU and
+ * runs its own io_uring event loop: it reads its next chunk while classifying
+ * and hashing the current one, then writes the log lines at the chunk's file
+ * offset. The only shared state is that offset, handed from chunk to chunk in
+ * input order once per chunk, so the log is identical to the ring engine's.
+ *
+ * Without io_uring the workers fall back to pread() / pwrite().
+ *
+ * @return 0 on success, -1 with `errno` set to ENOTSUP for inputs that cannot
+ *         be cut at fixed offsets (variable-length records and captures), or
+ *         to the error that prevented opening the files.
+ */
+int rtc_run(const char *in_file, const char *out_file, int num_workers);
+
+#endif /* __SO_RTC_H__ */
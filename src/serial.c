@@ -4,15 +4,50 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include "consumer.h"
 #include "packet.h"
+#include "pcap.h"
 #include "utils.h"
 
+static char buffer[PKT_MAX_SZ];
+static so_pcap_t capture;
+
+/* Reads the next packet into `buffer`; returns its length or 0 at end of file. */
+static ssize_t read_packet(int fd, int varlen)
+{
+	unsigned int rec_len;
+	ssize_t sz;
+
+	if (capture.map) {
+		sz = pcap_next(&capture, buffer, PKT_MAX_SZ);
+		DIE(sz < 0, "capture file corrupt");
+		return sz;
+	}
+
+	if (!varlen) {
+		sz = read(fd, buffer, PKT_SZ);
+		DIE(sz != 0 && sz != PKT_SZ, "packet truncated");
+		return sz;
+	}
+
+	sz = read(fd, &rec_len, sizeof(rec_len));
+	if (sz == 0)
+		return 0;
+	DIE(sz != sizeof(rec_len), "packet truncated");
+	DIE(rec_len < sizeof(so_hdr_t) || rec_len > PKT_MAX_SZ, "bad record length");
+
+	sz = read(fd, buffer, rec_len);
+	DIE(sz != rec_len, "packet truncated");
+
+	return sz;
+}
+
 int main(int argc, char **argv)
 {
-	char buffer[PKT_SZ], out_buf[PKT_SZ];
+	char out_buf[PKT_SZ];
 	ssize_t sz;
-	int in_fd, out_fd, len;
+	int in_fd, out_fd, len, varlen;
 
 	if (argc < 3) {
 		fprintf(stderr, "Usage %s <input-file> <output-file>\n", argv[0]);
@@ -25,13 +60,19 @@ int main(int argc, char **argv)
 	out_fd = open(argv[2], O_RDWR|O_CREAT|O_TRUNC, 0666);
 	DIE(out_fd < 0, "open");
 
-	while ((sz = read(in_fd, buffer, PKT_SZ)) != 0) {
-		DIE(sz != PKT_SZ, "packet truncated");
+	/* Variable-length inputs and captures start with a magic, fixed ones with a packet. */
+	sz = read(in_fd, buffer, PKT_VAR_MAGIC_SZ);
+	varlen = sz == PKT_VAR_MAGIC_SZ && !memcmp(buffer, PKT_VAR_MAGIC, PKT_VAR_MAGIC_SZ);
+	if (pcap_is_capture(buffer, sz))
+		DIE(pcap_open(&capture, in_fd) < 0, "pcap_open");
+	else if (!varlen)
+		lseek(in_fd, 0, SEEK_SET);
 
+	while ((sz = read_packet(in_fd, varlen)) != 0) {
 		struct so_packet_t *pkt = (struct so_packet_t *)buffer;
 
-		int action = process_packet(pkt);
-		unsigned long hash = packet_hash(pkt);
+		int action = process_packet_len(pkt, sz);
+		unsigned long hash = packet_hash_len(pkt, sz);
 		unsigned long timestamp = pkt->hdr.timestamp;
 
 		len = snprintf(out_buf, 256, "%s %016lx %lu\n",
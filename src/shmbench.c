@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include "shmring.h"
+#include "utils.h"
+
+// Records taken from the ring at once, as shmtail does
+#define BATCH 256
+
+#define DEFAULT_RECORDS 20000000UL
+#define RING_NAME_SZ 64
+
+enum {
+	OPT_RECORDS = 256,
+	OPT_SLOTS,
+};
+
+static const struct option long_options[] = {
+	{ "records",	required_argument,	NULL,	OPT_RECORDS },
+	{ "slots",	required_argument,	NULL,	OPT_SLOTS },
+	{ NULL,		0,			NULL,	0 },
+};
+
+// The runs reported: readers attached and what the writer does when one lags
+static const struct {
+	int readers;
+	so_shmring_policy_t policy;
+} runs[] = {
+	{ 0, SHMRING_BLOCK },
+	{ 1, SHMRING_BLOCK },
+	{ 2, SHMRING_BLOCK },
+	{ 4, SHMRING_BLOCK },
+	{ 4, SHMRING_OVERWRITE },
+};
+
+// What a reader process reports back through its pipe
+struct reader_result {
+	unsigned long records;
+	unsigned long lost;
+	unsigned long sum;	// of the hashes read, so that reading them is not optimized out
+	double rate;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options]\n"
+		"Times a writer publishing records into a shared memory ring, with 0, 1, 2 and 4\n"
+		"reader processes under the block policy and 4 under the overwrite policy\n"
+		"Options:\n"
+		"  --records <n>          records published per run (default %lu)\n"
+		"  --slots <n>            records in the ring, a power of two (default %d)\n",
+		prog, DEFAULT_RECORDS, SHMRING_SLOTS);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Body of a reader process: reads and touches every record, like shmtail --count
+static void __attribute__((noreturn)) reader_main(const char *name, int fd)
+{
+	struct reader_result res = { 0 };
+	so_shmring_reader_t r;
+	const so_shm_rec_t *recs;
+	double start = 0;
+	size_t n;
+
+	DIE(shmring_attach(&r, name) < 0, "shmring_attach");
+	while ((n = shmring_read(&r, &recs, BATCH)) > 0) {
+		if (!start)
+			start = now();
+		for (size_t i = 0; i < n; i++)
+			res.sum += recs[i].hash;
+		if (shmring_done(&r, n) == 0)
+			res.records += n;
+	}
+	res.lost = r.lost;
+	res.rate = res.records ? res.records / (now() - start) / 1e6 : 0;
+	shmring_detach(&r);
+
+	DIE(write(fd, &res, sizeof(res)) != sizeof(res), "write");
+	_exit(EXIT_SUCCESS);
+}
+
+static void run(int readers, so_shmring_policy_t policy, unsigned long records, size_t slots)
+{
+	struct reader_result res[SHMRING_MAX_READERS];
+	char name[RING_NAME_SZ], line[256];
+	so_hdr_t hdr = { .source = 1, .dest = 2 };
+	so_shmring_t *ring;
+	double start, secs;
+	int fds[2], len;
+
+	snprintf(name, sizeof(name), "/shmbench.%d", getpid());
+	ring = shmring_create(name, slots, policy);
+	DIE(ring == NULL, "shmring_create");
+	DIE(pipe(fds) < 0, "pipe");
+
+	for (int i = 0; i < readers; i++) {
+		pid_t pid = fork();
+
+		DIE(pid < 0, "fork");
+		if (pid == 0) {
+			close(fds[0]);
+			reader_main(name, fds[1]);
+		}
+	}
+	close(fds[1]);
+	shmring_wait_readers(ring, readers);
+
+	start = now();
+	for (unsigned long i = 0; i < records; i++) {
+		hdr.timestamp = i;
+		shmring_publish(ring, i & 1 ? PASS : DROP, i * 0x9e3779b97f4a7c15UL, &hdr);
+	}
+	secs = now() - start;
+
+	// Destroying the ring ends the readers' streams
+	shmring_destroy(ring);
+	for (int i = 0; i < readers; i++)
+		DIE(read(fds[0], &res[i], sizeof(res[i])) != sizeof(res[i]), "read");
+	close(fds[0]);
+	while (wait(NULL) > 0)
+		;
+
+	len = snprintf(line, sizeof(line), "%d reader%-2s %-9s %6.1f M rec/s (%5.1f ns/rec)",
+		       readers, readers == 1 ? "," : "s,", policy == SHMRING_BLOCK ? "block" : "overwrite",
+		       records / secs / 1e6, secs * 1e9 / records);
+	for (int i = 0; i < readers; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%s %.1f M/s %lu%% lost",
+				i ? "," : ", readers:", res[i].rate, res[i].lost * 100 / records);
+	printf("%s\n", line);
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long records = DEFAULT_RECORDS;
+	size_t slots = SHMRING_SLOTS;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_RECORDS:
+			records = parse_count(optarg);
+			break;
+		case OPT_SLOTS:
+			slots = parse_count(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || records == 0 || slots == 0 || (slots & (slots - 1)))
+		usage(argv[0]);
+
+	printf("%lu records into a %zu-slot ring\n", records, slots);
+	fflush(stdout);
+	for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+		run(runs[i].readers, runs[i].policy, records, slots);
+		fflush(stdout);
+	}
+
+	return 0;
+}
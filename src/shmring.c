@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+#include "utils.h"
+
+static size_t ring_size(uint64_t num_slots)
+{
+	return sizeof(so_shm_hdr_t) + num_slots * sizeof(so_shm_rec_t);
+}
+
+static int process_dead(uint32_t pid)
+{
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+so_shmring_t *shmring_create(const char *name, size_t num_slots, so_shmring_policy_t policy)
+{
+	so_shmring_t *ring;
+	int fd;
+
+	if (num_slots == 0 || (num_slots & (num_slots - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->name = name;
+	ring->map_size = ring_size(num_slots);
+	ring->mask = num_slots - 1;
+
+	// A ring left by a crashed run may still be mapped by readers: start a new object
+	if (shm_unlink(name) < 0 && errno != ENOENT)
+		goto err;
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto err;
+	if (ftruncate(fd, ring->map_size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		goto err;
+	}
+	ring->hdr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr == MAP_FAILED) {
+		shm_unlink(name);
+		goto err;
+	}
+	ring->recs = (so_shm_rec_t *)(ring->hdr + 1);
+
+	ring->hdr->rec_size = sizeof(so_shm_rec_t);
+	ring->hdr->policy = policy;
+	ring->hdr->num_slots = num_slots;
+	ring->hdr->writer_pid = getpid();
+	// Readers check the magic last
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(ring->hdr->magic, SHMRING_MAGIC, SHMRING_MAGIC_SZ);
+
+	return ring;
+err:
+	free(ring);
+	return NULL;
+}
+
+/*
+ * Waits until the slowest attached reader is less than a ring behind `head`,
+ * evicting dead ones, and sets the limit the writer can go to before looking again.
+ */
+static void wait_for_readers(so_shmring_t *ring, uint64_t head)
+{
+	so_shm_hdr_t *hdr = ring->hdr;
+	int waited = 0;
+
+	// Pairs with the fence in shmring_attach(): we see a new reader or it sees our head
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (;;) {
+		uint64_t min = head;
+
+		for (int i = 0; i < SHMRING_MAX_READERS; i++) {
+			struct so_shm_reader_slot *slot = &hdr->readers[i];
+			uint64_t tail;
+
+			if (!__atomic_load_n(&slot->attached, __ATOMIC_ACQUIRE))
+				continue;
+			tail = __atomic_load_n(&slot->tail, __ATOMIC_ACQUIRE);
+			if (head - tail > ring->mask && process_dead(slot->pid)) {
+				__atomic_store_n(&slot->attached, 0, __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+				ring->evicted++;
+				continue;
+			}
+			if (tail < min)
+				min = tail;
+		}
+
+		if (head - min <= ring->mask) {
+			ring->limit = min + ring->mask + 1;
+			return;
+		}
+
+		if (!waited++)
+			ring->waits++;
+		usleep(SHMRING_POLL_US);
+	}
+}
+
+void shmring_publish(so_shmring_t *ring, so_action_t action, unsigned long hash,
+		     const so_hdr_t *pkt)
+{
+	so_shm_hdr_t *hdr = ring->hdr;
+	uint64_t head = hdr->head;
+	so_shm_rec_t *rec;
+
+	if (hdr->policy == SHMRING_BLOCK && head >= ring->limit)
+		wait_for_readers(ring, head);
+
+	/*
+	 * The slot may be read as we write it: keep these stores after the one of
+	 * the previous head, which tells readers of its last record it is gone.
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec = &ring->recs[head & ring->mask];
+	rec->hash = hash;
+	rec->timestamp = pkt->timestamp;
+	rec->source = pkt->source;
+	rec->dest = pkt->dest;
+	rec->action = action;
+	__atomic_store_n(&hdr->head, head + 1, __ATOMIC_RELEASE);
+
+	ring->published++;
+}
+
+void shmring_wait_readers(so_shmring_t *ring, int n)
+{
+	for (;;) {
+		int attached = 0;
+
+		for (int i = 0; i < SHMRING_MAX_READERS; i++)
+			attached += __atomic_load_n(&ring->hdr->readers[i].attached, __ATOMIC_ACQUIRE);
+		if (attached >= n)
+			return;
+		usleep(SHMRING_POLL_US);
+	}
+}
+
+void shmring_destroy(so_shmring_t *ring)
+{
+	__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+
+	log_info("shm ring %s: %lu records published, %lu waits for readers, %lu dead readers evicted",
+		 ring->name, ring->published, ring->waits, ring->evicted);
+
+	// Attached readers keep their mapping until they are done with it
+	shm_unlink(ring->name);
+	munmap(ring->hdr, ring->map_size);
+	free(ring);
+}
+
+int shmring_attach(so_shmring_reader_t *r, const char *name)
+{
+	so_shm_hdr_t *hdr;
+	struct stat st;
+	uint32_t pid = getpid();
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return -1;
+	r->hdr = hdr;
+	r->map_size = st.st_size;
+
+	if (memcmp(hdr->magic, SHMRING_MAGIC, SHMRING_MAGIC_SZ) ||
+	    hdr->rec_size != sizeof(so_shm_rec_t) ||
+	    hdr->num_slots == 0 || (hdr->num_slots & (hdr->num_slots - 1)) ||
+	    ring_size(hdr->num_slots) != r->map_size) {
+		errno = EINVAL;
+		goto err;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	r->recs = (so_shm_rec_t *)(hdr + 1);
+	r->mask = hdr->num_slots - 1;
+
+	// Take a free slot, or one left by a reader that died
+	for (int i = 0; i < SHMRING_MAX_READERS && !r->slot; i++) {
+		struct so_shm_reader_slot *slot = &hdr->readers[i];
+		uint32_t cur = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+
+		if (cur && !process_dead(cur))
+			continue;
+		if (cur)
+			__atomic_store_n(&slot->attached, 0, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&slot->pid, &cur, pid, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			r->slot = slot;
+	}
+	if (!r->slot) {
+		errno = EBUSY;
+		goto err;
+	}
+
+	/*
+	 * A writer that scanned the slots before we show up has set its limit from
+	 * a head we see after the fence; starting from there, it cannot lap us.
+	 */
+	r->tail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&r->slot->tail, r->tail, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->slot->attached, 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	r->tail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&r->slot->tail, r->tail, __ATOMIC_RELEASE);
+
+	return 0;
+err:
+	munmap(hdr, r->map_size);
+	r->hdr = NULL;
+	return -1;
+}
+
+size_t shmring_read(so_shmring_reader_t *r, const so_shm_rec_t **recs, size_t max)
+{
+	so_shm_hdr_t *hdr = r->hdr;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		uint64_t n;
+
+		if (head > r->tail) {
+			// Lapped while away: only the records after head - num_slots are still whole
+			if (hdr->policy == SHMRING_OVERWRITE && head - r->tail > r->mask) {
+				r->lost += head - r->mask - r->tail;
+				r->tail = head - r->mask;
+			}
+			n = head - r->tail;
+			if (n > max)
+				n = max;
+			// Up to the end of the ring, the rest comes with the next call
+			if (n > r->mask + 1 - (r->tail & r->mask))
+				n = r->mask + 1 - (r->tail & r->mask);
+			*recs = &r->recs[r->tail & r->mask];
+			return n;
+		}
+
+		// The head is loaded again after `closed` for the records published before it
+		if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) || process_dead(hdr->writer_pid)) {
+			if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == r->tail)
+				return 0;
+			continue;
+		}
+
+		usleep(SHMRING_POLL_US);
+	}
+}
+
+int shmring_done(so_shmring_reader_t *r, size_t n)
+{
+	uint64_t head, oldest;
+
+	// Under SHMRING_BLOCK the writer waits for our tail instead
+	if (r->hdr->policy == SHMRING_OVERWRITE) {
+		// Whatever was read above comes before this check of the head
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+
+		// Record i's slot may be rewritten from the time head reaches i + num_slots
+		oldest = head > r->mask ? head - r->mask : 0;
+		if (r->tail < oldest) {
+			if (oldest < r->tail + n)
+				oldest = r->tail + n;
+			r->lost += oldest - r->tail;
+			r->tail = oldest;
+			__atomic_store_n(&r->slot->tail, r->tail, __ATOMIC_RELEASE);
+			return -1;
+		}
+	}
+
+	r->tail += n;
+	__atomic_store_n(&r->slot->tail, r->tail, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void shmring_detach(so_shmring_reader_t *r)
+{
+	__atomic_store_n(&r->slot->attached, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->slot->pid, 0, __ATOMIC_RELEASE);
+	munmap(r->hdr, r->map_size);
+	r->hdr = NULL;
+}
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_SHMRING_H__
+#define __SO_SHMRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "packet.h"
+
+/* First 8 bytes of the shared memory object. */
+#define SHMRING_MAGIC "SOSHMRG1"
+#define SHMRING_MAGIC_SZ 8
+
+/* Default number of records (a power of two) and the readers that can attach at once. */
+#define SHMRING_SLOTS 65536
+#define SHMRING_MAX_READERS 16
+
+/* Sleep between polls of a writer waiting for readers, or a reader for records. */
+#define SHMRING_POLL_US 50
+
+#define SHMRING_CACHE_LINE 64
+
+typedef enum {
+	SHMRING_BLOCK = 0,	/* the writer waits for the slowest reader */
+	SHMRING_OVERWRITE,	/* the writer never waits; lagging readers lose records */
+} so_shmring_policy_t;
+
+/* One packet as published, 32 bytes in host byte order. */
+typedef struct so_shm_rec_t {
+	uint64_t hash;
+	uint64_t timestamp;
+	uint32_t source;
+	uint32_t dest;
+	uint32_t action;	/* so_action_t */
+	uint32_t reserved;
+} so_shm_rec_t;
+
+struct so_shm_reader_slot {
+	uint32_t pid;		/* of the attached reader, 0 for a free slot */
+	uint32_t attached;	/* set once `tail` is valid */
+	uint64_t tail;		/* records consumed */
+} __attribute__((aligned(SHMRING_CACHE_LINE)));
+
+/**
+ * @brief Header of the shared memory object, followed by the records.
+ *
+ * Record i lives in slot i % num_slots. The writer fills the slot of `head`,
+ * then advances `head` with a release store, so a reader may use every record
+ * below the `head` it loaded. Under SHMRING_OVERWRITE the writer may have
+ * started on a record's slot again once `head` reaches record + num_slots: a
+ * reader checks `head` again after reading and discards what it read if so.
+ * Under SHMRING_BLOCK the writer does not go that far past the `tail` of any
+ * attached reader, and evicts readers whose process has died.
+ */
+typedef struct so_shm_hdr_t {
+	char magic[SHMRING_MAGIC_SZ];
+	uint32_t rec_size;
+	uint32_t policy;
+	uint64_t num_slots;
+	uint32_t writer_pid;
+	uint32_t closed;	/* set after the last record */
+
+	uint64_t head __attribute__((aligned(SHMRING_CACHE_LINE)));
+
+	struct so_shm_reader_slot readers[SHMRING_MAX_READERS];
+} so_shm_hdr_t;
+
+/**
+ * @brief Writer side of a ring of packet records in POSIX shared memory,
+ * which other processes attach to with shmring_attach() and read in place.
+ */
+typedef struct so_shmring_t {
+	const char *name;
+	so_shm_hdr_t *hdr;
+	so_shm_rec_t *recs;
+	size_t map_size;
+	uint64_t mask;
+
+	/* SHMRING_BLOCK: head the writer can reach without looking at the readers again */
+	uint64_t limit;
+
+	unsigned long published;
+	unsigned long waits;	/* publishes that had to wait for a reader */
+	unsigned long evicted;	/* readers found dead while waited for */
+} so_shmring_t;
+
+/**
+ * @brief Creates the shared memory object `name` (e.g. `/firewall`), replacing
+ * any left over by an earlier run.
+ *
+ * @return The ring, or NULL with `errno` set (EINVAL when `num_slots` is not a
+ *         power of two).
+ */
+so_shmring_t *shmring_create(const char *name, size_t num_slots, so_shmring_policy_t policy);
+
+/* Publishes one record; called by one thread at a time, in log order. */
+void shmring_publish(so_shmring_t *ring, so_action_t action, unsigned long hash,
+		     const so_hdr_t *hdr);
+
+/* Waits until `n` readers are attached, so that none misses the first records. */
+void shmring_wait_readers(so_shmring_t *ring, int n);
+
+/* Marks the ring closed so readers finish, unlinks its name and logs its counters. */
+void shmring_destroy(so_shmring_t *ring);
+
+typedef struct so_shmring_reader_t {
+	so_shm_hdr_t *hdr;
+	so_shm_rec_t *recs;
+	size_t map_size;
+	uint64_t mask;
+	struct so_shm_reader_slot *slot;
+	uint64_t tail;
+	uint64_t lost;		/* records overwritten before they were read */
+} so_shmring_reader_t;
+
+/**
+ * @brief Maps the ring `name` and takes a reader slot, starting from the
+ * records published after this call.
+ *
+ * @return 0, or -1 with `errno` set (EINVAL for an object that is not a ring,
+ *         EBUSY when every reader slot is taken).
+ */
+int shmring_attach(so_shmring_reader_t *r, const char *name);
+
+/**
+ * @brief Waits for records and points `*recs` at up to `max` of them, in place.
+ *
+ * @return The number of records, contiguous in memory, or 0 once the writer
+ *         has closed the ring (or died) and everything was read.
+ */
+size_t shmring_read(so_shmring_reader_t *r, const so_shm_rec_t **recs, size_t max);
+
+/**
+ * @brief Consumes the `n` records of the last shmring_read().
+ *
+ * @return 0, or -1 if the writer overwrote some of them while they were being
+ *         read (SHMRING_OVERWRITE only): the reader must discard them, and
+ *         continues from the oldest record still in the ring.
+ */
+int shmring_done(so_shmring_reader_t *r, size_t n);
+
+void shmring_detach(so_shmring_reader_t *r);
+
+#endif /* __SO_SHMRING_H__ */
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "shmring.h"
+#include "utils.h"
+
+// Records taken from the ring at once
+#define BATCH 256
+
+// How long to wait between attempts while the firewall has not created the ring yet
+#define ATTACH_POLL_US 10000
+
+enum {
+	OPT_COUNT = 256,
+	OPT_DELAY_US,
+};
+
+static const struct option long_options[] = {
+	{ "count",	no_argument,		NULL,	OPT_COUNT },
+	{ "delay-us",	required_argument,	NULL,	OPT_DELAY_US },
+	{ NULL,		0,			NULL,	0 },
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options] <ring-name>\n"
+		"Prints the records the firewall publishes with --shm-ring <ring-name>\n"
+		"Options:\n"
+		"  --count                only count the records, and report the rate at the end\n"
+		"  --delay-us <n>         sleep n microseconds after every batch, as a slow reader\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_addr(FILE *f, uint32_t addr)
+{
+	fprintf(f, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+}
+
+int main(int argc, char **argv)
+{
+	so_shmring_reader_t r;
+	const so_shm_rec_t *recs;
+	unsigned long records = 0, discarded = 0;
+	unsigned int delay_us = 0;
+	int count_only = 0, opt;
+	double start = 0;
+	size_t n;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_COUNT:
+			count_only = 1;
+			break;
+		case OPT_DELAY_US:
+			delay_us = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	// Readers are usually started first: wait for the firewall to create the ring
+	while (shmring_attach(&r, argv[optind]) < 0) {
+		DIE(errno != ENOENT, "shmring_attach");
+		usleep(ATTACH_POLL_US);
+	}
+
+	while ((n = shmring_read(&r, &recs, BATCH)) > 0) {
+		if (!start)
+			start = now();
+		if (!count_only) {
+			for (size_t i = 0; i < n; i++) {
+				printf("%s %016lx %lu ", RES_TO_STR(recs[i].action),
+				       (unsigned long)recs[i].hash, (unsigned long)recs[i].timestamp);
+				print_addr(stdout, recs[i].source);
+				putchar(' ');
+				print_addr(stdout, recs[i].dest);
+				putchar('\n');
+			}
+		}
+		// Records overwritten while we read them: what was printed of them is garbage
+		if (shmring_done(&r, n) < 0)
+			discarded += n;
+		else
+			records += n;
+		if (delay_us)
+			usleep(delay_us);
+	}
+
+	fprintf(stderr, "%lu records, %lu lost to the writer (%lu of them after being read)",
+		records, (unsigned long)r.lost, discarded);
+	if (count_only && records)
+		fprintf(stderr, ", %.2f M records/s", records / (now() - start) / 1e6);
+	fputc('\n', stderr);
+
+	shmring_detach(&r);
+
+	return 0;
+}
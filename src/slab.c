@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "slab.h"
+#include "lockprof.h"
+#include "utils.h"
+
+// A free object, linked through its first bytes
+struct free_obj {
+	struct free_obj *next;
+};
+
+struct slab_heap;
+
+// Header at the start of every page: who owns the objects in it
+struct slab_page {
+	struct slab_heap *owner;
+	struct slab_page *next;
+};
+
+#define SLAB_PAGE_HDR 16
+_Static_assert(sizeof(struct slab_page) <= SLAB_PAGE_HDR, "slab page header too large");
+
+// One thread's share of a cache
+struct slab_heap {
+	so_slab_t *slab;
+	struct free_obj *free;		// owner only
+	struct free_obj *returned;	// pushed by other threads, taken by the owner
+	struct slab_page *pages;
+	struct slab_heap *next;
+
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long remote_frees;
+	unsigned long num_pages;
+};
+
+struct so_slab_t {
+	const char *name;
+	size_t obj_size;
+	size_t per_page;
+	int id;
+	unsigned long gen;		// tells a cache from an earlier one with the same id
+	struct timespec created;
+
+	pthread_mutex_t mutex;		// protects `heaps`
+	struct slab_heap *heaps;
+};
+
+static so_slab_t *caches[SLAB_MAX_CACHES];
+static unsigned long caches_gen;
+static pthread_mutex_t caches_mutex;
+
+// Before main(), so that the lock profiler knows the lock by name from its first use
+static void __attribute__((constructor)) caches_mutex_init(void)
+{
+	so_mutex_init(&caches_mutex, "slab_caches_mutex");
+}
+
+static __thread struct {
+	struct slab_heap *heap;
+	unsigned long gen;
+} local_heaps[SLAB_MAX_CACHES];
+
+so_slab_t *slab_create(const char *name, size_t obj_size)
+{
+	so_slab_t *slab = calloc(1, sizeof(*slab));
+
+	if (!slab)
+		return NULL;
+
+	// Objects hold a free-list link and stay 16-byte aligned
+	if (obj_size < sizeof(struct free_obj))
+		obj_size = sizeof(struct free_obj);
+	slab->obj_size = (obj_size + 15) & ~(size_t)15;
+	slab->per_page = (SLAB_PAGE_SZ - SLAB_PAGE_HDR) / slab->obj_size;
+	slab->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &slab->created);
+	so_mutex_init(&slab->mutex, "slab->mutex");
+
+	so_mutex_lock(&caches_mutex);
+	for (slab->id = 0; slab->id < SLAB_MAX_CACHES && caches[slab->id]; slab->id++)
+		;
+	if (slab->id < SLAB_MAX_CACHES) {
+		caches[slab->id] = slab;
+		slab->gen = ++caches_gen;
+	}
+	so_mutex_unlock(&caches_mutex);
+
+	if (slab->id == SLAB_MAX_CACHES || slab->per_page == 0) {
+		slab_destroy(slab);
+		return NULL;
+	}
+
+	return slab;
+}
+
+// The calling thread's heap for `slab`, created on first use
+static struct slab_heap *local_heap(so_slab_t *slab)
+{
+	struct slab_heap *heap;
+
+	if (local_heaps[slab->id].gen == slab->gen)
+		return local_heaps[slab->id].heap;
+
+	heap = calloc(1, sizeof(*heap));
+	DIE(heap == NULL, "calloc");
+	heap->slab = slab;
+
+	so_mutex_lock(&slab->mutex);
+	heap->next = slab->heaps;
+	slab->heaps = heap;
+	so_mutex_unlock(&slab->mutex);
+
+	local_heaps[slab->id].heap = heap;
+	local_heaps[slab->id].gen = slab->gen;
+	return heap;
+}
+
+static void heap_grow(struct slab_heap *heap)
+{
+	so_slab_t *slab = heap->slab;
+	struct slab_page *page;
+	char *obj;
+
+	DIE(posix_memalign((void **)&page, SLAB_PAGE_SZ, SLAB_PAGE_SZ) != 0, "posix_memalign");
+	page->owner = heap;
+	page->next = heap->pages;
+	heap->pages = page;
+	heap->num_pages++;
+
+	// Thread the new objects onto the free list, lowest address first
+	obj = (char *)page + SLAB_PAGE_HDR + (slab->per_page - 1) * slab->obj_size;
+	for (size_t i = 0; i < slab->per_page; i++, obj -= slab->obj_size) {
+		((struct free_obj *)obj)->next = heap->free;
+		heap->free = (struct free_obj *)obj;
+	}
+}
+
+void *slab_alloc(so_slab_t *slab)
+{
+	struct slab_heap *heap = local_heap(slab);
+	struct free_obj *obj;
+
+	// Take back everything other threads returned, then carve a new page
+	if (!heap->free)
+		heap->free = __atomic_exchange_n(&heap->returned, NULL, __ATOMIC_ACQUIRE);
+	if (!heap->free)
+		heap_grow(heap);
+
+	obj = heap->free;
+	heap->free = obj->next;
+	heap->allocs++;
+
+	return obj;
+}
+
+void slab_free(so_slab_t *slab, void *ptr)
+{
+	struct slab_page *page = (struct slab_page *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SZ - 1));
+	struct slab_heap *heap = local_heap(slab);
+	struct slab_heap *owner = page->owner;
+	struct free_obj *obj = ptr;
+
+	heap->frees++;
+
+	if (owner == heap) {
+		obj->next = heap->free;
+		heap->free = obj;
+		return;
+	}
+
+	// Push onto the owner's return stack; the owner only ever takes the whole stack
+	heap->remote_frees++;
+	obj->next = __atomic_load_n(&owner->returned, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->returned, &obj->next, obj, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+void slab_stats(so_slab_t *slab, so_slab_stats_t *stats)
+{
+	struct timespec now;
+
+	memset(stats, 0, sizeof(*stats));
+
+	so_mutex_lock(&slab->mutex);
+	for (struct slab_heap *heap = slab->heaps; heap; heap = heap->next) {
+		stats->allocs += heap->allocs;
+		stats->frees += heap->frees;
+		stats->remote_frees += heap->remote_frees;
+		stats->pages += heap->num_pages;
+	}
+	so_mutex_unlock(&slab->mutex);
+
+	stats->footprint = stats->pages * SLAB_PAGE_SZ;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->seconds = (now.tv_sec - slab->created.tv_sec) +
+			 (now.tv_nsec - slab->created.tv_nsec) / 1e9;
+}
+
+void slab_report(so_slab_t *slab)
+{
+	so_slab_stats_t st;
+
+	slab_stats(slab, &st);
+	log_info("slab %s: %lu allocs (%.0f/s), %lu frees (%lu remote), %lu in use, %zu KiB in %lu pages",
+		 slab->name, st.allocs, st.seconds > 0 ? st.allocs / st.seconds : 0.0, st.frees,
+		 st.remote_frees, st.allocs - st.frees, st.footprint >> 10, st.pages);
+}
+
+void slab_destroy(so_slab_t *slab)
+{
+	struct slab_heap *heap, *next_heap;
+	struct slab_page *page, *next_page;
+
+	so_mutex_lock(&caches_mutex);
+	if (slab->id < SLAB_MAX_CACHES && caches[slab->id] == slab)
+		caches[slab->id] = NULL;
+	so_mutex_unlock(&caches_mutex);
+
+	for (heap = slab->heaps; heap; heap = next_heap) {
+		next_heap = heap->next;
+		for (page = heap->pages; page; page = next_page) {
+			next_page = page->next;
+			free(page);
+		}
+		free(heap);
+	}
+
+	so_mutex_destroy(&slab->mutex);
+	free(slab);
+}
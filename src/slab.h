@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_SLAB_H__
+#define __SO_SLAB_H__
+
+#include <stddef.h>
+
+/* Objects are carved out of pages of this size, aligned to it. */
+#define SLAB_PAGE_SZ (64 << 10)
+
+/* Slab caches alive at once, each thread keeps a heap per cache. */
+#define SLAB_MAX_CACHES 16
+
+typedef struct so_slab_t so_slab_t;
+
+/**
+ * @brief Usage of one cache, summed over all threads.
+ *
+ * Counters are kept per thread without atomics: exact once the threads using
+ * the cache are done, approximate while they run.
+ */
+typedef struct so_slab_stats_t {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long remote_frees;	/* freed by a thread other than the allocating one */
+	unsigned long pages;
+	size_t footprint;		/* bytes of pages held */
+	double seconds;			/* since the cache was created */
+} so_slab_stats_t;
+
+/**
+ * @brief Creates a cache of `obj_size`-byte objects.
+ *
+ * Every thread allocates from its own heap of pages, without locks. An object
+ * freed by its allocating thread goes back on that thread's free list; one
+ * freed by another thread is pushed onto the owner's lock-free return stack,
+ * which the owner takes over in one exchange when its free list runs dry.
+ * Pages are only released by `slab_destroy()`.
+ *
+ * @return The cache, or NULL if `SLAB_MAX_CACHES` are in use or out of memory.
+ */
+so_slab_t *slab_create(const char *name, size_t obj_size);
+
+void *slab_alloc(so_slab_t *slab);
+
+/* Any thread may free any object of the cache. */
+void slab_free(so_slab_t *slab, void *obj);
+
+void slab_stats(so_slab_t *slab, so_slab_stats_t *stats);
+
+/* Logs the statistics of the cache at info level. */
+void slab_report(so_slab_t *slab);
+
+/* Releases every page; no object of the cache may be used afterwards. */
+void slab_destroy(so_slab_t *slab);
+
+#endif /* __SO_SLAB_H__ */
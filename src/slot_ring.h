@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_SLOT_RING_H__
+#define __SO_SLOT_RING_H__
+
+#include <pthread.h>
+
+#include "lockprof.h"
+
+/**
+ * @brief Defines a blocking ring of fixed-size `type` slots.
+ *
+ * `SO_SLOT_RING_DEFINE(name, type, log2_cap)` generates `name_t`, a ring of
+ * `1 << log2_cap` elements, and static inline `name_init()`, `name_push()`,
+ * `name_pop()`, `name_stop()` and `name_destroy()`. The capacity and element
+ * size are compile-time constants, so the compiler inlines fixed-size copies
+ * and index math. `head` and `tail` only ever increase (64-bit, they never
+ * wrap in practice) and slots are found by masking: no modulo, and the number
+ * of elements is simply `head - tail`.
+ *
+ * The ring is large: allocate it rather than putting it on the stack.
+ */
+#define SO_SLOT_RING_DEFINE(name, type, log2_cap)				\
+									\
+typedef struct name##_t {						\
+	unsigned long head;	/* elements pushed */			\
+	unsigned long tail;	/* elements popped */			\
+	int stop;							\
+	pthread_mutex_t mutex;						\
+	pthread_cond_t not_empty;					\
+	pthread_cond_t not_full;					\
+	type slots[1UL << (log2_cap)];					\
+} name##_t;								\
+									\
+enum { name##_mask = (1UL << (log2_cap)) - 1 };			\
+									\
+static inline void name##_init(name##_t *r)				\
+{									\
+	r->head = 0;							\
+	r->tail = 0;							\
+	r->stop = 0;							\
+	so_mutex_init(&r->mutex, #name "->mutex");			\
+	pthread_cond_init(&r->not_empty, NULL);				\
+	pthread_cond_init(&r->not_full, NULL);				\
+}									\
+									\
+/* Copies `item` into the ring, waiting while it is full. */		\
+static inline void name##_push(name##_t *r, const type *item)		\
+{									\
+	so_mutex_lock(&r->mutex);					\
+	while (r->head - r->tail > name##_mask)				\
+		so_cond_wait(&r->not_full, &r->mutex);			\
+	r->slots[r->head & name##_mask] = *item;			\
+	r->head++;							\
+	so_mutex_unlock(&r->mutex);					\
+	pthread_cond_signal(&r->not_empty);				\
+}									\
+									\
+/*									\
+ * Copies the oldest element into `item`, waiting while the ring is	\
+ * empty. Returns its position in push order (0, 1, ...), or -1 once	\
+ * the ring is stopped and empty.					\
+ */									\
+static inline long name##_pop(name##_t *r, type *item)			\
+{									\
+	long seq;							\
+									\
+	so_mutex_lock(&r->mutex);					\
+	while (r->head == r->tail && !r->stop)				\
+		so_cond_wait(&r->not_empty, &r->mutex);			\
+	if (r->head == r->tail) {					\
+		so_mutex_unlock(&r->mutex);				\
+		return -1;						\
+	}								\
+	*item = r->slots[r->tail & name##_mask];			\
+	seq = r->tail++;						\
+	so_mutex_unlock(&r->mutex);					\
+	pthread_cond_signal(&r->not_full);				\
+									\
+	return seq;							\
+}									\
+									\
+/* Wakes up every waiter; pops drain the ring, then fail. */		\
+static inline void name##_stop(name##_t *r)				\
+{									\
+	so_mutex_lock(&r->mutex);					\
+	r->stop = 1;							\
+	so_mutex_unlock(&r->mutex);					\
+	pthread_cond_broadcast(&r->not_empty);				\
+	pthread_cond_broadcast(&r->not_full);				\
+}									\
+									\
+static inline void name##_destroy(name##_t *r)				\
+{									\
+	so_mutex_destroy(&r->mutex);					\
+	pthread_cond_destroy(&r->not_empty);				\
+	pthread_cond_destroy(&r->not_full);				\
+}
+
+#endif /* __SO_SLOT_RING_H__ */
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "srcset.h"
+#include "utils.h"
+
+#define DEFAULT_PROBES 20000000UL
+
+enum {
+	OPT_PROBES = 256,
+};
+
+static const struct option long_options[] = {
+	{ "probes",	required_argument,	NULL,	OPT_PROBES },
+	{ NULL,		0,			NULL,	0 },
+};
+
+// The sets timed: `num` random addresses, or blocks of a random prefix length in [min_bits, max_bits]
+static const struct {
+	const char *name;
+	size_t num;
+	int min_bits;
+	int max_bits;
+} sets[] = {
+	{ "10k random /32", 10000, 32, 32 },
+	{ "1M random /32", 1000000, 32, 32 },
+	{ "10M random /32", 10000000, 32, 32 },
+	{ "100k CIDR /16-/28", 100000, 16, 28 },
+};
+
+// The allowed sources built into packet.c
+static const so_src_range_t builtin[] = {
+	{ 0xf1000000, 0xf1ffffff },
+	{ 0x1f1f1f1f, 0x1f1f1f1f },
+	{ 0x80000000, 0xffffffff },
+};
+
+#define NUM_BUILTIN (sizeof(builtin) / sizeof(builtin[0]))
+
+static const char *const mode_names[] = {
+	[SRCSET_ROARING] = "roaring",
+	[SRCSET_FLAT] = "flat",
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options]\n"
+		"Times srcset_contains() over probes half of which are members, for sets of\n"
+		"random addresses, of random CIDR blocks and of the built-in ranges, stored as\n"
+		"roaring and as flat bitmaps, and reports the memory each holds\n"
+		"Options:\n"
+		"  --probes <n>           lookups per set and mode (default %lu)\n",
+		prog, DEFAULT_PROBES);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+// Even probes fall in a random range, odd ones anywhere
+static void fill_probes(uint32_t *probes, unsigned long num, const so_src_range_t *ranges, size_t n)
+{
+	for (unsigned long i = 0; i < num; i++) {
+		const so_src_range_t *r = &ranges[next_rand() % n];
+
+		probes[i] = i & 1 ? next_rand() : r->start + next_rand() % ((uint64_t)r->end - r->start + 1);
+	}
+}
+
+static void run(const char *name, const so_src_range_t *ranges, size_t n, uint32_t *probes,
+		unsigned long num)
+{
+	char line[256];
+	int len;
+
+	fill_probes(probes, num, ranges, n);
+	len = snprintf(line, sizeof(line), "%-20s", name);
+	for (int mode = SRCSET_ROARING; mode <= SRCSET_FLAT; mode++) {
+		unsigned long hits = 0;
+		double start, secs;
+		so_srcset_t *set;
+
+		set = srcset_build(ranges, n, mode);
+		DIE(set == NULL, "srcset_build");
+
+		start = now();
+		for (unsigned long i = 0; i < num; i++)
+			hits += srcset_contains(set, probes[i]);
+		secs = now() - start;
+
+		len += snprintf(line + len, sizeof(line) - len, "  %s %7.1f MiB %6.1f ns (%lu%% hits)",
+				mode_names[mode], srcset_bytes(set) / 1048576.0, secs * 1e9 / num,
+				hits * 100 / num);
+		srcset_destroy(set);
+	}
+	printf("%s\n", line);
+	fflush(stdout);
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long probes_num = DEFAULT_PROBES;
+	so_src_range_t *ranges;
+	uint32_t *probes;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_PROBES:
+			probes_num = parse_count(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || probes_num == 0)
+		usage(argv[0]);
+
+	probes = malloc(probes_num * sizeof(*probes));
+	DIE(probes == NULL, "malloc");
+
+	printf("%lu probes per set, half of them in a member range\n", probes_num);
+	for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+		ranges = malloc(sets[s].num * sizeof(*ranges));
+		DIE(ranges == NULL, "malloc");
+		for (size_t i = 0; i < sets[s].num; i++) {
+			int bits = sets[s].min_bits + next_rand() % (sets[s].max_bits - sets[s].min_bits + 1);
+			uint32_t host = bits == 32 ? 0 : 0xffffffffU >> bits;
+
+			ranges[i].start = next_rand() & ~host;
+			ranges[i].end = ranges[i].start | host;
+		}
+		run(sets[s].name, ranges, sets[s].num, probes, probes_num);
+		free(ranges);
+	}
+	run("built-in 3 ranges", builtin, NUM_BUILTIN, probes, probes_num);
+
+	free(probes);
+
+	return 0;
+}
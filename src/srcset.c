@@ -0,0 +1,522 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "srcset.h"
+#include "membudget.h"
+#include "utils.h"
+
+#define CHUNK_BITS 16
+#define CHUNK_SZ (1U << CHUNK_BITS)
+#define BITMAP_WORDS (CHUNK_SZ / 64)
+
+// Most runs a chunk can need: every other low value set
+#define CHUNK_MAX_RUNS (CHUNK_SZ / 2)
+
+enum { CT_ARRAY, CT_BITMAP, CT_RUN, CT_NUM };
+
+static const char * const ct_names[CT_NUM] = { "array", "bitmap", "run" };
+
+// Inclusive run of low 16-bit values
+struct run {
+	uint16_t start;
+	uint16_t last;
+};
+
+struct container {
+	int type;
+	uint32_t n;		// values for an array, runs for a run container
+	union {
+		uint16_t *array;
+		uint64_t *bitmap;
+		struct run *runs;
+	};
+};
+
+struct so_srcset_t {
+	so_srcset_mode_t mode;
+	uint64_t cardinality;
+	size_t bytes;
+	size_t charged;		// bytes charged to the memory budget
+
+	// SRCSET_ROARING: containers in key order, found through a direct index on
+	// the high 16 bits instead of a binary search over the keys
+	uint32_t num_containers;
+	int32_t *index;
+	struct container *containers;
+	unsigned long num_type[CT_NUM];
+
+	// SRCSET_FLAT
+	uint64_t *bits;
+};
+
+static int container_contains(const struct container *c, uint16_t low)
+{
+	size_t lo = 0, hi = c->n;
+
+	if (c->type == CT_BITMAP)
+		return (c->bitmap[low >> 6] >> (low & 63)) & 1;
+
+	if (c->type == CT_ARRAY) {
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+
+			if (c->array[mid] < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo < c->n && c->array[lo] == low;
+	}
+
+	// Last run starting at or before `low`
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (c->runs[mid].start <= low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && low <= c->runs[lo - 1].last;
+}
+
+int srcset_contains(const so_srcset_t *set, uint32_t source)
+{
+	int32_t idx;
+
+	if (set->bits)
+		return (set->bits[source >> 6] >> (source & 63)) & 1;
+
+	idx = set->index[source >> CHUNK_BITS];
+	if (idx < 0)
+		return 0;
+
+	return container_contains(&set->containers[idx], (uint16_t)source);
+}
+
+int srcset_ranges_cover(const so_src_range_t *ranges, size_t n, uint32_t source)
+{
+	size_t lo = 0, hi = n;
+
+	// Last range starting at or before the source
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (ranges[mid].start <= source)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 && source <= ranges[lo - 1].end;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const so_src_range_t *ra = a, *rb = b;
+
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+size_t srcset_merge_ranges(so_src_range_t *ranges, size_t n)
+{
+	size_t out = 0;
+
+	if (n == 0)
+		return 0;
+
+	qsort(ranges, n, sizeof(*ranges), range_cmp);
+	for (size_t i = 1; i < n; i++) {
+		so_src_range_t *last = &ranges[out];
+
+		if (last->end == UINT32_MAX || ranges[i].start <= last->end + 1) {
+			if (ranges[i].end > last->end)
+				last->end = ranges[i].end;
+		} else {
+			ranges[++out] = ranges[i];
+		}
+	}
+
+	return out + 1;
+}
+
+// Stores the runs of one chunk in the smallest of the three container types
+static int add_container(so_srcset_t *set, uint16_t key, const struct run *runs, uint32_t nr)
+{
+	struct container *c = &set->containers[set->num_containers];
+	size_t card = 0, run_sz = nr * sizeof(*runs), array_sz, sz;
+
+	for (uint32_t i = 0; i < nr; i++)
+		card += runs[i].last - runs[i].start + 1;
+	array_sz = card <= SRCSET_ARRAY_MAX ? card * sizeof(uint16_t) : SIZE_MAX;
+
+	if (run_sz <= array_sz && run_sz <= BITMAP_WORDS * sizeof(uint64_t)) {
+		c->type = CT_RUN;
+		c->n = nr;
+		sz = run_sz;
+		c->runs = malloc(sz);
+		if (!c->runs)
+			return -1;
+		memcpy(c->runs, runs, sz);
+	} else if (array_sz <= BITMAP_WORDS * sizeof(uint64_t)) {
+		c->type = CT_ARRAY;
+		c->n = card;
+		sz = array_sz;
+		c->array = malloc(sz);
+		if (!c->array)
+			return -1;
+		for (uint32_t i = 0, k = 0; i < nr; i++)
+			for (uint32_t v = runs[i].start; v <= runs[i].last; v++)
+				c->array[k++] = v;
+	} else {
+		c->type = CT_BITMAP;
+		c->n = card;
+		sz = BITMAP_WORDS * sizeof(uint64_t);
+		c->bitmap = calloc(BITMAP_WORDS, sizeof(uint64_t));
+		if (!c->bitmap)
+			return -1;
+		for (uint32_t i = 0; i < nr; i++)
+			for (uint32_t v = runs[i].start; v <= runs[i].last; v++)
+				c->bitmap[v >> 6] |= 1UL << (v & 63);
+	}
+
+	set->index[key] = set->num_containers++;
+	set->num_type[c->type]++;
+	set->bytes += sz + sizeof(*c);
+	set->cardinality += card;
+
+	return 0;
+}
+
+static int build_roaring(so_srcset_t *set, const so_src_range_t *ranges, size_t n)
+{
+	struct run *runs = malloc(CHUNK_MAX_RUNS * sizeof(*runs));
+	uint32_t nr = 0, key = 0;
+	int ret = -1;
+
+	set->index = malloc(CHUNK_SZ * sizeof(*set->index));
+	set->containers = malloc(CHUNK_SZ * sizeof(*set->containers));
+	if (!runs || !set->index || !set->containers)
+		goto out;
+	memset(set->index, 0xff, CHUNK_SZ * sizeof(*set->index));
+	set->bytes = CHUNK_SZ * sizeof(*set->index);
+
+	// Cut the ranges at chunk boundaries, flushing a container whenever the chunk changes
+	for (size_t i = 0; i < n; i++) {
+		uint64_t start = ranges[i].start;
+
+		while (start <= ranges[i].end) {
+			uint32_t k = start >> CHUNK_BITS;
+			uint64_t last = ((uint64_t)k << CHUNK_BITS) | (CHUNK_SZ - 1);
+
+			if (last > ranges[i].end)
+				last = ranges[i].end;
+			if (nr && k != key) {
+				if (add_container(set, key, runs, nr) < 0)
+					goto out;
+				nr = 0;
+			}
+			key = k;
+			runs[nr].start = (uint16_t)start;
+			runs[nr].last = (uint16_t)last;
+			nr++;
+			start = last + 1;
+		}
+	}
+	if (nr && add_container(set, key, runs, nr) < 0)
+		goto out;
+
+	// Give back the unused part of the container array
+	if (set->num_containers)
+		set->containers = realloc(set->containers,
+					  set->num_containers * sizeof(*set->containers));
+	ret = 0;
+out:
+	free(runs);
+	return ret;
+}
+
+// Free memory as reported by the kernel, page cache excluded
+static size_t free_memory(void)
+{
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+	long page_sz = sysconf(_SC_PAGESIZE);
+
+	return pages > 0 && page_sz > 0 ? (size_t)pages * page_sz : 0;
+}
+
+// Bytes of the pages of the flat bitmap that `ranges` (merged) touch
+static size_t flat_bytes(const so_src_range_t *ranges, size_t n)
+{
+	const size_t page_sz = sysconf(_SC_PAGESIZE);
+	size_t last_page = SIZE_MAX, bytes = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t first_pg = (ranges[i].start >> 3) / page_sz;
+		size_t last_pg = (ranges[i].end >> 3) / page_sz;
+
+		// Ranges are sorted and disjoint, only their first page can be shared
+		bytes += (last_pg - first_pg + 1) * page_sz;
+		if (first_pg == last_page)
+			bytes -= page_sz;
+		last_page = last_pg;
+	}
+
+	return bytes;
+}
+
+static int build_flat(so_srcset_t *set, const so_src_range_t *ranges, size_t n)
+{
+	// Untouched parts of the mapping read as zeroes and never take memory. Under
+	// mlockall(MCL_FUTURE) a readable mapping would be faulted in whole: map it
+	// inaccessible, which is not populated, and unlock it before opening it up.
+	set->bits = mmap(NULL, SRCSET_FLAT_SZ, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (set->bits == MAP_FAILED) {
+		set->bits = NULL;
+		return -1;
+	}
+	munlock(set->bits, SRCSET_FLAT_SZ);
+	if (mprotect(set->bits, SRCSET_FLAT_SZ, PROT_READ | PROT_WRITE) < 0) {
+		munmap(set->bits, SRCSET_FLAT_SZ);
+		set->bits = NULL;
+		return -1;
+	}
+
+	set->bytes = flat_bytes(ranges, n);
+	for (size_t i = 0; i < n; i++) {
+		uint64_t start = ranges[i].start, end = ranges[i].end;
+
+		set->cardinality += end - start + 1;
+
+		// Partial words at both ends, whole words in between
+		for (; start <= end && (start & 63); start++)
+			set->bits[start >> 6] |= 1UL << (start & 63);
+		if (start + 63 <= end) {
+			memset(&set->bits[start >> 6], 0xff, ((end + 1 - start) >> 6) * sizeof(uint64_t));
+			start += (end + 1 - start) & ~(uint64_t)63;
+		}
+		for (; start <= end; start++)
+			set->bits[start >> 6] |= 1UL << (start & 63);
+	}
+
+	return 0;
+}
+
+so_srcset_t *srcset_build(const so_src_range_t *ranges, size_t n, so_srcset_mode_t mode)
+{
+	so_srcset_t *set = calloc(1, sizeof(*set));
+	so_src_range_t *merged = malloc((n ? n : 1) * sizeof(*merged));
+	int ret;
+
+	if (!set || !merged) {
+		free(set);
+		free(merged);
+		return NULL;
+	}
+	memcpy(merged, ranges, n * sizeof(*merged));
+	n = srcset_merge_ranges(merged, n);
+
+	if (mode == SRCSET_FLAT && free_memory() < SRCSET_FLAT_SZ) {
+		log_warn("source set: %zu MiB free, below the %lu MiB of a flat bitmap, using roaring",
+			 free_memory() >> 20, SRCSET_FLAT_SZ >> 20);
+		mode = SRCSET_ROARING;
+	}
+	// The flat bitmap only takes the pages it touches, known before it is built
+	if (mode == SRCSET_FLAT && membudget_charge(MEM_TABLES, flat_bytes(merged, n)) < 0) {
+		log_warn("source set: a flat bitmap of %zu KiB is over the memory limit, using roaring",
+			 flat_bytes(merged, n) >> 10);
+		mode = SRCSET_ROARING;
+	}
+
+	set->mode = mode;
+	ret = mode == SRCSET_FLAT ? build_flat(set, merged, n) : build_roaring(set, merged, n);
+	if (ret < 0 && mode == SRCSET_FLAT) {
+		log_warn("source set: cannot map a flat bitmap (%s), using roaring", strerror(errno));
+		membudget_release(MEM_TABLES, flat_bytes(merged, n));
+		set->mode = SRCSET_ROARING;
+		set->cardinality = 0;
+		set->bytes = 0;
+		ret = build_roaring(set, merged, n);
+	}
+
+	// Roaring containers are charged once built, as their size depends on the ranges
+	if (ret == 0 && set->mode == SRCSET_ROARING && membudget_charge(MEM_TABLES, set->bytes) < 0)
+		ret = -1;
+	if (ret == 0)
+		set->charged = set->bytes;
+	free(merged);
+
+	if (ret < 0) {
+		srcset_destroy(set);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return set;
+}
+
+int srcset_parse_addr(const char *s, char **end, uint32_t *out)
+{
+	unsigned long v = 0, octet;
+
+	if (!isdigit((unsigned char)*s))
+		return -1;
+
+	v = strtoul(s, end, 0);
+	if (**end != '.') {
+		if (v > UINT32_MAX)
+			return -1;
+		*out = v;
+		return 0;
+	}
+
+	// Dotted quad: four decimal octets
+	v = 0;
+	for (int i = 0; i < 4; i++) {
+		if (i && *s++ != '.')
+			return -1;
+		if (!isdigit((unsigned char)*s))
+			return -1;
+		octet = strtoul(s, end, 10);
+		if (octet > 255)
+			return -1;
+		v = (v << 8) | octet;
+		s = *end;
+	}
+	*out = v;
+
+	return 0;
+}
+
+int srcset_parse_range(const char *s, char **end, so_src_range_t *range)
+{
+	unsigned long len;
+	char *p;
+
+	if (srcset_parse_addr(s, end, &range->start) < 0)
+		return -1;
+	range->end = range->start;
+	p = *end;
+
+	if (*p == '/') {
+		len = strtoul(p + 1, end, 10);
+		if (*end == p + 1 || len > 32)
+			return -1;
+		if (len < 32) {
+			uint32_t host = UINT32_MAX >> len;
+
+			range->start &= ~host;
+			range->end = range->start | host;
+		}
+	} else if (*p == '-') {
+		if (srcset_parse_addr(p + 1, end, &range->end) < 0 || range->end < range->start)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Parses one entry; returns 1 for a range, 0 for an empty line, -1 on error
+static int parse_line(char *line, so_src_range_t *range)
+{
+	char *p = line, *end;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '\0')
+		return 0;
+
+	if (srcset_parse_range(p, &end, range) < 0)
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+
+	return *p == '\0' ? 1 : -1;
+}
+
+so_srcset_t *srcset_load(const char *path, so_srcset_mode_t mode)
+{
+	so_src_range_t *ranges = NULL, *tmp;
+	size_t n = 0, cap = 0, line_cap = 0;
+	so_srcset_t *set = NULL;
+	char *line = NULL;
+	int lineno = 0, ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	while (getline(&line, &line_cap, f) != -1) {
+		lineno++;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 256;
+			tmp = realloc(ranges, cap * sizeof(*ranges));
+			if (!tmp)
+				goto out;
+			ranges = tmp;
+		}
+
+		ret = parse_line(line, &ranges[n]);
+		if (ret < 0) {
+			log_error("%s:%d: expected an address, CIDR block or range", path, lineno);
+			errno = EINVAL;
+			goto out;
+		}
+		n += ret;
+	}
+
+	set = srcset_build(ranges, n, mode);
+out:
+	free(line);
+	free(ranges);
+	fclose(f);
+	return set;
+}
+
+void srcset_report(const so_srcset_t *set)
+{
+	if (set->mode == SRCSET_FLAT) {
+		log_info("source set: flat bitmap, %lu sources, %zu KiB touched of %lu MiB",
+			 set->cardinality, set->bytes >> 10, SRCSET_FLAT_SZ >> 20);
+		return;
+	}
+
+	log_info("source set: roaring, %lu sources, %zu KiB in %u containers (%lu %s, %lu %s, %lu %s)",
+		 set->cardinality, set->bytes >> 10, set->num_containers,
+		 set->num_type[CT_ARRAY], ct_names[CT_ARRAY], set->num_type[CT_BITMAP],
+		 ct_names[CT_BITMAP], set->num_type[CT_RUN], ct_names[CT_RUN]);
+}
+
+size_t srcset_bytes(const so_srcset_t *set)
+{
+	return set->bytes;
+}
+
+uint64_t srcset_cardinality(const so_srcset_t *set)
+{
+	return set->cardinality;
+}
+
+void srcset_destroy(so_srcset_t *set)
+{
+	if (!set)
+		return;
+
+	if (set->bits)
+		munmap(set->bits, SRCSET_FLAT_SZ);
+	for (uint32_t i = 0; i < set->num_containers; i++)
+		free(set->containers[i].array);
+	free(set->containers);
+	free(set->index);
+	membudget_release(MEM_TABLES, set->charged);
+	free(set);
+}
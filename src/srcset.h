@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_SRCSET_H__
+#define __SO_SRCSET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the flat bitmap: one bit per 32-bit source. */
+#define SRCSET_FLAT_SZ (1UL << 29)
+
+/* Roaring containers switch from a sorted array to a bitmap above this many members. */
+#define SRCSET_ARRAY_MAX 4096
+
+typedef enum {
+	SRCSET_ROARING = 0,	/* compressed: array, bitmap or run container per 64K sources */
+	SRCSET_FLAT,		/* 512 MB bitmap, one memory access per lookup */
+} so_srcset_mode_t;
+
+/* Inclusive range of sources. */
+typedef struct so_src_range_t {
+	uint32_t start;
+	uint32_t end;
+} so_src_range_t;
+
+typedef struct so_srcset_t so_srcset_t;
+
+/**
+ * @brief Builds a set holding the union of `n` ranges (in any order, overlaps allowed).
+ *
+ * In `SRCSET_ROARING` mode the 32-bit space is split on the high 16 bits into
+ * chunks of 65536 sources, found through a 256 KB direct index; each non-empty
+ * chunk gets whichever container is smallest for it: a sorted array of the low
+ * 16 bits (sparse), a 8 KB bitmap (dense) or a sorted list of runs
+ * (contiguous). `SRCSET_FLAT` falls back to
+ * `SRCSET_ROARING` with a warning when less than `SRCSET_FLAT_SZ` of memory is
+ * free; only its touched pages are ever backed.
+ *
+ * @return The set, or NULL with `errno` set.
+ */
+so_srcset_t *srcset_build(const so_src_range_t *ranges, size_t n, so_srcset_mode_t mode);
+
+/**
+ * @brief Loads a set from a text file with one entry per line: an IPv4 address
+ * (`10.0.0.1`), a CIDR block (`10.0.0.0/8`), a range (`10.0.0.1-10.0.0.9`) or
+ * the same as plain or 0x-prefixed numbers. Blank lines and `#` comments are
+ * skipped.
+ *
+ * @return The set, or NULL with `errno` set (EINVAL for a malformed line,
+ *         which is logged).
+ */
+so_srcset_t *srcset_load(const char *path, so_srcset_mode_t mode);
+
+/**
+ * @brief Parses an address as written in a source file: a dotted quad or a
+ * plain or 0x-prefixed number, setting `*end` past it.
+ *
+ * @return 0, or -1 if `s` does not start with a valid address.
+ */
+int srcset_parse_addr(const char *s, char **end, uint32_t *addr);
+
+/**
+ * @brief Parses a single address, CIDR block or range of a source file entry,
+ * setting `*end` past it.
+ *
+ * @return 0, or -1 if `s` does not start with a valid entry.
+ */
+int srcset_parse_range(const char *s, char **end, so_src_range_t *range);
+
+/* Sorts `ranges` and merges overlapping or adjacent ones in place; returns the new count. */
+size_t srcset_merge_ranges(so_src_range_t *ranges, size_t n);
+
+/* Whether `source` is in one of `n` ranges as returned by srcset_merge_ranges(). */
+int srcset_ranges_cover(const so_src_range_t *ranges, size_t n, uint32_t source);
+
+int srcset_contains(const so_srcset_t *set, uint32_t source);
+
+/**
+ * @brief Logs the mode, member count, memory used and container mix.
+ */
+void srcset_report(const so_srcset_t *set);
+
+/* Bytes of memory held for the set (touched bytes for the flat bitmap). */
+size_t srcset_bytes(const so_srcset_t *set);
+
+uint64_t srcset_cardinality(const so_srcset_t *set);
+
+void srcset_destroy(so_srcset_t *set);
+
+#endif /* __SO_SRCSET_H__ */
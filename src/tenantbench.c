@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "packet.h"
+#include "srcset.h"
+#include "tenants.h"
+#include "utils.h"
+
+#define DEFAULT_PACKETS 10000000UL
+
+// Distinct packets, cycled through: about what the ring holds at once
+#define PACKET_POOL 4096
+
+// Allowed source ranges of each tenant
+#define TENANT_ALLOW 4
+
+enum {
+	OPT_PACKETS = 256,
+};
+
+static const struct option long_options[] = {
+	{ "packets",	required_argument,	NULL,	OPT_PACKETS },
+	{ NULL,		0,			NULL,	0 },
+};
+
+static const int tenant_counts[] = { 0, 1, 100, 10000 };
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage %s [options]\n"
+		"Times the classification of packets with random sources and destinations with\n"
+		"no tenants and with 1, 100 and 10000 tenants splitting the destinations, each\n"
+		"allowing %d random source ranges, and the tenant lookup and source check alone\n"
+		"Options:\n"
+		"  --packets <n>          packets classified per run (default %lu)\n",
+		prog, TENANT_ALLOW, DEFAULT_PACKETS);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t seed = 7;
+
+static uint32_t next_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+// A --tenants file of `num` tenants owning equal shares of the destinations
+static so_tenants_t *make_tenants(int num)
+{
+	char path[] = "/tmp/tenantbench.XXXXXX";
+	uint64_t share = (1ULL << 32) / num;
+	so_tenants_t *tenants;
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(path);
+	DIE(fd < 0, "mkstemp");
+	f = fdopen(fd, "w");
+	DIE(f == NULL, "fdopen");
+	for (int i = 0; i < num; i++) {
+		fprintf(f, "tenant t%d\ndest 0x%lx-0x%lx\n", i, i * share,
+			i == num - 1 ? 0xffffffffUL : (i + 1) * share - 1);
+		for (int k = 0; k < TENANT_ALLOW; k++) {
+			uint32_t start = next_rand(), len = next_rand() % (1U << 30);
+
+			if (len > 0xffffffffU - start)
+				len = 0xffffffffU - start;
+			fprintf(f, "allow 0x%x-0x%x\n", start, start + len);
+		}
+	}
+	DIE(fclose(f) != 0, "fclose");
+
+	tenants = tenants_load(path);
+	DIE(tenants == NULL, "tenants_load");
+	unlink(path);
+
+	return tenants;
+}
+
+static void run(int num, const so_packet_t *pkts, unsigned long packets)
+{
+	so_tenants_t *tenants = num ? make_tenants(num) : NULL;
+	int ids[PACKET_POOL], id;
+	unsigned long passed = 0, covered = 0;
+	double start, classify, lookup, cover;
+
+	packet_set_tenants(tenants);
+	start = now();
+	for (unsigned long i = 0; i < packets; i++)
+		passed += process_packet_tenant(&pkts[i % PACKET_POOL], PKT_SZ, &id) == PASS;
+	classify = now() - start;
+	packet_set_tenants(NULL);
+	printf("%5d tenant%s %5.1f ns/pkt (%2lu%% passed)", num, num == 1 ? ": " : "s:",
+	       classify * 1e9 / packets, passed * 100 / packets);
+
+	if (tenants) {
+		start = now();
+		for (unsigned long i = 0; i < packets; i++)
+			id = tenants_lookup(tenants, pkts[i % PACKET_POOL].hdr.dest);
+		lookup = now() - start;
+
+		for (int i = 0; i < PACKET_POOL; i++)
+			ids[i] = tenants_lookup(tenants, pkts[i].hdr.dest);
+		start = now();
+		for (unsigned long i = 0; i < packets; i++) {
+			const so_tenant_policy_t *policy = tenants_policy(tenants, ids[i % PACKET_POOL]);
+
+			covered += srcset_ranges_cover(policy->allow, policy->num_allow,
+						   pkts[i % PACKET_POOL].hdr.source);
+		}
+		cover = now() - start;
+		printf(", lookup %5.1f ns, source check %5.1f ns (%2lu%% allowed)",
+		       lookup * 1e9 / packets, cover * 1e9 / packets, covered * 100 / packets);
+		tenants_destroy(tenants);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+// The whole of `arg` as a positive decimal number, or 0
+static unsigned long parse_count(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+
+	return errno || end == arg || *end || *arg == '-' ? 0 : val;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long packets = DEFAULT_PACKETS;
+	so_packet_t *pkts;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_PACKETS:
+			packets = parse_count(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc != optind || packets == 0)
+		usage(argv[0]);
+
+	pkts = calloc(PACKET_POOL, sizeof(*pkts));
+	DIE(pkts == NULL, "calloc");
+	for (int i = 0; i < PACKET_POOL; i++) {
+		pkts[i].hdr.source = next_rand();
+		pkts[i].hdr.dest = next_rand();
+	}
+
+	for (size_t t = 0; t < sizeof(tenant_counts) / sizeof(tenant_counts[0]); t++)
+		run(tenant_counts[t], pkts, packets);
+
+	free(pkts);
+
+	return 0;
+}
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <stdint.h>
+
+#include "tenants.h"
+#include "dfa.h"
+#include "output.h"
+#include "membudget.h"
+#include "utils.h"
+
+// Destinations are indexed by their high 16 bits, like the roaring source sets
+#define INDEX_BITS 16
+#define INDEX_SZ (1U << INDEX_BITS)
+
+struct tenant {
+	char *name;
+	so_src_range_t *allow;
+	size_t num_allow;
+	size_t cap_allow;
+	so_output_t *out;
+
+	so_dfa_t *rules;
+
+	unsigned long packets;
+	unsigned long passed;
+};
+
+struct dest_range {
+	uint32_t start;
+	uint32_t end;
+	int tenant;
+};
+
+struct so_tenants_t {
+	struct tenant *tenants;
+	size_t num;
+
+	// Sorted by start, disjoint
+	struct dest_range *dests;
+	size_t num_dests;
+
+	// First destination range reaching into each 64K block of addresses, and one more
+	uint32_t *index;
+
+	// What classification reads, packed apart from the rest: one entry per tenant
+	// and the allowed ranges of all tenants back to back
+	so_tenant_policy_t *policies;
+	so_src_range_t *allow_pool;
+
+	unsigned long unowned;
+};
+
+int tenants_lookup(const so_tenants_t *t, uint32_t dest)
+{
+	size_t lo = t->index[dest >> INDEX_BITS], hi = t->index[(dest >> INDEX_BITS) + 1] + 1;
+
+	// The ranges ending in the block, and the one after them that may start in it
+	if (hi > t->num_dests)
+		hi = t->num_dests;
+	if (lo == hi)
+		return -1;
+
+	// Last range starting at or before the destination
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (t->dests[mid].start <= dest)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > t->index[dest >> INDEX_BITS] && dest <= t->dests[lo - 1].end ?
+	       t->dests[lo - 1].tenant : -1;
+}
+
+const so_tenant_policy_t *tenants_policy(const so_tenants_t *t, int tenant)
+{
+	return &t->policies[tenant];
+}
+
+void tenants_record(so_tenants_t *t, int tenant, so_action_t action, const char *line, size_t len)
+{
+	struct tenant *te;
+
+	if (tenant < 0) {
+		t->unowned++;
+		return;
+	}
+
+	te = &t->tenants[tenant];
+	te->packets++;
+	if (action == PASS)
+		te->passed++;
+	if (te->out)
+		output_write(te->out, line, len);
+}
+
+static int dest_cmp(const void *a, const void *b)
+{
+	const struct dest_range *da = a, *db = b;
+
+	return (da->start > db->start) - (da->start < db->start);
+}
+
+// Appends an element to a growable array; -1 when out of memory
+static int push(void **array, size_t *num, size_t *cap, const void *elem, size_t size)
+{
+	void *tmp;
+
+	if (*num == *cap) {
+		*cap = *cap ? 2 * *cap : 16;
+		tmp = realloc(*array, *cap * size);
+		if (!tmp)
+			return -1;
+		*array = tmp;
+	}
+	memcpy((char *)*array + *num * size, elem, size);
+	(*num)++;
+
+	return 0;
+}
+
+// Applies one directive to the tenant being defined; -1 with errno set on error
+static int apply(so_tenants_t *t, const char *word, char *arg, size_t *cap_tenants,
+		 size_t *cap_dests)
+{
+	struct tenant *te = t->num ? &t->tenants[t->num - 1] : NULL;
+	so_output_opts_t opts = { 0 };
+	struct dest_range d;
+	so_src_range_t range;
+	char *end;
+
+	errno = EINVAL;
+	if (!strcmp(word, "tenant")) {
+		struct tenant new_te = { .name = strdup(arg) };
+
+		if (!new_te.name)
+			return -1;
+		return push((void **)&t->tenants, &t->num, cap_tenants, &new_te, sizeof(new_te));
+	}
+
+	// Every other directive belongs to a tenant
+	if (!te)
+		return -1;
+
+	if (!strcmp(word, "dest") || !strcmp(word, "allow")) {
+		if (srcset_parse_range(arg, &end, &range) < 0 || *end != '\0')
+			return -1;
+		if (word[0] == 'a')
+			return push((void **)&te->allow, &te->num_allow, &te->cap_allow,
+				    &range, sizeof(range));
+
+		d = (struct dest_range){ range.start, range.end, t->num - 1 };
+		return push((void **)&t->dests, &t->num_dests, cap_dests, &d, sizeof(d));
+	}
+
+	if (!strcmp(word, "regex")) {
+		if (te->rules)
+			return -1;
+		te->rules = dfa_load(arg, 0);
+		return te->rules ? 0 : -1;
+	}
+
+	if (!strcmp(word, "log")) {
+		if (te->out)
+			return -1;
+		te->out = calloc(1, sizeof(*te->out));
+		if (!te->out)
+			return -1;
+		if (output_open(te->out, arg, &opts) < 0) {
+			free(te->out);
+			te->out = NULL;
+			return -1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+static int read_tenants(so_tenants_t *t, const char *path)
+{
+	size_t cap_tenants = 0, cap_dests = 0, line_cap = 0;
+	char *line = NULL, *p, *word, *end;
+	int lineno = 0, ret = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (getline(&line, &line_cap, f) != -1) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		// Trim both ends, then split off the directive
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		end = p + strlen(p);
+		while (end > p && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		if (*p == '\0')
+			continue;
+
+		word = p;
+		while (*p && !isspace((unsigned char)*p))
+			p++;
+		if (*p)
+			*p++ = '\0';
+		while (isspace((unsigned char)*p))
+			p++;
+
+		if (*p == '\0' || apply(t, word, p, &cap_tenants, &cap_dests) < 0) {
+			if (errno == EINVAL)
+				log_error("%s:%d: bad or misplaced '%s' directive", path, lineno, word);
+			else
+				log_error("%s:%d: %s: %s", path, lineno, word, strerror(errno));
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static int build_policies(so_tenants_t *t)
+{
+	size_t total = 0, off = 0;
+
+	for (size_t i = 0; i < t->num; i++) {
+		t->tenants[i].num_allow = srcset_merge_ranges(t->tenants[i].allow,
+							      t->tenants[i].num_allow);
+		total += t->tenants[i].num_allow;
+	}
+
+	t->policies = calloc(t->num + 1, sizeof(*t->policies));
+	t->allow_pool = malloc((total + 1) * sizeof(*t->allow_pool));
+	if (!t->policies || !t->allow_pool)
+		return -1;
+
+	for (size_t i = 0; i < t->num; i++) {
+		struct tenant *te = &t->tenants[i];
+
+		memcpy(&t->allow_pool[off], te->allow, te->num_allow * sizeof(*te->allow));
+		t->policies[i].allow = &t->allow_pool[off];
+		t->policies[i].num_allow = te->num_allow;
+		t->policies[i].rules = te->rules;
+		off += te->num_allow;
+	}
+
+	return 0;
+}
+
+so_tenants_t *tenants_load(const char *path)
+{
+	so_tenants_t *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+	if (read_tenants(t, path) < 0)
+		goto err;
+
+	// One sorted array for the lookup; ranges of two tenants may not overlap
+	qsort(t->dests, t->num_dests, sizeof(*t->dests), dest_cmp);
+	for (size_t i = 1; i < t->num_dests; i++) {
+		if (t->dests[i].start <= t->dests[i - 1].end) {
+			log_error("%s: destinations of tenants %s and %s overlap", path,
+				  t->tenants[t->dests[i - 1].tenant].name,
+				  t->tenants[t->dests[i].tenant].name);
+			errno = EINVAL;
+			goto err;
+		}
+	}
+
+	// index[b]: first range ending at or after the start of block b
+	if (membudget_charge(MEM_TABLES, (INDEX_SZ + 1) * sizeof(*t->index)) < 0)
+		goto err;
+	t->index = malloc((INDEX_SZ + 1) * sizeof(*t->index));
+	if (!t->index) {
+		membudget_release(MEM_TABLES, (INDEX_SZ + 1) * sizeof(*t->index));
+		goto err;
+	}
+	for (size_t b = 0, j = 0; b <= INDEX_SZ; b++) {
+		while (j < t->num_dests && t->dests[j].end < (uint64_t)b << INDEX_BITS)
+			j++;
+		t->index[b] = j;
+	}
+
+	if (build_policies(t) < 0)
+		goto err;
+
+	return t;
+err:
+	tenants_destroy(t);
+	return NULL;
+}
+
+static int busiest_first(const void *a, const void *b)
+{
+	const struct tenant *ta = *(const struct tenant * const *)a;
+	const struct tenant *tb = *(const struct tenant * const *)b;
+
+	return (ta->packets < tb->packets) - (ta->packets > tb->packets);
+}
+
+void tenants_report(so_tenants_t *t)
+{
+	struct tenant **order = malloc(t->num * sizeof(*order));
+	unsigned long packets = t->unowned;
+	size_t shown;
+
+	if (!order && t->num)
+		return;
+
+	for (size_t i = 0; i < t->num; i++) {
+		order[i] = &t->tenants[i];
+		packets += t->tenants[i].packets;
+	}
+	qsort(order, t->num, sizeof(*order), busiest_first);
+
+	log_info("tenants: %zu tenants over %zu destination ranges, %lu of %lu packets owned",
+		 t->num, t->num_dests, packets - t->unowned, packets);
+
+	shown = t->num < TENANTS_REPORT_MAX ? t->num : TENANTS_REPORT_MAX;
+	for (size_t i = 0; i < shown && order[i]->packets; i++)
+		log_info("tenant %s: %lu packets, %lu passed, %lu dropped", order[i]->name,
+			 order[i]->packets, order[i]->passed, order[i]->packets - order[i]->passed);
+
+	free(order);
+}
+
+void tenants_destroy(so_tenants_t *t)
+{
+	for (size_t i = 0; i < t->num; i++) {
+		struct tenant *te = &t->tenants[i];
+
+		if (te->out) {
+			output_close(te->out);
+			free(te->out);
+		}
+		if (te->rules)
+			dfa_destroy(te->rules);
+		free(te->allow);
+		free(te->name);
+	}
+	free(t->tenants);
+	free(t->dests);
+	if (t->index)
+		membudget_release(MEM_TABLES, (INDEX_SZ + 1) * sizeof(*t->index));
+	free(t->index);
+	free(t->policies);
+	free(t->allow_pool);
+	free(t);
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_TENANTS_H__
+#define __SO_TENANTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "srcset.h"
+
+/* Busiest tenants listed by tenants_report(). */
+#define TENANTS_REPORT_MAX 16
+
+struct so_dfa_t;
+
+/* What a tenant's packets are classified with; empty parts fall back to the global policy. */
+typedef struct so_tenant_policy_t {
+	const so_src_range_t *allow;	/* merged allowed source ranges */
+	size_t num_allow;
+	struct so_dfa_t *rules;		/* payload deny rules */
+} so_tenant_policy_t;
+
+/**
+ * @brief Virtual firewalls, each owning destination ranges.
+ *
+ * The destination ranges of all tenants are kept as one sorted array of
+ * disjoint ranges, so finding a packet's tenant is a binary search whatever
+ * the number of tenants, and the tenant's policy is compiled at load time
+ * (merged source ranges, its own DFA). Per-tenant counters and log sinks are
+ * updated by `tenants_record()` from the log writer, in log order, without
+ * locks of their own.
+ */
+typedef struct so_tenants_t so_tenants_t;
+
+/**
+ * @brief Loads tenants from a text file of directives, one per line:
+ *
+ *   tenant <name>      starts a tenant
+ *   dest <sources>     destination range it owns (one or more)
+ *   allow <sources>    source range it accepts, replacing the global source policy
+ *   regex <file>       payload deny rules, replacing the global ones
+ *   log <file>         also append its log lines to <file>
+ *
+ * Ranges are written as for `--allow-sources`; blank lines and `#` comments
+ * are skipped. Destination ranges of different tenants must not overlap.
+ *
+ * @return The tenants, or NULL with `errno` set (EINVAL for a malformed or
+ *         conflicting line, which is logged).
+ */
+so_tenants_t *tenants_load(const char *path);
+
+/* Index of the tenant owning `dest`, or -1. */
+int tenants_lookup(const so_tenants_t *tenants, uint32_t dest);
+
+const so_tenant_policy_t *tenants_policy(const so_tenants_t *tenants, int tenant);
+
+/**
+ * @brief Counts a packet of `tenant` (-1 for none) and appends its log line to
+ * the tenant's sink. Calls are serialized by the caller, in log order.
+ */
+void tenants_record(so_tenants_t *tenants, int tenant, so_action_t action,
+		    const char *line, size_t len);
+
+/* Logs totals and the counters of the busiest tenants at info level. */
+void tenants_report(so_tenants_t *tenants);
+
+/* Closes the sinks and frees the tenants. */
+void tenants_destroy(so_tenants_t *tenants);
+
+#endif /* __SO_TENANTS_H__ */
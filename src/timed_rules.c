@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "timed_rules.h"
+#include "timer_wheel.h"
+#include "srcset.h"
+#include "packet.h"
+#include "lockprof.h"
+#include "utils.h"
+
+struct timed_rule {
+	uint64_t start;
+	uint64_t end;			// TIMER_WHEEL_NEVER for a rule that never ends
+	so_action_t action;
+	so_src_range_t range;
+	int active;			// as of the wheel's now
+	so_timer_t on;
+	so_timer_t off;
+};
+
+// The rules active for timestamps in [from, to), as merged source ranges
+struct epoch {
+	uint64_t from;
+	uint64_t to;
+	so_src_range_t *drop;
+	size_t num_drop;
+	so_src_range_t *pass;
+	size_t num_pass;
+};
+
+struct so_timed_rules_t {
+	struct timed_rule *rules;
+	size_t num_rules;
+
+	pthread_mutex_t mutex;		// protects the wheel and the epoch appends
+	so_timer_wheel_t wheel;
+
+	// Epochs in time order; each start and end of a rule begins at most one
+	struct epoch *epochs;
+	size_t max_epochs;
+	size_t num_epochs;		// published with a release store
+	struct epoch *current;		// the last one, published with a release store
+
+	unsigned long past_lookups;
+};
+
+static void rule_on(void *arg)
+{
+	((struct timed_rule *)arg)->active = 1;
+}
+
+static void rule_off(void *arg)
+{
+	((struct timed_rule *)arg)->active = 0;
+}
+
+// Snapshot of the active rules, starting at the wheel's now; -1 when out of memory
+static int build_epoch(so_timed_rules_t *tr, struct epoch *e)
+{
+	e->from = tr->wheel.now;
+	e->to = timer_wheel_next(&tr->wheel);
+	e->num_drop = e->num_pass = 0;
+	e->drop = malloc((tr->num_rules + 1) * sizeof(*e->drop));
+	e->pass = malloc((tr->num_rules + 1) * sizeof(*e->pass));
+	if (!e->drop || !e->pass)
+		return -1;
+
+	for (size_t i = 0; i < tr->num_rules; i++) {
+		struct timed_rule *r = &tr->rules[i];
+
+		if (!r->active)
+			continue;
+		if (r->action == DROP)
+			e->drop[e->num_drop++] = r->range;
+		else
+			e->pass[e->num_pass++] = r->range;
+	}
+	e->num_drop = srcset_merge_ranges(e->drop, e->num_drop);
+	e->num_pass = srcset_merge_ranges(e->pass, e->num_pass);
+
+	return 0;
+}
+
+// Builds and publishes the epochs up to the one holding `ts`, returns that one
+static struct epoch *advance(so_timed_rules_t *tr, uint64_t ts)
+{
+	struct epoch *e;
+
+	so_mutex_lock(&tr->mutex);
+	e = tr->current;
+	while (e->to != TIMER_WHEEL_NEVER && e->to <= ts) {
+		timer_wheel_advance(&tr->wheel, e->to);
+
+		// Every step fires at least one start or end, which bounds the epochs
+		DIE(tr->num_epochs == tr->max_epochs, "timed rules: epoch overflow");
+		e = &tr->epochs[tr->num_epochs];
+		DIE(build_epoch(tr, e) < 0, "malloc");
+		__atomic_store_n(&tr->num_epochs, tr->num_epochs + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&tr->current, e, __ATOMIC_RELEASE);
+	}
+	so_mutex_unlock(&tr->mutex);
+
+	return e;
+}
+
+// The epoch holding a timestamp earlier than the current epoch
+static const struct epoch *past_epoch(so_timed_rules_t *tr, uint64_t ts)
+{
+	size_t lo = 0, hi = __atomic_load_n(&tr->num_epochs, __ATOMIC_ACQUIRE);
+
+	__atomic_fetch_add(&tr->past_lookups, 1, __ATOMIC_RELAXED);
+
+	// Last epoch starting at or before ts; the first one starts at 0
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if (tr->epochs[mid].from <= ts)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return &tr->epochs[lo];
+}
+
+int timed_rules_check(so_timed_rules_t *tr, uint32_t source, uint64_t ts)
+{
+	const struct epoch *e = __atomic_load_n(&tr->current, __ATOMIC_ACQUIRE);
+
+	// One comparison covers both ends: ts below `from` wraps around
+	if (ts - e->from >= e->to - e->from) {
+		if (ts >= e->from)
+			e = advance(tr, ts);
+		else
+			e = past_epoch(tr, ts);
+	}
+
+	if (e->num_drop && srcset_ranges_cover(e->drop, e->num_drop, source))
+		return DROP;
+	if (e->num_pass && srcset_ranges_cover(e->pass, e->num_pass, source))
+		return PASS;
+
+	return TIMED_NONE;
+}
+
+// Parses `<start> <end|-> <drop|pass> <sources>`; returns 1 for a rule, 0 for an empty line, -1 on error
+static int parse_line(char *line, struct timed_rule *r)
+{
+	char *p = line, *end;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '\0')
+		return 0;
+
+	if (!isdigit((unsigned char)*p))
+		return -1;
+	r->start = strtoull(p, &end, 0);
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+
+	if (*p == '-') {
+		r->end = TIMER_WHEEL_NEVER;
+		end = p + 1;
+	} else if (isdigit((unsigned char)*p)) {
+		r->end = strtoull(p, &end, 0);
+		if (r->end <= r->start)
+			return -1;
+	} else {
+		return -1;
+	}
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+
+	if (!strncmp(p, "drop", 4))
+		r->action = DROP;
+	else if (!strncmp(p, "pass", 4))
+		r->action = PASS;
+	else
+		return -1;
+	if (!isspace((unsigned char)p[4]))
+		return -1;
+	for (p += 4; isspace((unsigned char)*p); p++)
+		;
+
+	if (srcset_parse_range(p, &end, &r->range) < 0)
+		return -1;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+
+	return *p == '\0' ? 1 : -1;
+}
+
+static int read_rules(so_timed_rules_t *tr, const char *path)
+{
+	struct timed_rule *tmp;
+	size_t cap = 0, line_cap = 0;
+	char *line = NULL;
+	int lineno = 0, ret = -1, n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (getline(&line, &line_cap, f) != -1) {
+		lineno++;
+		if (tr->num_rules == cap) {
+			cap = cap ? 2 * cap : 64;
+			tmp = realloc(tr->rules, cap * sizeof(*tr->rules));
+			if (!tmp)
+				goto out;
+			tr->rules = tmp;
+		}
+
+		memset(&tr->rules[tr->num_rules], 0, sizeof(*tr->rules));
+		n = parse_line(line, &tr->rules[tr->num_rules]);
+		if (n < 0) {
+			log_error("%s:%d: expected <start> <end|-> <drop|pass> <sources>", path, lineno);
+			errno = EINVAL;
+			goto out;
+		}
+		tr->num_rules += n;
+	}
+	ret = 0;
+out:
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+so_timed_rules_t *timed_rules_load(const char *path)
+{
+	so_timed_rules_t *tr = calloc(1, sizeof(*tr));
+
+	if (!tr)
+		return NULL;
+	so_mutex_init(&tr->mutex, "timed_rules->mutex");
+
+	if (read_rules(tr, path) < 0)
+		goto err;
+
+	tr->max_epochs = 2 * tr->num_rules + 1;
+	tr->epochs = calloc(tr->max_epochs, sizeof(*tr->epochs));
+	if (!tr->epochs)
+		goto err;
+
+	// The rules array no longer moves: arm a timer for every start and end
+	timer_wheel_init(&tr->wheel, 0);
+	for (size_t i = 0; i < tr->num_rules; i++) {
+		struct timed_rule *r = &tr->rules[i];
+
+		r->on = (so_timer_t){ .expiry = r->start, .fn = rule_on, .arg = r };
+		timer_wheel_add(&tr->wheel, &r->on);
+		if (r->end != TIMER_WHEEL_NEVER) {
+			r->off = (so_timer_t){ .expiry = r->end, .fn = rule_off, .arg = r };
+			timer_wheel_add(&tr->wheel, &r->off);
+		}
+	}
+
+	// The first epoch starts at timestamp 0, with the rules starting there
+	timer_wheel_advance(&tr->wheel, 0);
+	tr->current = &tr->epochs[0];
+	tr->num_epochs = 1;
+	if (build_epoch(tr, tr->current) < 0)
+		goto err;
+
+	return tr;
+err:
+	timed_rules_destroy(tr);
+	return NULL;
+}
+
+void timed_rules_report(so_timed_rules_t *tr)
+{
+	log_info("timed rules: %zu rules, %zu of at most %zu epochs built, %lu lookups of past epochs",
+		 tr->num_rules, tr->num_epochs, tr->max_epochs, tr->past_lookups);
+}
+
+void timed_rules_destroy(so_timed_rules_t *tr)
+{
+	if (tr->epochs) {
+		for (size_t i = 0; i < tr->num_epochs; i++) {
+			free(tr->epochs[i].drop);
+			free(tr->epochs[i].pass);
+		}
+	}
+	free(tr->epochs);
+	free(tr->rules);
+	so_mutex_destroy(&tr->mutex);
+	free(tr);
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_TIMED_RULES_H__
+#define __SO_TIMED_RULES_H__
+
+#include <stdint.h>
+
+/* Verdict of timed_rules_check() when no active rule covers the source. */
+#define TIMED_NONE (-1)
+
+/**
+ * @brief Source rules that are only active for a window of packet timestamps.
+ *
+ * A `drop` rule drops its sources while active, whatever else allows them; a
+ * `pass` rule lets otherwise denied sources through (payload rules still
+ * apply). `drop` wins when both cover a source.
+ *
+ * The timeline is cut into epochs at every rule start and end. Each epoch
+ * holds the merged source ranges of the rules active in it, so checking a
+ * packet costs one timestamp comparison against the current epoch plus a
+ * binary search, as for a static rule set. A packet past the current epoch
+ * advances a timer wheel of rule starts and ends to its timestamp under a
+ * mutex, building the epochs it passes; one older than the current epoch
+ * finds its epoch among the earlier ones. The verdict only depends on the
+ * packet's own timestamp, never on which consumer saw which packet first.
+ */
+typedef struct so_timed_rules_t so_timed_rules_t;
+
+/**
+ * @brief Loads rules from a text file, one `<start> <end> <drop|pass> <sources>`
+ * per line: the rule is active for timestamps in [start, end), `-` as end
+ * means forever, and <sources> is an address, CIDR block or range as for
+ * `--allow-sources`. Blank lines and `#` comments are skipped.
+ *
+ * @return The rules, or NULL with `errno` set (EINVAL for a malformed line,
+ *         which is logged).
+ */
+so_timed_rules_t *timed_rules_load(const char *path);
+
+/* Returns DROP or PASS from the rules active at `timestamp`, or TIMED_NONE; thread-safe. */
+int timed_rules_check(so_timed_rules_t *rules, uint32_t source, uint64_t timestamp);
+
+/* Logs the rules, epochs built and lookups of past epochs at info level. */
+void timed_rules_report(so_timed_rules_t *rules);
+
+void timed_rules_destroy(so_timed_rules_t *rules);
+
+#endif /* __SO_TIMED_RULES_H__ */
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_BITS 8
+
+void timer_wheel_init(so_timer_wheel_t *w, uint64_t now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+// Files a timer by the highest byte in which its expiry differs from now
+static void file_timer(so_timer_wheel_t *w, so_timer_t *timer)
+{
+	int level, slot;
+
+	if (timer->expiry <= w->now) {
+		timer->next = w->due;
+		w->due = timer;
+		return;
+	}
+
+	level = (63 - __builtin_clzll(timer->expiry ^ w->now)) / SLOT_BITS;
+	slot = (timer->expiry >> (level * SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+	timer->next = w->slots[level][slot];
+	w->slots[level][slot] = timer;
+	w->occupied[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+void timer_wheel_add(so_timer_wheel_t *w, so_timer_t *timer)
+{
+	w->pending++;
+	file_timer(w, timer);
+}
+
+// Lowest occupied slot of the lowest occupied level: it holds the earliest timers
+static int lowest_slot(const so_timer_wheel_t *w, int *level, int *slot)
+{
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for (int i = 0; i < TIMER_WHEEL_SLOTS / 64; i++) {
+			if (w->occupied[l][i]) {
+				*level = l;
+				*slot = i * 64 + __builtin_ctzll(w->occupied[l][i]);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// First time covered by a slot: now's higher bytes, the slot's byte, zeroes below
+static uint64_t slot_start(const so_timer_wheel_t *w, int level, int slot)
+{
+	int shift = level * SLOT_BITS;
+	uint64_t below = shift + SLOT_BITS < 64 ? (1ULL << (shift + SLOT_BITS)) - 1 : UINT64_MAX;
+
+	return (w->now & ~below) | ((uint64_t)slot << shift);
+}
+
+static void run_due(so_timer_wheel_t *w)
+{
+	so_timer_t *timer;
+
+	// A callback may add timers that are already due
+	while (w->due) {
+		timer = w->due;
+		w->due = timer->next;
+		w->pending--;
+		timer->fn(timer->arg);
+	}
+}
+
+void timer_wheel_advance(so_timer_wheel_t *w, uint64_t to)
+{
+	so_timer_t *list, *timer;
+	int level, slot;
+
+	run_due(w);
+
+	// Enter each occupied slot in time order and re-file its timers against the new now
+	while (lowest_slot(w, &level, &slot)) {
+		uint64_t start = slot_start(w, level, slot);
+
+		if (start > to)
+			break;
+
+		w->now = start;
+		list = w->slots[level][slot];
+		w->slots[level][slot] = NULL;
+		w->occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+		while (list) {
+			timer = list;
+			list = timer->next;
+			file_timer(w, timer);
+		}
+		run_due(w);
+	}
+
+	if (to > w->now)
+		w->now = to;
+}
+
+uint64_t timer_wheel_next(const so_timer_wheel_t *w)
+{
+	uint64_t next = TIMER_WHEEL_NEVER;
+	int level, slot;
+
+	if (w->due)
+		return w->now;
+	if (!lowest_slot(w, &level, &slot))
+		return TIMER_WHEEL_NEVER;
+	if (level == 0)
+		return slot_start(w, level, slot);
+
+	for (const so_timer_t *timer = w->slots[level][slot]; timer; timer = timer->next)
+		if (timer->expiry < next)
+			next = timer->expiry;
+
+	return next;
+}
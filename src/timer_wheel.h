@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_TIMER_WHEEL_H__
+#define __SO_TIMER_WHEEL_H__
+
+#include <stdint.h>
+
+/* 8 levels of 256 slots, one level per byte of a 64-bit time. */
+#define TIMER_WHEEL_LEVELS 8
+#define TIMER_WHEEL_SLOTS 256
+
+/* Returned by timer_wheel_next() when no timer is pending. */
+#define TIMER_WHEEL_NEVER UINT64_MAX
+
+/* A timer, embedded in its owner; `fn(arg)` runs when the wheel passes `expiry`. */
+typedef struct so_timer_t {
+	uint64_t expiry;
+	void (*fn)(void *arg);
+	void *arg;
+	struct so_timer_t *next;
+} so_timer_t;
+
+/**
+ * @brief Hierarchical timing wheel over an abstract 64-bit clock.
+ *
+ * A timer sits at the level of the highest byte in which its expiry differs
+ * from `now`, in the slot named by that byte. Advancing jumps straight to the
+ * lowest occupied slot (found through per-level occupancy bitmaps), so the
+ * cost depends on the timers passed, not on how far the clock moves, and the
+ * timers of a slot are re-filed one level down when the clock enters it.
+ *
+ * Not thread-safe: callers serialize access.
+ */
+typedef struct so_timer_wheel_t {
+	uint64_t now;
+	so_timer_t *due;	/* added at or before `now`, fired by the next advance */
+	so_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64];
+	unsigned long pending;
+} so_timer_wheel_t;
+
+void timer_wheel_init(so_timer_wheel_t *w, uint64_t now);
+
+void timer_wheel_add(so_timer_wheel_t *w, so_timer_t *timer);
+
+/**
+ * @brief Moves the clock to `to` (if later), running every timer with an
+ * expiry at or before it; timers of equal expiry run in no particular order.
+ */
+void timer_wheel_advance(so_timer_wheel_t *w, uint64_t to);
+
+/* Earliest pending expiry, or `TIMER_WHEEL_NEVER`. */
+uint64_t timer_wheel_next(const so_timer_wheel_t *w);
+
+#endif /* __SO_TIMER_WHEEL_H__ */
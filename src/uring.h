@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __SO_URING_H__
+#define __SO_URING_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief Minimal io_uring instance driven through the raw system calls.
+ *
+ * Only what the firewall needs: one submission and one completion queue, used
+ * by a single thread at a time (callers serialize access themselves).
+ */
+typedef struct so_uring_t {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail;	/* SQEs prepared but not yet published */
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_ring_sz;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	unsigned int entries;
+} so_uring_t;
+
+/**
+ * @brief Creates a ring with room for `entries` submissions.
+ *
+ * @return 0 on success, -1 with `errno` set (e.g. ENOSYS or EPERM when the
+ *         kernel or a seccomp policy does not allow io_uring).
+ */
+int uring_init(so_uring_t *ring, unsigned int entries);
+
+/**
+ * @brief Returns a zeroed submission entry, or NULL if the queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(so_uring_t *ring);
+
+/**
+ * @brief Submits the prepared entries and waits for at least `wait_nr` completions.
+ *
+ * @return The number of entries submitted, or -1 with `errno` set.
+ */
+int uring_submit(so_uring_t *ring, unsigned int wait_nr);
+
+/**
+ * @brief Returns the oldest unseen completion without waiting, or NULL.
+ */
+struct io_uring_cqe *uring_peek_cqe(so_uring_t *ring);
+
+/**
+ * @brief Marks the completion returned by `uring_peek_cqe()` as consumed.
+ */
+void uring_cqe_seen(so_uring_t *ring);
+
+void uring_exit(so_uring_t *ring);
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+				 const void *buf, unsigned int len, off_t off,
+				 unsigned long user_data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+}
+
+#endif /* __SO_URING_H__ */
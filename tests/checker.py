@@ -27,6 +27,32 @@ SERIAL_TIMEOUT = 5
 
 TEST_SIZES = [10, 100, 1_000, 10_000, 20_000]
 
+"""Runs with firewall options: (name, input in in/, options), the input
+without extension meaning <input>.in. The input files and option files are
+committed, the reference is ref/<name>.ref."""
+OPTION_TESTS = [
+    ("regex", "test_1_000", ["--regex-rules", "in/regex.rules"]),
+    ("timestamps", "timestamps", []),
+    ("reorder", "timestamps", ["--reorder-window", "8"]),
+    ("imix", "imix", []),
+    ("pcap", "capture.pcap", []),
+    ("pcapng", "capture.pcapng", []),
+    ("allow", "test_1_000", ["--allow-sources", "in/allow.txt"]),
+    ("allow-flat", "test_1_000", ["--allow-sources", "in/allow.txt", "--source-set", "flat"]),
+    ("pinholes", "test_1_000", ["--allow-sources", "in/allow.txt", "--pinholes", "in/pinholes.txt"]),
+    ("timed", "test_1_000", ["--timed-rules", "in/timed_rules.txt"]),
+    ("timed-late", "timestamps", ["--timed-rules", "in/timed_rules.txt"]),
+    ("tenants", "test_1_000", ["--regex-rules", "in/regex.rules", "--tenants", "in/tenants.txt"]),
+    ("prefix-db", "test_1_000", ["--prefix-db", "out/prefixes.db"]),
+]
+
+"""Tools of src/ run before OPTION_TESTS, to build option files that are
+kept in host byte order from committed sources."""
+OPTION_SETUP = [
+    ["mkprefixdb", "in/prefixes.csv", "out/prefixes.db"],
+]
+OPTION_THREADS = [1, 4]
+
 test_duration = {}
 passed_tests = set()
 
@@ -61,7 +87,8 @@ def generate_tests(test_sizes) -> bool:
     """
     print("")
     try:
-        tests = os.listdir(in_dir)
+        # in/ also holds the inputs and option files of OPTION_TESTS
+        tests = [t for t in os.listdir(in_dir) if t.startswith("test_")]
 
         if len(tests) == len(test_sizes):
             print_log("Skipping test generation")
@@ -71,8 +98,8 @@ def generate_tests(test_sizes) -> bool:
 
     print_log("Generating test cases")
 
-    create_dir(in_dir)
-    create_dir(ref_dir)
+    os.makedirs(in_dir, exist_ok=True)
+    os.makedirs(ref_dir, exist_ok=True)
     serial_imp = os.path.join(src, "serial")
 
     # Generate the rest of tests
@@ -150,7 +177,8 @@ def file_exists_probe_check(probe: List[bool]) -> bool:
 def run_once_and_check_output(binary: str, in_file_path: str, out_file_path: str,
                               ref_file_path: str, sort_out_file: bool,
                               threads: int = 1, test_timeout: float = 1,
-                              trace_logs: bool = False) -> (bool, int):
+                              trace_logs: bool = False,
+                              options: List[str] = []) -> (bool, int):
     """Run the test once and check the output file with the reference file
 
     Also, delete the output file before running to ensure all the content
@@ -163,7 +191,7 @@ def run_once_and_check_output(binary: str, in_file_path: str, out_file_path: str
         pass
 
     duration = -1
-    with subprocess.Popen([binary, in_file_path, out_file_path, f'{threads}'],
+    with subprocess.Popen([binary, *options, in_file_path, out_file_path, f'{threads}'],
             stdout=subprocess.PIPE, stderr=subprocess.PIPE, preexec_fn=os.setpgrp) as proc_firewall_res:
         start = time.time_ns()
         try:
@@ -316,6 +344,24 @@ def check_and_grade(test_size: int, sort_out_file: bool = False,
         print(result_format + "failed ... 0")
 
 
+def check_option_test(name: str, in_name: str, options: List[str], threads: int):
+    """Check a run with options against its reference, in log order.
+
+    Not graded: the options are extensions to the assignment."""
+    in_file_path = os.path.join("in", in_name if "." in in_name else f'{in_name}.in')
+    out_file_path = os.path.join("out", f'{name}.out')
+    ref_file_path = os.path.join("ref", f'{name}.ref')
+    firewall_path = os.path.join(src, "firewall")
+
+    res, _ = run_once_and_check_output(firewall_path, in_file_path, out_file_path,
+                                       ref_file_path, False, threads=threads,
+                                       test_timeout=5, options=options)
+    result_format = "Test [{}, {} thread{}]".format(
+        name.ljust(16), threads, "s" if threads > 1 else " ")
+    result_format += " " + (49 - len(result_format)) * "." + " "
+    print(result_format + ("passed" if res else "failed"))
+
+
 def main():
     global TOTAL
     if not generate_tests(TEST_SIZES):
@@ -347,5 +393,14 @@ def main():
     TOTAL = int(TOTAL)
     print("\nTotal:" + 67 * " " + f" {TOTAL}/100")
 
+    print_log("Running option tests ...", newline=True)
+    for tool, *args in OPTION_SETUP:
+        if subprocess.run([os.path.join(src, tool), *args]).returncode != 0:
+            print(f"{tool} failed, skipping the option tests")
+            return
+    for name, in_name, options in OPTION_TESTS:
+        for threads in OPTION_THREADS:
+            check_option_test(name, in_name, options, threads)
+
 if __name__ == "__main__":
     main()
@@ -7,17 +7,21 @@ import argparse
 import os
 
 PKT_SZ = 256
+PKT_VAR_MAGIC = b'SOVARPKT'
+
+# Simple IMIX: (packet size, weight), sizes include the 16-byte header
+IMIX = [(64, 7), (576, 4), (1500, 1)]
 
 class SoPacket:
     prev_timestamp = 0
-    def __init__(self):
+    def __init__(self, size=PKT_SZ):
         self.source = random.randint(0, 2**32 - 1)
         self.dest = random.randint(0, 2**32 - 1)
         # Add between 3 and 10 units to the previous timestamp
         self.timestamp = SoPacket.prev_timestamp
         SoPacket.prev_timestamp += random.randint(3, 10)
 
-        payload_size = PKT_SZ - struct.calcsize('IIQ')
+        payload_size = size - struct.calcsize('IIQ')
         self.payload = os.urandom(payload_size)
 
     def to_bytes(self):
@@ -35,16 +39,23 @@ class SoPacket:
     def reset_timestamp(cls):
         cls.prev_timestamp = 0
 
-def generate_packets(filename, count, seed):
+def generate_packets(filename, count, seed, varlen=False):
     # Possibly set the seed for each file
     if seed != 0:
         random.seed(seed)
 
     SoPacket.reset_timestamp()
+    sizes, weights = zip(*IMIX)
     with open(filename, 'wb') as f:
+        if varlen:
+            f.write(PKT_VAR_MAGIC)
         for _ in range(count):
-            packet = SoPacket()
-            f.write(packet.to_bytes())
+            if varlen:
+                packet = SoPacket(random.choices(sizes, weights)[0])
+                data = packet.to_bytes()
+                f.write(struct.pack('I', len(data)) + data)
+            else:
+                f.write(SoPacket().to_bytes())
 
 def display_packet(filename, index):
     with open(filename, 'rb') as f:
@@ -67,6 +78,8 @@ def main():
     gen_parser = subparsers.add_parser("generate", help="Generate random packets")
     gen_parser.add_argument("filename", help="Output file name")
     gen_parser.add_argument("count", type=int, help="Number of packets to generate")
+    gen_parser.add_argument("--varlen", action="store_true",
+                            help="Write length-prefixed records with an IMIX size mix")
 
     display_parser = subparsers.add_parser("display", help="Display a specific packet")
     display_parser.add_argument("filename", help="Input file name")
@@ -75,7 +88,7 @@ def main():
     args = parser.parse_args()
 
     if args.command == "generate":
-        generate_packets(args.filename, args.count, 0)
+        generate_packets(args.filename, args.count, 0, args.varlen)
     elif args.command == "display":
         display_packet(args.filename, args.index)
     else: